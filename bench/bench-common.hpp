@@ -0,0 +1,119 @@
+#ifndef bench_common_h
+#define bench_common_h
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+namespace wasm_instrument {
+
+// a benchmark result of repeated samples in milliseconds
+// /params/ are printed as json numbers and identify the case when comparing across versions
+struct BenchResult {
+    std::string name;
+    std::vector<std::pair<std::string, double>> params;
+    std::vector<double> samples_ms;
+    // additional values that are not timings, e.g. overhead ratios or counts
+    std::vector<std::pair<std::string, double>> metrics;
+};
+
+class BenchTimer final {
+public:
+    void start() {
+        this->start_ = std::chrono::steady_clock::now();
+    }
+    double stop() {
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::milli>(end - this->start_).count();
+    }
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+inline double benchMin(const std::vector<double> &v) {
+    return v.empty() ? 0.0 : *std::min_element(v.begin(), v.end());
+}
+
+inline double benchMedian(std::vector<double> v) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    return (v.size() % 2) ? v[v.size() / 2] : (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2;
+}
+
+inline double benchMean(const std::vector<double> &v) {
+    return v.empty() ? 0.0 : std::accumulate(v.begin(), v.end(), 0.0) / v.size();
+}
+
+inline void writeBenchJson(std::ostream &o, const std::string &suite, const std::vector<BenchResult> &results) {
+    o << "{\n  \"suite\": \"" << suite << "\",\n  \"revision\": \"" << BENCH_REVISION << "\",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto &r = results[i];
+        o << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name << "\"";
+        for (const auto &[k, v] : r.params) o << ", \"" << k << "\": " << v;
+        if (!r.samples_ms.empty()) {
+            o << ", \"samples\": " << r.samples_ms.size()
+              << ", \"min_ms\": " << benchMin(r.samples_ms)
+              << ", \"median_ms\": " << benchMedian(r.samples_ms)
+              << ", \"mean_ms\": " << benchMean(r.samples_ms);
+        }
+        for (const auto &[k, v] : r.metrics) o << ", \"" << k << "\": " << v;
+        o << "}";
+    }
+    o << "\n  ]\n}\n";
+}
+
+// write the json report to stdout and to /filename/ if it is not empty
+inline bool emitBenchJson(const std::string &filename, const std::string &suite, const std::vector<BenchResult> &results) {
+    writeBenchJson(std::cout, suite, results);
+    if (filename.empty()) return true;
+    std::ofstream ofile(filename);
+    if (!ofile.is_open()) {
+        std::cerr << "bench: cannot open output file: " << filename << std::endl;
+        return false;
+    }
+    writeBenchJson(ofile, suite, results);
+    return true;
+}
+
+// parse "10,100,1000" to a list of numbers
+inline std::vector<size_t> parseSizeList(const std::string &s) {
+    std::vector<size_t> ret;
+    std::stringstream sstream(s);
+    std::string item;
+    while (std::getline(sstream, item, ',')) {
+        if (!item.empty()) ret.emplace_back(std::stoull(item));
+    }
+    return ret;
+}
+
+// minimal "--key value" argument parser
+// flags without value are mapped to "1"
+inline std::map<std::string, std::string> parseBenchArgs(int argc, const char* argv[]) {
+    std::map<std::string, std::string> args;
+    for (int i = 1; i < argc; i++) {
+        std::string key = argv[i];
+        if (key.rfind("--", 0) != 0) continue;
+        key = key.substr(2);
+        if ((i + 1 < argc) && (std::string(argv[i + 1]).rfind("--", 0) != 0)) {
+            args[key] = argv[++i];
+        } else {
+            args[key] = "1";
+        }
+    }
+    return args;
+}
+
+}
+
+#endif
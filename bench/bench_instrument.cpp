@@ -0,0 +1,146 @@
+#include "instrumenter.hpp"
+#include "bench-common.hpp"
+#include "synth-module.hpp"
+
+using namespace wasm_instrument;
+
+/*
+* bench_instrument doc:
+* 1. generate synthetic modules with different function counts
+* 2. time each phase of the instrumentation pipeline on them:
+*    setConfig, addFunctions, instrument with 1/10/50 operations,
+*    instrumentFunction in a loop and writeBinary
+* 3. print results as json and write them to --out
+* usage: bench_instrument [--funcs 10,100,1000] [--size 64] [--density 0.2]
+*                         [--iterations 3] [--seed 1] [--workdir .] [--out file]
+*/
+
+static const std::string kProbeFunc =
+    "(func $__bench_probe\n"
+    "global.get $__bench_count\n"
+    "i32.const 1\n"
+    "i32.add\n"
+    "global.set $__bench_count\n)";
+
+static bool prepare(Instrumenter &instrumenter, const InstrumentConfig &config) {
+    if (instrumenter.setConfig(config) != InstrumentResult::success) return false;
+    if (instrumenter.addGlobal("__bench_count", BinaryenTypeInt32(), true, BinaryenLiteralInt32(0)) == nullptr) return false;
+    return instrumenter.addFunctions({"__bench_probe"}, {kProbeFunc});
+}
+
+// make /num/ orthogonal operations that insert a probe call
+// the first one matches local.get, the rest match different binary ops
+static std::vector<InstrumentOperation> make_operations(size_t num) {
+    std::vector<InstrumentOperation> ops(num);
+    for (size_t i = 0; i < num; i++) {
+        InstrumentOperation::ExpName target{wasm::Expression::Id::LocalGetId, std::nullopt, std::nullopt};
+        if (i != 0) {
+            InstrumentOperation::ExpName::ExpOp exp_op;
+            exp_op.bop = wasm::BinaryOp(i - 1);
+            target.id = wasm::Expression::Id::BinaryId;
+            target.exp_op = exp_op;
+        }
+        ops[i].targets.push_back(target);
+        ops[i].pre_instructions.instructions = {"call $__bench_probe"};
+    }
+    return ops;
+}
+
+int main(int argc, const char* argv[]) {
+    auto args = parseBenchArgs(argc, argv);
+    auto func_nums = parseSizeList(args.count("funcs") ? args["funcs"] : "10,100,1000");
+    SynthConfig synth;
+    synth.func_size = args.count("size") ? std::stoull(args["size"]) : 64;
+    synth.cf_density = args.count("density") ? std::stod(args["density"]) : 0.2;
+    synth.seed = args.count("seed") ? std::stoul(args["seed"]) : 1;
+    size_t iterations = args.count("iterations") ? std::stoull(args["iterations"]) : 3;
+    std::string workdir = args.count("workdir") ? args["workdir"] : ".";
+    std::string out = args.count("out") ? args["out"] : "";
+
+    std::vector<BenchResult> results;
+    BenchTimer timer;
+    for (auto func_num : func_nums) {
+        synth.func_num = func_num;
+        InstrumentConfig config;
+        config.filename = workdir + "/__bench_synth_" + std::to_string(func_num) + ".wasm";
+        config.targetname = workdir + "/__bench_synth_" + std::to_string(func_num) + "_instr.wasm";
+        std::cerr << "bench_instrument: generating " << func_num << " functions" << std::endl;
+        if (!writeSynthModule(synth, config.filename)) return 1;
+
+        std::vector<std::pair<std::string, double>> params = {
+            {"funcs", double(func_num)},
+            {"func_size", double(synth.func_size)},
+            {"cf_density", synth.cf_density},
+        };
+        auto add_result = [&results, &params](const std::string &name) -> BenchResult& {
+            results.emplace_back();
+            results.back().name = name;
+            results.back().params = params;
+            return results.back();
+        };
+
+        auto &r_set = add_result("setConfig");
+        for (size_t it = 0; it < iterations; it++) {
+            Instrumenter instrumenter;
+            timer.start();
+            auto ret = instrumenter.setConfig(config);
+            r_set.samples_ms.emplace_back(timer.stop());
+            if (ret != InstrumentResult::success) return 1;
+        }
+
+        auto &r_add = add_result("addFunctions");
+        for (size_t it = 0; it < iterations; it++) {
+            Instrumenter instrumenter;
+            instrumenter.setConfig(config);
+            instrumenter.addGlobal("__bench_count", BinaryenTypeInt32(), true, BinaryenLiteralInt32(0));
+            timer.start();
+            bool ret = instrumenter.addFunctions({"__bench_probe"}, {kProbeFunc});
+            r_add.samples_ms.emplace_back(timer.stop());
+            if (!ret) return 1;
+        }
+
+        for (size_t op_num : {1, 10, 50}) {
+            auto ops = make_operations(op_num);
+            auto &r_ins = add_result("instrument");
+            r_ins.params.emplace_back("operations", double(op_num));
+            for (size_t it = 0; it < iterations; it++) {
+                Instrumenter instrumenter;
+                if (!prepare(instrumenter, config)) return 1;
+                timer.start();
+                auto ret = instrumenter.instrument(ops);
+                r_ins.samples_ms.emplace_back(timer.stop());
+                if (ret != InstrumentResult::success) return 1;
+            }
+        }
+
+        auto &r_func = add_result("instrumentFunction");
+        size_t loop_num = std::min(func_num, size_t(100));
+        r_func.params.emplace_back("calls", double(loop_num));
+        InstrumentOperation op;
+        op.post_instructions.instructions = {"call $__bench_probe"};
+        for (size_t it = 0; it < iterations; it++) {
+            Instrumenter instrumenter;
+            if (!prepare(instrumenter, config)) return 1;
+            timer.start();
+            for (size_t i = 0; i < loop_num; i++) {
+                auto name = "f" + std::to_string(i);
+                if (instrumenter.instrumentFunction(op, name.c_str(), 0) != InstrumentResult::success) return 1;
+            }
+            r_func.samples_ms.emplace_back(timer.stop());
+        }
+
+        auto &r_write = add_result("writeBinary");
+        for (size_t it = 0; it < iterations; it++) {
+            Instrumenter instrumenter;
+            if (!prepare(instrumenter, config)) return 1;
+            if (instrumenter.instrument(make_operations(1)) != InstrumentResult::success) return 1;
+            timer.start();
+            auto ret = instrumenter.writeBinary();
+            r_write.samples_ms.emplace_back(timer.stop());
+            if (ret != InstrumentResult::success) return 1;
+        }
+        std::remove(config.filename.c_str());
+        std::remove(config.targetname.c_str());
+    }
+    return emitBenchJson(out, "instrument", results) ? 0 : 1;
+}
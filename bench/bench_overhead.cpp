@@ -0,0 +1,275 @@
+#include "instrumenter.hpp"
+#include "bench-common.hpp"
+#include "synth-module.hpp"
+#include <shell-interface.h>
+#include <wasm-interpreter.h>
+#include <wasm-io.h>
+
+using namespace wasm_instrument;
+
+/*
+* bench_overhead doc:
+* 1. build the original and one instrumented module per strategy for every workload
+*    strategies follow test/test_fib and the scenarios of examples/my_analysis.cpp
+*    every variant exports __bench_main(i32) -> i32 that prepares the probes and calls the workload
+* 2. build a counting copy of every variant that increments an exported i64 global
+*    before each instruction, so executed instructions include the inserted probes
+* 3. run every variant in Binaryen's interpreter, or in an external runtime given by
+*    --runtime with {wasm} and {arg} placeholders, e.g. "wasmtime --invoke __bench_main {wasm} {arg}"
+* 4. report wall time and executed instruction overhead of every strategy as json
+* usage: bench_overhead [--fib path/to/fib.wasm] [--fib-arg 20] [--synth-funcs 200] [--synth-arg 3]
+*                       [--iterations 3] [--runtime cmd] [--workdir .] [--out file]
+*/
+
+struct Workload {
+    std::string name;
+    std::string filename;
+    std::string export_name;
+    int32_t arg;
+};
+
+static const char* kStrategies[] = {
+    "none",
+    "call_count",
+    "instruction_mix",
+    "cryptominer_detection",
+    "memory_access_tracing",
+};
+
+static const std::string kIncInstrFunc =
+    "(func $__incInstr (param i32) (local i32)\nlocal.get 0\ni32.const 4\ni32.mul\nglobal.get $__count_base\n"
+    "i32.add\nlocal.tee 1\nlocal.get 1\ni32.load\ni32.const 1\ni32.add\ni32.store\n)";
+
+static const std::string kPrepareFunc =
+    "(func $__prepare\ni32.const 1\nmemory.grow\ni32.const 65536\ni32.mul\nglobal.set $__count_base\n)";
+
+// probes of the scenarios write to memory, add one if the module has none
+// and make sure that memory.grow in __prepare succeeds
+static bool ensure_memory(Instrumenter &instrumenter) {
+    auto memory = instrumenter.getMemory();
+    if (memory == nullptr) {
+        return instrumenter.addMemory("mem", false, 1, 2) != nullptr;
+    }
+    if (memory->max - memory->initial <= 0) {
+        memory->max = std::min(static_cast<uint64_t>(memory->max + 1), static_cast<uint64_t>(wasm::Memory::kMaxSize32));
+    }
+    return (memory->max - memory->initial) > 0;
+}
+
+static bool apply_strategy(Instrumenter &instrumenter, const std::string &strategy) {
+    std::vector<InstrumentOperation> ops;
+    if (strategy == "call_count") {
+        // test_fib: count calls being executed
+        if (instrumenter.addGlobal("__call_num", BinaryenTypeInt32(), true, BinaryenLiteralInt32(0)) == nullptr) return false;
+        if (!instrumenter.addFunctions({"__add_call"}, {
+            "(func $__add_call\ni32.const 1\nglobal.get $__call_num\ni32.add\nglobal.set $__call_num\n)"})) return false;
+        ops.resize(1);
+        ops[0].targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id::CallId, std::nullopt, std::nullopt});
+        ops[0].pre_instructions.instructions = {"call $__add_call"};
+    } else if (strategy == "instruction_mix" || strategy == "cryptominer_detection") {
+        if (!ensure_memory(instrumenter)) return false;
+        if (instrumenter.addGlobal("__count_base", BinaryenTypeInt32(), true, BinaryenLiteralInt32(-1)) == nullptr) return false;
+        if (!instrumenter.addFunctions({"__incInstr", "__prepare"}, {kIncInstrFunc, kPrepareFunc})) return false;
+        if (strategy == "instruction_mix") {
+            ops.resize(wasm::Expression::Id::UnreachableId);
+            for (int i = 1; i <= wasm::Expression::Id::UnreachableId; i++) {
+                ops[i-1].targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id(i), std::nullopt, std::nullopt});
+                ops[i-1].pre_instructions.instructions = {"i32.const " + std::to_string(i), "call $__incInstr"};
+            }
+        } else {
+            std::vector<wasm::BinaryOp> signature {wasm::BinaryOp::AddInt32, wasm::BinaryOp::AndInt32,
+                wasm::BinaryOp::ShlInt32, wasm::BinaryOp::ShrUInt32, wasm::BinaryOp::XorInt32};
+            ops.resize(signature.size());
+            for (size_t i = 0; i < signature.size(); i++) {
+                InstrumentOperation::ExpName t {wasm::Expression::Id::BinaryId, std::nullopt, std::nullopt};
+                InstrumentOperation::ExpName::ExpOp exp_op;
+                exp_op.bop = signature[i];
+                t.exp_op = exp_op;
+                ops[i].targets.push_back(t);
+                ops[i].pre_instructions.instructions = {"i32.const " + std::to_string(i + 1), "call $__incInstr"};
+            }
+        }
+    } else if (strategy == "memory_access_tracing") {
+        if (!ensure_memory(instrumenter)) return false;
+        if (instrumenter.addGlobal("__count_base", BinaryenTypeInt32(), true, BinaryenLiteralInt32(-1)) == nullptr) return false;
+        if (instrumenter.addGlobal("__trace_pos", BinaryenTypeInt32(), true, BinaryenLiteralInt32(0)) == nullptr) return false;
+        // records of (address, is_store) are kept in a ring inside the probe page
+        // so that long runs do not write out of it
+        const std::string record =
+            "global.get $__count_base\nglobal.get $__trace_pos\ni32.add\nlocal.get 0\ni32.store\n"
+            "global.get $__count_base\nglobal.get $__trace_pos\ni32.add\n";
+        const std::string advance =
+            "i32.store offset=4\nglobal.get $__trace_pos\ni32.const 8\ni32.add\ni32.const 65535\ni32.and\n"
+            "global.set $__trace_pos\n";
+        if (!instrumenter.addFunctions({"__accessload", "__accessstore", "__prepare"}, {
+            "(func $__accessload (param i32) (result i32)\n" + record + "i32.const 0\n" + advance + "local.get 0\n)",
+            "(func $__accessstore (param i32 i32) (result i32 i32)\n" + record + "i32.const 1\n" + advance +
+                "local.get 0\nlocal.get 1\n)",
+            kPrepareFunc})) return false;
+        ops.resize(2);
+        ops[0].targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id::LoadId, std::nullopt, std::nullopt});
+        ops[0].pre_instructions.instructions = {"call $__accessload"};
+        ops[0].pre_instructions.stack_context = {wasm::Type::i32};
+        // workloads only store i32 values
+        ops[1].targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id::StoreId, std::nullopt, std::nullopt});
+        ops[1].pre_instructions.instructions = {"call $__accessstore"};
+        ops[1].pre_instructions.stack_context = {wasm::Type::i32, wasm::Type::i32};
+    }
+    if (!ops.empty() && instrumenter.instrument(ops) != InstrumentResult::success) return false;
+    return true;
+}
+
+// export __bench_main(i32) -> i32 which prepares the probes and runs the workload
+static bool add_entry(Instrumenter &instrumenter, const Workload &workload) {
+    auto exp = instrumenter.getExport(workload.export_name.c_str());
+    if (exp == nullptr) return false;
+    std::string body = "(func $__bench_main (param i32) (result i32)\n";
+    if (instrumenter.getFunction("__prepare") != nullptr) body += "call $__prepare\n";
+    body += "local.get 0\ncall $" + exp->value.toString() + "\n)";
+    if (!instrumenter.addFunctions({"__bench_main"}, {body})) return false;
+    return instrumenter.addExport(wasm::ModuleItemKind::Function, "__bench_main", "__bench_main") != nullptr;
+}
+
+// count every executed instruction (control flow markers included) of the variant
+static bool add_instruction_counter(Instrumenter &instrumenter) {
+    if (instrumenter.addGlobal("__bench_icount", BinaryenTypeInt64(), true, BinaryenLiteralInt64(0)) == nullptr) return false;
+    if (instrumenter.addExport(wasm::ModuleItemKind::Global, "__bench_icount", "__bench_icount") == nullptr) return false;
+    InstrumentOperation op;
+    for (int i = 1; i < wasm::Expression::Id::NumExpressionIds; i++) {
+        op.targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id(i), std::nullopt, std::nullopt});
+    }
+    op.pre_instructions.instructions = {
+        "global.get $__bench_icount",
+        "i64.const 1",
+        "i64.add",
+        "global.set $__bench_icount",
+    };
+    return instrumenter.instrument({op}) == InstrumentResult::success;
+}
+
+static bool build_variant(const std::string &infile, const std::string &outfile, const std::string &strategy,
+                          const Workload &workload, bool count) {
+    InstrumentConfig config;
+    config.filename = infile;
+    config.targetname = outfile;
+    Instrumenter instrumenter;
+    if (instrumenter.setConfig(config) != InstrumentResult::success) return false;
+    if (count) {
+        if (!add_instruction_counter(instrumenter)) return false;
+    } else {
+        if (!apply_strategy(instrumenter, strategy)) return false;
+        if (!add_entry(instrumenter, workload)) return false;
+    }
+    return instrumenter.writeBinary() == InstrumentResult::success;
+}
+
+// run __bench_main(arg) in Binaryen's interpreter
+// return wall time in ms of the call and set /icount/ if the module exports __bench_icount
+static std::optional<double> run_interpreter(const std::string &filename, int32_t arg, int64_t &icount) {
+    wasm::Module module;
+    module.features = FEATURE_SPEC | wasm::FeatureSet::MultiMemory;
+    wasm::ModuleReader reader;
+    try {
+        reader.read(filename, module, "");
+    } catch(wasm::ParseException &p) {
+        p.dump(std::cerr);
+        std::cerr << '\n';
+        return std::nullopt;
+    }
+    BenchTimer timer;
+    double ret = 0.0;
+    try {
+        wasm::ShellExternalInterface interface;
+        wasm::ModuleRunner instance(module, &interface);
+        timer.start();
+        instance.callExport("__bench_main", {wasm::Literal(arg)});
+        ret = timer.stop();
+        if (module.getExportOrNull("__bench_icount") != nullptr) {
+            icount = instance.getExportedGlobal("__bench_icount")[0].geti64();
+        }
+    } catch(...) {
+        std::cerr << "bench_overhead: trap when running " << filename << std::endl;
+        return std::nullopt;
+    }
+    return ret;
+}
+
+static std::optional<double> run_external(std::string cmd, const std::string &filename, int32_t arg) {
+    auto replace = [&cmd](const std::string &key, const std::string &value) {
+        for (auto pos = cmd.find(key); pos != std::string::npos; pos = cmd.find(key, pos + value.size())) {
+            cmd.replace(pos, key.size(), value);
+        }
+    };
+    replace("{wasm}", filename);
+    replace("{arg}", std::to_string(arg));
+    cmd += " > /dev/null";
+    BenchTimer timer;
+    timer.start();
+    int return_code = system(cmd.c_str());
+    double ret = timer.stop();
+    if (return_code != 0) {
+        std::cerr << "bench_overhead: \"" << cmd << "\" returns " << return_code << std::endl;
+        return std::nullopt;
+    }
+    return ret;
+}
+
+int main(int argc, const char* argv[]) {
+    auto args = parseBenchArgs(argc, argv);
+    size_t iterations = args.count("iterations") ? std::stoull(args["iterations"]) : 3;
+    std::string workdir = args.count("workdir") ? args["workdir"] : ".";
+    std::string runtime = args.count("runtime") ? args["runtime"] : "";
+    std::string out = args.count("out") ? args["out"] : "";
+
+    std::vector<Workload> workloads;
+    workloads.push_back(Workload{"fib", args.count("fib") ? args["fib"] : "../test/test_fib/fib.wasm", "fib",
+                                 args.count("fib-arg") ? std::stoi(args["fib-arg"]) : 20});
+    SynthConfig synth;
+    synth.func_num = args.count("synth-funcs") ? std::stoull(args["synth-funcs"]) : 200;
+    synth.cf_density = 0.3;
+    auto synth_file = workdir + "/__overhead_synth.wasm";
+    if (!writeSynthModule(synth, synth_file)) return 1;
+    workloads.push_back(Workload{"synth", synth_file, "run", args.count("synth-arg") ? std::stoi(args["synth-arg"]) : 3});
+
+    std::vector<BenchResult> results;
+    for (const auto &workload : workloads) {
+        double base_time = 0.0;
+        int64_t base_icount = 0;
+        for (const std::string strategy : kStrategies) {
+            auto variant = workdir + "/__overhead_" + workload.name + "_" + strategy + ".wasm";
+            auto counting = workdir + "/__overhead_" + workload.name + "_" + strategy + "_count.wasm";
+            if (!build_variant(workload.filename, variant, strategy, workload, false) ||
+                !build_variant(variant, counting, strategy, workload, true)) {
+                std::cerr << "bench_overhead: cannot build " << strategy << " for " << workload.name << std::endl;
+                return 1;
+            }
+            results.emplace_back();
+            auto &r = results.back();
+            r.name = workload.name + "/" + strategy;
+            r.params = {{"arg", double(workload.arg)}};
+            for (size_t it = 0; it < iterations; it++) {
+                int64_t unused = 0;
+                auto t = runtime.empty() ? run_interpreter(variant, workload.arg, unused)
+                                         : run_external(runtime, variant, workload.arg);
+                if (!t.has_value()) return 1;
+                r.samples_ms.emplace_back(t.value());
+            }
+            int64_t icount = 0;
+            if (!run_interpreter(counting, workload.arg, icount).has_value()) return 1;
+            double time = benchMedian(r.samples_ms);
+            if (std::string(strategy) == "none") {
+                base_time = time;
+                base_icount = icount;
+            }
+            r.metrics = {
+                {"executed_instructions", double(icount)},
+                {"instruction_overhead", base_icount ? double(icount) / double(base_icount) : 0.0},
+                {"time_overhead", (base_time > 0.0) ? time / base_time : 0.0},
+            };
+            std::remove(variant.c_str());
+            std::remove(counting.c_str());
+        }
+    }
+    std::remove(synth_file.c_str());
+    return emitBenchJson(out, runtime.empty() ? "overhead-interpreter" : "overhead-external", results) ? 0 : 1;
+}
@@ -0,0 +1,16 @@
+#include "bench-common.hpp"
+#include "synth-module.hpp"
+
+using namespace wasm_instrument;
+
+// usage: gen_module [outfile name] [--funcs 1000] [--size 64] [--density 0.2] [--seed 1]
+int main(int argc, const char* argv[]) {
+    if (argc <= 1) return 1;
+    auto args = parseBenchArgs(argc, argv);
+    SynthConfig synth;
+    synth.func_num = args.count("funcs") ? std::stoull(args["funcs"]) : 1000;
+    synth.func_size = args.count("size") ? std::stoull(args["size"]) : 64;
+    synth.cf_density = args.count("density") ? std::stod(args["density"]) : 0.2;
+    synth.seed = args.count("seed") ? std::stoul(args["seed"]) : 1;
+    return writeSynthModule(synth, argv[1]) ? 0 : 1;
+}
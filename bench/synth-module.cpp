@@ -0,0 +1,181 @@
+#include "synth-module.hpp"
+#include <random>
+#include <binaryen-c.h>
+#include <wasm-builder.h>
+#include <wasm-io.h>
+
+namespace wasm_instrument {
+
+namespace {
+
+// generate function bodies statement by statement
+// a statement is always of type none and leaves the stack balanced
+class SynthFunctionGenerator {
+public:
+    SynthFunctionGenerator(const SynthConfig &config, wasm::Module &module, std::mt19937 &rng)
+        : config_(config), module_(module), builder_(module), rng_(rng) {}
+
+    wasm::Expression* makeBody(size_t func_idx) {
+        this->func_idx_ = func_idx;
+        this->label_num_ = 0;
+        size_t budget = this->config_.func_size;
+        auto* body = this->builder_.makeBlock();
+        while (budget > 0) {
+            body->list.push_back(_make_statement(budget, 0));
+        }
+        // (param $0 i32) (local $1 i32) (local $2 i32)
+        body->list.push_back(this->builder_.makeBinary(wasm::BinaryOp::AddInt32,
+            this->builder_.makeLocalGet(0, wasm::Type::i32),
+            this->builder_.makeLocalGet(1, wasm::Type::i32)));
+        body->finalize();
+        return body;
+    }
+
+private:
+    const SynthConfig &config_;
+    wasm::Module &module_;
+    wasm::Builder builder_;
+    std::mt19937 &rng_;
+    size_t func_idx_ = 0;
+    size_t label_num_ = 0;
+
+    static constexpr int kMaxDepth = 4;
+    static constexpr wasm::Address kDataRange = 4096;
+
+    wasm::Name _next_label() {
+        return wasm::Name("L" + std::to_string(this->label_num_++));
+    }
+
+    wasm::Expression* _make_i32(int32_t value) {
+        return this->builder_.makeConst(wasm::Literal(value));
+    }
+
+    // local.get 0 op const => local.set 1, about 4 instructions
+    wasm::Expression* _make_arith(size_t &budget) {
+        const wasm::BinaryOp ops[] = {
+            wasm::BinaryOp::AddInt32, wasm::BinaryOp::SubInt32, wasm::BinaryOp::MulInt32,
+            wasm::BinaryOp::AndInt32, wasm::BinaryOp::XorInt32, wasm::BinaryOp::ShlInt32,
+        };
+        auto op = ops[this->rng_() % (sizeof(ops) / sizeof(ops[0]))];
+        budget -= std::min(budget, size_t(4));
+        return this->builder_.makeLocalSet(1, this->builder_.makeBinary(op,
+            this->builder_.makeLocalGet(1, wasm::Type::i32),
+            _make_i32(int32_t(this->rng_() % 64))));
+    }
+
+    // memory traffic inside a small range, about 6 instructions
+    wasm::Expression* _make_memory(size_t &budget) {
+        budget -= std::min(budget, size_t(6));
+        auto memory = this->module_.memories[0]->name;
+        auto address = wasm::Address((this->rng_() % (kDataRange / 4)) * 4);
+        auto* load = this->builder_.makeLoad(4, false, address, 4, _make_i32(0), wasm::Type::i32, memory);
+        return this->builder_.makeStore(4, address, 4, _make_i32(0),
+            this->builder_.makeBinary(wasm::BinaryOp::AddInt32, load,
+                this->builder_.makeLocalGet(0, wasm::Type::i32)),
+            wasm::Type::i32, memory);
+    }
+
+    wasm::Expression* _make_call(size_t &budget) {
+        budget -= std::min(budget, size_t(3));
+        auto target = wasm::Name("f" + std::to_string(this->rng_() % this->func_idx_));
+        return this->builder_.makeLocalSet(1, this->builder_.makeCall(target,
+            {this->builder_.makeLocalGet(1, wasm::Type::i32)}, wasm::Type::i32));
+    }
+
+    wasm::Expression* _make_statement(size_t &budget, int depth) {
+        std::uniform_real_distribution<double> dist(0.0, 1.0);
+        if ((depth >= kMaxDepth) || (budget < 16) || (dist(this->rng_) >= this->config_.cf_density)) {
+            return ((this->rng_() % 4) == 0) ? _make_memory(budget) : _make_arith(budget);
+        }
+        switch (this->rng_() % 4) {
+            case 0: {
+                // block $L ... (br_if $L (local.get 0)) ... end
+                auto name = _next_label();
+                auto* block = this->builder_.makeBlock();
+                block->name = name;
+                budget -= std::min(budget, size_t(4));
+                block->list.push_back(_make_statement(budget, depth + 1));
+                block->list.push_back(this->builder_.makeBreak(name, nullptr,
+                    this->builder_.makeLocalGet(0, wasm::Type::i32)));
+                block->list.push_back(_make_statement(budget, depth + 1));
+                block->finalize();
+                return block;
+            }
+            case 1: {
+                budget -= std::min(budget, size_t(4));
+                auto* if_true = _make_statement(budget, depth + 1);
+                auto* if_false = _make_statement(budget, depth + 1);
+                return this->builder_.makeIf(this->builder_.makeBinary(wasm::BinaryOp::LtUInt32,
+                    this->builder_.makeLocalGet(0, wasm::Type::i32), _make_i32(int32_t(this->rng_() % 16))),
+                    if_true, if_false);
+            }
+            case 2: {
+                // $2 = 0; loop $L ... $2++; br_if $L ($2 < 4) end
+                auto name = _next_label();
+                budget -= std::min(budget, size_t(12));
+                auto* body = this->builder_.makeBlock();
+                body->list.push_back(_make_statement(budget, depth + 1));
+                body->list.push_back(this->builder_.makeLocalSet(2, this->builder_.makeBinary(
+                    wasm::BinaryOp::AddInt32, this->builder_.makeLocalGet(2, wasm::Type::i32), _make_i32(1))));
+                body->list.push_back(this->builder_.makeBreak(name, nullptr, this->builder_.makeBinary(
+                    wasm::BinaryOp::LtUInt32, this->builder_.makeLocalGet(2, wasm::Type::i32), _make_i32(4))));
+                body->finalize();
+                auto* loop = this->builder_.makeLoop(name, body);
+                return this->builder_.makeSequence(this->builder_.makeLocalSet(2, _make_i32(0)), loop);
+            }
+            default: {
+                if (this->func_idx_ == 0) return _make_arith(budget);
+                return _make_call(budget);
+            }
+        }
+    }
+};
+
+} // anonymous namespace
+
+void makeSynthModule(const SynthConfig &config, wasm::Module &module) {
+    std::mt19937 rng(config.seed);
+    auto memory = std::make_unique<wasm::Memory>();
+    memory->name = "mem";
+    memory->initial = 1;
+    memory->max = 1;
+    module.addMemory(std::move(memory));
+    module.addGlobal(wasm::Builder::makeGlobal("g0", wasm::Type::i32,
+        wasm::Builder(module).makeConst(wasm::Literal(int32_t(0))), wasm::Builder::Mutable));
+
+    SynthFunctionGenerator generator(config, module, rng);
+    wasm::Signature sig(wasm::Type::i32, wasm::Type::i32);
+    for (size_t i = 0; i < config.func_num; i++) {
+        auto func = wasm::Builder::makeFunction(wasm::Name("f" + std::to_string(i)), wasm::HeapType(sig),
+                                                {wasm::Type::i32, wasm::Type::i32});
+        func->body = generator.makeBody(i);
+        module.addFunction(std::move(func));
+    }
+    if (config.func_num > 0) {
+        module.addExport(wasm::Builder::makeExport("run",
+            wasm::Name("f" + std::to_string(config.func_num - 1)), wasm::ExternalKind::Function));
+    }
+    module.addExport(wasm::Builder::makeExport("memory", "mem", wasm::ExternalKind::Memory));
+}
+
+bool writeSynthModule(const SynthConfig &config, const std::string &filename) {
+    wasm::Module module;
+    module.features = wasm::FeatureSet::MVP | wasm::FeatureSet::MutableGlobals;
+    makeSynthModule(config, module);
+    if (!BinaryenModuleValidate(&module)) {
+        std::cerr << "writeSynthModule: generated module is invalid!" << std::endl;
+        return false;
+    }
+    wasm::ModuleWriter writer;
+    writer.setBinary(true);
+    try {
+        writer.write(module, filename);
+    } catch(wasm::ParseException &p) {
+        p.dump(std::cerr);
+        std::cerr << '\n';
+        return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,30 @@
+#ifndef synth_module_h
+#define synth_module_h
+
+#include <wasm.h>
+#include <string>
+
+namespace wasm_instrument {
+
+// config to generate a synthetic module for benchmarks
+// every function has signature (i32) -> i32 and roughly /func_size/ instructions
+// /cf_density/ in [0, 1] is the probability that a statement is a control flow structure
+// (block with br_if, if-else, bounded loop) or a call to a previously generated function
+struct SynthConfig {
+    size_t func_num = 100;
+    size_t func_size = 64;
+    double cf_density = 0.2;
+    uint32_t seed = 1;
+};
+
+// fill an empty module with generated functions, a memory and a global
+// functions only call functions with smaller index so the call graph is acyclic
+// the last function is exported as "run"
+void makeSynthModule(const SynthConfig &config, wasm::Module &module);
+
+// generate and write the module as binary, return false on failure
+bool writeSynthModule(const SynthConfig &config, const std::string &filename);
+
+}
+
+#endif
@@ -0,0 +1,29 @@
+#include "instrumenter.hpp"
+using namespace wasm_instrument;
+// usage: ir_count [infile name] [outfile name] [optimize level]
+// count calls and loads in the exported global __instr_count through binaryen ir,
+// then optimize the module so the counting helper is inlined
+int main(int argc, const char* argv[]) {
+    if (argc <= 2) return 1;
+    InstrumentConfig config;
+    config.filename = argv[1];
+    config.targetname = argv[2];
+    Instrumenter instrumenter;
+    if (instrumenter.setConfig(config) != InstrumentResult::success) return 1;
+    instrumenter.addGlobal("__instr_count", BinaryenTypeInt64(), true, BinaryenLiteralInt64(0));
+    instrumenter.addFunctions({"__instr_inc"},
+        {"(func $__instr_inc\nglobal.get $__instr_count\ni64.const 1\ni64.add\nglobal.set $__instr_count\n)"});
+    instrumenter.addExport(wasm::ModuleItemKind::Global, "__instr_count", "__instr_count");
+    InstrumentOperation op_call;
+    op_call.targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id::CallId, std::nullopt, std::nullopt});
+    op_call.targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id::CallIndirectId, std::nullopt, std::nullopt});
+    op_call.pre_instructions.instructions = {"call $__instr_inc"};
+    InstrumentOperation op_load;
+    op_load.targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id::LoadId, std::nullopt, std::nullopt});
+    op_load.pre_instructions.instructions = {"call $__instr_inc"};
+    // the helper is added after the scope was made, so it is not instrumented
+    if (instrumenter.instrumentIR({op_call, op_load}) != InstrumentResult::success) return 1;
+    int level = argc > 3 ? std::atoi(argv[3]) : 2;
+    if (level > 0 && instrumenter.optimize(level) != InstrumentResult::success) return 1;
+    return instrumenter.writeBinary() == InstrumentResult::success ? 0 : 1;
+}
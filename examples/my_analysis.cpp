@@ -1,62 +1,135 @@
 #include <instrumenter.hpp>
+#include <counter-promotion.hpp>
 using namespace wasm_instrument;
+// usage: my_analysis [instruction_mix|cryptominer_detection|memory_access_tracing] [infile name] [outfile name]
+//                    [--separate-memory]
+// without _start in the module, the host calls the exported __prepare before anything else
 
-void instruction_mix() {
-    Instrumenter instrumenter;
-    instrumenter.addGlobal("__count_base", BinaryenTypeInt32(), true, BinaryenLiteralInt32(-1));
-    instrumenter.addFunctions({"__incInstr", "__prepare"},
-        {"(func $__incInstr (param i32) (local i32)\nlocal.get 0\ni32.const 4\ni32.mul\nglobal.get $__count_base\ni32.add\nlocal.tee 1\nlocal.get 1\ni32.load\ni32.const 1\ni32.add\ni32.store\n)",
-        "(func $__prepare\ni32.const 1\nmemory.grow\ni32.const 65536\ni32.mul\nglobal.set $__count_base\n)"});
-    std::vector<InstrumentOperation> ops(23);
-    for (int i = 1; i <= 23; i++) {
-        ops[i-1].targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id(i), std::nullopt, std::nullopt});
-        ops[i-1].pre_instructions.instructions = {"i32.const " + std::to_string(i), "call $incInstr",};
+// the tables are in a page grown at start, or at 0 of a memory of their own with separate_memory,
+// which leaves the app memory as it is and can be read by the host, but needs multi-memory
+static std::string on_table(const std::string &inst, bool separate_memory) {
+    return separate_memory ? inst + " $__count_mem" : inst;
+}
+
+static bool add_table(Instrumenter &instrumenter, bool separate_memory) {
+    if (!separate_memory) {
+        // memory.grow in __prepare needs room for one more page
+        auto memory = instrumenter.getMemory();
+        if (memory == nullptr) {
+            if (instrumenter.addMemory("mem", false, 1, 2) == nullptr) return false;
+        } else if (memory->max <= memory->initial) {
+            memory->max = std::min(static_cast<uint64_t>(memory->max + 1), static_cast<uint64_t>(wasm::Memory::kMaxSize32));
+            if (memory->max <= memory->initial) return false;
+        }
+        return instrumenter.addGlobal("__count_base", BinaryenTypeInt32(), true, BinaryenLiteralInt32(-1)) != nullptr &&
+            instrumenter.addFunctions({"__prepare"},
+                {"(func $__prepare\ni32.const 1\nmemory.grow\ni32.const 65536\ni32.mul\nglobal.set $__count_base\n)"});
+    }
+    return instrumenter.addGlobal("__count_base", BinaryenTypeInt32(), true, BinaryenLiteralInt32(0)) != nullptr &&
+        instrumenter.addMemory("__count_mem", false, 1, 1) != nullptr &&
+        instrumenter.addExport(wasm::ModuleItemKind::Memory, "__count_mem", "__count_mem") != nullptr;
+}
+
+// after instrumenting, so that the call is not instrumented itself
+static bool prepare_table(Instrumenter &instrumenter, bool separate_memory) {
+    if (separate_memory) return true;
+    auto start = instrumenter.getStartFunction();
+    if (start == nullptr) {
+        return instrumenter.addExport(wasm::ModuleItemKind::Function, "__prepare", "__prepare") != nullptr;
     }
-    instrumenter.instrument(ops);
     InstrumentOperation op;
     op.post_instructions.instructions = {"call $__prepare"};
-    instrumenter.instrumentFunction(op, instrumenter.getStartFunction()->name.toString().c_str(), 0);
+    return instrumenter.instrumentFunction(op, start->name.toString().c_str(), 0) == InstrumentResult::success;
+}
+
+static bool instruction_mix(const InstrumentConfig &config, bool separate_memory) {
+    Instrumenter instrumenter;
+    if (instrumenter.setConfig(config) != InstrumentResult::success) return false;
+    if (!add_table(instrumenter, separate_memory)) return false;
+    auto load = on_table("i32.load", separate_memory);
+    auto store = on_table("i32.store", separate_memory);
+    if (!instrumenter.addFunctions({"__incInstr", "__addInstr"},
+        {"(func $__incInstr (param i32) (local i32)\nlocal.get 0\ni32.const 4\ni32.mul\nglobal.get $__count_base\ni32.add\nlocal.tee 1\nlocal.get 1\n" + load + "\ni32.const 1\ni32.add\n" + store + "\n)",
+        "(func $__addInstr (param i32 i32) (local i32)\nlocal.get 0\ni32.const 4\ni32.mul\nglobal.get $__count_base\ni32.add\nlocal.tee 2\nlocal.get 2\n" + load + "\nlocal.get 1\ni32.add\n" + store + "\n)"})) return false;
+    std::vector<InstrumentOperation> ops(wasm::Expression::Id::UnreachableId);
+    for (int i = 1; i <= wasm::Expression::Id::UnreachableId; i++) {
+        ops[i-1].targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id(i), std::nullopt, std::nullopt});
+        ops[i-1].pre_instructions.instructions = {"i32.const " + std::to_string(i), "call $__incInstr",};
+    }
+    if (instrumenter.instrument(ops) != InstrumentResult::success) return false;
+    // sites run once per iteration are counted by a trip counter of their loop,
+    // other counters hit in loops are kept in locals and added to the table on the way out
+    HoistResult hoisted;
+    PromotionResult promoted;
+    if (!hoistLoopCounters(instrumenter, {"__incInstr", "__addInstr"}, hoisted) ||
+        !promoteCounters(instrumenter, {"__incInstr", "__addInstr"}, promoted)) return false;
+    return prepare_table(instrumenter, separate_memory) && instrumenter.writeBinary() == InstrumentResult::success;
 }
 
-void cryptominer_detection() {
+static bool cryptominer_detection(const InstrumentConfig &config, bool separate_memory) {
     Instrumenter instrumenter;
-    instrumenter.addGlobal("__count_base", BinaryenTypeInt32(), true, BinaryenLiteralInt32(-1));
-    instrumenter.addFunctions({"__incInstr", "__prepare"},
-        {"(func $__incInstr (param i32) (local i32)\nlocal.get 0\ni32.const 4\ni32.mul\nglobal.get $__count_base\ni32.add\nlocal.tee 1\nlocal.get 1\ni32.load\ni32.const 1\ni32.add\ni32.store\n)",
-        "(func $__prepare\ni32.const 1\nmemory.grow\ni32.const 65536\ni32.mul\nglobal.set $__count_base\n)"});
-    std::vector<InstrumentOperation> ops(4);
+    if (instrumenter.setConfig(config) != InstrumentResult::success) return false;
+    if (!add_table(instrumenter, separate_memory)) return false;
+    if (!instrumenter.addFunctions({"__incInstr"},
+        {"(func $__incInstr (param i32) (local i32)\nlocal.get 0\ni32.const 4\ni32.mul\nglobal.get $__count_base\ni32.add\nlocal.tee 1\nlocal.get 1\n" +
+         on_table("i32.load", separate_memory) + "\ni32.const 1\ni32.add\n" + on_table("i32.store", separate_memory) + "\n)"})) return false;
     std::vector<wasm::BinaryOp> signature {wasm::BinaryOp::AddInt32, wasm::BinaryOp::AndInt32, wasm::BinaryOp::ShlInt32, wasm::BinaryOp::ShrUInt32, wasm::BinaryOp::XorInt32};
-    for (int i = 1; i <= 4; i++) {
+    std::vector<InstrumentOperation> ops(signature.size());
+    for (size_t i = 0; i < signature.size(); i++) {
         InstrumentOperation::ExpName t {wasm::Expression::Id::BinaryId, std::nullopt, std::nullopt};
-        t.exp_op->bop = signature[i-1];
-        ops[i-1].targets.push_back(t);
-        ops[i-1].pre_instructions.instructions = {"i32.const " + std::to_string(i), "call $incInstr",};
+        InstrumentOperation::ExpName::ExpOp exp_op;
+        exp_op.bop = signature[i];
+        t.exp_op = exp_op;
+        ops[i].targets.push_back(t);
+        ops[i].pre_instructions.instructions = {"i32.const " + std::to_string(i + 1), "call $__incInstr",};
     }
-    instrumenter.instrument(ops);
-    InstrumentOperation op;
-    op.post_instructions.instructions = {"call $__prepare"};
-    instrumenter.instrumentFunction(op, instrumenter.getStartFunction()->name.toString().c_str(), 0);
+    if (instrumenter.instrument(ops) != InstrumentResult::success) return false;
+    return prepare_table(instrumenter, separate_memory) && instrumenter.writeBinary() == InstrumentResult::success;
 }
 
-void memory_access_tracing() {
+static bool memory_access_tracing(const InstrumentConfig &config, bool separate_memory) {
     Instrumenter instrumenter;
-    instrumenter.addGlobal("__count_base", BinaryenTypeInt32(), true, BinaryenLiteralInt32(-1));
-    instrumenter.addFunctions({"__accessload", "__accessstore", "__prepare"},
-        {"(func $__accessload (param i32) (result i32) (local i32)\nlocal.get 0\nlocal.set 1\nglobal.get $__count_base\nlocal.get 1\ni32.store\ni32.const 4\nglobal.get $__count_base\ni32.add\ni32.const 0\ni32.store\ni32.const 8\nglobal.get $__count_base\ni32.add\nglobal.set $__count_base\nlocal.get 1\n)",
-        "(func $__accessstore (param i32 i32) (result i32 i32) (local i32 i32)\nlocal.get 0\nlocal.set 2\nlocal.get 1\nlocal.set 3\nglobal.get $__count_base\nlocal.get 2\ni32.store\ni32.const 4\nglobal.get $__count_base\ni32.add\ni32.const 1\ni32.store\ni32.const 8\nglobal.get $__count_base\ni32.add\nglobal.set $__count_base\nlocal.get 2\nlocal.get 3\n)",
-        "(func $__prepare\ni32.const 1\nmemory.grow\ni32.const 65536\ni32.mul\nglobal.set $__count_base\n)"});
+    if (instrumenter.setConfig(config) != InstrumentResult::success) return false;
+    if (!add_table(instrumenter, separate_memory)) return false;
+    if (instrumenter.addGlobal("__trace_pos", BinaryenTypeInt32(), true, BinaryenLiteralInt32(0)) == nullptr) return false;
+    auto store = on_table("i32.store", separate_memory);
+    auto store_flag = store + " offset=4";
+    // records of (address, is_store) are kept in a ring inside the table page
+    const std::string record =
+        "global.get $__count_base\nglobal.get $__trace_pos\ni32.add\nlocal.get 0\n" + store + "\n"
+        "global.get $__count_base\nglobal.get $__trace_pos\ni32.add\n";
+    const std::string advance =
+        store_flag + "\nglobal.get $__trace_pos\ni32.const 8\ni32.add\ni32.const 65535\ni32.and\nglobal.set $__trace_pos\n";
+    if (!instrumenter.addFunctions({"__accessload", "__accessstore"},
+        {"(func $__accessload (param i32) (result i32)\n" + record + "i32.const 0\n" + advance + "local.get 0\n)",
+        "(func $__accessstore (param i32 i32) (result i32 i32)\n" + record + "i32.const 1\n" + advance + "local.get 0\nlocal.get 1\n)"})) return false;
     std::vector<InstrumentOperation> ops(2);
     ops[0].targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id::LoadId, std::nullopt, std::nullopt});
     ops[0].pre_instructions.instructions = {"call $__accessload",};
+    ops[0].pre_instructions.stack_context = {wasm::Type::i32};
+    // only stores of i32 values match the helper
     ops[1].targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id::StoreId, std::nullopt, std::nullopt});
     ops[1].pre_instructions.instructions = {"call $__accessstore",};
-    instrumenter.instrument(ops);
-    InstrumentOperation op;
-    op.post_instructions.instructions = {"call $__prepare"};
-    instrumenter.instrumentFunction(op, instrumenter.getStartFunction()->name.toString().c_str(), 0);
+    ops[1].pre_instructions.stack_context = {wasm::Type::i32, wasm::Type::i32};
+    if (instrumenter.instrument(ops) != InstrumentResult::success) return false;
+    return prepare_table(instrumenter, separate_memory) && instrumenter.writeBinary() == InstrumentResult::success;
 }
 
-int main() {
-    
-    return 0;
-}
\ No newline at end of file
+int main(int argc, const char* argv[]) {
+    if (argc <= 3) return 1;
+    std::string analysis = argv[1];
+    InstrumentConfig config;
+    config.filename = argv[2];
+    config.targetname = argv[3];
+    bool separate_memory = argc > 4 && std::string(argv[4]) == "--separate-memory";
+    if (separate_memory) config.feature.enable(wasm::FeatureSet::MultiMemory);
+    bool ok = false;
+    if (analysis == "instruction_mix") {
+        ok = instruction_mix(config, separate_memory);
+    } else if (analysis == "cryptominer_detection") {
+        ok = cryptominer_detection(config, separate_memory);
+    } else if (analysis == "memory_access_tracing") {
+        ok = memory_access_tracing(config, separate_memory);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,30 @@
+#include "binary-patcher.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+using namespace wasm_instrument;
+// usage: patch [infile name] [function name or index] [pos] [hex bytes] [outfile name]
+// insert the bytes after instruction pos of the function without parsing the module,
+// e.g. `patch app.wasm main 0 230041016a2400 out.wasm` adds 1 to global 0 on each call of main
+int main(int argc, const char* argv[]) {
+    if (argc <= 5) return 1;
+    std::ifstream in(argv[1], std::ios::binary);
+    std::vector<char> input((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    BinaryPatch patch;
+    if (!findFunctionIndex(input, argv[2], patch.func_index)) {
+        std::fprintf(stderr, "no function %s\n", argv[2]);
+        return 1;
+    }
+    patch.pos = std::stoul(argv[3]);
+    std::string hex = argv[4];
+    if (hex.size() % 2 != 0) return 1;
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        patch.bytes.push_back(static_cast<uint8_t>(std::stoul(hex.substr(i, 2), nullptr, 16)));
+    }
+    std::vector<char> output;
+    if (!patchBinary(input, {patch}, output)) return 1;
+    std::ofstream out(argv[5], std::ios::binary);
+    if (!out.write(output.data(), output.size())) return 1;
+    std::printf("patched function %u: %zu -> %zu bytes\n", patch.func_index, input.size(), output.size());
+    return 0;
+}
@@ -1,45 +1,44 @@
-#include "operation-builder.hpp"
 #include "instrumenter.hpp"
+#include "tree-shaker.hpp"
+#include <wasm-builder.h>
 using namespace wasm_instrument;
-// usage: snip [infile name] [function name] [outfile name]
+// usage: snip [infile name] [function names separated by ',', or -] [outfile name]
+// the bodies of the named functions become unreachable, then everything
+// no longer reachable from the exports is removed
 int main(int argc, const char* argv[]) {
     if (argc <= 3) return 1;
-    std::string func_name = argv[2];
+    std::set<std::string> func_names;
+    std::string names = argv[2];
+    for (size_t begin = 0; names != "-" && begin <= names.size();) {
+        auto end = std::min(names.find(',', begin), names.size());
+        if (end > begin) func_names.insert(names.substr(begin, end - begin));
+        begin = end + 1;
+    }
     InstrumentConfig config;
     config.filename = argv[1];
     config.targetname = argv[3];
     Instrumenter instrumenter;
-    instrumenter.setConfig(config);
-    std::map<std::string, int> in_degree;
-    for (const auto &name : instrumenter.getScope()) in_degree[name] = 0;
-    std::string cur_func;
-    auto inst_vistor = [&instrumenter, &in_degree, &cur_func](std::list<wasm::StackInst*> &l, std::list<wasm::StackInst*>::iterator &iter) {
-        auto inst = *iter;
-        if (inst->origin->_id != wasm::Expression::Id::CallId) return;
-        auto call = inst->origin->dynCast<wasm::Call>();
-        if (call->target.toString() != cur_func)
-            in_degree[call->target.toString()]++;
+    if (instrumenter.setConfig(config) != InstrumentResult::success) return 1;
+    auto module = instrumenter.getModule();
+    wasm::Builder builder(*module);
+    size_t snipped = 0;
+    auto func_snipper = [&](wasm::Function* func) {
+        if (!func_names.count(func->name.toString())) return;
+        // the body is validated and the stack ir is written, replace both
+        func->body = builder.makeUnreachable();
+        func->stackIR = std::make_unique<wasm::StackIR>(
+            std::vector<wasm::StackInst*>{_make_stack_inst(wasm::StackInst::Basic, func->body, module)});
+        instrumenter.stackIRChanged(func->name.toString());
+        snipped++;
     };
-    auto func_visitor = [&inst_vistor, &instrumenter, &func_name, &cur_func](wasm::Function* func) {
-        cur_func = func->name.toString();
-        if (cur_func == func_name) return;
-        iterInstructions(func, inst_vistor);
-    };
-    iterDefinedFunctions(instrumenter.getModule(), func_visitor);
-    instrumenter.scopeClear();
-    for (const auto &[k, v] : in_degree)
-        if (v == 0) instrumenter.scopeAdd(k);
-    InstrumentOperation op;
-    op.pre_instructions.instructions = {
-        "unreachable",
-    };
-    auto added_instructions = OperationBuilder().makeOperations(instrumenter.getModule(), {op});
-    auto insts = (*added_instructions)[0].pre_instructions;
-    auto func_snipper = [&instrumenter, &insts](wasm::Function* func) {
-        if (!instrumenter.scopeContains(func->name.toString())) return;
-        func->stackIR = std::make_unique<wasm::StackIR>(insts);
-    };
-    iterDefinedFunctions(instrumenter.getModule(), func_snipper);
-    instrumenter.writeBinary();
-    return 0;
-}
\ No newline at end of file
+    iterDefinedFunctions(module, func_snipper);
+    instrumenter.invalidateCallGraph();
+
+    ShakeResult result;
+    if (!shakeModule(instrumenter, result)) return 1;
+    std::printf("snipped %zu functions, removed %zu functions, %zu imports, %zu globals, "
+                "%zu data segments, %zu element segments, %zu tables\n",
+                snipped, result.functions, result.imported_functions, result.globals,
+                result.data_segments, result.element_segments, result.tables);
+    return instrumenter.writeBinary() == InstrumentResult::success ? 0 : 1;
+}
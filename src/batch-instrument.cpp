@@ -0,0 +1,211 @@
+#include "batch-instrument.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <poll.h>
+#include <support/threads.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace wasm_instrument {
+
+std::string BatchStatus2str(BatchStatus status) {
+    std::string status_map[] = {
+        "done",
+        "failed",
+        "crashed",
+        "not_started"
+    };
+    return status_map[int(status)];
+}
+
+// runs in the forked worker or a worker thread, the exit code carries the InstrumentResult
+static int _run_job(const InstrumentPlan &plan, const BatchJob &job, const BatchOptions &options) {
+    InstrumentConfig config;
+    config.filename = job.filename;
+    config.targetname = job.targetname;
+    config.feature = options.feature;
+    if (options.stack_ir_cache) config.stack_ir_cache = job.filename + ".sir";
+    Instrumenter instrumenter;
+    auto result = instrumenter.setConfig(config);
+    if (result != InstrumentResult::success) return result;
+    result = applyPlan(instrumenter, plan);
+    if (result != InstrumentResult::success) return result;
+    return instrumenter.writeBinary();
+}
+
+// one instrumenter per job on worker threads of this process
+// the binaryen pool of forked workers, fork copies the pool but none of its threads, so it
+// is made here with one core, without threads, before the first fork. return false if the
+// pool was made before with threads the workers would wait for
+static bool _make_fork_safe_pool() {
+    const char* cores = getenv("BINARYEN_CORES");
+    std::string saved = cores ? cores : "";
+    // the worker pool already occupies the cores
+    setenv("BINARYEN_CORES", "1", 1);
+    auto size = wasm::ThreadPool::get()->size();
+    if (cores) {
+        setenv("BINARYEN_CORES", saved.c_str(), 1);
+    } else {
+        unsetenv("BINARYEN_CORES");
+    }
+    return size <= 1;
+}
+
+static void _run_batch_threads(const InstrumentPlan &plan,
+                               const std::vector<BatchJob> &jobs,
+                               const BatchOptions &options,
+                               size_t workers,
+                               std::vector<BatchJobResult> &results) {
+    using clock = std::chrono::steady_clock;
+    std::mutex mutex;
+    size_t next = 0;
+    size_t finished = 0;
+    auto worker = [&]() {
+        while (true) {
+            size_t job = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (next >= jobs.size()) return;
+                job = next++;
+            }
+            auto start = clock::now();
+            int code = InstrumentResult::instrument_error;
+            try {
+                code = _run_job(plan, jobs[job], options);
+            } catch (...) {
+                std::cerr << "BatchInstrument: runBatch() uncaught exception in " << jobs[job].filename << "!" << std::endl;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            auto &r = results[job];
+            r.time_us = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+            r.result = static_cast<InstrumentResult>(code);
+            r.status = (r.result == InstrumentResult::success) ? BatchStatus::done : BatchStatus::failed;
+            finished++;
+            if (options.progress) options.progress(job, r, finished, jobs.size());
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::min(workers, jobs.size()); i++) threads.emplace_back(worker);
+    for (auto &t : threads) t.join();
+}
+
+std::vector<BatchJobResult> runBatch(const InstrumentPlan &plan,
+                                     const std::vector<BatchJob> &jobs,
+                                     const BatchOptions &options) noexcept {
+    std::vector<BatchJobResult> results(jobs.size());
+    size_t workers = options.workers;
+    if (workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+    bool threads = options.threads;
+    if (!threads && !_make_fork_safe_pool()) {
+        std::cerr << "BatchInstrument: runBatch() binaryen threads already started, run jobs on threads!" << std::endl;
+        threads = true;
+    }
+    if (threads) {
+        _run_batch_threads(plan, jobs, options, workers, results);
+        return results;
+    }
+
+    using clock = std::chrono::steady_clock;
+    struct Worker {
+        size_t job;
+        clock::time_point start;
+        // read end of a pipe whose write end only the worker holds, it hangs up when the worker exits
+        int exit_fd;
+    };
+    // only the forked workers are waited for, other children of the caller are left alone
+    std::map<pid_t, Worker> running;
+    size_t next = 0;
+    size_t finished = 0;
+    auto finish = [&](size_t job) {
+        finished++;
+        if (options.progress) options.progress(job, results[job], finished, jobs.size());
+    };
+
+    while (finished < jobs.size()) {
+        // fill the pool
+        while (running.size() < workers && next < jobs.size()) {
+            std::cout.flush();
+            std::cerr.flush();
+            int exit_pipe[2];
+            if (pipe(exit_pipe) != 0) {
+                std::cerr << "BatchInstrument: runBatch() pipe error for " << jobs[next].filename << "!" << std::endl;
+                results[next].status = BatchStatus::not_started;
+                finish(next++);
+                continue;
+            }
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(exit_pipe[0]);
+                int code = InstrumentResult::instrument_error;
+                try {
+                    code = _run_job(plan, jobs[next], options);
+                } catch (...) {
+                    std::cerr << "BatchInstrument: runBatch() uncaught exception in " << jobs[next].filename << "!" << std::endl;
+                }
+                std::cout.flush();
+                std::cerr.flush();
+                _exit(code);
+            }
+            close(exit_pipe[1]);
+            if (pid < 0) {
+                close(exit_pipe[0]);
+                std::cerr << "BatchInstrument: runBatch() fork error for " << jobs[next].filename << "!" << std::endl;
+                results[next].status = BatchStatus::not_started;
+                finish(next++);
+                continue;
+            }
+            running[pid] = {next++, clock::now(), exit_pipe[0]};
+        }
+        if (running.empty()) continue;
+
+        std::vector<pollfd> fds;
+        std::vector<pid_t> pids;
+        for (const auto &[pid, worker] : running) {
+            fds.push_back({worker.exit_fd, POLLIN, 0});
+            pids.push_back(pid);
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "BatchInstrument: runBatch() poll error!" << std::endl;
+            break;
+        }
+        size_t exited = 0;
+        while (exited < fds.size() && fds[exited].revents == 0) exited++;
+        if (exited == fds.size()) continue;
+        pid_t pid = pids[exited];
+        int wstatus = 0;
+        pid_t waited = -1;
+        do {
+            waited = waitpid(pid, &wstatus, 0);
+        } while (waited < 0 && errno == EINTR);
+        auto iter = running.find(pid);
+        auto job = iter->second.job;
+        auto start = iter->second.start;
+        close(iter->second.exit_fd);
+        running.erase(iter);
+        if (waited != pid) {
+            std::cerr << "BatchInstrument: runBatch() wait error for " << jobs[job].filename << "!" << std::endl;
+        }
+
+        auto &r = results[job];
+        r.time_us = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+        if (waited == pid && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) <= InstrumentResult::invalid_state) {
+            r.result = static_cast<InstrumentResult>(WEXITSTATUS(wstatus));
+            r.status = (r.result == InstrumentResult::success) ? BatchStatus::done : BatchStatus::failed;
+        } else {
+            r.status = BatchStatus::crashed;
+        }
+        finish(job);
+    }
+    for (const auto &[pid, worker] : running) {
+        close(worker.exit_fd);
+        waitpid(pid, nullptr, 0);
+    }
+    return results;
+}
+
+}
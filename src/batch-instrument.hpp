@@ -0,0 +1,59 @@
+#ifndef batch_instrument_h
+#define batch_instrument_h
+
+#include <functional>
+#include "instrument-plan.hpp"
+
+namespace wasm_instrument {
+
+struct BatchJob {
+    std::string filename;
+    std::string targetname;
+};
+
+enum BatchStatus {
+    // the module is instrumented and written
+    done = 0,
+    // the instrumenter returned an error, see BatchJobResult.result
+    failed,
+    // the worker was killed by a signal (e.g. an assertion in binaryen)
+    crashed,
+    // the worker could not be started
+    not_started
+};
+
+struct BatchJobResult {
+    BatchStatus status = BatchStatus::not_started;
+    InstrumentResult result = InstrumentResult::success;
+    // wall time of the worker
+    double time_us = 0;
+};
+
+struct BatchOptions {
+    // 0 for the number of hardware threads
+    size_t workers = 0;
+    // run jobs on threads of this process instead of forked processes,
+    // which saves the fork but a crash takes down the whole batch
+    bool threads = false;
+    // keep the stack ir of each input in <input>.sir, see stack-ir-cache.hpp
+    bool stack_ir_cache = false;
+    wasm::FeatureSet feature = FEATURE_SPEC;
+    // called in the order jobs finish, with the index of the finished job
+    std::function<void(size_t job, const BatchJobResult &result, size_t finished, size_t total)> progress;
+};
+
+// apply the plan to every job concurrently
+// each job runs in its own forked process by default, so a failing or crashing
+// module does not affect the others. forked workers use one binaryen core, and the
+// binaryen pool of this process is made with one core before the first fork; if it
+// was made before with more, the jobs run on threads instead
+// return results in the order of jobs
+std::vector<BatchJobResult> runBatch(const InstrumentPlan &plan,
+                                     const std::vector<BatchJob> &jobs,
+                                     const BatchOptions &options = BatchOptions()) noexcept;
+
+std::string BatchStatus2str(BatchStatus status);
+
+}
+
+#endif
@@ -0,0 +1,482 @@
+#include "binary-patcher.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+namespace wasm_instrument {
+
+namespace {
+
+// a cursor over [pos, end), reading past the end clears ok and gives zeros
+struct ByteReader {
+    const uint8_t* data;
+    size_t pos;
+    size_t end;
+    bool ok = true;
+
+    ByteReader(const uint8_t* d, size_t begin, size_t e) : data(d), pos(begin), end(e) {}
+    bool more() const {
+        return this->ok && this->pos < this->end;
+    }
+    uint8_t u8() {
+        if (this->pos >= this->end) {
+            this->ok = false;
+            return 0;
+        }
+        return this->data[this->pos++];
+    }
+    uint64_t uleb() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            auto b = this->u8();
+            value |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) return value;
+        }
+        this->ok = false;
+        return 0;
+    }
+    int64_t sleb() {
+        uint64_t value = 0;
+        int shift = 0;
+        uint8_t b = 0;
+        do {
+            if (shift >= 64) {
+                this->ok = false;
+                return 0;
+            }
+            b = this->u8();
+            value |= uint64_t(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+        if ((shift < 64) && (b & 0x40)) value |= ~uint64_t(0) << shift;
+        return static_cast<int64_t>(value);
+    }
+    void skip(size_t n) {
+        if (this->end - this->pos < n) {
+            this->ok = false;
+            this->pos = this->end;
+        } else {
+            this->pos += n;
+        }
+    }
+    std::string name() {
+        auto len = this->uleb();
+        if (!this->ok || this->end - this->pos < len) {
+            this->ok = false;
+            return "";
+        }
+        std::string ret(reinterpret_cast<const char*>(this->data + this->pos), len);
+        this->pos += len;
+        return ret;
+    }
+};
+
+struct Section {
+    uint8_t id;
+    // of the id byte
+    size_t begin;
+    size_t payload;
+    size_t end;
+};
+
+struct Body {
+    // of the size field
+    size_t begin;
+    size_t payload;
+    size_t end;
+};
+
+// the sections and function bodies of a binary, nothing else is decoded
+struct BinaryLayout {
+    std::vector<Section> sections;
+    // index in sections, or -1
+    int code = -1;
+    uint32_t imported_functions = 0;
+    std::vector<Body> bodies;
+};
+
+}
+
+static const uint8_t* _bytes(const std::vector<char> &input) {
+    return reinterpret_cast<const uint8_t*>(input.data());
+}
+
+// a value type or block type, with the heap type of (ref null ht) and (ref ht)
+static void _skip_value_type(ByteReader &r) {
+    auto t = r.sleb();
+    if (t == -28 || t == -29) r.sleb();
+}
+
+static void _skip_memarg(ByteReader &r) {
+    auto align = r.uleb();
+    // memory index of multi-memory
+    if (align & 0x40) r.uleb();
+    r.uleb();
+}
+
+static void _skip_limits(ByteReader &r) {
+    auto flags = r.u8();
+    r.uleb();
+    if (flags & 1) r.uleb();
+}
+
+// skip one instruction with its immediates, false on opcodes without a known encoding
+static bool _skip_instruction(ByteReader &r) {
+    auto op = r.u8();
+    if ((op >= 0x45 && op <= 0xc4)) return r.ok;
+    if (op >= 0x28 && op <= 0x3e) {
+        _skip_memarg(r);
+        return r.ok;
+    }
+    switch (op) {
+        case 0x00: case 0x01: case 0x05: case 0x0a: case 0x0b: case 0x0f:
+        case 0x19: case 0x1a: case 0x1b: case 0xd1: case 0xd3: case 0xd4:
+            break;
+        case 0x02: case 0x03: case 0x04: case 0x06:
+            _skip_value_type(r);
+            break;
+        case 0x07: case 0x08: case 0x09: case 0x0c: case 0x0d: case 0x10: case 0x12:
+        case 0x14: case 0x15: case 0x18: case 0x20: case 0x21: case 0x22: case 0x23:
+        case 0x24: case 0x25: case 0x26: case 0x3f: case 0x40: case 0xd2: case 0xd5: case 0xd6:
+            r.uleb();
+            break;
+        case 0x0e: {
+            // labels and the default one
+            auto n = r.uleb();
+            for (uint64_t i = 0; i <= n && r.ok; i++) r.uleb();
+            break;
+        }
+        case 0x11: case 0x13:
+            r.uleb();
+            r.uleb();
+            break;
+        case 0x1c: {
+            auto n = r.uleb();
+            for (uint64_t i = 0; i < n && r.ok; i++) _skip_value_type(r);
+            break;
+        }
+        case 0x1f: {
+            _skip_value_type(r);
+            auto n = r.uleb();
+            for (uint64_t i = 0; i < n && r.ok; i++) {
+                // catch and catch_ref have a tag
+                if (r.u8() < 2) r.uleb();
+                r.uleb();
+            }
+            break;
+        }
+        case 0x41: case 0x42: case 0xd0:
+            r.sleb();
+            break;
+        case 0x43:
+            r.skip(4);
+            break;
+        case 0x44:
+            r.skip(8);
+            break;
+        case 0xfc: {
+            auto sub = r.uleb();
+            if (sub <= 7) break;
+            if (sub == 8 || sub == 10 || sub == 12 || sub == 14) {
+                r.uleb();
+                r.uleb();
+            } else if (sub == 9 || sub == 11 || sub == 13 || (sub >= 15 && sub <= 17)) {
+                r.uleb();
+            } else return false;
+            break;
+        }
+        case 0xfd: {
+            auto sub = r.uleb();
+            if (sub <= 11 || sub == 92 || sub == 93) {
+                _skip_memarg(r);
+            } else if (sub == 12 || sub == 13) {
+                r.skip(16);
+            } else if (sub >= 21 && sub <= 34) {
+                r.skip(1);
+            } else if (sub >= 84 && sub <= 91) {
+                _skip_memarg(r);
+                r.skip(1);
+            } else if (sub > 0x113) return false;
+            break;
+        }
+        case 0xfe: {
+            auto sub = r.uleb();
+            if (sub == 3) {
+                r.skip(1);
+            } else if (sub <= 0x4e) {
+                _skip_memarg(r);
+            } else return false;
+            break;
+        }
+        // gc instructions are not decoded
+        default: return false;
+    }
+    return r.ok;
+}
+
+static bool _read_layout(const std::vector<char> &input, BinaryLayout &layout, const char* caller) {
+    auto data = _bytes(input);
+    if (input.size() < 8 || std::memcmp(data, "\0asm\1\0\0\0", 8) != 0) {
+        std::cerr << "BinaryPatcher: " << caller << " not a wasm binary!" << std::endl;
+        return false;
+    }
+    ByteReader r(data, 8, input.size());
+    while (r.more()) {
+        Section section;
+        section.begin = r.pos;
+        section.id = r.u8();
+        auto size = r.uleb();
+        section.payload = r.pos;
+        if (!r.ok || r.end - r.pos < size) break;
+        section.end = r.pos + size;
+        r.pos = section.end;
+        if (section.id == 10) layout.code = static_cast<int>(layout.sections.size());
+        layout.sections.push_back(section);
+
+        if (section.id == 2) {
+            ByteReader s(data, section.payload, section.end);
+            auto n = s.uleb();
+            for (uint64_t i = 0; i < n && s.ok; i++) {
+                s.name();
+                s.name();
+                auto kind = s.u8();
+                if (kind == 0) {
+                    s.uleb();
+                    layout.imported_functions++;
+                } else if (kind == 1) {
+                    _skip_value_type(s);
+                    _skip_limits(s);
+                } else if (kind == 2) {
+                    _skip_limits(s);
+                } else if (kind == 3) {
+                    _skip_value_type(s);
+                    s.u8();
+                } else if (kind == 4) {
+                    s.u8();
+                    s.uleb();
+                } else s.ok = false;
+            }
+            if (!s.ok) r.ok = false;
+        } else if (section.id == 10) {
+            ByteReader s(data, section.payload, section.end);
+            auto n = s.uleb();
+            for (uint64_t i = 0; i < n && s.ok; i++) {
+                Body body;
+                body.begin = s.pos;
+                auto body_size = s.uleb();
+                body.payload = s.pos;
+                s.skip(body_size);
+                body.end = s.pos;
+                layout.bodies.push_back(body);
+            }
+            if (!s.ok || s.pos != section.end) r.ok = false;
+        }
+    }
+    if (!r.ok || r.pos != input.size()) {
+        std::cerr << "BinaryPatcher: " << caller << " malformed binary!" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// offsets of the instructions of a body, the last one is the final end
+static bool _decode_body(const std::vector<char> &input, const Body &body, std::vector<size_t> &starts) {
+    ByteReader r(_bytes(input), body.payload, body.end);
+    auto groups = r.uleb();
+    for (uint64_t i = 0; i < groups && r.ok; i++) {
+        r.uleb();
+        _skip_value_type(r);
+    }
+    while (r.more()) {
+        starts.push_back(r.pos);
+        if (!_skip_instruction(r)) return false;
+    }
+    return r.ok && !starts.empty() && (r.pos == body.end) && (input[starts.back()] == 0x0b);
+}
+
+static bool _find_body(const std::vector<char> &input, const BinaryLayout &layout, uint32_t func_index,
+                       std::vector<size_t> &starts, const char* caller) {
+    if (func_index < layout.imported_functions ||
+        func_index - layout.imported_functions >= layout.bodies.size()) {
+        std::cerr << "BinaryPatcher: " << caller << " no body of function " << func_index << "!" << std::endl;
+        return false;
+    }
+    if (!_decode_body(input, layout.bodies[func_index - layout.imported_functions], starts)) {
+        std::cerr << "BinaryPatcher: " << caller << " cannot decode function " << func_index << "!" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void appendULEB128(std::vector<uint8_t> &bytes, uint64_t value) {
+    do {
+        uint8_t b = value & 0x7f;
+        value >>= 7;
+        if (value != 0) b |= 0x80;
+        bytes.push_back(b);
+    } while (value != 0);
+}
+
+void appendSLEB128(std::vector<uint8_t> &bytes, int64_t value) {
+    bool more = true;
+    while (more) {
+        uint8_t b = value & 0x7f;
+        // arithmetic shift
+        value >>= 7;
+        more = !((value == 0 && !(b & 0x40)) || (value == -1 && (b & 0x40)));
+        if (more) b |= 0x80;
+        bytes.push_back(b);
+    }
+}
+
+static void _append(std::vector<char> &output, const std::vector<char> &input, size_t begin, size_t end) {
+    output.insert(output.end(), input.begin() + begin, input.begin() + end);
+}
+
+static void _append_uleb(std::vector<char> &output, uint64_t value) {
+    std::vector<uint8_t> bytes;
+    appendULEB128(bytes, value);
+    output.insert(output.end(), bytes.begin(), bytes.end());
+}
+
+bool patchBinary(const std::vector<char> &input,
+                 const std::vector<BinaryPatch> &patches,
+                 std::vector<char> &output) noexcept {
+    BinaryLayout layout;
+    if (!_read_layout(input, layout, "patchBinary()")) return false;
+    // patches of each body in order of pos, stable for the same pos
+    std::map<size_t, std::vector<const BinaryPatch*>> body_patches;
+    for (const auto &patch : patches) {
+        if (patch.func_index < layout.imported_functions ||
+            patch.func_index - layout.imported_functions >= layout.bodies.size()) {
+            std::cerr << "BinaryPatcher: patchBinary() no body of function " << patch.func_index << "!" << std::endl;
+            return false;
+        }
+        body_patches[patch.func_index - layout.imported_functions].push_back(&patch);
+    }
+    output.clear();
+    if (body_patches.empty()) {
+        output = input;
+        return true;
+    }
+    for (auto &[_, list] : body_patches) {
+        std::stable_sort(list.begin(), list.end(), [](const BinaryPatch* a, const BinaryPatch* b) {
+            return a->pos < b->pos;
+        });
+    }
+
+    const auto &code = layout.sections[layout.code];
+    std::vector<char> content;
+    content.reserve(code.end - code.payload + 64);
+    // the number of bodies, as it is
+    _append(content, input, code.payload, layout.bodies.front().begin);
+    for (size_t i = 0; i < layout.bodies.size(); i++) {
+        const auto &body = layout.bodies[i];
+        auto iter = body_patches.find(i);
+        if (iter == body_patches.end()) {
+            _append(content, input, body.begin, body.end);
+            continue;
+        }
+        std::vector<size_t> starts;
+        if (!_find_body(input, layout, i + layout.imported_functions, starts, "patchBinary()")) return false;
+        std::vector<char> new_body;
+        size_t cur = body.payload;
+        for (auto patch : iter->second) {
+            // the final end is starts[count]
+            if (patch->pos >= starts.size()) {
+                std::cerr << "BinaryPatcher: patchBinary() pos " << patch->pos << " out of function "
+                          << patch->func_index << "!" << std::endl;
+                return false;
+            }
+            _append(new_body, input, cur, starts[patch->pos]);
+            new_body.insert(new_body.end(), patch->bytes.begin(), patch->bytes.end());
+            cur = starts[patch->pos];
+        }
+        _append(new_body, input, cur, body.end);
+        _append_uleb(content, new_body.size());
+        content.insert(content.end(), new_body.begin(), new_body.end());
+    }
+
+    output.reserve(input.size() + content.size() - (code.end - code.payload) + 8);
+    _append(output, input, 0, code.begin);
+    output.push_back(10);
+    _append_uleb(output, content.size());
+    output.insert(output.end(), content.begin(), content.end());
+    _append(output, input, code.end, input.size());
+    return true;
+}
+
+bool findFunctionIndex(const std::vector<char> &input, const std::string &name, uint32_t &index) noexcept {
+    BinaryLayout layout;
+    if (name.empty() || !_read_layout(input, layout, "findFunctionIndex()")) return false;
+    auto data = _bytes(input);
+    for (const auto &section : layout.sections) {
+        if (section.id != 7) continue;
+        ByteReader r(data, section.payload, section.end);
+        auto n = r.uleb();
+        for (uint64_t i = 0; i < n && r.ok; i++) {
+            auto export_name = r.name();
+            auto kind = r.u8();
+            auto idx = r.uleb();
+            if (r.ok && kind == 0 && export_name == name) {
+                index = static_cast<uint32_t>(idx);
+                return true;
+            }
+        }
+    }
+    for (const auto &section : layout.sections) {
+        if (section.id != 0) continue;
+        ByteReader r(data, section.payload, section.end);
+        if (r.name() != "name") continue;
+        while (r.more()) {
+            auto id = r.u8();
+            auto size = r.uleb();
+            auto next = r.pos + size;
+            if (id == 1) {
+                auto n = r.uleb();
+                for (uint64_t i = 0; i < n && r.ok; i++) {
+                    auto idx = r.uleb();
+                    if (r.name() == name && r.ok) {
+                        index = static_cast<uint32_t>(idx);
+                        return true;
+                    }
+                }
+            }
+            if (next > r.end) break;
+            r.pos = next;
+        }
+    }
+    if (name.size() <= 9 && name.find_first_not_of("0123456789") == std::string::npos) {
+        index = static_cast<uint32_t>(std::stoul(name));
+        return true;
+    }
+    return false;
+}
+
+bool readBodyOffsets(const std::vector<char> &input, std::vector<BodyOffsets> &bodies) noexcept {
+    BinaryLayout layout;
+    if (!_read_layout(input, layout, "readBodyOffsets()")) return false;
+    bodies.clear();
+    bodies.reserve(layout.bodies.size());
+    for (size_t i = 0; i < layout.bodies.size(); i++) {
+        BodyOffsets body;
+        body.func_index = static_cast<uint32_t>(i + layout.imported_functions);
+        body.begin = layout.bodies[i].payload;
+        body.end = layout.bodies[i].end;
+        if (!_decode_body(input, layout.bodies[i], body.instructions)) body.instructions.clear();
+        bodies.emplace_back(std::move(body));
+    }
+    return true;
+}
+
+bool countInstructions(const std::vector<char> &input, uint32_t func_index, size_t &count) noexcept {
+    BinaryLayout layout;
+    std::vector<size_t> starts;
+    if (!_read_layout(input, layout, "countInstructions()") ||
+        !_find_body(input, layout, func_index, starts, "countInstructions()")) return false;
+    count = starts.size() - 1;
+    return true;
+}
+
+}
@@ -0,0 +1,55 @@
+#ifndef binary_patcher_h
+#define binary_patcher_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace wasm_instrument {
+
+// pre-encoded instructions inserted after an instruction of a function body
+struct BinaryPatch {
+    // in the function index space, imported functions first
+    uint32_t func_index;
+    // instructions of the body as they are in the binary, from 1, the final end excluded
+    // 0 inserts at the beginning of the body
+    size_t pos;
+    std::vector<uint8_t> bytes;
+};
+
+// insert /patches/ into the wasm binary /input/ and write the result to /output/
+// only the bodies of the patched functions are decoded, their sizes and the size of the
+// code section are encoded again and everything else is copied as it is
+// fragments must leave the stack and the locals as they are, and may only refer to
+// functions, globals and memories of the binary. patches at the same pos keep their order
+// return false if the binary is malformed, uses gc instructions in a patched body,
+// or a patch is out of range
+bool patchBinary(const std::vector<char> &input,
+                 const std::vector<BinaryPatch> &patches,
+                 std::vector<char> &output) noexcept;
+
+// index of a function by its export name, its name in the name section,
+// or its index written in decimal as binaryen names functions without names
+bool findFunctionIndex(const std::vector<char> &input, const std::string &name, uint32_t &index) noexcept;
+
+// number of instructions of a function body, the final end excluded
+bool countInstructions(const std::vector<char> &input, uint32_t func_index, size_t &count) noexcept;
+
+// module offsets of a function body, for relating offsets in a binary to functions
+struct BodyOffsets {
+    uint32_t func_index;
+    // of the local declarations, after the size of the body
+    size_t begin;
+    size_t end;
+    // of each instruction, the final end included; empty if the body cannot be decoded
+    std::vector<size_t> instructions;
+};
+// the bodies of the code section in order
+bool readBodyOffsets(const std::vector<char> &input, std::vector<BodyOffsets> &bodies) noexcept;
+
+void appendULEB128(std::vector<uint8_t> &bytes, uint64_t value);
+void appendSLEB128(std::vector<uint8_t> &bytes, int64_t value);
+
+}
+
+#endif
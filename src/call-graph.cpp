@@ -0,0 +1,129 @@
+#include "call-graph.hpp"
+#include <ir/find_all.h>
+
+namespace wasm_instrument {
+
+std::set<std::string> CallGraph::reachable() const {
+    std::set<std::string> ret;
+    std::vector<std::string> worklist(this->roots.begin(), this->roots.end());
+    if (this->tables_escape) {
+        worklist.insert(worklist.end(), this->indirect_targets.begin(), this->indirect_targets.end());
+    }
+    bool indirect_done = false;
+    while (!worklist.empty()) {
+        auto name = worklist.back();
+        worklist.pop_back();
+        if (!ret.insert(name).second) continue;
+        auto iter = this->callees.find(name);
+        if (iter != this->callees.end()) {
+            worklist.insert(worklist.end(), iter->second.begin(), iter->second.end());
+        }
+        if (!indirect_done && this->indirect_callers.count(name)) {
+            indirect_done = true;
+            worklist.insert(worklist.end(), this->indirect_targets.begin(), this->indirect_targets.end());
+        }
+    }
+    return ret;
+}
+
+std::set<std::string> CallGraph::noReturn(bool &indirect) const {
+    std::set<std::string> ret;
+    std::vector<std::string> worklist(this->exits.begin(), this->exits.end());
+    // functions from outside may be in the table
+    indirect = this->tables_escape && !this->indirect_callers.empty();
+    if (indirect) worklist.insert(worklist.end(), this->indirect_callers.begin(), this->indirect_callers.end());
+    while (!worklist.empty()) {
+        auto name = worklist.back();
+        worklist.pop_back();
+        if (!ret.insert(name).second) continue;
+        auto iter = this->callers.find(name);
+        if (iter != this->callers.end()) {
+            worklist.insert(worklist.end(), iter->second.begin(), iter->second.end());
+        }
+        if (!indirect && this->indirect_targets.count(name)) {
+            indirect = true;
+            worklist.insert(worklist.end(), this->indirect_callers.begin(), this->indirect_callers.end());
+        }
+    }
+    return ret;
+}
+
+namespace {
+
+struct FunctionCalls {
+    std::set<std::string> callees;
+    std::set<std::string> ref_funcs;
+    bool indirect = false;
+    bool unreachable = false;
+};
+
+void _add_expression(wasm::Expression* e, FunctionCalls &calls) {
+    if (auto* call = e->dynCast<wasm::Call>()) {
+        calls.callees.insert(call->target.toString());
+    } else if (e->is<wasm::CallIndirect>() || e->is<wasm::CallRef>()) {
+        calls.indirect = true;
+    } else if (auto* ref = e->dynCast<wasm::RefFunc>()) {
+        calls.ref_funcs.insert(ref->func.toString());
+    } else if (e->is<wasm::Unreachable>()) {
+        calls.unreachable = true;
+    }
+}
+
+void _add_ref_funcs(wasm::Expression* e, std::set<std::string> &targets) {
+    if (e == nullptr) return;
+    for (auto* ref : wasm::FindAll<wasm::RefFunc>(e).list) {
+        targets.insert(ref->func.toString());
+    }
+}
+
+}
+
+bool buildCallGraph(wasm::Module* m, CallGraph &graph) noexcept {
+    graph = CallGraph();
+    // read only, the stack ir of each function is scanned in place
+    auto analysis = iterDefinedFunctionsParallel<FunctionCalls>(
+        m, [](const wasm::Function* func, FunctionCalls &calls) {
+            if (func->stackIR != nullptr) {
+                iterInstructionsConst(func, [&calls](const wasm::StackInst* inst) {
+                    _add_expression(inst->origin, calls);
+                });
+                return;
+            }
+            for (auto* call : wasm::FindAll<wasm::Call>(func->body).list) _add_expression(call, calls);
+            for (auto* call : wasm::FindAll<wasm::CallIndirect>(func->body).list) _add_expression(call, calls);
+            for (auto* call : wasm::FindAll<wasm::CallRef>(func->body).list) _add_expression(call, calls);
+            calls.unreachable = !wasm::FindAll<wasm::Unreachable>(func->body).list.empty();
+            _add_ref_funcs(func->body, calls.ref_funcs);
+        });
+    for (auto &[func, calls] : analysis) {
+        auto name = func->name.toString();
+        for (const auto &callee : calls.callees) {
+            graph.callees[name].insert(callee);
+            graph.callers[callee].insert(name);
+        }
+        if (calls.indirect) graph.indirect_callers.insert(name);
+        if (calls.unreachable) graph.exits.insert(name);
+        graph.indirect_targets.insert(calls.ref_funcs.begin(), calls.ref_funcs.end());
+    }
+
+    for (auto &func : m->functions) {
+        if (func->imported() && func->base == "proc_exit") graph.exits.insert(func->name.toString());
+    }
+    for (auto &segment : m->elementSegments) {
+        for (auto* e : segment->data) _add_ref_funcs(e, graph.indirect_targets);
+    }
+    for (auto &global : m->globals) {
+        if (!global->imported()) _add_ref_funcs(global->init, graph.indirect_targets);
+    }
+    for (auto &table : m->tables) {
+        if (table->imported()) graph.tables_escape = true;
+    }
+    for (auto &e : m->exports) {
+        if (e->kind == wasm::ExternalKind::Function) graph.roots.insert(e->value.toString());
+        if (e->kind == wasm::ExternalKind::Table) graph.tables_escape = true;
+    }
+    if (m->start.is()) graph.roots.insert(m->start.toString());
+    return true;
+}
+
+}
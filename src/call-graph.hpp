@@ -0,0 +1,39 @@
+#ifndef call_graph_h
+#define call_graph_h
+
+#include <map>
+#include <set>
+#include "instr-utils.hpp"
+
+namespace wasm_instrument {
+
+// static call graph of a module, by internal function names
+// use Instrumenter::callGraph() to get a cached one
+struct CallGraph {
+    // direct calls (return_call included) of each defined function, imports may be callees
+    std::map<std::string, std::set<std::string>> callees;
+    std::map<std::string, std::set<std::string>> callers;
+    // defined functions that contain call_indirect or call_ref
+    std::set<std::string> indirect_callers;
+    // candidates of indirect calls: functions in element segments or taken by ref.func
+    std::set<std::string> indirect_targets;
+    // exported functions and the start function
+    std::set<std::string> roots;
+    // imports of proc_exit, and defined functions that contain unreachable
+    std::set<std::string> exits;
+    // a table is imported or exported, so indirect targets may be called from outside
+    bool tables_escape = false;
+
+    // functions reachable from the roots, an indirect call may reach all indirect targets
+    std::set<std::string> reachable() const;
+    // functions whose call may not come back: the exits and their callers, transitively
+    // /indirect/ is set if an indirect call may not come back either
+    std::set<std::string> noReturn(bool &indirect) const;
+};
+
+// scan the stack ir (or the binaryen ir if there is none) of all functions in parallel
+bool buildCallGraph(wasm::Module* m, CallGraph &graph) noexcept;
+
+}
+
+#endif
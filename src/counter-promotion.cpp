@@ -0,0 +1,291 @@
+#include "counter-promotion.hpp"
+#include <algorithm>
+#include <set>
+#include <wasm-builder.h>
+
+namespace wasm_instrument {
+
+using Insts = std::vector<wasm::StackInst*>;
+
+// the counter of the counting site whose call is insts[i]
+static bool _counting_site(const Insts &insts, size_t i, wasm::Name increment, int32_t &counter) {
+    if (i == 0 || insts[i]->op != wasm::StackInst::Basic || insts[i - 1]->op != wasm::StackInst::Basic) return false;
+    auto call = insts[i]->origin->dynCast<wasm::Call>();
+    auto c = insts[i - 1]->origin->dynCast<wasm::Const>();
+    if (call == nullptr || call->target != increment || call->isReturn) return false;
+    if (c == nullptr || c->type != wasm::Type::i32) return false;
+    counter = c->value.geti32();
+    return true;
+}
+
+// i32 or i64, the type of the amounts $add takes, or none if the helpers do not fit
+static wasm::Type _amount_type(const wasm::Function* increment, const wasm::Function* add) {
+    if (increment == nullptr || add == nullptr || increment->getParams() != wasm::Type::i32) return wasm::Type::none;
+    for (auto type : {wasm::Type::i32, wasm::Type::i64}) {
+        if (add->getParams() == wasm::Type({wasm::Type::i32, type})) return type;
+    }
+    return wasm::Type::none;
+}
+
+// where the function may be left, or where a callee may read the table or exit
+static bool _needs_flush(const wasm::StackInst* inst, wasm::Name increment, wasm::Name add) {
+    if (inst->op != wasm::StackInst::Basic) return false;
+    switch (inst->origin->_id) {
+        case wasm::Expression::Id::CallId: {
+            auto target = inst->origin->cast<wasm::Call>()->target;
+            return target != increment && target != add;
+        }
+        case wasm::Expression::Id::CallIndirectId:
+        case wasm::Expression::Id::CallRefId:
+        case wasm::Expression::Id::ReturnId:
+        case wasm::Expression::Id::UnreachableId:
+        case wasm::Expression::Id::ThrowId:
+        case wasm::Expression::Id::RethrowId:
+            return true;
+        default:
+            return false;
+    }
+}
+
+namespace {
+
+struct Promoter {
+    wasm::Module* module;
+    wasm::Name add;
+    // of the locals, as $add takes it
+    wasm::Type type;
+    wasm::Builder builder;
+    // counter => local
+    std::map<int32_t, wasm::Index> locals;
+
+    Promoter(wasm::Module* m, wasm::Name a, wasm::Type t) : module(m), add(a), type(t), builder(*m) {}
+
+    void push(Insts &out, wasm::Expression* expr) {
+        out.push_back(_make_stack_inst(wasm::StackInst::Basic, expr, this->module));
+    }
+    void increment(Insts &out, wasm::Index local) {
+        auto get = this->builder.makeLocalGet(local, this->type);
+        auto one = this->builder.makeConst(wasm::Literal::makeOne(this->type));
+        auto sum = this->builder.makeBinary(this->type == wasm::Type::i64 ? wasm::AddInt64 : wasm::AddInt32, get, one);
+        this->push(out, get);
+        this->push(out, one);
+        this->push(out, sum);
+        this->push(out, this->builder.makeLocalSet(local, sum));
+    }
+    // add every local to its counter, and zero it if the function goes on
+    void flush(Insts &out, bool reset) {
+        for (const auto &[counter, local] : this->locals) {
+            auto c = this->builder.makeConst(counter);
+            auto get = this->builder.makeLocalGet(local, this->type);
+            this->push(out, c);
+            this->push(out, get);
+            this->push(out, this->builder.makeCall(this->add, {c, get}, wasm::Type::none));
+            if (!reset) continue;
+            auto zero = this->builder.makeConst(wasm::Literal::makeZero(this->type));
+            this->push(out, zero);
+            this->push(out, this->builder.makeLocalSet(local, zero));
+        }
+    }
+};
+
+}
+
+bool promoteCounters(Instrumenter &instrumenter, const CounterHelpers &helpers,
+                     PromotionResult &result) noexcept {
+    result = PromotionResult();
+    auto module = instrumenter.getModule();
+    auto increment = module->getFunctionOrNull(helpers.increment);
+    auto add = module->getFunctionOrNull(helpers.add);
+    auto amount = _amount_type(increment, add);
+    if (amount == wasm::Type::none) {
+        std::cerr << "promoteCounters() invalid helpers " << helpers.increment << " " << helpers.add << "!" << std::endl;
+        return false;
+    }
+
+    for (const auto &name : instrumenter.getScope()) {
+        auto func = module->getFunctionOrNull(name);
+        if (func == nullptr || func->imported() || func->stackIR == nullptr ||
+            func == increment || func == add) continue;
+        auto analysis = instrumenter.getAnalysis(func);
+        if (analysis == nullptr) continue;
+        Insts insts;
+        for (auto inst : *(func->stackIR)) {
+            if (inst != nullptr) insts.push_back(inst);
+        }
+
+        // counters with a site in a loop
+        Promoter promoter(module, add->name, amount);
+        int32_t counter = 0;
+        for (size_t i = 0; i < insts.size(); i++) {
+            if (_counting_site(insts, i, increment->name, counter) &&
+                analysis->loop_of[analysis->block_of[i]] != StackAnalysis::npos) {
+                promoter.locals.emplace(counter, 0);
+            }
+        }
+        if (promoter.locals.empty()) continue;
+        for (auto &[_, local] : promoter.locals) local = wasm::Builder::addVar(func, amount);
+
+        Insts out;
+        out.reserve(insts.size() * 2);
+        for (size_t i = 0; i < insts.size(); i++) {
+            if (i + 1 < insts.size() && _counting_site(insts, i + 1, increment->name, counter) &&
+                promoter.locals.count(counter)) {
+                promoter.increment(out, promoter.locals[counter]);
+                result.sites++;
+                i++;
+                continue;
+            }
+            if (_needs_flush(insts[i], increment->name, add->name)) {
+                promoter.flush(out, true);
+                result.flushes++;
+            }
+            out.push_back(insts[i]);
+        }
+        // values left for the result stay below
+        promoter.flush(out, false);
+        result.flushes++;
+        func->stackIR = std::make_unique<wasm::StackIR>(std::move(out));
+        instrumenter.stackIRChanged(name);
+        result.functions++;
+        result.counters += promoter.locals.size();
+    }
+    instrumenter.invalidateCallGraph();
+    return true;
+}
+
+// the loop has no calls, which could exit or read the table in the middle of an iteration
+static bool _loop_without_calls(const StackAnalysis &analysis, const StackLoop &loop,
+                                wasm::Name increment, wasm::Name add) {
+    for (auto b : loop.blocks) {
+        const auto &block = analysis.cfg.blocks[b];
+        for (size_t i = block.begin; i < block.end; i++) {
+            auto inst = analysis.cfg.insts[i];
+            if (inst->op != wasm::StackInst::Basic) continue;
+            if (auto call = inst->origin->dynCast<wasm::Call>()) {
+                if (call->isReturn || (call->target != increment && call->target != add)) return false;
+            } else if (inst->origin->is<wasm::CallIndirect>() || inst->origin->is<wasm::CallRef>()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool hoistLoopCounters(Instrumenter &instrumenter, const CounterHelpers &helpers,
+                       HoistResult &result) noexcept {
+    result = HoistResult();
+    auto module = instrumenter.getModule();
+    auto increment = module->getFunctionOrNull(helpers.increment);
+    auto add = module->getFunctionOrNull(helpers.add);
+    auto amount = _amount_type(increment, add);
+    if (amount == wasm::Type::none) {
+        std::cerr << "hoistLoopCounters() invalid helpers " << helpers.increment << " " << helpers.add << "!" << std::endl;
+        return false;
+    }
+
+    wasm::Builder builder(*module);
+    auto push = [module](std::vector<wasm::StackInst*> &insts, wasm::Expression* expr) {
+        insts.push_back(_make_stack_inst(wasm::StackInst::Basic, expr, module));
+    };
+    for (const auto &name : instrumenter.getScope()) {
+        auto func = module->getFunctionOrNull(name);
+        if (func == nullptr || func->imported() || func->stackIR == nullptr ||
+            func == increment || func == add) continue;
+        auto analysis = instrumenter.getAnalysis(func);
+        if (analysis == nullptr) continue;
+        const auto &cfg = analysis->cfg;
+
+        // counting sites by their innermost loop
+        std::map<size_t, std::vector<std::pair<size_t, int32_t>>> loop_sites;
+        int32_t counter = 0;
+        for (size_t i = 0; i < cfg.insts.size(); i++) {
+            if (!_counting_site(cfg.insts, i, increment->name, counter)) continue;
+            auto loop = analysis->loop_of[analysis->block_of[i]];
+            if (loop != StackAnalysis::npos) loop_sites[loop].emplace_back(i, counter);
+        }
+
+        std::vector<StackProbeCode> code;
+        std::set<const wasm::StackInst*> removed;
+        for (const auto &[l, sites] : loop_sites) {
+            const auto &loop = analysis->loops[l];
+            if (!_loop_without_calls(*analysis, loop, increment->name, add->name)) continue;
+            // edges that end an iteration
+            std::vector<size_t> exits;
+            std::vector<size_t> ends = loop.back_edges;
+            bool probeable = true;
+            for (auto b : loop.blocks) {
+                for (auto e : cfg.blocks[b].succs) {
+                    if (std::binary_search(loop.blocks.begin(), loop.blocks.end(), cfg.edges[e].to)) continue;
+                    probeable = probeable && (findEdgeProbe(cfg, e).kind != StackEdgeProbe::none);
+                    exits.push_back(e);
+                    ends.push_back(e);
+                }
+            }
+            auto header_probe = findBlockProbe(cfg, loop.header);
+            if (!probeable || header_probe.kind == StackEdgeProbe::none) continue;
+
+            // static count per iteration of each counter
+            std::map<int32_t, int32_t> counts;
+            for (auto [i, c] : sites) {
+                auto b = analysis->block_of[i];
+                bool every_iteration = std::all_of(ends.begin(), ends.end(), [&](size_t e) {
+                    return analysis->dominates(b, cfg.edges[e].from);
+                });
+                if (!every_iteration) continue;
+                counts[c]++;
+                removed.insert(cfg.insts[i - 1]);
+                removed.insert(cfg.insts[i]);
+                result.sites++;
+            }
+            if (counts.empty()) continue;
+
+            // trips * n is taken in i64, so it only wraps as an i32 counter would
+            auto trips = wasm::Builder::addVar(func, wasm::Type::i64);
+            StackProbeCode iteration{header_probe, {}};
+            auto get = builder.makeLocalGet(trips, wasm::Type::i64);
+            auto one = builder.makeConst(int64_t(1));
+            auto sum = builder.makeBinary(wasm::AddInt64, get, one);
+            push(iteration.insts, get);
+            push(iteration.insts, one);
+            push(iteration.insts, sum);
+            push(iteration.insts, builder.makeLocalSet(trips, sum));
+            code.push_back(std::move(iteration));
+            for (auto e : exits) {
+                StackProbeCode flush{findEdgeProbe(cfg, e), {}};
+                for (auto [c, n] : counts) {
+                    auto k = builder.makeConst(c);
+                    auto trips_get = builder.makeLocalGet(trips, wasm::Type::i64);
+                    auto times = builder.makeConst(int64_t(n));
+                    wasm::Expression* product = builder.makeBinary(wasm::MulInt64, trips_get, times);
+                    push(flush.insts, k);
+                    push(flush.insts, trips_get);
+                    push(flush.insts, times);
+                    push(flush.insts, product);
+                    if (amount == wasm::Type::i32) {
+                        product = builder.makeUnary(wasm::WrapInt64, product);
+                        push(flush.insts, product);
+                    }
+                    push(flush.insts, builder.makeCall(add->name, {k, product}, wasm::Type::none));
+                }
+                auto zero = builder.makeConst(int64_t(0));
+                push(flush.insts, zero);
+                push(flush.insts, builder.makeLocalSet(trips, zero));
+                code.push_back(std::move(flush));
+            }
+            result.loops++;
+        }
+        if (code.empty()) continue;
+
+        applyStackProbes(module, func, cfg, code);
+        // the stack ir optimizer leaves nulls as well
+        for (auto &inst : *(func->stackIR)) {
+            if (removed.count(inst)) inst = nullptr;
+        }
+        instrumenter.stackIRChanged(name);
+        result.functions++;
+    }
+    instrumenter.invalidateCallGraph();
+    return true;
+}
+
+}
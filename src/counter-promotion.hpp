@@ -0,0 +1,59 @@
+#ifndef counter_promotion_h
+#define counter_promotion_h
+
+#include "instrumenter.hpp"
+
+namespace wasm_instrument {
+
+// helpers of a counter table, both defined in the module
+// a counting site is i32.const k; call $increment
+struct CounterHelpers {
+    // (param i32) adds one to counter k
+    std::string increment;
+    // (param i32 i32) adds its second param to counter k, or (param i32 i64) for
+    // a table of i64 counters
+    std::string add;
+};
+
+struct PromotionResult {
+    size_t functions = 0;
+    // distinct counters kept in locals, per function
+    size_t counters = 0;
+    // counting sites that increment a local instead
+    size_t sites = 0;
+    // flushes inserted before exits and calls
+    size_t flushes = 0;
+};
+
+// keep the counters of a function that are incremented inside a loop in new locals of the
+// type $add takes
+// and add them to the table with $add where the function can be left:
+// before return, return_call, throw, rethrow, unreachable and other calls, which also
+// reset the locals, and at the end of the function. the totals stay the same unless
+// the function traps on something else, e.g. a memory access
+// runs on the functions in scope, except the helpers, and drops their cached analyses
+bool promoteCounters(Instrumenter &instrumenter, const CounterHelpers &helpers,
+                     PromotionResult &result) noexcept;
+
+struct HoistResult {
+    size_t functions = 0;
+    // loops that got a trip counter
+    size_t loops = 0;
+    // counting sites removed from loop bodies
+    size_t sites = 0;
+};
+
+// remove the counting sites that run exactly once per iteration of their innermost loop,
+// i.e. whose block dominates every back edge and every exit of the loop, and count the
+// iterations in a new i64 local instead. on each exit edge the counters get the trip count
+// times the number of their removed sites, and the trip count is zeroed. the product is
+// taken in i64 and wrapped for an i32 $add, as the counter would wrap
+// loops with calls other than to the helpers, or with exits that cannot be probed, are left
+// as they are, and so are functions whose cfg cannot be built (see buildStackCFG())
+// runs on the functions in scope, except the helpers, and drops their cached analyses
+bool hoistLoopCounters(Instrumenter &instrumenter, const CounterHelpers &helpers,
+                       HoistResult &result) noexcept;
+
+}
+
+#endif
@@ -0,0 +1,204 @@
+#include "frag-builder.hpp"
+#include <wasm-builder.h>
+
+namespace wasm_instrument {
+
+Frag::Frag(wasm::Module* m, const std::vector<wasm::Type> &stack_context) noexcept
+    : module_(m), stack_context_(stack_context) {
+    wasm::Builder builder(*m);
+    for (const auto t : stack_context) {
+        if (!t.isConcrete() || t.isTuple()) {
+            this->_fail("Frag", "bad stack context type " + t.toString());
+            return;
+        }
+        // never emitted, only stands for a value on the stack
+        this->stack_.push_back(builder.makeConstantExpression(wasm::Literal::makeZero(t)));
+    }
+}
+
+void Frag::_fail(const char* method, const std::string &msg) noexcept {
+    if (!this->error_.empty()) return;
+    this->error_ = msg;
+    std::cerr << "Frag: " << method << "() " << msg << "!" << std::endl;
+}
+
+wasm::Expression* Frag::_pop(const char* method, wasm::Type type) noexcept {
+    if (!this->ok()) return nullptr;
+    if (this->stack_.empty()) {
+        this->_fail(method, "stack underflow");
+        return nullptr;
+    }
+    auto e = this->stack_.back();
+    if (type != wasm::Type::none && !wasm::Type::isSubType(e->type, type)) {
+        this->_fail(method, "expect " + type.toString() + " but got " + e->type.toString());
+        return nullptr;
+    }
+    this->stack_.pop_back();
+    return e;
+}
+
+void Frag::_push(wasm::Expression* e) noexcept {
+    if (e->type.isConcrete()) this->stack_.push_back(e);
+    this->insts_.push_back(_make_stack_inst(wasm::StackInst::Basic, e, this->module_));
+}
+
+wasm::Name Frag::_memory(const char* method, const std::string &memory, wasm::Type &addr) noexcept {
+    wasm::Memory* mem = nullptr;
+    if (memory.empty()) {
+        if (!this->module_->memories.empty()) mem = this->module_->memories[0].get();
+    } else {
+        mem = this->module_->getMemoryOrNull(memory);
+    }
+    if (mem == nullptr) {
+        this->_fail(method, "no memory " + memory);
+        return wasm::Name();
+    }
+    addr = mem->indexType;
+    return mem->name;
+}
+
+Frag& Frag::i32Const(int32_t value) noexcept {
+    if (this->ok()) this->_push(wasm::Builder(*this->module_).makeConst(wasm::Literal(value)));
+    return *this;
+}
+
+Frag& Frag::i64Const(int64_t value) noexcept {
+    if (this->ok()) this->_push(wasm::Builder(*this->module_).makeConst(wasm::Literal(value)));
+    return *this;
+}
+
+Frag& Frag::f32Const(float value) noexcept {
+    if (this->ok()) this->_push(wasm::Builder(*this->module_).makeConst(wasm::Literal(value)));
+    return *this;
+}
+
+Frag& Frag::f64Const(double value) noexcept {
+    if (this->ok()) this->_push(wasm::Builder(*this->module_).makeConst(wasm::Literal(value)));
+    return *this;
+}
+
+Frag& Frag::localGet(wasm::Index index, wasm::Type type) noexcept {
+    if (this->ok()) this->_push(wasm::Builder(*this->module_).makeLocalGet(index, type));
+    return *this;
+}
+
+Frag& Frag::localSet(wasm::Index index) noexcept {
+    auto value = this->_pop("localSet", wasm::Type::none);
+    if (value != nullptr) this->_push(wasm::Builder(*this->module_).makeLocalSet(index, value));
+    return *this;
+}
+
+Frag& Frag::localTee(wasm::Index index, wasm::Type type) noexcept {
+    auto value = this->_pop("localTee", type);
+    if (value != nullptr) this->_push(wasm::Builder(*this->module_).makeLocalTee(index, value, type));
+    return *this;
+}
+
+Frag& Frag::globalGet(const std::string &name) noexcept {
+    if (!this->ok()) return *this;
+    auto global = this->module_->getGlobalOrNull(name);
+    if (global == nullptr) {
+        this->_fail("globalGet", "no global " + name);
+        return *this;
+    }
+    this->_push(wasm::Builder(*this->module_).makeGlobalGet(global->name, global->type));
+    return *this;
+}
+
+Frag& Frag::globalSet(const std::string &name) noexcept {
+    if (!this->ok()) return *this;
+    auto global = this->module_->getGlobalOrNull(name);
+    if (global == nullptr || !global->mutable_) {
+        this->_fail("globalSet", "no mutable global " + name);
+        return *this;
+    }
+    auto value = this->_pop("globalSet", global->type);
+    if (value != nullptr) this->_push(wasm::Builder(*this->module_).makeGlobalSet(global->name, value));
+    return *this;
+}
+
+Frag& Frag::unary(wasm::UnaryOp op, wasm::Type operand) noexcept {
+    auto value = this->_pop("unary", operand);
+    if (value != nullptr) this->_push(wasm::Builder(*this->module_).makeUnary(op, value));
+    return *this;
+}
+
+Frag& Frag::binary(wasm::BinaryOp op, wasm::Type operand) noexcept {
+    auto right = this->_pop("binary", operand);
+    auto left = this->_pop("binary", operand);
+    if (left != nullptr) this->_push(wasm::Builder(*this->module_).makeBinary(op, left, right));
+    return *this;
+}
+
+Frag& Frag::load(uint32_t bytes, bool signed_, uint64_t offset, wasm::Type type,
+                 const std::string &memory) noexcept {
+    if (!this->ok()) return *this;
+    wasm::Type addr;
+    auto name = this->_memory("load", memory, addr);
+    auto ptr = this->_pop("load", addr);
+    if (ptr != nullptr) {
+        this->_push(wasm::Builder(*this->module_).makeLoad(bytes, signed_, offset, bytes, ptr, type, name));
+    }
+    return *this;
+}
+
+Frag& Frag::store(uint32_t bytes, uint64_t offset, wasm::Type type, const std::string &memory) noexcept {
+    if (!this->ok()) return *this;
+    wasm::Type addr;
+    auto name = this->_memory("store", memory, addr);
+    auto value = this->_pop("store", type);
+    auto ptr = this->_pop("store", addr);
+    if (ptr != nullptr) {
+        this->_push(wasm::Builder(*this->module_).makeStore(bytes, offset, bytes, ptr, value, type, name));
+    }
+    return *this;
+}
+
+Frag& Frag::call(const std::string &name) noexcept {
+    if (!this->ok()) return *this;
+    auto func = this->module_->getFunctionOrNull(name);
+    if (func == nullptr) {
+        this->_fail("call", "no function " + name);
+        return *this;
+    }
+    const auto params = func->getParams();
+    std::vector<wasm::Expression*> operands(params.size());
+    for (size_t i = params.size(); i > 0; i--) {
+        operands[i - 1] = this->_pop("call", params[i - 1]);
+    }
+    if (!this->ok()) return *this;
+    auto results = func->getResults();
+    auto e = wasm::Builder(*this->module_).makeCall(func->name, operands, results);
+    this->insts_.push_back(_make_stack_inst(wasm::StackInst::Basic, e, this->module_));
+    // multiple results are pushed one by one, standing for the call
+    if (results.isTuple()) {
+        for (const auto t : results) {
+            this->stack_.push_back(wasm::Builder(*this->module_).makeConstantExpression(wasm::Literal::makeZero(t)));
+        }
+    } else if (results.isConcrete()) {
+        this->stack_.push_back(e);
+    }
+    return *this;
+}
+
+Frag& Frag::drop() noexcept {
+    auto value = this->_pop("drop", wasm::Type::none);
+    if (value != nullptr) this->_push(wasm::Builder(*this->module_).makeDrop(value));
+    return *this;
+}
+
+bool Frag::build(std::vector<wasm::StackInst*> &insts) const noexcept {
+    if (!this->ok()) return false;
+    bool match = (this->stack_.size() == this->stack_context_.size());
+    for (size_t i = 0; match && i < this->stack_.size(); i++) {
+        match = wasm::Type::isSubType(this->stack_[i]->type, this->stack_context_[i]);
+    }
+    if (!match) {
+        std::cerr << "Frag: build() stack is not back to the context!" << std::endl;
+        return false;
+    }
+    insts = this->insts_;
+    return true;
+}
+
+}
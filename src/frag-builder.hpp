@@ -0,0 +1,91 @@
+#ifndef frag_builder_h
+#define frag_builder_h
+
+#include "instr-utils.hpp"
+
+namespace wasm_instrument {
+
+// typed builder of straight-line fragments, an alternative to the wat strings of
+// InstrumentFragment that skips text parsing. expressions are allocated in the module
+// and each instruction is checked against the operand stack when it is appended
+// e.g. Frag(m).globalGet("g").i32Const(4).i32Add().globalSet("g")
+// after the first error, the error is printed and later calls do nothing
+class Frag final {
+public:
+    // /stack_context/ as in InstrumentFragment: the fragment finds these types
+    // on the stack and must leave them there
+    Frag(wasm::Module* m, const std::vector<wasm::Type> &stack_context = {}) noexcept;
+
+    Frag& i32Const(int32_t value) noexcept;
+    Frag& i64Const(int64_t value) noexcept;
+    Frag& f32Const(float value) noexcept;
+    Frag& f64Const(double value) noexcept;
+
+    // locals of the function the fragment goes into, types are not checked against it
+    Frag& localGet(wasm::Index index, wasm::Type type) noexcept;
+    Frag& localSet(wasm::Index index) noexcept;
+    Frag& localTee(wasm::Index index, wasm::Type type) noexcept;
+    Frag& globalGet(const std::string &name) noexcept;
+    Frag& globalSet(const std::string &name) noexcept;
+
+    // /operand/ is the type of the operands, the result type follows from /op/
+    Frag& unary(wasm::UnaryOp op, wasm::Type operand) noexcept;
+    Frag& binary(wasm::BinaryOp op, wasm::Type operand) noexcept;
+    Frag& i32Add() noexcept { return this->binary(wasm::AddInt32, wasm::Type::i32); }
+    Frag& i32Sub() noexcept { return this->binary(wasm::SubInt32, wasm::Type::i32); }
+    Frag& i32Mul() noexcept { return this->binary(wasm::MulInt32, wasm::Type::i32); }
+    Frag& i32And() noexcept { return this->binary(wasm::AndInt32, wasm::Type::i32); }
+    Frag& i32Or() noexcept { return this->binary(wasm::OrInt32, wasm::Type::i32); }
+    Frag& i32Xor() noexcept { return this->binary(wasm::XorInt32, wasm::Type::i32); }
+    Frag& i32Shl() noexcept { return this->binary(wasm::ShlInt32, wasm::Type::i32); }
+    Frag& i32ShrU() noexcept { return this->binary(wasm::ShrUInt32, wasm::Type::i32); }
+    Frag& i32Eqz() noexcept { return this->unary(wasm::EqZInt32, wasm::Type::i32); }
+    Frag& i64Add() noexcept { return this->binary(wasm::AddInt64, wasm::Type::i64); }
+    Frag& i64Sub() noexcept { return this->binary(wasm::SubInt64, wasm::Type::i64); }
+    Frag& i64ExtendI32U() noexcept { return this->unary(wasm::ExtendUInt32, wasm::Type::i32); }
+
+    // natural alignment, an empty /memory/ for the first memory of the module
+    Frag& load(uint32_t bytes, bool signed_, uint64_t offset, wasm::Type type,
+               const std::string &memory = "") noexcept;
+    Frag& store(uint32_t bytes, uint64_t offset, wasm::Type type, const std::string &memory = "") noexcept;
+    Frag& i32Load(uint64_t offset = 0, const std::string &memory = "") noexcept {
+        return this->load(4, false, offset, wasm::Type::i32, memory);
+    }
+    Frag& i64Load(uint64_t offset = 0, const std::string &memory = "") noexcept {
+        return this->load(8, false, offset, wasm::Type::i64, memory);
+    }
+    Frag& i32Store(uint64_t offset = 0, const std::string &memory = "") noexcept {
+        return this->store(4, offset, wasm::Type::i32, memory);
+    }
+    Frag& i64Store(uint64_t offset = 0, const std::string &memory = "") noexcept {
+        return this->store(8, offset, wasm::Type::i64, memory);
+    }
+
+    // the callee must be in the module already
+    Frag& call(const std::string &name) noexcept;
+    Frag& drop() noexcept;
+
+    bool ok() const noexcept {
+        return this->error_.empty();
+    }
+    // the stack insts, false if an instruction failed or the stack is not back to the context
+    bool build(std::vector<wasm::StackInst*> &insts) const noexcept;
+
+private:
+    void _fail(const char* method, const std::string &msg) noexcept;
+    // pop an operand of /type/, none for any type
+    wasm::Expression* _pop(const char* method, wasm::Type type) noexcept;
+    void _push(wasm::Expression* e) noexcept;
+    wasm::Name _memory(const char* method, const std::string &memory, wasm::Type &addr) noexcept;
+
+    wasm::Module* module_;
+    std::vector<wasm::Type> stack_context_;
+    // expressions whose values are on the stack, starting with placeholders of the context
+    std::vector<wasm::Expression*> stack_;
+    std::vector<wasm::StackInst*> insts_;
+    std::string error_;
+};
+
+}
+
+#endif
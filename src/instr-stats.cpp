@@ -0,0 +1,75 @@
+#include "instr-stats.hpp"
+#include <fstream>
+#include <iostream>
+
+namespace wasm_instrument {
+
+std::string InstrumentPhase2str(InstrumentPhase phase) {
+    std::string phase_map[] = {
+        "read",
+        "stack_ir",
+        "compile",
+        "match",
+        "splice",
+        "analysis",
+        "optimize",
+        "validate",
+        "write"
+    };
+    return phase_map[int(phase)];
+}
+
+size_t arenaUsage(const wasm::MixedArena &arena) {
+    size_t ret = 0;
+    for (const wasm::MixedArena* a = &arena; a != nullptr; a = a->next.load()) {
+        if (a->chunks.empty()) continue;
+        ret += (a->chunks.size() - 1) * wasm::MixedArena::CHUNK_SIZE + a->index;
+    }
+    return ret;
+}
+
+void InstrumentStats::sampleArena(const wasm::MixedArena &arena) {
+    this->peak_arena_bytes = std::max(this->peak_arena_bytes, arenaUsage(arena));
+}
+
+void InstrumentStats::print(std::ostream &o) const {
+    o << "phases (ms):" << std::endl;
+    for (int i = 0; i < InstrumentPhase::phase_num; i++) {
+        o << "  " << InstrumentPhase2str(InstrumentPhase(i)) << ": " << this->phase_us[i] / 1000 << std::endl;
+    }
+    for (size_t i = 0; i < this->operation_matches.size(); i++) {
+        o << "instrument() call " << i << " matches:";
+        for (auto num : this->operation_matches[i]) o << " " << num;
+        o << std::endl;
+    }
+    size_t inserted = 0;
+    size_t inserted_expressions = 0;
+    for (const auto &[_, f] : this->functions) {
+        inserted += f.inserted_instructions;
+        inserted_expressions += f.inserted_expressions;
+    }
+    o << "instrumented functions: " << this->functions.size() << std::endl;
+    o << "inserted instructions: " << inserted << std::endl;
+    if (inserted_expressions != 0) o << "inserted expressions: " << inserted_expressions << std::endl;
+    o << "peak arena bytes: " << this->peak_arena_bytes << std::endl;
+}
+
+bool InstrumentStats::dumpTrace(const std::string &filename) const {
+    std::ofstream ofile(filename);
+    if (!ofile.is_open()) {
+        std::cerr << "InstrumentStats: cannot open trace file: " << filename << std::endl;
+        return false;
+    }
+    ofile << "{\"traceEvents\":[";
+    for (size_t i = 0; i < this->events.size(); i++) {
+        const auto &e = this->events[i];
+        ofile << (i ? ",\n" : "\n")
+              << "{\"name\":\"" << InstrumentPhase2str(e.phase) << "\",\"cat\":\"" << e.call
+              << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << e.start_us
+              << ",\"dur\":" << e.duration_us << "}";
+    }
+    ofile << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return true;
+}
+
+}
@@ -0,0 +1,86 @@
+#ifndef instr_stats_h
+#define instr_stats_h
+
+#include <array>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include <mixed_arena.h>
+
+namespace wasm_instrument {
+
+enum InstrumentPhase {
+    // read the module from file
+    phase_read = 0,
+    // generate and optimize stack ir of the whole module
+    phase_stack_ir,
+    // parse fragments of operations and functions to be added
+    phase_compile,
+    // iterate stack ir and match targets, splices of matched sites included
+    phase_match,
+    // convert stack ir of instrumented functions to list and back
+    phase_splice,
+    // build control flow analyses of functions
+    phase_analysis,
+    // run binaryen optimization passes on the module
+    phase_optimize,
+    // validate the module after modification
+    phase_validate,
+    // write the module to binary
+    phase_write,
+    phase_num
+};
+
+std::string InstrumentPhase2str(InstrumentPhase phase);
+
+// statistics of what the instrumenter did and how long it took
+// times are accumulated over all calls until Instrumenter::clear() or resetStats()
+struct InstrumentStats {
+    struct FunctionStats {
+        size_t inserted_instructions = 0;
+        // inserted into the binaryen ir by Instrumenter::instrumentIR()
+        size_t inserted_expressions = 0;
+        // time spent in match and splice phases of this function
+        double time_us = 0;
+    };
+    // a complete event of the chrome trace format
+    struct TraceEvent {
+        InstrumentPhase phase;
+        // the api call that the phase belongs to, e.g. "instrument"
+        std::string call;
+        double start_us;
+        double duration_us;
+    };
+
+    std::array<double, InstrumentPhase::phase_num> phase_us = {};
+    // [instrument() call][operation] => number of matched sites
+    std::vector<std::vector<size_t>> operation_matches;
+    std::map<std::string, FunctionStats> functions;
+    // peak bytes allocated in module->allocator, sampled after each phase
+    size_t peak_arena_bytes = 0;
+    std::vector<TraceEvent> events;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+    double now_us() const {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - this->origin).count();
+    }
+    // record a phase started at start_us and ended now
+    void record(InstrumentPhase phase, const char* call, double start_us) {
+        double duration = now_us() - start_us;
+        this->phase_us[phase] += duration;
+        this->events.emplace_back(TraceEvent{phase, call, start_us, duration});
+    }
+    void sampleArena(const wasm::MixedArena &arena);
+    // print a human readable summary
+    void print(std::ostream &o) const;
+    // dump events in chrome trace json format, which can be loaded by chrome://tracing or perfetto
+    bool dumpTrace(const std::string &filename) const;
+};
+
+// approximate number of bytes allocated in an arena and its per-thread arenas
+size_t arenaUsage(const wasm::MixedArena &arena);
+
+}
+
+#endif
@@ -1,23 +1,52 @@
 #include "instr-utils.hpp"
+#include <sstream>
+#include <ir/module-utils.h>
 #include <parser/wat-parser.h>
 #include <pass.h>
-#include <passes/passes.h>
+#include <wasm-builder.h>
 
 namespace wasm_instrument {
 
-std::ostream& _out_stackir_module(std::ostream &o, wasm::Module *module) {
-    bool is_cout = (o.rdbuf() == std::cout.rdbuf());
-    std::streambuf* old_streambuf = nullptr;
-    if (!is_cout) {
-        old_streambuf = std::cout.rdbuf();
-        std::cout.rdbuf(o.rdbuf());
+std::string _strip_colors(const std::string &text) {
+    std::string ret;
+    ret.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++) {
+        // ESC [ ... m
+        if (text[i] == '\x1b' && i + 1 < text.size() && text[i + 1] == '[') {
+            i += 2;
+            while (i < text.size() && text[i] != 'm') i++;
+            continue;
+        }
+        ret += text[i];
     }
-    wasm::PassRunner runner(module);
-    runner.add(std::unique_ptr<wasm::Pass>(wasm::createPrintStackIRPass()));
-    runner.run();
-    if (!is_cout) {
-        std::cout.rdbuf(old_streambuf);
+    return ret;
+}
+
+// the module as binaryen prints it, with the stack ir as it is in place of the bodies of
+// the defined functions. the print pass of binaryen only writes to std::cout and generates
+// the stack ir again, so the rest is printed from a copy without the defined functions
+std::ostream& _out_stackir_module(std::ostream &o, wasm::Module *module) {
+    wasm::Module rest;
+    wasm::ModuleUtils::copyModule(*module, rest);
+    rest.removeFunctions([](wasm::Function* func) { return !func->imported(); });
+    std::stringstream rest_stream;
+    rest_stream << rest;
+    std::string text = _strip_colors(rest_stream.str());
+    // the functions go before the closing paren
+    while (!text.empty() && text.back() != ')') text.pop_back();
+    if (!text.empty()) text.pop_back();
+    o << text;
+    for (auto &func : module->functions) {
+        if (func->imported()) continue;
+        o << " (func $" << func->name << " (type " << func->type << ")";
+        for (wasm::Index i = func->getVarIndexBase(); i < func->getNumLocals(); i++) {
+            o << " (local $" << func->getLocalNameOrGeneric(i) << " " << func->getLocalType(i) << ")";
+        }
+        o << "\n";
+        if (func->stackIR != nullptr) o << *(func->stackIR);
+        o << " )\n";
     }
+    o << ")\n";
     return o;
 }
 
@@ -33,6 +62,101 @@ bool _readTextData(const std::string& input, wasm::Module& wasm) {
     return true;
 }
 
+// a module with the names and types of everything in /m/ but no code,
+// so that functions parsed along with it can refer to them
+static std::unique_ptr<wasm::Module> _make_decl_module(const wasm::Module* m) {
+    auto decls = std::make_unique<wasm::Module>();
+    decls->features = m->features;
+    auto import = [](wasm::Importable* item, const wasm::Importable* orig) {
+        item->module = orig->imported() ? orig->module : wasm::Name("env");
+        item->base = orig->imported() ? orig->base : orig->name;
+    };
+    // all declarations are imports, so they are numbered in the order they are added.
+    // add them as the binary numbers them, imports first, so that a numeric index in the
+    // new functions refers to the same item as in the written module
+    auto in_binary_order = [](const auto &items, auto add) {
+        for (auto &item : items) {
+            if (item->imported()) add(item.get());
+        }
+        for (auto &item : items) {
+            if (!item->imported()) add(item.get());
+        }
+    };
+    in_binary_order(m->functions, [&](const wasm::Function* func) {
+        auto decl = wasm::Builder::makeFunction(func->name, func->type, {});
+        import(decl.get(), func);
+        decls->addFunction(std::move(decl));
+    });
+    in_binary_order(m->globals, [&](const wasm::Global* global) {
+        auto decl = wasm::Builder::makeGlobal(global->name, global->type, nullptr,
+                                              global->mutable_ ? wasm::Builder::Mutable : wasm::Builder::Immutable);
+        import(decl.get(), global);
+        decls->addGlobal(std::move(decl));
+    });
+    in_binary_order(m->memories, [&](const wasm::Memory* memory) {
+        auto decl = std::make_unique<wasm::Memory>(*memory);
+        import(decl.get(), memory);
+        decls->addMemory(std::move(decl));
+    });
+    in_binary_order(m->tables, [&](const wasm::Table* table) {
+        auto decl = std::make_unique<wasm::Table>(*table);
+        import(decl.get(), table);
+        decls->addTable(std::move(decl));
+    });
+    in_binary_order(m->tags, [&](const wasm::Tag* tag) {
+        auto decl = std::make_unique<wasm::Tag>(*tag);
+        import(decl.get(), tag);
+        decls->addTag(std::move(decl));
+    });
+    // passive and empty, only the names are needed
+    for (auto &segment : m->dataSegments) {
+        auto decl = std::make_unique<wasm::DataSegment>();
+        decl->setName(segment->name, true);
+        decl->isPassive = true;
+        decls->addDataSegment(std::move(decl));
+    }
+    for (auto &segment : m->elementSegments) {
+        auto decl = std::make_unique<wasm::ElementSegment>();
+        decl->setName(segment->name, true);
+        decl->type = segment->type;
+        decls->addElementSegment(std::move(decl));
+    }
+    return decls;
+}
+
+bool _compileFunctions(wasm::Module* m, const std::string &funcs, std::vector<wasm::Function*> &added) {
+    added.clear();
+    auto decls = _make_decl_module(m);
+    std::stringstream mstream;
+    mstream << *decls;
+    std::string module_str = _strip_colors(mstream.str());
+    while (!module_str.empty() && module_str.back() != ')') module_str.pop_back();
+    if (module_str.empty()) return false;
+    module_str.pop_back();
+    module_str += funcs;
+    module_str += ")";
+
+    wasm::Module scratch;
+    scratch.features = m->features;
+    if (!_readTextData(module_str, scratch)) return false;
+    for (auto &func : scratch.functions) {
+        if (func->imported()) continue;
+        if (m->getFunctionOrNull(func->name) != nullptr) {
+            std::cerr << "_compileFunctions() function " << func->name << " already exists!" << std::endl;
+            for (auto f : added) m->removeFunction(f->name);
+            added.clear();
+            return false;
+        }
+        added.push_back(wasm::ModuleUtils::copyFunction(func.get(), *m));
+    }
+
+    wasm::PassRunner pass_runner(m);
+    pass_runner.add("generate-stack-ir");
+    pass_runner.add("optimize-stack-ir");
+    for (auto func : added) pass_runner.runOnFunction(func);
+    return true;
+}
+
 bool _isControlFlowStructure(wasm::Expression::Id id) {
     return (id == wasm::Expression::Id::BlockId) || (id == wasm::Expression::Id::IfId) 
         || (id == wasm::Expression::Id::LoopId) 
@@ -2,8 +2,10 @@
 #define instr_utils_h
 
 #include <list>
+#include <map>
 #include <wasm.h>
 #include <wasm-stack.h>
+#include <ir/module-utils.h>
 #include "binaryen-c.h"
 
 namespace wasm_instrument {
@@ -57,11 +59,34 @@ struct AddedInstruction {
 };
 using AddedInstructions = std::vector<AddedInstruction>;
 
+// 1 to 1 related to operations of Instrumenter::instrumentIR()
+// a fragment as the body of a function whose params are the locals declared by the
+// fragment followed by its stack context, stored back to the params at the end
+// nullptr if the fragment has no instructions
+struct AddedExpression {
+    wasm::Expression* pre_body = nullptr;
+    wasm::Expression* post_body = nullptr;
+    // types of the locals past the params of a fragment, e.g. scratch locals of the parser
+    std::vector<wasm::Type> pre_vars;
+    std::vector<wasm::Type> post_vars;
+};
+using AddedExpressions = std::vector<AddedExpression>;
+
 
+// print the module to /o/, with the stack ir of the defined functions in place of their bodies
 std::ostream& _out_stackir_module(std::ostream &o, wasm::Module *module);
 
 bool _readTextData(const std::string& input, wasm::Module& wasm);
 
+// remove the color codes binaryen's printer adds when stdout is a terminal
+std::string _strip_colors(const std::string &text);
+
+// parse /funcs/, a sequence of (func ...) in wat that may refer to anything in /m/,
+// and add them to /m/ with their stack ir. /m/ is unchanged on failure
+// only the declarations of /m/ are printed and parsed, in a scratch module, so
+// independent modules can do this on different threads
+bool _compileFunctions(wasm::Module* m, const std::string &funcs, std::vector<wasm::Function*> &added);
+
 bool _isControlFlowStructure(wasm::Expression::Id id);
 
 bool _exp_match_target(const wasm::StackInst* exp, const InstrumentOperation::ExpName &target);
@@ -96,6 +121,33 @@ inline void iterInstructions(wasm::Function* func, T visitor) {
     func->stackIR = std::make_unique<wasm::StackIR>(new_stack_ir_vec);
 }
 
+// read-only iteration over the stack ir in place, without copying or rebuilding it
+// null insts are skipped
+// The visitor provided should have signature void(const wasm::StackInst*)
+template<typename T>
+inline void iterInstructionsConst(const wasm::Function* func, T visitor) {
+    assert(func->stackIR != nullptr);
+    for (const wasm::StackInst* inst : *(func->stackIR)) {
+        if (inst != nullptr) visitor(inst);
+    }
+}
+
+// run a read-only visitor on all defined functions in parallel, one result per function
+// the visitor must not change the module and runs on binaryen's worker threads
+// The visitor provided should have signature void(const wasm::Function*, R&)
+template<typename R, typename T>
+inline std::map<wasm::Function*, R> iterDefinedFunctionsParallel(wasm::Module* m, T visitor) {
+    wasm::ModuleUtils::ParallelFunctionAnalysis<R> analysis(
+        *m, [&visitor](wasm::Function* func, R &result) {
+            if (!func->imported()) visitor(func, result);
+        });
+    std::map<wasm::Function*, R> results;
+    for (auto &[func, result] : analysis.map) {
+        if (!func->imported()) results.emplace(func, std::move(result));
+    }
+    return results;
+}
+
 wasm::StackInst* _make_stack_inst(wasm::StackInst::Op op, wasm::Expression* origin, wasm::Module* m);
 
 }
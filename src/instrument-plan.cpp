@@ -0,0 +1,342 @@
+#include "instrument-plan.hpp"
+#include <fstream>
+#include <sstream>
+
+namespace wasm_instrument {
+
+static const std::pair<const char*, wasm::StackInst::Op> stack_op_names[] = {
+    {"Basic", wasm::StackInst::Basic},
+    {"BlockBegin", wasm::StackInst::BlockBegin},
+    {"BlockEnd", wasm::StackInst::BlockEnd},
+    {"IfBegin", wasm::StackInst::IfBegin},
+    {"IfElse", wasm::StackInst::IfElse},
+    {"IfEnd", wasm::StackInst::IfEnd},
+    {"LoopBegin", wasm::StackInst::LoopBegin},
+    {"LoopEnd", wasm::StackInst::LoopEnd},
+    {"TryBegin", wasm::StackInst::TryBegin},
+    {"Catch", wasm::StackInst::Catch},
+    {"CatchAll", wasm::StackInst::CatchAll},
+    {"Delegate", wasm::StackInst::Delegate},
+    {"TryEnd", wasm::StackInst::TryEnd},
+    {"TryTableBegin", wasm::StackInst::TryTableBegin},
+    {"TryTableEnd", wasm::StackInst::TryTableEnd},
+};
+
+static bool _str2expression_id(const std::string &name, wasm::Expression::Id &id) {
+#define DELEGATE(CLASS_TO_VISIT)                                  \
+    if (name == #CLASS_TO_VISIT) {                                \
+        id = wasm::Expression::Id::CLASS_TO_VISIT##Id;            \
+        return true;                                              \
+    }
+#include "wasm-delegations.def"
+    return false;
+}
+
+static std::string _expression_id2str(wasm::Expression::Id id) {
+    switch (id) {
+#define DELEGATE(CLASS_TO_VISIT)                                  \
+        case wasm::Expression::Id::CLASS_TO_VISIT##Id:            \
+            return #CLASS_TO_VISIT;
+#include "wasm-delegations.def"
+        default:
+            return "Invalid";
+    }
+}
+
+static bool _str2type(const std::string &name, BinaryenType &type) {
+    const std::pair<const char*, wasm::Type::BasicType> type_names[] = {
+        {"none", wasm::Type::none},
+        {"i32", wasm::Type::i32},
+        {"i64", wasm::Type::i64},
+        {"f32", wasm::Type::f32},
+        {"f64", wasm::Type::f64},
+        {"v128", wasm::Type::v128},
+    };
+    for (const auto &p : type_names) {
+        if (name == p.first) {
+            type = wasm::Type(p.second).getID();
+            return true;
+        }
+    }
+    return false;
+}
+
+// "i32,i64" or "none"
+static bool _str2types(const std::string &names, std::vector<BinaryenType> &types) {
+    types.clear();
+    if (names == "none") return true;
+    std::stringstream ss(names);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        BinaryenType t;
+        if (!_str2type(name, t) || t == BinaryenTypeNone()) return false;
+        types.push_back(t);
+    }
+    return !types.empty();
+}
+
+static std::string _types2str(const std::vector<BinaryenType> &types) {
+    if (types.empty()) return "none";
+    std::string ret;
+    for (size_t i = 0; i < types.size(); i++) {
+        if (i != 0) ret += ",";
+        ret += wasm::Type(types[i]).toString();
+    }
+    return ret;
+}
+
+static bool _parse_target(std::istringstream &ls, InstrumentOperation::ExpName &target) {
+    std::string word;
+    if (!(ls >> word) || !_str2expression_id(word, target.id)) return false;
+    while (ls >> word) {
+        if (word.rfind("op=", 0) == 0) {
+            auto value = word.substr(3);
+            InstrumentOperation::ExpName::ExpOp exp_op;
+            if (target.id == wasm::Expression::Id::UnaryId) {
+                exp_op.uop = static_cast<wasm::UnaryOp>(std::stoi(value));
+            } else if (target.id == wasm::Expression::Id::BinaryId) {
+                exp_op.bop = static_cast<wasm::BinaryOp>(std::stoi(value));
+            } else if (_isControlFlowStructure(target.id)) {
+                bool found = false;
+                for (const auto &p : stack_op_names) {
+                    if (value == p.first) {
+                        exp_op.cop = p.second;
+                        found = true;
+                    }
+                }
+                if (!found) return false;
+            } else {
+                return false;
+            }
+            target.exp_op = exp_op;
+        } else if (word.rfind("type=", 0) == 0) {
+            BinaryenType t;
+            if (!_str2type(word.substr(5), t)) return false;
+            target.exp_type = t;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool _parse_types(std::istringstream &ls, std::vector<wasm::Type> &types) {
+    std::string word;
+    while (ls >> word) {
+        BinaryenType t;
+        if (!_str2type(word, t) || t == BinaryenTypeNone()) return false;
+        types.emplace_back(t);
+    }
+    return true;
+}
+
+static std::string _rest_of_line(std::istringstream &ls) {
+    std::string rest;
+    std::getline(ls, rest);
+    auto start = rest.find_first_not_of(" \t");
+    if (start == std::string::npos) return "";
+    return rest.substr(start);
+}
+
+bool parsePlan(std::istream &in, InstrumentPlan &plan) noexcept {
+    enum { top, in_func, in_op } state = top;
+    std::string line;
+    std::string func_body;
+    InstrumentOperation op;
+    size_t line_num = 0;
+    try {
+        while (std::getline(in, line)) {
+            line_num++;
+            std::istringstream ls(line);
+            std::string word;
+            if (state == in_func) {
+                if ((ls >> word) && word == "end" && _rest_of_line(ls).empty()) {
+                    plan.function_bodies.push_back(func_body);
+                    state = top;
+                } else {
+                    func_body += line + "\n";
+                }
+                continue;
+            }
+            if (!(ls >> word) || word[0] == '#') continue;
+
+            bool ok = true;
+            if (state == top) {
+                if (word == "global") {
+                    InstrumentPlan::GlobalDecl g;
+                    std::string mut;
+                    ok = static_cast<bool>(ls >> g.name >> word >> mut >> g.init) &&
+                        _str2type(word, g.type) && (mut == "mut" || mut == "const");
+                    g.if_mutable = (mut == "mut");
+                    plan.globals.push_back(g);
+                } else if (word == "import-func") {
+                    InstrumentPlan::ImportFunctionDecl f;
+                    std::string params, results;
+                    ok = static_cast<bool>(ls >> f.name >> f.module >> f.base >> params >> results) &&
+                        _str2types(params, f.params) && _str2types(results, f.results);
+                    plan.import_functions.push_back(f);
+                } else if (word == "func") {
+                    std::string name;
+                    ok = static_cast<bool>(ls >> name);
+                    plan.function_names.push_back(name);
+                    func_body.clear();
+                    state = in_func;
+                } else if (word == "op") {
+                    op = InstrumentOperation();
+                    state = in_op;
+                } else {
+                    ok = false;
+                }
+            } else {
+                if (word == "end") {
+                    plan.operations.push_back(op);
+                    state = top;
+                } else if (word == "target") {
+                    InstrumentOperation::ExpName target;
+                    ok = _parse_target(ls, target);
+                    op.targets.push_back(target);
+                } else if (word == "pre-local") {
+                    ok = _parse_types(ls, op.pre_instructions.local_types);
+                } else if (word == "pre-stack") {
+                    ok = _parse_types(ls, op.pre_instructions.stack_context);
+                } else if (word == "pre") {
+                    op.pre_instructions.instructions.push_back(_rest_of_line(ls));
+                } else if (word == "post-local") {
+                    ok = _parse_types(ls, op.post_instructions.local_types);
+                } else if (word == "post-stack") {
+                    ok = _parse_types(ls, op.post_instructions.stack_context);
+                } else if (word == "post") {
+                    op.post_instructions.instructions.push_back(_rest_of_line(ls));
+                } else {
+                    ok = false;
+                }
+            }
+            if (!ok) {
+                std::cerr << "InstrumentPlan: parsePlan() syntax error at line " << line_num << "!" << std::endl;
+                return false;
+            }
+        }
+    } catch (...) {
+        std::cerr << "InstrumentPlan: parsePlan() bad value at line " << line_num << "!" << std::endl;
+        return false;
+    }
+    if (state != top) {
+        std::cerr << "InstrumentPlan: parsePlan() missing end!" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool readPlan(const std::string &filename, InstrumentPlan &plan) noexcept {
+    std::ifstream in(filename);
+    if (!in.is_open()) {
+        std::cerr << "InstrumentPlan: readPlan() cannot open " << filename << "!" << std::endl;
+        return false;
+    }
+    return parsePlan(in, plan);
+}
+
+static void _write_fragment(std::ostream &o, const InstrumentFragment &fragment, const char* prefix) {
+    if (!fragment.local_types.empty()) {
+        o << "  " << prefix << "-local";
+        for (const auto &t : fragment.local_types) o << " " << t.toString();
+        o << "\n";
+    }
+    if (!fragment.stack_context.empty()) {
+        o << "  " << prefix << "-stack";
+        for (const auto &t : fragment.stack_context) o << " " << t.toString();
+        o << "\n";
+    }
+    for (const auto &instr : fragment.instructions) {
+        o << "  " << prefix << " " << instr << "\n";
+    }
+}
+
+void writePlan(std::ostream &o, const InstrumentPlan &plan) {
+    for (const auto &g : plan.globals) {
+        o << "global " << g.name << " " << wasm::Type(g.type).toString() << " "
+          << (g.if_mutable ? "mut" : "const") << " " << g.init << "\n";
+    }
+    for (const auto &f : plan.import_functions) {
+        o << "import-func " << f.name << " " << f.module << " " << f.base << " "
+          << _types2str(f.params) << " " << _types2str(f.results) << "\n";
+    }
+    for (size_t i = 0; i < plan.function_names.size(); i++) {
+        o << "func " << plan.function_names[i] << "\n" << plan.function_bodies[i];
+        if (!plan.function_bodies[i].empty() && plan.function_bodies[i].back() != '\n') o << "\n";
+        o << "end\n";
+    }
+    for (const auto &op : plan.operations) {
+        o << "op\n";
+        for (const auto &target : op.targets) {
+            o << "  target " << _expression_id2str(target.id);
+            if (target.exp_op.has_value()) {
+                o << " op=";
+                if (target.id == wasm::Expression::Id::UnaryId) {
+                    o << int(target.exp_op->uop);
+                } else if (target.id == wasm::Expression::Id::BinaryId) {
+                    o << int(target.exp_op->bop);
+                } else {
+                    for (const auto &p : stack_op_names) {
+                        if (p.second == target.exp_op->cop) o << p.first;
+                    }
+                }
+            }
+            if (target.exp_type.has_value()) {
+                o << " type=" << wasm::Type(target.exp_type.value()).toString();
+            }
+            o << "\n";
+        }
+        _write_fragment(o, op.pre_instructions, "pre");
+        _write_fragment(o, op.post_instructions, "post");
+        o << "end\n";
+    }
+}
+
+static bool _make_literal(const InstrumentPlan::GlobalDecl &g, BinaryenLiteral &literal) {
+    try {
+        if (g.type == BinaryenTypeInt32()) {
+            literal = BinaryenLiteralInt32(static_cast<int32_t>(std::stol(g.init, nullptr, 0)));
+        } else if (g.type == BinaryenTypeInt64()) {
+            literal = BinaryenLiteralInt64(std::stoll(g.init, nullptr, 0));
+        } else if (g.type == BinaryenTypeFloat32()) {
+            literal = BinaryenLiteralFloat32(std::stof(g.init));
+        } else if (g.type == BinaryenTypeFloat64()) {
+            literal = BinaryenLiteralFloat64(std::stod(g.init));
+        } else {
+            return false;
+        }
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
+InstrumentResult applyPlan(Instrumenter &instrumenter, const InstrumentPlan &plan) noexcept {
+    for (const auto &g : plan.globals) {
+        BinaryenLiteral literal;
+        if (!_make_literal(g, literal)) {
+            std::cerr << "InstrumentPlan: applyPlan() bad init value of global " << g.name << "!" << std::endl;
+            return InstrumentResult::config_error;
+        }
+        if (instrumenter.addGlobal(g.name.c_str(), g.type, g.if_mutable, literal) == nullptr) {
+            return InstrumentResult::instrument_error;
+        }
+    }
+    for (const auto &f : plan.import_functions) {
+        auto params = BinaryenTypeCreate(const_cast<BinaryenType*>(f.params.data()), f.params.size());
+        auto results = BinaryenTypeCreate(const_cast<BinaryenType*>(f.results.data()), f.results.size());
+        if (!instrumenter.addImportFunction(f.name.c_str(), f.module.c_str(), f.base.c_str(), params, results)) {
+            return InstrumentResult::instrument_error;
+        }
+    }
+    if (!plan.function_names.empty()) {
+        if (!instrumenter.addFunctions(plan.function_names, plan.function_bodies)) {
+            return InstrumentResult::instrument_error;
+        }
+    }
+    if (plan.operations.empty()) return InstrumentResult::success;
+    return instrumenter.instrument(plan.operations);
+}
+
+}
@@ -0,0 +1,62 @@
+#ifndef instrument_plan_h
+#define instrument_plan_h
+
+#include <iostream>
+#include "instrumenter.hpp"
+
+namespace wasm_instrument {
+
+// a serializable set of declarations and operations
+// that can be parsed once and applied to many modules
+//
+// text format, one directive per line, '#' starts a comment line:
+//   global <name> <type> <mut|const> <init>
+//   import-func <name> <module> <base> <params> <results>
+//   func <name>
+//     <wat lines of the whole function>
+//   end
+//   op
+//     target <ExpressionName> [op=<n|StackInstOp>] [type=<type>]
+//     pre-local <type>...
+//     pre-stack <type>...
+//     pre <instruction>
+//     post-local <type>...
+//     post-stack <type>...
+//     post <instruction>
+//   end
+// <params> and <results> are comma separated basic types or "none"
+struct InstrumentPlan {
+    struct GlobalDecl {
+        std::string name;
+        BinaryenType type;
+        bool if_mutable;
+        // int value for i32 i64, float value for f32 f64
+        std::string init;
+    };
+    struct ImportFunctionDecl {
+        std::string name;
+        std::string module;
+        std::string base;
+        std::vector<BinaryenType> params;
+        std::vector<BinaryenType> results;
+    };
+
+    std::vector<GlobalDecl> globals;
+    std::vector<ImportFunctionDecl> import_functions;
+    std::vector<std::string> function_names;
+    std::vector<std::string> function_bodies;
+    std::vector<InstrumentOperation> operations;
+};
+
+// return false and print the line number to std::cerr on syntax error
+bool parsePlan(std::istream &in, InstrumentPlan &plan) noexcept;
+bool readPlan(const std::string &filename, InstrumentPlan &plan) noexcept;
+void writePlan(std::ostream &o, const InstrumentPlan &plan);
+
+// declare globals, imports and functions of the plan and do its operations
+// the instrumenter should be in valid state (after setConfig())
+InstrumentResult applyPlan(Instrumenter &instrumenter, const InstrumentPlan &plan) noexcept;
+
+}
+
+#endif
@@ -0,0 +1,373 @@
+#include "instrument-server.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <queue>
+#include <sstream>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <pass.h>
+#include <wasm-io.h>
+#include "stack-ir-cache.hpp"
+
+namespace wasm_instrument {
+
+std::shared_ptr<const ResidentModule> ModuleCache::get(const std::string &filename, bool &hit) noexcept {
+    hit = false;
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return nullptr;
+    auto stamp = std::make_pair(static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+                                static_cast<size_t>(st.st_size));
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        auto iter = this->entries_.find(filename);
+        if (iter != this->entries_.end() && iter->second.stamp == stamp) {
+            iter->second.last_use = ++this->clock_;
+            hit = true;
+            return iter->second.module;
+        }
+    }
+
+    // parse without the lock, a module read twice at the same time is kept once
+    auto resident = std::make_shared<ResidentModule>();
+    auto module = &(resident->module);
+    module->features.enable(this->feature_);
+    wasm::ModuleReader reader;
+    try {
+        reader.read(filename, *module, "");
+    } catch(wasm::ParseException &p) {
+        p.dump(std::cerr);
+        std::cerr << '\n';
+        return nullptr;
+    }
+    // the stack ir is generated and optimized once here, copies decode it
+    wasm::PassRunner runner(module);
+    runner.add("generate-stack-ir");
+    runner.add("optimize-stack-ir");
+    runner.run();
+    resident->stack_ir = encodeStackIR(0, 0, module);
+    iterDefinedFunctions(module, [](wasm::Function* func) { func->stackIR.reset(); });
+
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    auto &entry = this->entries_[filename];
+    if (entry.module == nullptr || entry.stamp != stamp) {
+        entry.module = resident;
+        entry.stamp = stamp;
+    }
+    entry.last_use = ++this->clock_;
+    auto ret = entry.module;
+    while (this->entries_.size() > std::max<size_t>(this->capacity_, 1)) {
+        auto oldest = this->entries_.begin();
+        for (auto i = this->entries_.begin(); i != this->entries_.end(); i++) {
+            if (i->second.last_use < oldest->second.last_use) oldest = i;
+        }
+        // jobs still holding it keep it alive
+        this->entries_.erase(oldest);
+    }
+    return ret;
+}
+
+size_t ModuleCache::size() noexcept {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->entries_.size();
+}
+
+static bool _read_all(int fd, void* data, size_t len) {
+    auto p = static_cast<char*>(data);
+    while (len > 0) {
+        auto n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool _write_all(int fd, const void* data, size_t len) {
+    auto p = static_cast<const char*>(data);
+    while (len > 0) {
+        auto n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool _read_u32(int fd, uint32_t &value) {
+    uint8_t b[4];
+    if (!_read_all(fd, b, 4)) return false;
+    value = b[0] | (b[1] << 8) | (b[2] << 16) | (static_cast<uint32_t>(b[3]) << 24);
+    return true;
+}
+
+static bool _write_u32(int fd, uint32_t value) {
+    uint8_t b[4] = {uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24)};
+    return _write_all(fd, b, 4);
+}
+
+template<typename T>
+static bool _read_frame(int fd, T &bytes) {
+    uint32_t len = 0;
+    if (!_read_u32(fd, len)) return false;
+    bytes.resize(len);
+    return len == 0 || _read_all(fd, &bytes[0], len);
+}
+
+template<typename T>
+static bool _write_frame(int fd, const T &bytes) {
+    return _write_u32(fd, static_cast<uint32_t>(bytes.size())) &&
+        (bytes.empty() || _write_all(fd, &bytes[0], bytes.size()));
+}
+
+static int _make_socket(const std::string &socket_path, sockaddr_un &addr) {
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "InstrumentServer: socket path too long: " << socket_path << "!" << std::endl;
+        return -1;
+    }
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, socket_path.c_str());
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+// how often a worker waiting on an idle connection checks for a stop or other connections
+const int IDLE_POLL_MS = 200;
+
+namespace {
+
+// the real path of /path/, false if it does not resolve below /root/ (unless /root/ is empty)
+static bool _resolve_path(const std::string &path, const std::string &root, std::string &real, bool &allowed) {
+    char buf[PATH_MAX];
+    allowed = false;
+    if (realpath(path.c_str(), buf) == nullptr) return false;
+    real = buf;
+    allowed = root.empty() || real.compare(0, root.size() + 1, root + "/") == 0;
+    return true;
+}
+
+struct Server {
+    const ServerOptions &options;
+    ModuleCache cache;
+    // the real path of options.root
+    std::string root;
+    int listen_fd = -1;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::queue<int> clients;
+    bool stopping = false;
+
+    Server(const ServerOptions &o) : options(o), cache(o.max_modules, o.feature) {}
+
+    InstrumentResult run(const std::string &path, const std::string &plan_text,
+                         std::vector<char> &output, ServerJobResult &job) {
+        std::string real;
+        bool allowed = false;
+        bool found = _resolve_path(path, this->root, real, allowed);
+        if (found && !allowed) {
+            std::string msg = "module " + path + " is outside of " + this->root;
+            output.assign(msg.begin(), msg.end());
+            return InstrumentResult::config_error;
+        }
+        auto resident = found ? this->cache.get(real, job.warm) : nullptr;
+        if (resident == nullptr) {
+            std::string msg = "cannot read module " + path;
+            output.assign(msg.begin(), msg.end());
+            return InstrumentResult::open_module_error;
+        }
+        InstrumentPlan plan;
+        std::istringstream in(plan_text);
+        if (!parsePlan(in, plan)) {
+            std::string msg = "cannot parse plan";
+            output.assign(msg.begin(), msg.end());
+            return InstrumentResult::config_error;
+        }
+        Instrumenter instrumenter;
+        InstrumentConfig config;
+        config.filename = path;
+        config.feature = this->options.feature;
+        auto result = instrumenter.setConfig(config, resident->module, &(resident->stack_ir));
+        if (result == InstrumentResult::success) result = applyPlan(instrumenter, plan);
+        if (result == InstrumentResult::success) result = instrumenter.writeBinary(output);
+        if (result != InstrumentResult::success) {
+            auto msg = InstrumentResult2str(result);
+            output.assign(msg.begin(), msg.end());
+        }
+        return result;
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+        // wakes up accept()
+        shutdown(this->listen_fd, SHUT_RDWR);
+        this->cv.notify_all();
+    }
+
+    enum class Wait { request, requeued, closed };
+    // wait for the next request on /fd/. an idle connection goes back to the queue when other
+    // connections wait, so idle clients cannot hold all workers, and is closed on a stop
+    Wait wait_request(int fd) {
+        pollfd p = {fd, POLLIN, 0};
+        while (true) {
+            int n = poll(&p, 1, IDLE_POLL_MS);
+            // a hang up is readable as well, the read tells
+            if (n > 0) return Wait::request;
+            if (n < 0 && errno != EINTR) return Wait::closed;
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->stopping) return Wait::closed;
+            if (n == 0 && !this->clients.empty()) {
+                this->clients.push(fd);
+                this->cv.notify_one();
+                return Wait::requeued;
+            }
+        }
+    }
+
+    // false if the connection went back to the queue and must stay open
+    bool serve(int fd) {
+        std::string path;
+        std::string plan_text;
+        while (true) {
+            auto wait = this->wait_request(fd);
+            if (wait == Wait::requeued) return false;
+            if (wait == Wait::closed || !_read_frame(fd, path)) return true;
+            if (path.empty()) {
+                this->stop();
+                _write_u32(fd, InstrumentResult::success);
+                _write_frame(fd, std::string());
+                return true;
+            }
+            if (!_read_frame(fd, plan_text)) return true;
+            auto start = std::chrono::steady_clock::now();
+            ServerJobResult job;
+            std::vector<char> output;
+            try {
+                job.result = this->run(path, plan_text, output, job);
+            } catch (...) {
+                job.result = InstrumentResult::instrument_error;
+                std::string msg = "uncaught exception";
+                output.assign(msg.begin(), msg.end());
+            }
+            job.time_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            if (this->options.log) {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->options.log(path, job);
+            }
+            if (!_write_u32(fd, job.result) || !_write_frame(fd, output)) return true;
+        }
+    }
+
+    void work() {
+        while (true) {
+            int fd = -1;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->cv.wait(lock, [this]() { return this->stopping || !this->clients.empty(); });
+                if (this->clients.empty()) return;
+                fd = this->clients.front();
+                this->clients.pop();
+            }
+            if (this->serve(fd)) close(fd);
+        }
+    }
+};
+
+}
+
+bool runServer(const std::string &socket_path, const ServerOptions &options) noexcept {
+    char root[PATH_MAX];
+    if (!options.root.empty() && realpath(options.root.c_str(), root) == nullptr) {
+        std::cerr << "InstrumentServer: runServer() cannot find root " << options.root << "!" << std::endl;
+        return false;
+    }
+    sockaddr_un addr;
+    int fd = _make_socket(socket_path, addr);
+    if (fd < 0) return false;
+    unlink(socket_path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        std::cerr << "InstrumentServer: runServer() cannot listen on " << socket_path << "!" << std::endl;
+        close(fd);
+        return false;
+    }
+
+    Server server(options);
+    if (!options.root.empty()) server.root = root;
+    server.listen_fd = fd;
+    size_t workers = options.workers;
+    if (workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers; i++) threads.emplace_back([&server]() { server.work(); });
+
+    while (true) {
+        int client = accept(fd, nullptr, nullptr);
+        std::lock_guard<std::mutex> lock(server.mutex);
+        if (server.stopping) {
+            if (client >= 0) close(client);
+            break;
+        }
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "InstrumentServer: runServer() accept error!" << std::endl;
+            server.stopping = true;
+            server.cv.notify_all();
+            break;
+        }
+        server.clients.push(client);
+        server.cv.notify_one();
+    }
+    // pending requests are still served, idle connections are closed
+    for (auto &t : threads) t.join();
+    close(fd);
+    unlink(socket_path.c_str());
+    return true;
+}
+
+static int _connect(const std::string &socket_path) {
+    sockaddr_un addr;
+    int fd = _make_socket(socket_path, addr);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        std::cerr << "InstrumentServer: cannot connect to " << socket_path << "!" << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+InstrumentResult requestInstrument(const std::string &socket_path,
+                                   const std::string &module_path,
+                                   const std::string &plan_text,
+                                   std::vector<char> &output) noexcept {
+    int fd = _connect(socket_path);
+    if (fd < 0) return InstrumentResult::config_error;
+    uint32_t result = InstrumentResult::config_error;
+    if (!_write_frame(fd, module_path) || !_write_frame(fd, plan_text) ||
+        !_read_u32(fd, result) || !_read_frame(fd, output) || result > InstrumentResult::invalid_state) {
+        std::cerr << "InstrumentServer: requestInstrument() broken connection!" << std::endl;
+        result = InstrumentResult::config_error;
+    }
+    close(fd);
+    return static_cast<InstrumentResult>(result);
+}
+
+bool requestStop(const std::string &socket_path) noexcept {
+    int fd = _connect(socket_path);
+    if (fd < 0) return false;
+    uint32_t result = 0;
+    std::string empty;
+    bool ok = _write_frame(fd, empty) && _read_u32(fd, result);
+    close(fd);
+    return ok;
+}
+
+}
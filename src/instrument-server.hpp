@@ -0,0 +1,85 @@
+#ifndef instrument_server_h
+#define instrument_server_h
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include "instrument-plan.hpp"
+
+namespace wasm_instrument {
+
+// a parsed module and the stack ir of its functions from encodeStackIR(), which copies of it
+// take instead of generating their own (see Instrumenter::setConfig())
+struct ResidentModule {
+    wasm::Module module;
+    std::vector<uint32_t> stack_ir;
+};
+
+// parsed modules kept in memory, keyed by the path of the file, and checked against its
+// modification time and size on every use, so a warm hit does not read the file again
+// the least recently used module is dropped when there are more than /capacity/
+class ModuleCache final {
+public:
+    ModuleCache(size_t capacity, const wasm::FeatureSet &feature) noexcept
+        : capacity_(capacity), feature_(feature) {}
+
+    // the module read from the regular file /filename/, parsed again once the file changes
+    // /hit/ tells whether it was resident, nullptr if the file cannot be read
+    std::shared_ptr<const ResidentModule> get(const std::string &filename, bool &hit) noexcept;
+    size_t size() noexcept;
+
+private:
+    struct Entry {
+        std::shared_ptr<const ResidentModule> module;
+        // (modification time in ns, size) of the file it was read from
+        std::pair<int64_t, size_t> stamp;
+        uint64_t last_use;
+    };
+    size_t capacity_;
+    wasm::FeatureSet feature_;
+    std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+    uint64_t clock_ = 0;
+};
+
+// a job of the server, the result is the instrumented binary or an error message
+struct ServerJobResult {
+    InstrumentResult result = InstrumentResult::success;
+    // the module was resident
+    bool warm = false;
+    double time_us = 0;
+};
+
+struct ServerOptions {
+    // 0 for the number of hardware threads
+    size_t workers = 0;
+    // resident modules
+    size_t max_modules = 8;
+    // modules are only opened below this directory, any path if empty
+    std::string root;
+    wasm::FeatureSet feature = FEATURE_SPEC;
+    // called after each job, from worker threads under a lock
+    std::function<void(const std::string &filename, const ServerJobResult &result)> log;
+};
+
+// serve instrumentation jobs on a unix socket at /socket_path/ until a stop request
+// each connection sends any number of requests and gets one response for each:
+//   request:  frame(absolute module path) frame(plan text), an empty path asks to stop
+//             a path that does not resolve below options.root is refused with config_error
+//   response: u32 InstrumentResult, frame(instrumented binary or error message)
+// a frame is a u32 length followed by the bytes, integers are little endian
+// idle connections do not hold workers, and are closed on a stop
+// return false if the socket cannot be set up or options.root does not exist
+bool runServer(const std::string &socket_path, const ServerOptions &options) noexcept;
+
+// send one job to the server at /socket_path/, /output/ gets the instrumented binary,
+// or the error message. return config_error if the server cannot be reached
+InstrumentResult requestInstrument(const std::string &socket_path,
+                                   const std::string &module_path,
+                                   const std::string &plan_text,
+                                   std::vector<char> &output) noexcept;
+bool requestStop(const std::string &socket_path) noexcept;
+
+}
+
+#endif
@@ -1,5 +1,13 @@
 #include "instrumenter.hpp"
 #include "operation-builder.hpp"
+#include "stack-ir-cache.hpp"
+#include "binary-patcher.hpp"
+#include "offset-map.hpp"
+#include "ir-instrument.hpp"
+#include <algorithm>
+#include <fstream>
+#include <ir/module-utils.h>
+#include <wasm-binary.h>
 #include <wasm-io.h>
 #include <support/colors.h>
 
@@ -55,23 +63,79 @@ InstrumentResult Instrumenter::setConfig(const InstrumentConfig &config) noexcep
     }
     this->config_.filename = config.filename;
     this->config_.targetname = config.targetname;
+    this->config_.feature = config.feature;
+    this->config_.offset_map = config.offset_map;
+    this->config_.validate_each = config.validate_each;
     if (this->config_.filename.empty() || this->config_.targetname.empty()) {
         std::cerr << "Instrumenter: setConfig() empty file name!" << std::endl;
         return InstrumentResult::config_error;
     }
 
     // read file to the instrumenter
+    auto phase_start = this->stats_.now_us();
     InstrumentResult state_result = _read_file();
+    this->stats_.record(InstrumentPhase::phase_read, "setConfig", phase_start);
     if (state_result != InstrumentResult::success) {
         std::cerr << "Instrumenter: setConfig() error when read file!" << std::endl;
         return state_result;
     }
 
+    this->_prepare_module(config.stack_ir_cache);
+    this->state_ = InstrumentState::valid;
+    return InstrumentResult::success;
+}
+
+InstrumentResult Instrumenter::setConfig(const InstrumentConfig &config, const wasm::Module &source,
+                                         const std::vector<uint32_t>* stack_ir) noexcept {
+    if (this->state_ != InstrumentState::idle) {
+        std::cerr << "Instrumenter: wrong state for setConfig()!" << std::endl;
+        return InstrumentResult::invalid_state;
+    }
+    this->config_.filename = config.filename;
+    this->config_.targetname = config.targetname;
+    this->config_.feature = config.feature;
+    this->config_.offset_map = config.offset_map;
+    this->config_.validate_each = config.validate_each;
+
+    auto phase_start = this->stats_.now_us();
+    wasm::ModuleUtils::copyModule(source, *(this->module_));
+    this->module_->features = source.features;
+    this->module_->features.enable(this->config_.feature);
+    this->stats_.record(InstrumentPhase::phase_read, "setConfig", phase_start);
+    if (this->module_->functions.empty()) {
+        std::cerr << "Instrumenter: setConfig() empty module!" << std::endl;
+        return InstrumentResult::open_module_error;
+    }
+
+    this->_prepare_module("", stack_ir);
+    this->state_ = InstrumentState::valid;
+    return InstrumentResult::success;
+}
+
+void Instrumenter::_prepare_module(const std::string &cache_file, const std::vector<uint32_t>* stack_ir) noexcept {
     // do stack ir pass on mallocator
+    auto phase_start = this->stats_.now_us();
+    uint64_t hash = 0;
+    size_t size = 0;
+    bool use_cache = !cache_file.empty() && hashFile(this->config_.filename, hash, size);
+    bool cached = (stack_ir != nullptr)
+        ? decodeStackIR(stack_ir->data(), stack_ir->size(), 0, 0, this->module_)
+        : use_cache && loadStackIRCache(cache_file, hash, size, this->module_);
     wasm::PassRunner runner(this->module_);
     runner.add("generate-stack-ir");
     runner.add("optimize-stack-ir");
-    runner.run();
+    if (cached) {
+        // functions that were not cached
+        iterDefinedFunctions(this->module_, [&runner](wasm::Function* func) {
+            if (func->stackIR == nullptr) runner.runOnFunction(func);
+        });
+    } else {
+        runner.run();
+        if (use_cache) saveStackIRCache(cache_file, hash, size, this->module_);
+    }
+    this->stats_.record(InstrumentPhase::phase_stack_ir, "setConfig", phase_start);
+    this->stats_.sampleArena(this->module_->allocator);
+    if (!this->config_.offset_map.empty()) this->_record_original_lines();
 
     // add functions of the original binary to function_scope
     for (const auto &f : this->module_->functions) {
@@ -79,9 +143,72 @@ InstrumentResult Instrumenter::setConfig(const InstrumentConfig &config) noexcep
             this->function_scope_.emplace(f.get()->name.toString());
         }
     }
+}
 
-    this->state_ = InstrumentState::valid;
-    return InstrumentResult::success;
+void Instrumenter::_record_original_lines() noexcept {
+    this->original_lines_.clear();
+    this->original_funcs_.clear();
+    // imports come first, as in the binary
+    uint32_t index = 0;
+    for (const auto &f : this->module_->functions) {
+        this->original_funcs_.emplace(f->name.toString(), index++);
+        if (f->imported() || f->stackIR == nullptr) continue;
+        uint32_t line = 0;
+        for (auto inst : *(f->stackIR)) {
+            if (inst != nullptr) this->original_lines_.emplace(inst, ++line);
+        }
+    }
+}
+
+bool Instrumenter::_write_offset_map(const std::vector<char> &binary) noexcept {
+    std::vector<BodyOffsets> bodies;
+    if (!readBodyOffsets(binary, bodies)) return false;
+    OffsetMap map;
+    size_t body_idx = 0;
+    iterDefinedFunctions(this->module_, [&](wasm::Function* func) {
+        if (body_idx >= bodies.size()) return;
+        const auto &body = bodies[body_idx++];
+        auto func_iter = this->original_funcs_.find(func->name.toString());
+        uint32_t func_index = (func_iter == this->original_funcs_.end()) ? OFFSET_MAP_NO_FUNC : func_iter->second;
+        map.entries.push_back({uint32_t(body.begin), func_index, 0, OffsetKind::offset_none});
+        if (body.instructions.empty()) return;
+        auto end = uint32_t(body.instructions.back());
+        if (func_index == OFFSET_MAP_NO_FUNC) {
+            map.entries.push_back({uint32_t(body.instructions.front()), func_index, 0, OffsetKind::offset_inserted});
+            map.entries.push_back({end, func_index, 0, OffsetKind::offset_none});
+            return;
+        }
+        // the writer emits one instruction for each inst, but none for pops and tuple.make
+        std::vector<const wasm::StackInst*> insts;
+        if (func->stackIR != nullptr) {
+            for (auto inst : *(func->stackIR)) {
+                if (inst == nullptr || inst->origin->is<wasm::Pop>() || inst->origin->is<wasm::TupleMake>()) continue;
+                insts.push_back(inst);
+            }
+        }
+        // e.g. tuple locals are written as several instructions, the body stays unmatched
+        if (insts.size() + 1 != body.instructions.size()) return;
+        uint32_t last_line = 0;
+        for (size_t i = 0; i < insts.size(); i++) {
+            auto offset = uint32_t(body.instructions[i]);
+            auto line_iter = this->original_lines_.find(insts[i]);
+            if (line_iter != this->original_lines_.end()) {
+                last_line = line_iter->second;
+                map.entries.push_back({offset, func_index, last_line, OffsetKind::offset_original});
+            } else if (map.entries.back().kind != OffsetKind::offset_inserted) {
+                map.entries.push_back({offset, func_index, last_line, OffsetKind::offset_inserted});
+            }
+        }
+        map.entries.push_back({end, func_index, 0, OffsetKind::offset_none});
+    });
+    if (body_idx != bodies.size()) {
+        std::cerr << "Instrumenter: writeBinary() functions and code section mismatch!" << std::endl;
+        return false;
+    }
+    if (!bodies.empty()) {
+        map.entries.push_back({uint32_t(bodies.back().end), OFFSET_MAP_NO_FUNC, 0, OffsetKind::offset_none});
+    }
+    return map.save(this->config_.offset_map);
 }
 
 InstrumentResult Instrumenter::instrument(const std::vector<InstrumentOperation> &operations) noexcept {
@@ -91,16 +218,23 @@ InstrumentResult Instrumenter::instrument(const std::vector<InstrumentOperation>
     }
 
     // parse operations
+    auto phase_start = this->stats_.now_us();
     OperationBuilder builder;
     auto added_instructions = builder.makeOperations(this->module_, operations);
+    this->stats_.record(InstrumentPhase::phase_compile, "instrument", phase_start);
+    // analyses of the rewritten functions are rebuilt by their generation
+    this->invalidateCallGraph();
     if (!added_instructions) {
         std::cerr << "Instrumenter: instrumentFunction() parse operations error!" << std::endl;
         return InstrumentResult::instrument_error;
     }
+    std::vector<size_t> matches(operations.size(), 0);
+    double match_us = 0;
+    double splice_us = 0;
 
     // do specific instrument operations in config
     // iter through functions in the module
-    auto func_visitor = [this, &operations, &added_instructions](wasm::Function* func){
+    auto func_visitor = [this, &operations, &added_instructions, &matches, &match_us, &splice_us](wasm::Function* func){
         if (!this->scopeContains(func->name.toString())) return;
         // std::cout << "in function: " << func->name << " type: " << func->type.toString() << std::endl;
     
@@ -109,7 +243,10 @@ InstrumentResult Instrumenter::instrument(const std::vector<InstrumentOperation>
 
         // iter through the body in the current function (with Stack IR)
         // transform the vector of stack ir to a list for better modification
+        auto t0 = this->stats_.now_us();
         std::list<wasm::StackInst*> stack_ir_list = _stack_ir_vec2list(*(func->stackIR.get()));
+        auto t1 = this->stats_.now_us();
+        size_t inserted = 0;
         
         for (auto i = stack_ir_list.begin(); i != stack_ir_list.end(); i++) {
             auto cur_stack_inst = *i;
@@ -128,14 +265,29 @@ InstrumentResult Instrumenter::instrument(const std::vector<InstrumentOperation>
                 stack_ir_list.splice(i, _stack_ir_vec2list(
                     (*added_instructions)[op_num].post_instructions));
                 std::advance(i, -1);
+                matches[op_num]++;
+                inserted += (*added_instructions)[op_num].pre_instructions.size() +
+                            (*added_instructions)[op_num].post_instructions.size();
                 break;
             }
         }
+        auto t2 = this->stats_.now_us();
     
         // write back the modified stack ir list to the func
         auto new_stack_ir_vec = _stack_ir_list2vec(stack_ir_list);
         func->stackIR = std::make_unique<wasm::StackIR>(new_stack_ir_vec);
+        auto t3 = this->stats_.now_us();
+
+        match_us += t2 - t1;
+        splice_us += (t1 - t0) + (t3 - t2);
+        if (inserted != 0) {
+            this->stackIRChanged(func->name.toString());
+            auto &func_stats = this->stats_.functions[func->name.toString()];
+            func_stats.inserted_instructions += inserted;
+            func_stats.time_us += t3 - t0;
+        }
     };
+    phase_start = this->stats_.now_us();
     try {
         iterDefinedFunctions(this->module_, func_visitor);
     } catch(...) {
@@ -144,22 +296,110 @@ InstrumentResult Instrumenter::instrument(const std::vector<InstrumentOperation>
         return InstrumentResult::instrument_error;
     }
     delete added_instructions;
-
-    // validate the module after modification
-    if (!BinaryenModuleValidate(this->module_)) {
-        std::cerr << "Instrumenter: instrument() error when validate!" << std::endl;
-        return InstrumentResult::validate_error;
+    // matching and splicing are interleaved per function, record them as two consecutive events
+    this->stats_.phase_us[InstrumentPhase::phase_match] += match_us;
+    this->stats_.phase_us[InstrumentPhase::phase_splice] += splice_us;
+    this->stats_.events.emplace_back(InstrumentStats::TraceEvent{
+        InstrumentPhase::phase_match, "instrument", phase_start, match_us});
+    this->stats_.events.emplace_back(InstrumentStats::TraceEvent{
+        InstrumentPhase::phase_splice, "instrument", phase_start + match_us, splice_us});
+    this->stats_.operation_matches.emplace_back(std::move(matches));
+    this->stats_.sampleArena(this->module_->allocator);
+
+    // the module is validated by writeBinary() anyway
+    if (this->config_.validate_each) {
+        phase_start = this->stats_.now_us();
+        bool valid = this->validate();
+        this->stats_.record(InstrumentPhase::phase_validate, "instrument", phase_start);
+        if (!valid) {
+            std::cerr << "Instrumenter: instrument() error when validate!" << std::endl;
+            return InstrumentResult::validate_error;
+        }
     }
     
     return InstrumentResult::success;
 }
 
 InstrumentResult Instrumenter::writeBinary() noexcept {
+    auto phase_start = this->stats_.now_us();
+    bool valid = this->validate();
+    this->stats_.record(InstrumentPhase::phase_validate, "writeBinary", phase_start);
+    if (!valid) {
+        std::cerr << "Instrumenter: writeBinary() error when validate!" << std::endl;
+        return InstrumentResult::validate_error;
+    }
+    phase_start = this->stats_.now_us();
     InstrumentResult state_result = _write_file();
+    this->stats_.record(InstrumentPhase::phase_write, "writeBinary", phase_start);
     if (state_result != InstrumentResult::success) {
         std::cerr << "Instrumenter: writeBinary() error when write file!" << std::endl;
         return state_result;
     }
+    if (!this->config_.offset_map.empty()) {
+        // offsets are taken from the file as written
+        std::ifstream in(this->config_.targetname, std::ios::binary);
+        std::vector<char> binary((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (!this->_write_offset_map(binary)) {
+            std::cerr << "Instrumenter: writeBinary() error when write offset map!" << std::endl;
+            return InstrumentResult::generation_error;
+        }
+    }
+    this->state_ = InstrumentState::written;
+    return InstrumentResult::success;
+}
+
+bool Instrumenter::validate() noexcept {
+    auto result = BinaryenModuleAllocateAndWrite(this->module_, nullptr);
+    if (result.binary == nullptr) {
+        std::cerr << "Instrumenter: validate() error when write buffer!" << std::endl;
+        return false;
+    }
+    auto bytes = static_cast<const char*>(result.binary);
+    std::vector<char> buffer(bytes, bytes + result.binaryBytes);
+    free(result.binary);
+    return this->_validate_binary(buffer);
+}
+
+bool Instrumenter::_validate_binary(const std::vector<char> &buffer) noexcept {
+    wasm::Module written;
+    written.features = this->module_->features;
+    try {
+        wasm::WasmBinaryReader reader(written, written.features, buffer);
+        reader.read();
+    } catch(wasm::ParseException &p) {
+        p.dump(std::cerr);
+        std::cerr << '\n';
+        return false;
+    }
+    return BinaryenModuleValidate(&written);
+}
+
+InstrumentResult Instrumenter::writeBinary(std::vector<char> &buffer) noexcept {
+    if (this->state_ != InstrumentState::valid) {
+        std::cerr << "Instrumenter: wrong state for writeBinary()!" << std::endl;
+        return InstrumentResult::invalid_state;
+    }
+    auto phase_start = this->stats_.now_us();
+    auto result = BinaryenModuleAllocateAndWrite(this->module_, nullptr);
+    this->stats_.record(InstrumentPhase::phase_write, "writeBinary", phase_start);
+    if (result.binary == nullptr) {
+        std::cerr << "Instrumenter: writeBinary() error when write buffer!" << std::endl;
+        return InstrumentResult::generation_error;
+    }
+    auto bytes = static_cast<const char*>(result.binary);
+    buffer.assign(bytes, bytes + result.binaryBytes);
+    free(result.binary);
+    phase_start = this->stats_.now_us();
+    bool valid = this->_validate_binary(buffer);
+    this->stats_.record(InstrumentPhase::phase_validate, "writeBinary", phase_start);
+    if (!valid) {
+        std::cerr << "Instrumenter: writeBinary() error when validate!" << std::endl;
+        return InstrumentResult::validate_error;
+    }
+    if (!this->config_.offset_map.empty() && !this->_write_offset_map(buffer)) {
+        std::cerr << "Instrumenter: writeBinary() error when write offset map!" << std::endl;
+        return InstrumentResult::generation_error;
+    }
     this->state_ = InstrumentState::written;
     return InstrumentResult::success;
 }
@@ -289,42 +529,21 @@ bool Instrumenter::addFunctions(const std::vector<std::string> &names, const std
         }
     }
 
-    std::stringstream mstream;
-    auto is_color = Colors::isEnabled();
-    Colors::setEnabled(false);
-    _out_stackir_module(mstream, this->module_);
-    std::string module_str = mstream.str();
-    std::string backup_str = module_str;
-    while (module_str.back() != ')') 
-        module_str.pop_back();
-    assert(module_str.back() == ')');
-    module_str.pop_back();
+    auto phase_start = this->stats_.now_us();
+    std::string funcs_str;
     for (auto i = 0; i < names.size(); i++) {
-        module_str += func_bodies[i];
-        module_str += "\n";
-    }
-    module_str += ")";
-    auto feature = this->module_->features;
-    delete this->module_;
-    this->module_ = new wasm::Module();
-    this->module_->features.set(feature);
-    if (!_readTextData(module_str, *(this->module_))) {
+        funcs_str += func_bodies[i];
+        funcs_str += "\n";
+    }
+    std::vector<wasm::Function*> funcs;
+    if (!_compileFunctions(this->module_, funcs_str, funcs)) {
         std::cerr << "Instrumenter: addFunctions() read text error!" << std::endl;
-        Colors::setEnabled(is_color);
-        delete this->module_;
-        this->module_ = new wasm::Module();
-        if (!_readTextData(backup_str, *(this->module_))) {
-            std::cerr << "Instrumenter: addFunctions() cannot recover module! Further operations should end!" << std::endl;
-        }
         return false;
     }
-    Colors::setEnabled(is_color);
-
-    // do stack ir pass on the module
-    wasm::PassRunner pass_runner(this->module_);
-    pass_runner.add("generate-stack-ir");
-    pass_runner.add("optimize-stack-ir");
-    pass_runner.run();
+    this->stats_.record(InstrumentPhase::phase_compile, "addFunctions", phase_start);
+    this->invalidateAnalysis();
+    this->invalidateCallGraph();
+    this->stats_.sampleArena(this->module_->allocator);
     return true;
 }
 
@@ -372,6 +591,7 @@ bool Instrumenter::addImportFunction(const char* internal_name,
         return false;
     }
     BinaryenAddFunctionImport(this->module_, internal_name, external_module_name, external_base_name, params, results);
+    this->invalidateCallGraph();
     return true;
 }
 
@@ -413,6 +633,7 @@ wasm::Export* Instrumenter::addExport(wasm::ModuleItemKind kind, const char* int
         std::cerr << "Instrumenter: wrong state for addExport()!" << std::endl;
         return nullptr;
     }
+    this->invalidateCallGraph();
     wasm::Export* ret = nullptr;
     switch (kind) {
         case wasm::ModuleItemKind::Function:
@@ -429,6 +650,42 @@ wasm::Export* Instrumenter::addExport(wasm::ModuleItemKind kind, const char* int
     }
 }
 
+const CallGraph& Instrumenter::callGraph() noexcept {
+    if (this->call_graph_ == nullptr) {
+        auto phase_start = this->stats_.now_us();
+        this->call_graph_ = std::make_unique<CallGraph>();
+        buildCallGraph(this->module_, *(this->call_graph_));
+        this->stats_.record(InstrumentPhase::phase_analysis, "callGraph", phase_start);
+    }
+    return *(this->call_graph_);
+}
+
+const StackAnalysis* Instrumenter::getAnalysis(wasm::Function* func) noexcept {
+    if (this->state_ != InstrumentState::valid) {
+        std::cerr << "Instrumenter: wrong state for getAnalysis()!" << std::endl;
+        return nullptr;
+    }
+    if (func == nullptr || func->imported()) return nullptr;
+    auto name = func->name.toString();
+    auto iter = this->analyses_.find(name);
+    auto generation = this->stackIRGeneration(name);
+    if (iter != this->analyses_.end() && iter->second->generation == generation) {
+        return iter->second.get();
+    }
+    auto phase_start = this->stats_.now_us();
+    auto analysis = std::make_unique<StackAnalysis>();
+    bool built = buildStackAnalysis(func, *analysis);
+    this->stats_.record(InstrumentPhase::phase_analysis, "getAnalysis", phase_start);
+    if (!built) {
+        this->analyses_.erase(name);
+        return nullptr;
+    }
+    analysis->generation = generation;
+    auto ret = analysis.get();
+    this->analyses_[name] = std::move(analysis);
+    return ret;
+}
+
 InstrumentResult Instrumenter::instrumentFunction(const InstrumentOperation &operation,
                                                 const char* name,
                                                 size_t pos) noexcept
@@ -439,8 +696,11 @@ InstrumentResult Instrumenter::instrumentFunction(const InstrumentOperation &ope
     }
 
     // parse operation
+    auto phase_start = this->stats_.now_us();
     OperationBuilder builder;
     auto added_instructions = builder.makeOperations(this->module_, {operation});
+    this->stats_.record(InstrumentPhase::phase_compile, "instrumentFunction", phase_start);
+    this->invalidateCallGraph();
     if (!added_instructions) {
         std::cerr << "Instrumenter: instrumentFunction() parse operation error!" << std::endl;
         return InstrumentResult::instrument_error;
@@ -468,6 +728,7 @@ InstrumentResult Instrumenter::instrumentFunction(const InstrumentOperation &ope
     }
 
     // transform the vector of stack ir to a list for better modification
+    phase_start = this->stats_.now_us();
     std::list<wasm::StackInst*> stack_ir_list = _stack_ir_vec2list(*(func->stackIR));
     
     // perform operation on the pos
@@ -478,16 +739,228 @@ InstrumentResult Instrumenter::instrumentFunction(const InstrumentOperation &ope
     // write back the modified stack ir list to the func
     auto new_stack_ir_vec = _stack_ir_list2vec(stack_ir_list);
     func->stackIR = std::make_unique<wasm::StackIR>(new_stack_ir_vec);
+    this->stackIRChanged(func->name.toString());
+    auto &func_stats = this->stats_.functions[func->name.toString()];
+    func_stats.inserted_instructions += (*added_instructions)[0].post_instructions.size();
+    func_stats.time_us += this->stats_.now_us() - phase_start;
+    this->stats_.record(InstrumentPhase::phase_splice, "instrumentFunction", phase_start);
+    this->stats_.sampleArena(this->module_->allocator);
 
     delete added_instructions;
 
-    // validate the module after modification
-    if (!BinaryenModuleValidate(this->module_)) {
-        std::cerr << "Instrumenter: instrumentFunction() error when validate!" << std::endl;
-        return InstrumentResult::validate_error;
+    // the module is validated by writeBinary() anyway
+    if (this->config_.validate_each) {
+        phase_start = this->stats_.now_us();
+        bool valid = this->validate();
+        this->stats_.record(InstrumentPhase::phase_validate, "instrumentFunction", phase_start);
+        if (!valid) {
+            std::cerr << "Instrumenter: instrumentFunction() error when validate!" << std::endl;
+            return InstrumentResult::validate_error;
+        }
     }
     
     return InstrumentResult::success;
 }
 
-}
\ No newline at end of file
+InstrumentResult Instrumenter::instrumentFunctions(const std::vector<InstrumentOperation> &operations,
+                                                 const std::vector<std::string> &names,
+                                                 const std::vector<size_t> &positions) noexcept
+{
+    if (this->state_ != InstrumentState::valid) {
+        std::cerr << "Instrumenter: wrong state for instrumentFunctions()!" << std::endl;
+        return InstrumentResult::invalid_state;
+    }
+    if ((operations.size() != names.size()) || (operations.size() != positions.size())) {
+        std::cerr << "Instrumenter: instrumentFunctions() sizes mismatch!" << std::endl;
+        return InstrumentResult::config_error;
+    }
+
+    // check positions before changing anything
+    std::map<wasm::Function*, std::vector<size_t>> func_ops;
+    for (size_t i = 0; i < operations.size(); i++) {
+        auto func = this->module_->getFunctionOrNull(names[i]);
+        if ((func == nullptr) || func->imported() || (func->stackIR == nullptr)) {
+            std::cerr << "Instrumenter: instrumentFunctions() invalid function: " << names[i] << "!" << std::endl;
+            return InstrumentResult::instrument_error;
+        }
+        // lines are the insts that are not removed by the stack ir optimizer
+        auto lines = func->stackIR->size() - std::count(func->stackIR->begin(), func->stackIR->end(), nullptr);
+        if (positions[i] > static_cast<size_t>(lines)) {
+            std::cerr << "Instrumenter: instrumentFunctions() pos invalid!" << std::endl;
+            return InstrumentResult::instrument_error;
+        }
+        func_ops[func].push_back(i);
+    }
+
+    auto phase_start = this->stats_.now_us();
+    OperationBuilder builder;
+    auto added_instructions = builder.makeOperations(this->module_, operations);
+    this->stats_.record(InstrumentPhase::phase_compile, "instrumentFunctions", phase_start);
+    this->invalidateCallGraph();
+    if (!added_instructions) {
+        std::cerr << "Instrumenter: instrumentFunctions() parse operations error!" << std::endl;
+        return InstrumentResult::instrument_error;
+    }
+
+    phase_start = this->stats_.now_us();
+    for (auto &[func, ops] : func_ops) {
+        auto t0 = this->stats_.now_us();
+        std::list<wasm::StackInst*> stack_ir_list = _stack_ir_vec2list(*(func->stackIR));
+        // iterators of the original lines stay valid while splicing
+        std::vector<std::list<wasm::StackInst*>::iterator> lines;
+        lines.reserve(stack_ir_list.size() + 1);
+        for (auto iter = stack_ir_list.begin(); iter != stack_ir_list.end(); iter++) lines.push_back(iter);
+        lines.push_back(stack_ir_list.end());
+        size_t inserted = 0;
+        for (auto i : ops) {
+            const auto &insts = (*added_instructions)[i].post_instructions;
+            stack_ir_list.splice(lines[positions[i]], _stack_ir_vec2list(insts));
+            inserted += insts.size();
+        }
+        func->stackIR = std::make_unique<wasm::StackIR>(_stack_ir_list2vec(stack_ir_list));
+        this->stackIRChanged(func->name.toString());
+        auto &func_stats = this->stats_.functions[func->name.toString()];
+        func_stats.inserted_instructions += inserted;
+        func_stats.time_us += this->stats_.now_us() - t0;
+    }
+    this->stats_.record(InstrumentPhase::phase_splice, "instrumentFunctions", phase_start);
+    this->stats_.sampleArena(this->module_->allocator);
+    delete added_instructions;
+
+    // the module is validated by writeBinary() anyway
+    if (this->config_.validate_each) {
+        phase_start = this->stats_.now_us();
+        bool valid = this->validate();
+        this->stats_.record(InstrumentPhase::phase_validate, "instrumentFunctions", phase_start);
+        if (!valid) {
+            std::cerr << "Instrumenter: instrumentFunctions() error when validate!" << std::endl;
+            return InstrumentResult::validate_error;
+        }
+    }
+    return InstrumentResult::success;
+}
+
+InstrumentResult Instrumenter::instrumentIR(const std::vector<InstrumentOperation> &operations) noexcept {
+    if (this->state_ != InstrumentState::valid) {
+        std::cerr << "Instrumenter: wrong state for instrumentIR()!" << std::endl;
+        return InstrumentResult::invalid_state;
+    }
+    if (!_ir_operations_supported(operations)) {
+        std::cerr << "Instrumenter: instrumentIR() control flow targets are not supported!" << std::endl;
+        return InstrumentResult::config_error;
+    }
+    // the stack ir is generated from the body again, which would drop them
+    for (const auto &name : this->function_scope_) {
+        if (this->stack_ir_modified_.count(name)) {
+            std::cerr << "Instrumenter: instrumentIR() stack ir of " << name << " is instrumented!" << std::endl;
+            return InstrumentResult::invalid_state;
+        }
+    }
+
+    auto phase_start = this->stats_.now_us();
+    OperationBuilder builder;
+    auto added_expressions = builder.makeIROperations(this->module_, operations);
+    this->stats_.record(InstrumentPhase::phase_compile, "instrumentIR", phase_start);
+    this->invalidateCallGraph();
+    if (!added_expressions) {
+        std::cerr << "Instrumenter: instrumentIR() parse operations error!" << std::endl;
+        return InstrumentResult::instrument_error;
+    }
+
+    // find and check the sites of every function before changing any of them
+    std::vector<std::pair<wasm::Function*, IRSites>> func_sites;
+    bool ok = true;
+    phase_start = this->stats_.now_us();
+    iterDefinedFunctions(this->module_, [&](wasm::Function* func) {
+        if (!ok || !this->scopeContains(func->name.toString())) return;
+        IRSites sites;
+        if (!_find_ir_sites(this->module_, func, operations, *added_expressions, sites)) {
+            ok = false;
+            return;
+        }
+        if (!sites.empty()) func_sites.emplace_back(func, std::move(sites));
+    });
+    if (!ok) {
+        delete added_expressions;
+        this->stats_.record(InstrumentPhase::phase_match, "instrumentIR", phase_start);
+        return InstrumentResult::instrument_error;
+    }
+
+    std::vector<size_t> matches(operations.size(), 0);
+    wasm::PassRunner runner(this->module_);
+    runner.add("generate-stack-ir");
+    runner.add("optimize-stack-ir");
+    for (const auto &[func, sites] : func_sites) {
+        auto name = func->name.toString();
+        auto t0 = this->stats_.now_us();
+        size_t inserted = 0;
+        _instrument_function_ir(this->module_, func, operations, *added_expressions, sites, matches, inserted);
+        if (inserted == 0) continue;
+        runner.runOnFunction(func);
+        this->_stack_ir_regenerated(name);
+        auto &func_stats = this->stats_.functions[name];
+        func_stats.inserted_expressions += inserted;
+        func_stats.time_us += this->stats_.now_us() - t0;
+    }
+    delete added_expressions;
+    this->stats_.record(InstrumentPhase::phase_match, "instrumentIR", phase_start);
+    this->stats_.operation_matches.emplace_back(std::move(matches));
+    this->stats_.sampleArena(this->module_->allocator);
+
+    if (this->config_.validate_each) {
+        phase_start = this->stats_.now_us();
+        bool valid = BinaryenModuleValidate(this->module_);
+        this->stats_.record(InstrumentPhase::phase_validate, "instrumentIR", phase_start);
+        if (!valid) {
+            std::cerr << "Instrumenter: instrumentIR() error when validate!" << std::endl;
+            return InstrumentResult::validate_error;
+        }
+    }
+    return InstrumentResult::success;
+}
+
+InstrumentResult Instrumenter::optimize(int optimize_level, int shrink_level) noexcept {
+    if (this->state_ != InstrumentState::valid) {
+        std::cerr << "Instrumenter: wrong state for optimize()!" << std::endl;
+        return InstrumentResult::invalid_state;
+    }
+    if (!this->stack_ir_modified_.empty()) {
+        std::cerr << "Instrumenter: optimize() stack ir of " << *(this->stack_ir_modified_.begin())
+                  << " is instrumented!" << std::endl;
+        return InstrumentResult::invalid_state;
+    }
+
+    auto phase_start = this->stats_.now_us();
+    wasm::PassOptions options;
+    options.optimizeLevel = optimize_level;
+    options.shrinkLevel = shrink_level;
+    wasm::PassRunner runner(this->module_, options);
+    runner.addDefaultOptimizationPasses();
+    // passes drop the stack ir of the functions they change
+    runner.add("generate-stack-ir");
+    runner.add("optimize-stack-ir");
+    runner.run();
+    this->stats_.record(InstrumentPhase::phase_optimize, "optimize", phase_start);
+    this->stats_.sampleArena(this->module_->allocator);
+    for (auto &func : this->module_->functions) this->_stack_ir_regenerated(func->name.toString());
+    this->invalidateAnalysis();
+    this->invalidateCallGraph();
+    for (auto iter = this->function_scope_.begin(); iter != this->function_scope_.end();) {
+        if (this->module_->getFunctionOrNull(*iter) == nullptr) {
+            iter = this->function_scope_.erase(iter);
+        } else {
+            iter++;
+        }
+    }
+
+    phase_start = this->stats_.now_us();
+    bool valid = BinaryenModuleValidate(this->module_);
+    this->stats_.record(InstrumentPhase::phase_validate, "optimize", phase_start);
+    if (!valid) {
+        std::cerr << "Instrumenter: optimize() error when validate!" << std::endl;
+        return InstrumentResult::validate_error;
+    }
+    return InstrumentResult::success;
+}
+
+}
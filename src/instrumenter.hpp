@@ -1,6 +1,10 @@
 #ifndef instrumenter_h
 #define instrumenter_h
 #include "instr-utils.hpp"
+#include "call-graph.hpp"
+#include "instr-stats.hpp"
+#include "stack-analysis.hpp"
+#include <unordered_map>
 
 namespace wasm_instrument {
 
@@ -10,6 +14,16 @@ struct InstrumentConfig final {
     std::string filename;
     std::string targetname;
     wasm::FeatureSet feature = FEATURE_SPEC;
+    // optional sidecar file of the stack ir of /filename/ (see stack-ir-cache.hpp),
+    // used if it matches the contents of /filename/, and written otherwise
+    std::string stack_ir_cache;
+    // optional file of an offset map (see offset-map.hpp) from the module offsets of the
+    // written binary to the functions and stack ir lines of /filename/, made by writeBinary()
+    std::string offset_map;
+    // validate the whole module, at O(module) each time, at the end of every instrument(),
+    // instrumentFunction(), instrumentFunctions() and instrumentIR() call. the module is
+    // always validated once by writeBinary(), fragments are always checked when compiled
+    bool validate_each = false;
 };
 
 enum InstrumentResult {
@@ -50,12 +64,33 @@ public:
     // set config, read module and make stack ir emitted
     // prepare for further instrumentations
     InstrumentResult setConfig(const InstrumentConfig &config) noexcept;
+    // same as above, but start from a copy of /source/, an already read module,
+    // instead of reading config.filename, which may be empty
+    // /source/ is only read, so one module can feed instrumenters on several threads
+    // /stack_ir/, if given, is the stack ir of /source/ from encodeStackIR() with hash and
+    // size 0 (see stack-ir-cache.hpp), taken instead of generating it again
+    InstrumentResult setConfig(const InstrumentConfig &config, const wasm::Module &source,
+                               const std::vector<uint32_t>* stack_ir = nullptr) noexcept;
     // do the general instrumentations with match-and-insert semantics
     // and validate the modified module
     // make sure that the stack is balanced after insertion to pass the validation
     InstrumentResult instrument(const std::vector<InstrumentOperation> &operations) noexcept;
+    // instrument() on the binaryen ir instead of the stack ir, so that optimize() can run afterwards
+    // pre fragments run after the operands of a matched expression, which are moved to locals,
+    // and see the last of them as stack context; post fragments see its result
+    // control flow targets are not supported, and the stack ir of functions in scope must not
+    // have been changed before, see stackIRModified(). their stack ir is generated again
+    // every site is checked before any function is changed, the module is unchanged on failure
+    InstrumentResult instrumentIR(const std::vector<InstrumentOperation> &operations) noexcept;
+    // run the binaryen optimization pipeline of -O<optimize_level> -s<shrink_level> on the
+    // module and generate the stack ir of all functions again, which would drop instructions
+    // made to the stack ir, so it is refused once stackIRModified() is not empty
+    // functions may be inlined and removed, the scope keeps those that are left
+    InstrumentResult optimize(int optimize_level = 2, int shrink_level = 0) noexcept;
     // write the module to binary file with name config.targetname
     InstrumentResult writeBinary() noexcept;
+    // write the module to /buffer/ instead of a file
+    InstrumentResult writeBinary(std::vector<char> &buffer) noexcept;
 
     // instrumenter can be re-used after call clear()
     void clear() {
@@ -63,6 +98,25 @@ public:
         delete this->module_;
         this->module_ = new wasm::Module();
         this->scopeClear();
+        this->resetStats();
+        this->invalidateAnalysis();
+        this->stack_ir_generations_.clear();
+        this->stack_ir_modified_.clear();
+        this->invalidateCallGraph();
+        this->original_lines_.clear();
+        this->original_funcs_.clear();
+    }
+
+    // statistics of phase timings, matches and inserted instructions
+    const InstrumentStats& getStats() const {
+        return this->stats_;
+    }
+    void resetStats() {
+        this->stats_ = InstrumentStats();
+    }
+    // dump phase timings in chrome trace json format
+    bool dumpTrace(const std::string &filename) const {
+        return this->stats_.dumpTrace(filename);
     }
 
     // below: return nullptr denotes add or get failed
@@ -138,6 +192,43 @@ public:
     wasm::Module*& getModule() {
         return this->module_;
     }
+    // validate the module as it is written, stack ir rewrites do not update
+    // the function bodies that BinaryenModuleValidate() checks
+    // writeBinary() does this once, see InstrumentConfig::validate_each for every call
+    bool validate() noexcept;
+
+    // blocks, dominators and loops of a function, built from its stack ir on first use
+    // and cached until the function is rewritten, nullptr if it cannot be built
+    // tools that replace or edit func->stackIR themselves must call stackIRChanged()
+    const StackAnalysis* getAnalysis(wasm::Function* func) noexcept;
+    // bump the stack ir generation of a function, cached analyses of older generations are rebuilt,
+    // and record that its stack ir no longer follows from its body
+    void stackIRChanged(const std::string &name) {
+        this->stack_ir_generations_[name]++;
+        this->stack_ir_modified_.insert(name);
+    }
+    // functions whose stack ir was changed after it was generated from the body,
+    // passes on the body would drop the changes. not reset by resetStats()
+    const std::set<std::string>& stackIRModified() const {
+        return this->stack_ir_modified_;
+    }
+    uint64_t stackIRGeneration(const std::string &name) const {
+        auto iter = this->stack_ir_generations_.find(name);
+        return (iter == this->stack_ir_generations_.end()) ? 0 : iter->second;
+    }
+    void invalidateAnalysis(const std::string &name) {
+        this->analyses_.erase(name);
+    }
+    void invalidateAnalysis() {
+        this->analyses_.clear();
+    }
+    // static call graph of the module, built on first use by a read-only parallel scan
+    // and cached until the module is changed through the instrumenter
+    // tools that change calls, exports or tables themselves should call invalidateCallGraph()
+    const CallGraph& callGraph() noexcept;
+    void invalidateCallGraph() {
+        this->call_graph_.reset();
+    }
 
     // insert instructions in operation.post_instructions after the line of pos
     // instructions are indexed from 1
@@ -147,6 +238,12 @@ public:
     InstrumentResult instrumentFunction(const InstrumentOperation &operation,
                                         const char* name,
                                         size_t pos) noexcept;
+    // instrumentFunction() for many insertions, operations[i] goes after the line positions[i]
+    // of function names[i], counted before any insertion; operations at the same line keep their order
+    // all operations are compiled at once and the module is validated once
+    InstrumentResult instrumentFunctions(const std::vector<InstrumentOperation> &operations,
+                                         const std::vector<std::string> &names,
+                                         const std::vector<size_t> &positions) noexcept;
     
 private:
     InstrumentConfig config_;
@@ -155,9 +252,32 @@ private:
     // record function names that should be instrumented
     // default contain all unimport functions from the original binary
     std::set<std::string> function_scope_;
+    InstrumentStats stats_;
+    // cached analyses by function name
+    std::map<std::string, std::unique_ptr<StackAnalysis>> analyses_;
+    // bumped by every rewrite of the stack ir of a function
+    std::map<std::string, uint64_t> stack_ir_generations_;
+    std::set<std::string> stack_ir_modified_;
+    std::unique_ptr<CallGraph> call_graph_;
+    // stack ir lines from 1 and indices of the functions as read, kept for the offset map
+    std::unordered_map<const wasm::StackInst*, uint32_t> original_lines_;
+    std::map<std::string, uint32_t> original_funcs_;
+
+    // the stack ir of a function was generated from its body again
+    void _stack_ir_regenerated(const std::string &name) {
+        this->stack_ir_generations_[name]++;
+        this->stack_ir_modified_.erase(name);
+    }
 
     InstrumentResult _read_file() noexcept;
+    // stack ir and scope of a newly read module, stack ir from the cache if given and valid
+    // /binary/ read back and validated
+    bool _validate_binary(const std::vector<char> &binary) noexcept;
+    void _prepare_module(const std::string &cache_file = "", const std::vector<uint32_t>* stack_ir = nullptr) noexcept;
     InstrumentResult _write_file() noexcept;
+    void _record_original_lines() noexcept;
+    // build the offset map of /binary/, the module as written, and save it to config.offset_map
+    bool _write_offset_map(const std::vector<char> &binary) noexcept;
 };
 
 std::string InstrumentResult2str(InstrumentResult result);
@@ -0,0 +1,195 @@
+#include "ir-instrument.hpp"
+#include <ir/eh-utils.h>
+#include <ir/iteration.h>
+#include <ir/utils.h>
+#include <map>
+#include <wasm-builder.h>
+#include <wasm-traversal.h>
+
+namespace wasm_instrument {
+
+bool _ir_operations_supported(const std::vector<InstrumentOperation> &operations) {
+    for (const auto &operation : operations) {
+        for (const auto &target : operation.targets) {
+            if (_isControlFlowStructure(target.id)) return false;
+        }
+    }
+    return true;
+}
+
+namespace {
+
+// matched expressions in post order, by the pointers to them in their parents
+struct SiteFinder : public wasm::PostWalker<SiteFinder, wasm::UnifiedExpressionVisitor<SiteFinder>> {
+    wasm::Module* module;
+    const std::vector<InstrumentOperation> &operations;
+    IRSites sites;
+
+    SiteFinder(wasm::Module* m, const std::vector<InstrumentOperation> &o) : module(m), operations(o) {}
+
+    void visitExpression(wasm::Expression* curr) {
+        // matched as the inst it becomes in the stack ir
+        wasm::StackInst inst(this->module->allocator);
+        inst.op = wasm::StackInst::Basic;
+        inst.origin = curr;
+        inst.type = curr->type;
+        for (size_t i = 0; i < this->operations.size(); i++) {
+            if (_exp_match_targets(&inst, this->operations[i].targets)) {
+                this->sites.emplace_back(this->getCurrentPointer(), i);
+                return;
+            }
+        }
+    }
+};
+
+// the params of a fragment body below /base/ are locals of the function, the next are
+// its stack context and go to /context/, the locals past them become new vars of /func/
+struct ContextMapper : public wasm::PostWalker<ContextMapper> {
+    wasm::Function* func;
+    wasm::Index base;
+    const std::vector<wasm::Index> &context;
+    const std::vector<wasm::Type> &vars;
+    std::map<wasm::Index, wasm::Index> added;
+
+    ContextMapper(wasm::Function* f, wasm::Index b, const std::vector<wasm::Index> &c, const std::vector<wasm::Type> &v)
+        : func(f), base(b), context(c), vars(v) {}
+
+    wasm::Index map(wasm::Index index) {
+        if (index < this->base) return index;
+        index -= this->base;
+        if (index < this->context.size()) return this->context[index];
+        index -= this->context.size();
+        // makeIROperations() rejects fragments with locals past their vars
+        assert(index < this->vars.size());
+        auto iter = this->added.find(index);
+        if (iter != this->added.end()) return iter->second;
+        auto var = wasm::Builder::addVar(this->func, this->vars[index]);
+        this->added[index] = var;
+        return var;
+    }
+    void visitLocalGet(wasm::LocalGet* curr) {
+        curr->index = this->map(curr->index);
+    }
+    void visitLocalSet(wasm::LocalSet* curr) {
+        curr->index = this->map(curr->index);
+    }
+};
+
+}
+
+static std::vector<wasm::Expression**> _children(wasm::Expression* expr) {
+    std::vector<wasm::Expression**> children;
+    for (auto &child : wasm::ChildIterator(expr)) children.push_back(&child);
+    return children;
+}
+
+static bool _has_unreachable_child(wasm::Expression* expr) {
+    for (auto child : _children(expr)) {
+        if ((*child)->type == wasm::Type::unreachable) return true;
+    }
+    return false;
+}
+
+// whether the stack contexts of /operation/ are the last children and the result of /expr/
+static bool _context_fits(wasm::Expression* expr, const InstrumentOperation &operation, const AddedExpression &added) {
+    if (added.pre_body != nullptr) {
+        const auto &context = operation.pre_instructions.stack_context;
+        auto children = _children(expr);
+        if (context.size() > children.size()) return false;
+        auto first = children.size() - context.size();
+        for (size_t i = 0; i < context.size(); i++) {
+            if ((*children[first + i])->type != context[i]) return false;
+        }
+    }
+    if (added.post_body != nullptr && expr->type != wasm::Type::unreachable) {
+        const auto &context = operation.post_instructions.stack_context;
+        if (expr->type == wasm::Type::none) return context.empty();
+        return context.size() == 1 && context[0] == expr->type;
+    }
+    return true;
+}
+
+static wasm::Expression* _copy_fragment(wasm::Module* m, wasm::Function* func, wasm::Expression* body,
+                                        size_t num_locals, const std::vector<wasm::Index> &context,
+                                        const std::vector<wasm::Type> &vars, size_t &inserted) {
+    auto copy = wasm::ExpressionManipulator::copy(body, *m);
+    ContextMapper mapper(func, static_cast<wasm::Index>(num_locals), context, vars);
+    mapper.walk(copy);
+    inserted += wasm::Measurer::measure(copy);
+    return copy;
+}
+
+bool _find_ir_sites(wasm::Module* m,
+                    wasm::Function* func,
+                    const std::vector<InstrumentOperation> &operations,
+                    const AddedExpressions &added,
+                    IRSites &sites) {
+    SiteFinder finder(m, operations);
+    finder.walk(func->body);
+    // rewriting does not change the types of children, so every site can be checked first
+    for (auto [ptr, op_num] : finder.sites) {
+        if (_has_unreachable_child(*ptr)) continue;
+        if (!_context_fits(*ptr, operations[op_num], added[op_num])) {
+            std::cerr << "_find_ir_sites() stack context of operation " << op_num
+                      << " does not fit in " << func->name << "!" << std::endl;
+            return false;
+        }
+    }
+    sites = std::move(finder.sites);
+    return true;
+}
+
+void _instrument_function_ir(wasm::Module* m,
+                             wasm::Function* func,
+                             const std::vector<InstrumentOperation> &operations,
+                             const AddedExpressions &added,
+                             const IRSites &sites,
+                             std::vector<size_t> &matches,
+                             size_t &inserted) {
+    wasm::Builder builder(*m);
+    bool changed = false;
+    // children before parents, a parent takes the wrapped children along
+    for (auto [ptr, op_num] : sites) {
+        auto expr = *ptr;
+        const auto &operation = operations[op_num];
+        const auto &fragments = added[op_num];
+        bool post = (fragments.post_body != nullptr) && (expr->type != wasm::Type::unreachable);
+        if (_has_unreachable_child(expr) || ((fragments.pre_body == nullptr) && !post)) continue;
+
+        std::vector<wasm::Expression*> list;
+        if (fragments.pre_body != nullptr) {
+            // all children are moved to locals to keep the order of evaluation
+            std::vector<wasm::Index> locals;
+            for (auto child : _children(expr)) {
+                auto type = (*child)->type;
+                auto index = wasm::Builder::addVar(func, type);
+                list.push_back(builder.makeLocalSet(index, *child));
+                *child = builder.makeLocalGet(index, type);
+                locals.push_back(index);
+            }
+            std::vector<wasm::Index> context(locals.end() - operation.pre_instructions.stack_context.size(), locals.end());
+            list.push_back(_copy_fragment(m, func, fragments.pre_body, operation.pre_instructions.local_types.size(),
+                                          context, fragments.pre_vars, inserted));
+        }
+        if (post && expr->type == wasm::Type::none) {
+            list.push_back(expr);
+            list.push_back(_copy_fragment(m, func, fragments.post_body, operation.post_instructions.local_types.size(),
+                                          {}, fragments.post_vars, inserted));
+        } else if (post) {
+            auto result = wasm::Builder::addVar(func, expr->type);
+            list.push_back(builder.makeLocalSet(result, expr));
+            list.push_back(_copy_fragment(m, func, fragments.post_body, operation.post_instructions.local_types.size(),
+                                          {result}, fragments.post_vars, inserted));
+            list.push_back(builder.makeLocalGet(result, expr->type));
+        } else {
+            list.push_back(expr);
+        }
+        *ptr = builder.makeBlock(list);
+        matches[op_num]++;
+        changed = true;
+    }
+    // a pop moved to a local must stay first in its catch
+    if (changed && m->features.hasExceptionHandling()) wasm::EHUtils::handleBlockNestedPops(func, *m);
+}
+
+}
@@ -0,0 +1,41 @@
+#ifndef ir_instrument_h
+#define ir_instrument_h
+
+#include "instr-utils.hpp"
+
+namespace wasm_instrument {
+
+// whether /operations/ can be done on binaryen ir, control flow targets cannot
+bool _ir_operations_supported(const std::vector<InstrumentOperation> &operations);
+
+// matched expressions of a body, by the pointers to them in their parents, and the operations
+using IRSites = std::vector<std::pair<wasm::Expression**, size_t>>;
+
+// the expressions of the body of /func/ that match /operations/ in post order, the first matching
+// operation of an expression wins. return false if a stack context does not fit a matched expression
+bool _find_ir_sites(wasm::Module* m,
+                    wasm::Function* func,
+                    const std::vector<InstrumentOperation> &operations,
+                    const AddedExpressions &added,
+                    IRSites &sites);
+
+// insert the fragments of /added/ at /sites/ of /func/ found by _find_ir_sites()
+// an expression E with pre and post fragments P and Q becomes
+//   (block (local.set $c1 child1) ... (local.set $cn childn)
+//          P (local.set $r E(local.get $c1 ... local.get $cn))
+//          Q (local.get $r))
+// so P runs after the children and sees the last of them as its stack context, and
+// Q sees the result of E. expressions with an unreachable child are skipped
+// matches[i] is increased by the sites of operations[i] and /inserted/ by the number of
+// inserted expressions
+void _instrument_function_ir(wasm::Module* m,
+                             wasm::Function* func,
+                             const std::vector<InstrumentOperation> &operations,
+                             const AddedExpressions &added,
+                             const IRSites &sites,
+                             std::vector<size_t> &matches,
+                             size_t &inserted);
+
+}
+
+#endif
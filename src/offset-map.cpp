@@ -0,0 +1,76 @@
+#include "offset-map.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+namespace wasm_instrument {
+
+// "WOFM" in little endian
+const uint32_t OFFSET_MAP_MAGIC = 0x4d464f57;
+const uint32_t OFFSET_MAP_VERSION = 1;
+const uint32_t OFFSET_MAP_LINE_MASK = (1u << 30) - 1;
+
+static void _put_u32(std::vector<char> &bytes, uint32_t value) {
+    for (int i = 0; i < 4; i++) bytes.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+static uint32_t _get_u32(const std::vector<char> &bytes, size_t pos) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= uint32_t(static_cast<uint8_t>(bytes[pos + i])) << (8 * i);
+    return value;
+}
+
+bool OffsetMap::save(const std::string &filename) const noexcept {
+    std::vector<char> bytes;
+    bytes.reserve(12 + 12 * this->entries.size());
+    _put_u32(bytes, OFFSET_MAP_MAGIC);
+    _put_u32(bytes, OFFSET_MAP_VERSION);
+    _put_u32(bytes, static_cast<uint32_t>(this->entries.size()));
+    for (const auto &entry : this->entries) {
+        _put_u32(bytes, entry.offset);
+        _put_u32(bytes, entry.func);
+        _put_u32(bytes, (uint32_t(entry.kind) << 30) | (entry.line & OFFSET_MAP_LINE_MASK));
+    }
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out.is_open() || !out.write(bytes.data(), bytes.size())) {
+        std::cerr << "OffsetMap: save() cannot write " << filename << "!" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool OffsetMap::load(const std::string &filename) noexcept {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) return false;
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (bytes.size() < 12 || _get_u32(bytes, 0) != OFFSET_MAP_MAGIC || _get_u32(bytes, 4) != OFFSET_MAP_VERSION) {
+        std::cerr << "OffsetMap: load() " << filename << " is not an offset map!" << std::endl;
+        return false;
+    }
+    size_t num = _get_u32(bytes, 8);
+    if (bytes.size() != 12 + 12 * num) {
+        std::cerr << "OffsetMap: load() " << filename << " is truncated!" << std::endl;
+        return false;
+    }
+    this->entries.resize(num);
+    for (size_t i = 0; i < num; i++) {
+        auto &entry = this->entries[i];
+        entry.offset = _get_u32(bytes, 12 + 12 * i);
+        entry.func = _get_u32(bytes, 16 + 12 * i);
+        auto word = _get_u32(bytes, 20 + 12 * i);
+        entry.line = word & OFFSET_MAP_LINE_MASK;
+        entry.kind = static_cast<OffsetKind>(std::min<uint32_t>(word >> 30, OffsetKind::offset_none));
+    }
+    return true;
+}
+
+const OffsetMapEntry* OffsetMap::lookup(uint32_t offset) const noexcept {
+    auto iter = std::upper_bound(this->entries.begin(), this->entries.end(), offset,
+                                 [](uint32_t o, const OffsetMapEntry &entry) { return o < entry.offset; });
+    // before the first body, or after the end of the code section
+    if (iter == this->entries.begin() || iter == this->entries.end()) return nullptr;
+    return &*(iter - 1);
+}
+
+}
@@ -0,0 +1,52 @@
+#ifndef offset_map_h
+#define offset_map_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace wasm_instrument {
+
+enum OffsetKind {
+    // an instruction of a stack ir line of the original function
+    offset_original = 0,
+    // instructions inserted after /line/ of the function, 0 for its beginning,
+    // or all of a function added by the instrumentation
+    offset_inserted,
+    // not an instruction of a line: local declarations, the final end, other
+    // sections, or a body whose instructions cannot be matched to lines
+    offset_none,
+};
+
+// a function without an index in the original binary
+const uint32_t OFFSET_MAP_NO_FUNC = ~0u;
+
+// /offset/ up to the offset of the next entry of the instrumented binary
+// comes from /line/ of function /func/ of the original binary
+// lines are the stack ir lines shown by wabidb-inspect
+struct OffsetMapEntry {
+    uint32_t offset;
+    uint32_t func;
+    uint32_t line;
+    OffsetKind kind;
+};
+
+// map from module offsets of an instrumented binary to the original code,
+// as reported by engines in stack traces and profiles
+// file layout (u32 in little endian):
+//   magic "WOFM", version, number of entries
+//   per entry: offset, function index, kind << 30 | line
+class OffsetMap final {
+public:
+    // sorted by offset, the last one ends the code section
+    std::vector<OffsetMapEntry> entries;
+
+    bool save(const std::string &filename) const noexcept;
+    bool load(const std::string &filename) noexcept;
+    // the entry that covers /offset/ by binary search, nullptr outside of the code section
+    const OffsetMapEntry* lookup(uint32_t offset) const noexcept;
+};
+
+}
+
+#endif
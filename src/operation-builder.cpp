@@ -1,4 +1,5 @@
 #include "operation-builder.hpp"
+#include <ir/find_all.h>
 #include <random>
 
 namespace wasm_instrument {
@@ -65,6 +66,42 @@ static std::string _make_func_str(const InstrumentFragment& fragment,
     return func_str;
 }
 
+// the stack context is passed in params after the locals and stored back to them,
+// so the body is an expression of type none that can be copied into any function
+static std::string _make_ir_func_str(const InstrumentFragment& fragment,
+                                     int func_num,
+                                     const std::string &random_prefix,
+                                     const std::string &suffix) {
+    auto params = fragment.local_types;
+    params.insert(params.end(), fragment.stack_context.begin(), fragment.stack_context.end());
+    std::string func_str = "(func $" + random_prefix + std::to_string(func_num) + suffix + _make_func_param(params) + "\n";
+    auto base = fragment.local_types.size();
+    for (size_t i = 0; i < fragment.stack_context.size(); i++) {
+        func_str += "local.get " + std::to_string(base + i) + "\n";
+    }
+    for (const auto& instr_str : fragment.instructions) {
+        func_str += instr_str;
+        func_str += "\n";
+    }
+    for (size_t i = fragment.stack_context.size(); i > 0; i--) {
+        func_str += "local.set " + std::to_string(base + i - 1) + "\n";
+    }
+    func_str += ")\n";
+    return func_str;
+}
+
+// whether every local of the body of /func/ is a param or var of it
+static bool _locals_in_range(wasm::Function* func) {
+    auto num = func->getNumLocals();
+    for (auto get : wasm::FindAll<wasm::LocalGet>(func->body).list) {
+        if (get->index >= num) return false;
+    }
+    for (auto set : wasm::FindAll<wasm::LocalSet>(func->body).list) {
+        if (set->index >= num) return false;
+    }
+    return true;
+}
+
 // transform two lists to a well-formed func string like .wat
 static std::string _makeFuncsString(const InstrumentFragment& pre_list, 
                         const InstrumentFragment& post_list,
@@ -76,67 +113,37 @@ static std::string _makeFuncsString(const InstrumentFragment& pre_list,
     return pre_func_str + post_func_str;
 }
 
-// transform all operations to a well-formed module string like .wat
-static void _makeModuleString(std::string& module_str, 
-                                const std::vector<InstrumentOperation>& operations, 
-                                const std::string& random_prefix)
+// transform all operations to well-formed func strings like .wat
+static std::string _makeFuncsStrings(const std::vector<InstrumentOperation>& operations,
+                                     const std::string& random_prefix)
 {
-    while (module_str.back() != ')') 
-        module_str.pop_back();
-    assert(module_str.back() == ')');
-    module_str.pop_back();
+    std::string funcs_str;
     int op_num = 1;
     for (const auto& operation : operations) {
-        module_str += _makeFuncsString(operation.pre_instructions, operation.post_instructions,
+        funcs_str += _makeFuncsString(operation.pre_instructions, operation.post_instructions,
                                     op_num, random_prefix);
         op_num++;
     }
-    module_str += ")";
+    return funcs_str;
 }
 
 // input operations and output the data structure of a vector of both pre_list and post_list
 // which can be used directly for class Instrumenter to do instrument()
 // this function is called by class Instrumenter when dealing with operations
+// the module is left as it was on failure
 // return nullptr aka InstrumentResult::instrument_error
 AddedInstructions* OperationBuilder::makeOperations(wasm::Module* &mallocator, const std::vector<InstrumentOperation> &operations) noexcept {
     AddedInstructions* added_instructions = new AddedInstructions;
     added_instructions->resize(operations.size());
     auto random_prefix = _random_prefix_generator();
-    
-    std::stringstream mstream;
-    auto is_color = Colors::isEnabled();
-    Colors::setEnabled(false);
-    // also do stack ir pass on the module
-    mallocator->typeNames.clear();
-    _out_stackir_module(mstream, mallocator);
-    std::string module_str = mstream.str();
-    std::string backup_str = module_str;
-
-    _makeModuleString(module_str, operations, random_prefix);
-
-    auto feature = mallocator->features;
-    delete mallocator;
-    mallocator = new wasm::Module();
-    mallocator->features.set(feature);
-    
-    if (!_readTextData(module_str, *(mallocator))) {
+
+    // fragments are compiled as functions against the declarations of the module
+    std::vector<wasm::Function*> funcs;
+    if (!_compileFunctions(mallocator, _makeFuncsStrings(operations, random_prefix), funcs)) {
         std::cerr << "OperationBuilder: makeOperations() read text error!" << std::endl;
         delete added_instructions;
-        Colors::setEnabled(is_color);
-        delete mallocator;
-        mallocator = new wasm::Module();
-        if (!_readTextData(backup_str, *(mallocator))) {
-            std::cerr << "OperationBuilder: makeOperations() cannot recover module! Further operations should end!" << std::endl;
-        }
         return nullptr;
     }
-    Colors::setEnabled(is_color);
-
-    // do stack ir pass on the module
-    wasm::PassRunner pass_runner(mallocator);
-    pass_runner.add("generate-stack-ir");
-    pass_runner.add("optimize-stack-ir");
-    pass_runner.run();
 
     for (int op_num = 0; op_num < operations.size(); op_num++) {
         std::string op_num_str = std::to_string(op_num + 1);
@@ -159,4 +166,45 @@ AddedInstructions* OperationBuilder::makeOperations(wasm::Module* &mallocator, c
     return added_instructions;
 }
 
+// same as makeOperations(), but keep the bodies of the fragment functions
+// the bodies stay in the arena of the module after the functions are removed
+AddedExpressions* OperationBuilder::makeIROperations(wasm::Module* &mallocator, const std::vector<InstrumentOperation> &operations) noexcept {
+    auto random_prefix = _random_prefix_generator();
+    std::string funcs_str;
+    for (size_t op_num = 0; op_num < operations.size(); op_num++) {
+        funcs_str += _make_ir_func_str(operations[op_num].pre_instructions, op_num + 1, random_prefix, "_1");
+        funcs_str += _make_ir_func_str(operations[op_num].post_instructions, op_num + 1, random_prefix, "_2");
+    }
+    std::vector<wasm::Function*> funcs;
+    if (!_compileFunctions(mallocator, funcs_str, funcs)) {
+        std::cerr << "OperationBuilder: makeIROperations() read text error!" << std::endl;
+        return nullptr;
+    }
+
+    AddedExpressions* added_expressions = new AddedExpressions(operations.size());
+    bool in_range = true;
+    for (size_t op_num = 0; op_num < operations.size(); op_num++) {
+        std::string op_num_str = std::to_string(op_num + 1);
+        auto func1 = mallocator->getFunction(random_prefix + op_num_str + "_1");
+        auto func2 = mallocator->getFunction(random_prefix + op_num_str + "_2");
+        in_range = in_range && _locals_in_range(func1) && _locals_in_range(func2);
+        if (!operations[op_num].pre_instructions.instructions.empty()) {
+            (*added_expressions)[op_num].pre_body = func1->body;
+            (*added_expressions)[op_num].pre_vars = func1->vars;
+        }
+        if (!operations[op_num].post_instructions.instructions.empty()) {
+            (*added_expressions)[op_num].post_body = func2->body;
+            (*added_expressions)[op_num].post_vars = func2->vars;
+        }
+        mallocator->removeFunction(func1->name);
+        mallocator->removeFunction(func2->name);
+    }
+    if (!in_range) {
+        std::cerr << "OperationBuilder: makeIROperations() local index out of range!" << std::endl;
+        delete added_expressions;
+        return nullptr;
+    }
+    return added_expressions;
+}
+
 }
\ No newline at end of file
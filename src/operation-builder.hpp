@@ -17,6 +17,8 @@ public:
     ~OperationBuilder() noexcept = default;
 
     AddedInstructions* makeOperations(wasm::Module* &mallocator, const std::vector<InstrumentOperation> &operations) noexcept;
+    // the fragments of /operations/ as binaryen ir, for Instrumenter::instrumentIR()
+    AddedExpressions* makeIROperations(wasm::Module* &mallocator, const std::vector<InstrumentOperation> &operations) noexcept;
 private:
 
 };
@@ -0,0 +1,129 @@
+#include "path-numbering.hpp"
+#include "stack-cfg.hpp"
+
+namespace wasm_instrument {
+
+bool numberPaths(size_t num_blocks,
+                 const std::vector<std::pair<size_t, size_t>> &edges,
+                 const std::vector<bool> &probeable,
+                 const std::vector<double> &weights,
+                 uint64_t max_paths,
+                 PathNumbering &numbering) noexcept {
+    if (num_blocks < 2) return false;
+    // dag node of the exit block
+    const size_t exit = num_blocks;
+    numbering.edges.clear();
+    numbering.edges.push_back(PathNumbering::Edge{0, 1, PathNumbering::entry, 0, 0, 0});
+    for (size_t e = 0; e < edges.size(); e++) {
+        auto from = edges[e].first;
+        auto to = edges[e].second;
+        if (to > from) {
+            numbering.edges.push_back(PathNumbering::Edge{from + 1, to + 1, PathNumbering::forward, e, 0, 0});
+            continue;
+        }
+        if (!probeable[e]) return false;
+        numbering.edges.push_back(PathNumbering::Edge{from + 1, exit, PathNumbering::back_exit, e, 0, 0});
+        numbering.edges.push_back(PathNumbering::Edge{0, to + 1, PathNumbering::back_entry, e, 0, 0});
+    }
+
+    // forward edges go to later blocks, so exit, ..., 1, 0 is a reverse topological order
+    std::vector<std::vector<size_t>> out(exit + 1);
+    for (size_t i = 0; i < numbering.edges.size(); i++) {
+        out[numbering.edges[i].from].push_back(i);
+    }
+    numbering.paths.assign(exit + 1, 0);
+    numbering.paths[exit] = 1;
+    for (size_t v = exit; v-- > 0;) {
+        uint64_t sum = 0;
+        for (auto i : out[v]) {
+            auto &edge = numbering.edges[i];
+            edge.val = sum;
+            sum += numbering.paths[edge.to];
+            if (sum > max_paths) return false;
+        }
+        numbering.paths[v] = sum;
+    }
+
+    // increments only on chords of a spanning tree, the code of the dummy edges
+    // is placed at their back edge anyway, so prefer them as chords
+    std::vector<std::pair<size_t, size_t>> dag_edges;
+    std::vector<bool> dag_probeable;
+    std::vector<double> dag_weights;
+    for (const auto &edge : numbering.edges) {
+        dag_edges.emplace_back(edge.from, edge.to);
+        switch (edge.kind) {
+            case PathNumbering::entry:
+                dag_probeable.push_back(true);
+                dag_weights.push_back(1.0);
+                break;
+            case PathNumbering::forward:
+                dag_probeable.push_back(probeable[edge.edge]);
+                dag_weights.push_back(weights[edge.edge]);
+                break;
+            default:
+                dag_probeable.push_back(true);
+                dag_weights.push_back(0.0);
+                break;
+        }
+    }
+    std::vector<bool> chord;
+    if (!selectProbeEdges(exit + 1, dag_edges, dag_probeable, dag_weights, chord)) return false;
+
+    // potentials along the tree, the virtual edge from exit to entry has val 0
+    std::vector<std::vector<size_t>> tree(exit + 1);
+    for (size_t i = 0; i < numbering.edges.size(); i++) {
+        if (chord[i]) continue;
+        tree[numbering.edges[i].from].push_back(i);
+        tree[numbering.edges[i].to].push_back(i);
+    }
+    std::vector<int64_t> potential(exit + 1, 0);
+    std::vector<bool> seen(exit + 1, false);
+    std::vector<size_t> worklist = {0, exit};
+    seen[0] = seen[exit] = true;
+    while (!worklist.empty()) {
+        auto v = worklist.back();
+        worklist.pop_back();
+        for (auto i : tree[v]) {
+            const auto &edge = numbering.edges[i];
+            auto other = (edge.from == v) ? edge.to : edge.from;
+            if (seen[other]) continue;
+            seen[other] = true;
+            auto val = static_cast<int64_t>(edge.val);
+            potential[other] = (edge.from == v) ? potential[v] + val : potential[v] - val;
+            worklist.push_back(other);
+        }
+    }
+    for (size_t i = 0; i < numbering.edges.size(); i++) {
+        auto &edge = numbering.edges[i];
+        edge.inc = chord[i] ? static_cast<int64_t>(edge.val) + potential[edge.from] - potential[edge.to] : 0;
+    }
+    return true;
+}
+
+bool decodePath(const PathNumbering &numbering, uint64_t id,
+                std::vector<size_t> &blocks, bool &from_loop, bool &to_loop) noexcept {
+    blocks.clear();
+    from_loop = false;
+    to_loop = false;
+    if (id >= numbering.numPaths()) return false;
+    const size_t exit = numbering.exitNode();
+    size_t v = 0;
+    while (v != exit) {
+        const PathNumbering::Edge* next = nullptr;
+        for (const auto &edge : numbering.edges) {
+            if (edge.from == v && edge.val <= id && id < edge.val + numbering.paths[edge.to]) {
+                next = &edge;
+                break;
+            }
+        }
+        if (next == nullptr) return false;
+        id -= next->val;
+        if (next->kind == PathNumbering::back_entry) from_loop = true;
+        if (next->kind == PathNumbering::back_exit) to_loop = true;
+        if (next->to != exit) blocks.push_back(next->to - 1);
+        v = next->to;
+    }
+    return true;
+}
+
+}
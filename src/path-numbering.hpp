@@ -0,0 +1,69 @@
+#ifndef path_numbering_h
+#define path_numbering_h
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace wasm_instrument {
+
+// Ball-Larus numbering of the acyclic paths of a cfg, given in the plain shape of
+// selectProbeEdges(): block 0 is the entry and num_blocks - 1 is the exit.
+// an edge to a block that is not after its source is a back edge, which ends a path
+// (as if it went to the exit) and starts a new one at the loop header
+struct PathNumbering {
+    enum EdgeKind {
+        // from the virtual entry to block 0
+        entry = 0,
+        // a forward edge of the cfg
+        forward,
+        // replaces a back edge: from its source to the exit
+        back_exit,
+        // replaces a back edge: from the virtual entry to the loop header
+        back_entry,
+    };
+    struct Edge {
+        // nodes of the dag, node 0 is the virtual entry, block b is node b + 1
+        size_t from;
+        size_t to;
+        EdgeKind kind;
+        // index in the edges of the cfg, 0 for the entry edge
+        size_t edge;
+        // sum of the edges on a path is its id
+        uint64_t val;
+        // sum of the increments on a path is its id as well,
+        // but only chords of a spanning tree are not 0
+        int64_t inc;
+    };
+
+    std::vector<Edge> edges;
+    // number of paths from each node to the exit
+    std::vector<uint64_t> paths;
+
+    uint64_t numPaths() const {
+        return this->paths.empty() ? 0 : this->paths[0];
+    }
+    size_t exitNode() const {
+        return this->paths.size() - 1;
+    }
+};
+
+// number the paths and place increments on edges that are probeable and light
+// back edges must be probeable, all edges to the exit are counted anyway
+// return false if there are more than /max_paths/ paths or probes cannot be placed
+bool numberPaths(size_t num_blocks,
+                 const std::vector<std::pair<size_t, size_t>> &edges,
+                 const std::vector<bool> &probeable,
+                 const std::vector<double> &weights,
+                 uint64_t max_paths,
+                 PathNumbering &numbering) noexcept;
+
+// the blocks on path /id/, /from_loop/ is set if the path starts at a loop header
+// after a back edge, /to_loop/ is set if it ends with a back edge
+bool decodePath(const PathNumbering &numbering, uint64_t id,
+                std::vector<size_t> &blocks, bool &from_loop, bool &to_loop) noexcept;
+
+}
+
+#endif
@@ -0,0 +1,146 @@
+#include "stack-analysis.hpp"
+#include <algorithm>
+#include <map>
+#include <set>
+
+namespace wasm_instrument {
+
+// reverse post order of the blocks reachable from the entry
+static std::vector<size_t> _reverse_post_order(const StackCFG &cfg) {
+    std::vector<size_t> order;
+    std::vector<bool> visited(cfg.blocks.size(), false);
+    // (block, next succ)
+    std::vector<std::pair<size_t, size_t>> stack = {{cfg.entry(), 0}};
+    visited[cfg.entry()] = true;
+    while (!stack.empty()) {
+        auto &[b, i] = stack.back();
+        if (i < cfg.blocks[b].succs.size()) {
+            auto next = cfg.edges[cfg.blocks[b].succs[i++]].to;
+            if (!visited[next]) {
+                visited[next] = true;
+                stack.emplace_back(next, 0);
+            }
+            continue;
+        }
+        order.push_back(b);
+        stack.pop_back();
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+static void _compute_dominators(const StackCFG &cfg, std::vector<size_t> &idom) {
+    const auto npos = StackAnalysis::npos;
+    auto rpo = _reverse_post_order(cfg);
+    std::vector<size_t> rpo_index(cfg.blocks.size(), npos);
+    for (size_t i = 0; i < rpo.size(); i++) rpo_index[rpo[i]] = i;
+    idom.assign(cfg.blocks.size(), npos);
+    idom[cfg.entry()] = cfg.entry();
+    auto intersect = [&](size_t a, size_t b) {
+        while (a != b) {
+            while (rpo_index[a] > rpo_index[b]) a = idom[a];
+            while (rpo_index[b] > rpo_index[a]) b = idom[b];
+        }
+        return a;
+    };
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < rpo.size(); i++) {
+            auto b = rpo[i];
+            size_t new_idom = npos;
+            for (auto e : cfg.blocks[b].preds) {
+                auto p = cfg.edges[e].from;
+                if (idom[p] == npos) continue;
+                new_idom = (new_idom == npos) ? p : intersect(p, new_idom);
+            }
+            if (new_idom != idom[b]) {
+                idom[b] = new_idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+static void _compute_loops(const StackAnalysis &analysis, std::vector<StackLoop> &loops,
+                           std::vector<size_t> &loop_of) {
+    const auto &cfg = analysis.cfg;
+    const auto npos = StackAnalysis::npos;
+    std::map<size_t, StackLoop> by_header;
+    for (size_t e = 0; e < cfg.edges.size(); e++) {
+        auto from = cfg.edges[e].from;
+        auto header = cfg.edges[e].to;
+        if (!analysis.dominates(header, from)) continue;
+        auto &loop = by_header[header];
+        loop.header = header;
+        loop.back_edges.push_back(e);
+        // walk back from the source of the back edge up to the header
+        std::vector<size_t> worklist = {from};
+        std::set<size_t> body(loop.blocks.begin(), loop.blocks.end());
+        body.insert(header);
+        while (!worklist.empty()) {
+            auto b = worklist.back();
+            worklist.pop_back();
+            if (!body.insert(b).second) continue;
+            for (auto p : cfg.blocks[b].preds) {
+                if (analysis.reachable(cfg.edges[p].from)) worklist.push_back(cfg.edges[p].from);
+            }
+        }
+        loop.blocks.assign(body.begin(), body.end());
+    }
+    loops.clear();
+    for (auto &[header, loop] : by_header) loops.push_back(std::move(loop));
+
+    // the parent is the smallest other loop that contains the header
+    std::vector<size_t> by_size(loops.size());
+    for (size_t i = 0; i < loops.size(); i++) by_size[i] = i;
+    std::stable_sort(by_size.begin(), by_size.end(), [&](size_t a, size_t b) {
+        return loops[a].blocks.size() > loops[b].blocks.size();
+    });
+    loop_of.assign(cfg.blocks.size(), npos);
+    for (auto l : by_size) {
+        auto &loop = loops[l];
+        loop.parent = loop_of[loop.header];
+        loop.depth = (loop.parent == npos) ? 1 : loops[loop.parent].depth + 1;
+        for (auto b : loop.blocks) loop_of[b] = l;
+    }
+}
+
+bool buildStackAnalysis(wasm::Function* func, StackAnalysis &analysis) noexcept {
+    const auto npos = StackAnalysis::npos;
+    if (!buildStackCFG(func, analysis.cfg)) return false;
+    const auto &cfg = analysis.cfg;
+    analysis.block_of.assign(cfg.insts.size(), npos);
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) analysis.block_of[i] = b;
+    }
+    _compute_dominators(cfg, analysis.idom);
+
+    // pre and post numbering of the dominator tree for dominates()
+    std::vector<std::vector<size_t>> children(cfg.blocks.size());
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        if (b != cfg.entry() && analysis.idom[b] != npos) children[analysis.idom[b]].push_back(b);
+    }
+    analysis.dom_pre_.assign(cfg.blocks.size(), npos);
+    analysis.dom_post_.assign(cfg.blocks.size(), npos);
+    size_t counter = 0;
+    std::vector<std::pair<size_t, size_t>> stack = {{cfg.entry(), 0}};
+    analysis.dom_pre_[cfg.entry()] = counter++;
+    while (!stack.empty()) {
+        auto &[b, i] = stack.back();
+        if (i < children[b].size()) {
+            auto c = children[b][i++];
+            analysis.dom_pre_[c] = counter++;
+            stack.emplace_back(c, 0);
+            continue;
+        }
+        analysis.dom_post_[b] = counter++;
+        stack.pop_back();
+    }
+
+    _compute_loops(analysis, analysis.loops, analysis.loop_of);
+    return true;
+}
+
+}
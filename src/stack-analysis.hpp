@@ -0,0 +1,65 @@
+#ifndef stack_analysis_h
+#define stack_analysis_h
+
+#include "stack-cfg.hpp"
+
+namespace wasm_instrument {
+
+// a natural loop, loops of wasm are reducible so they nest properly
+struct StackLoop {
+    // block that starts with the LoopBegin, it dominates all blocks of the loop
+    size_t header;
+    // blocks of the loop including the header, sorted
+    std::vector<size_t> blocks;
+    // edges back to the header
+    std::vector<size_t> back_edges;
+    // enclosing loop, StackAnalysis::npos for outermost loops
+    size_t parent;
+    // 1 for outermost loops
+    size_t depth;
+};
+
+// control flow structure of a function: blocks, dominators and the loop nest
+// use Instrumenter::getAnalysis() to get a cached one
+struct StackAnalysis {
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    StackCFG cfg;
+    // immediate dominator of each block, idom[entry] = entry, npos if unreachable
+    std::vector<size_t> idom;
+    // loops sorted by their header
+    std::vector<StackLoop> loops;
+    // innermost loop of each block or npos
+    std::vector<size_t> loop_of;
+    // block of each inst
+    std::vector<size_t> block_of;
+
+    bool reachable(size_t block) const {
+        return this->idom[block] != npos;
+    }
+    // a dominates b, every block dominates itself
+    bool dominates(size_t a, size_t b) const {
+        if (!this->reachable(a) || !this->reachable(b)) return false;
+        return this->dom_pre_[a] <= this->dom_pre_[b] && this->dom_post_[b] <= this->dom_post_[a];
+    }
+    // block of the inst at /line/ of the listing of wabidb-inspect (from 1)
+    size_t blockOfLine(size_t line) const {
+        return (line == 0 || line > this->block_of.size()) ? npos : this->block_of[line - 1];
+    }
+    // generation of the stack ir it was built from, see Instrumenter::stackIRChanged()
+    uint64_t generation = 0;
+
+private:
+    // numbering of the dominator tree
+    std::vector<size_t> dom_pre_;
+    std::vector<size_t> dom_post_;
+
+    friend bool buildStackAnalysis(wasm::Function* func, StackAnalysis &analysis) noexcept;
+};
+
+// return false if the cfg cannot be built, see buildStackCFG()
+bool buildStackAnalysis(wasm::Function* func, StackAnalysis &analysis) noexcept;
+
+}
+
+#endif
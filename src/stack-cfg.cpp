@@ -0,0 +1,446 @@
+#include "stack-cfg.hpp"
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include <set>
+
+namespace wasm_instrument {
+
+static bool _is_exception_handling(const wasm::StackInst* inst) {
+    switch (inst->op) {
+        case wasm::StackInst::TryBegin:
+        case wasm::StackInst::Catch:
+        case wasm::StackInst::CatchAll:
+        case wasm::StackInst::Delegate:
+        case wasm::StackInst::TryEnd:
+        case wasm::StackInst::TryTableBegin:
+        case wasm::StackInst::TryTableEnd:
+            return true;
+        default:
+            break;
+    }
+    auto id = inst->origin->_id;
+    return (id == wasm::Expression::Id::ThrowId) || (id == wasm::Expression::Id::RethrowId) ||
+        (id == wasm::Expression::Id::ThrowRefId);
+}
+
+static bool _is_return_call(const wasm::Expression* e) {
+    if (auto* call = e->dynCast<wasm::Call>()) return call->isReturn;
+    if (auto* call = e->dynCast<wasm::CallIndirect>()) return call->isReturn;
+    if (auto* call = e->dynCast<wasm::CallRef>()) return call->isReturn;
+    return false;
+}
+
+static bool _is_cond_branch(const wasm::StackInst* inst) {
+    if (inst->op != wasm::StackInst::Basic) return false;
+    if (auto* br = inst->origin->dynCast<wasm::Break>()) return br->condition != nullptr;
+    return inst->origin->_id == wasm::Expression::Id::BrOnId;
+}
+
+// control never falls through to the next inst
+static bool _is_transfer(const wasm::StackInst* inst) {
+    if (inst->op == wasm::StackInst::IfElse) return true;
+    if (inst->op != wasm::StackInst::Basic) return false;
+    auto e = inst->origin;
+    if (auto* br = e->dynCast<wasm::Break>()) return br->condition == nullptr;
+    return (e->_id == wasm::Expression::Id::SwitchId) || (e->_id == wasm::Expression::Id::ReturnId) ||
+        (e->_id == wasm::Expression::Id::UnreachableId) || _is_return_call(e);
+}
+
+bool buildStackCFG(wasm::Function* func, StackCFG &cfg) noexcept {
+    cfg = StackCFG();
+    if (func->stackIR == nullptr) return false;
+    for (auto inst : *(func->stackIR)) {
+        if (inst != nullptr) cfg.insts.push_back(inst);
+    }
+    const auto &insts = cfg.insts;
+    const size_t n = insts.size();
+
+    // match structure markers and collect branch targets
+    // a branch to a block goes to its end, a branch to a loop goes to its beginning
+    std::vector<size_t> scope_end(n, n);
+    std::vector<size_t> else_pos(n, n);
+    std::vector<size_t> if_of_else(n, n);
+    std::vector<size_t> loop_depth(n, 0);
+    std::map<wasm::Name, size_t> labels;
+    std::vector<size_t> scopes;
+    size_t depth = 0;
+    for (size_t i = 0; i < n; i++) {
+        auto inst = insts[i];
+        if (_is_exception_handling(inst)) return false;
+        switch (inst->op) {
+            case wasm::StackInst::LoopBegin:
+                depth++;
+                if (inst->origin->cast<wasm::Loop>()->name.is()) {
+                    labels[inst->origin->cast<wasm::Loop>()->name] = i;
+                }
+                [[fallthrough]];
+            case wasm::StackInst::BlockBegin:
+            case wasm::StackInst::IfBegin:
+                scopes.push_back(i);
+                break;
+            case wasm::StackInst::IfElse:
+                if (scopes.empty()) return false;
+                else_pos[scopes.back()] = i;
+                if_of_else[i] = scopes.back();
+                break;
+            case wasm::StackInst::BlockEnd:
+                if (inst->origin->cast<wasm::Block>()->name.is()) {
+                    labels[inst->origin->cast<wasm::Block>()->name] = i;
+                }
+                [[fallthrough]];
+            case wasm::StackInst::IfEnd:
+            case wasm::StackInst::LoopEnd:
+                if (scopes.empty()) return false;
+                scope_end[scopes.back()] = i;
+                scopes.pop_back();
+                break;
+            default:
+                break;
+        }
+        loop_depth[i] = depth;
+        if (inst->op == wasm::StackInst::LoopEnd) depth--;
+    }
+    if (!scopes.empty()) return false;
+
+    auto target_of = [&labels](wasm::Name name, size_t &target) {
+        auto iter = labels.find(name);
+        if (iter == labels.end()) return false;
+        target = iter->second;
+        return true;
+    };
+
+    // leaders: branch targets, joins of ifs, arms of ifs and insts after transfers
+    std::vector<bool> leader(n + 1, false);
+    leader[0] = true;
+    for (size_t i = 0; i < n; i++) {
+        auto inst = insts[i];
+        size_t target = 0;
+        switch (inst->op) {
+            case wasm::StackInst::IfBegin:
+            case wasm::StackInst::IfElse:
+                leader[i + 1] = true;
+                break;
+            case wasm::StackInst::IfEnd:
+                leader[i] = true;
+                break;
+            case wasm::StackInst::Basic:
+                if (auto* br = inst->origin->dynCast<wasm::Break>()) {
+                    if (!target_of(br->name, target)) return false;
+                    leader[target] = true;
+                    leader[i + 1] = true;
+                } else if (auto* sw = inst->origin->dynCast<wasm::Switch>()) {
+                    for (auto name : sw->targets) {
+                        if (!target_of(name, target)) return false;
+                        leader[target] = true;
+                    }
+                    if (!target_of(sw->default_, target)) return false;
+                    leader[target] = true;
+                    leader[i + 1] = true;
+                } else if (auto* br_on = inst->origin->dynCast<wasm::BrOn>()) {
+                    if (!target_of(br_on->name, target)) return false;
+                    leader[target] = true;
+                    leader[i + 1] = true;
+                } else if (_is_transfer(inst)) {
+                    leader[i + 1] = true;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    std::vector<size_t> block_of(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        if (leader[i]) {
+            cfg.blocks.emplace_back();
+            cfg.blocks.back().begin = i;
+            cfg.blocks.back().loop_depth = loop_depth[i];
+        }
+        cfg.blocks.back().end = i + 1;
+        block_of[i] = cfg.blocks.size() - 1;
+    }
+    if (n == 0) {
+        cfg.blocks.emplace_back();
+        cfg.blocks.back().begin = cfg.blocks.back().end = 0;
+    }
+    cfg.blocks.emplace_back();
+    cfg.blocks.back().begin = cfg.blocks.back().end = n;
+    const size_t exit = cfg.exit();
+
+    auto add_edge = [&cfg](size_t from, size_t to, StackEdgeKind kind, size_t inst) {
+        cfg.blocks[from].succs.push_back(cfg.edges.size());
+        cfg.blocks[to].preds.push_back(cfg.edges.size());
+        cfg.edges.push_back(StackCFG::Edge{from, to, kind, inst});
+    };
+    if (n == 0) {
+        add_edge(0, exit, StackEdgeKind::edge_exit, 0);
+        return true;
+    }
+    for (size_t b = 0; b < exit; b++) {
+        size_t last = cfg.blocks[b].end - 1;
+        auto inst = insts[last];
+        size_t next = (cfg.blocks[b].end < n) ? block_of[cfg.blocks[b].end] : exit;
+        size_t target = 0;
+        if (inst->op == wasm::StackInst::IfBegin) {
+            add_edge(b, block_of[last + 1], StackEdgeKind::edge_if_then, last);
+            if (else_pos[last] < n) {
+                add_edge(b, block_of[else_pos[last] + 1], StackEdgeKind::edge_if_else, else_pos[last]);
+            } else {
+                add_edge(b, block_of[scope_end[last]], StackEdgeKind::edge_if_else, scope_end[last]);
+            }
+        } else if (inst->op == wasm::StackInst::IfElse) {
+            add_edge(b, block_of[scope_end[if_of_else[last]]], StackEdgeKind::edge_branch, last);
+        } else if (inst->op != wasm::StackInst::Basic) {
+            add_edge(b, next, (next == exit) ? StackEdgeKind::edge_exit : StackEdgeKind::edge_fallthrough, last);
+        } else if (auto* br = inst->origin->dynCast<wasm::Break>()) {
+            target_of(br->name, target);
+            if (br->condition != nullptr) {
+                add_edge(b, block_of[target], StackEdgeKind::edge_cond_branch, last);
+                add_edge(b, next, (next == exit) ? StackEdgeKind::edge_exit : StackEdgeKind::edge_fallthrough, last);
+            } else {
+                add_edge(b, block_of[target], StackEdgeKind::edge_branch, last);
+            }
+        } else if (auto* sw = inst->origin->dynCast<wasm::Switch>()) {
+            std::set<size_t> targets;
+            for (auto name : sw->targets) {
+                target_of(name, target);
+                targets.insert(block_of[target]);
+            }
+            target_of(sw->default_, target);
+            targets.insert(block_of[target]);
+            for (auto t : targets) {
+                add_edge(b, t, (targets.size() == 1) ? StackEdgeKind::edge_branch : StackEdgeKind::edge_switch_branch, last);
+            }
+        } else if (auto* br_on = inst->origin->dynCast<wasm::BrOn>()) {
+            target_of(br_on->name, target);
+            add_edge(b, block_of[target], StackEdgeKind::edge_cond_branch, last);
+            add_edge(b, next, (next == exit) ? StackEdgeKind::edge_exit : StackEdgeKind::edge_fallthrough, last);
+        } else if (inst->origin->_id == wasm::Expression::Id::ReturnId || _is_return_call(inst->origin)) {
+            add_edge(b, exit, StackEdgeKind::edge_exit, last);
+        } else if (inst->origin->_id == wasm::Expression::Id::UnreachableId) {
+            add_edge(b, exit, StackEdgeKind::edge_trap, last);
+        } else {
+            add_edge(b, next, (next == exit) ? StackEdgeKind::edge_exit : StackEdgeKind::edge_fallthrough, last);
+        }
+    }
+    return true;
+}
+
+std::vector<size_t> findNoReturnBlocks(const StackCFG &cfg, const std::set<std::string> &no_return,
+                                       bool indirect) noexcept {
+    std::vector<size_t> ret;
+    for (size_t b = 0; b < cfg.exit(); b++) {
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+            auto inst = cfg.insts[i];
+            if (inst->op != wasm::StackInst::Basic || _is_return_call(inst->origin)) continue;
+            bool may_stay = false;
+            if (auto* call = inst->origin->dynCast<wasm::Call>()) {
+                may_stay = no_return.count(call->target.toString()) != 0;
+            } else if (inst->origin->is<wasm::CallIndirect>() || inst->origin->is<wasm::CallRef>()) {
+                may_stay = indirect;
+            }
+            if (may_stay) {
+                ret.push_back(b);
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+StackEdgeProbe findBlockProbe(const StackCFG &cfg, size_t block) noexcept {
+    const auto &b = cfg.blocks[block];
+    if (block == cfg.exit() || b.begin == b.end) return StackEdgeProbe();
+    // branches to a block or loop land after its marker
+    auto op = cfg.insts[b.begin]->op;
+    if (op == wasm::StackInst::LoopBegin || op == wasm::StackInst::BlockEnd || op == wasm::StackInst::IfEnd) {
+        return StackEdgeProbe{StackEdgeProbe::after, b.begin};
+    }
+    return StackEdgeProbe{StackEdgeProbe::before, b.begin};
+}
+
+StackEdgeProbe findEdgeProbe(const StackCFG &cfg, size_t edge) noexcept {
+    const auto &e = cfg.edges[edge];
+    const auto &from = cfg.blocks[e.from];
+    if (from.begin == from.end) return StackEdgeProbe();
+    size_t last = from.end - 1;
+    switch (e.kind) {
+        case StackEdgeKind::edge_if_then:
+            return StackEdgeProbe{StackEdgeProbe::after, e.inst};
+        case StackEdgeKind::edge_if_else:
+            if (cfg.insts[e.inst]->op == wasm::StackInst::IfElse) {
+                return StackEdgeProbe{StackEdgeProbe::after, e.inst};
+            }
+            return StackEdgeProbe{StackEdgeProbe::add_else, e.inst};
+        case StackEdgeKind::edge_cond_branch:
+            if (auto* br = cfg.insts[e.inst]->origin->dynCast<wasm::Break>()) {
+                if (br->value == nullptr) return StackEdgeProbe{StackEdgeProbe::wrap_br_if, e.inst};
+            }
+            break;
+        default:
+            // only the fall-through path passes right after a conditional branch
+            if (_is_cond_branch(cfg.insts[last])) {
+                return StackEdgeProbe{StackEdgeProbe::after, last};
+            }
+            break;
+    }
+    if (from.succs.size() == 1) {
+        if (_is_transfer(cfg.insts[last])) return StackEdgeProbe{StackEdgeProbe::before, last};
+        if (from.end < cfg.insts.size()) return StackEdgeProbe{StackEdgeProbe::before, from.end};
+        return StackEdgeProbe{StackEdgeProbe::after, last};
+    }
+    if (e.to != cfg.exit() && cfg.blocks[e.to].preds.size() == 1) {
+        return findBlockProbe(cfg, e.to);
+    }
+    return StackEdgeProbe();
+}
+
+void applyStackProbes(wasm::Module* m, wasm::Function* func, const StackCFG &cfg,
+                      const std::vector<StackProbeCode> &code) noexcept {
+    const size_t n = cfg.insts.size();
+    std::vector<std::vector<const StackProbeCode*>> before(n), after(n), add_else(n), wrap_br_if(n);
+    for (const auto &c : code) {
+        switch (c.probe.kind) {
+            case StackEdgeProbe::before: before[c.probe.inst].push_back(&c); break;
+            case StackEdgeProbe::after: after[c.probe.inst].push_back(&c); break;
+            case StackEdgeProbe::add_else: add_else[c.probe.inst].push_back(&c); break;
+            case StackEdgeProbe::wrap_br_if: wrap_br_if[c.probe.inst].push_back(&c); break;
+            default: break;
+        }
+    }
+    wasm::StackIR new_stack_ir;
+    auto emit = [&](const std::vector<const StackProbeCode*> &codes) {
+        for (auto c : codes) {
+            new_stack_ir.insert(new_stack_ir.end(), c->insts.begin(), c->insts.end());
+        }
+    };
+    for (size_t i = 0; i < n; i++) {
+        auto inst = cfg.insts[i];
+        emit(before[i]);
+        if (!add_else[i].empty()) {
+            // the if has no else-arm, run the code of its false edge in a new one
+            new_stack_ir.push_back(_make_stack_inst(wasm::StackInst::IfElse, inst->origin, m));
+            emit(add_else[i]);
+        }
+        if (!wrap_br_if[i].empty()) {
+            // br_if $l => if code br $l end, the stack ir writer resolves the depth of $l
+            auto br = inst->origin->cast<wasm::Break>();
+            auto iff = BinaryenIf(m, br->condition, BinaryenNop(m), nullptr);
+            auto new_br = BinaryenBreak(m, br->name.toString().c_str(), nullptr, nullptr);
+            new_stack_ir.push_back(_make_stack_inst(wasm::StackInst::IfBegin, iff, m));
+            emit(wrap_br_if[i]);
+            new_stack_ir.push_back(_make_stack_inst(wasm::StackInst::Basic, new_br, m));
+            new_stack_ir.push_back(_make_stack_inst(wasm::StackInst::IfEnd, iff, m));
+        } else {
+            new_stack_ir.push_back(inst);
+        }
+        emit(after[i]);
+    }
+    func->stackIR = std::make_unique<wasm::StackIR>(new_stack_ir);
+}
+
+static size_t _find(std::vector<size_t> &parent, size_t x) {
+    while (parent[x] != x) {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+    return x;
+}
+
+bool selectProbeEdges(size_t num_blocks,
+                      const std::vector<std::pair<size_t, size_t>> &edges,
+                      const std::vector<bool> &probeable,
+                      const std::vector<double> &weights,
+                      std::vector<bool> &probed) noexcept {
+    if (num_blocks == 0) return false;
+    std::vector<size_t> parent(num_blocks);
+    std::iota(parent.begin(), parent.end(), 0);
+    // the virtual edge from exit to entry is always in the tree
+    parent[_find(parent, num_blocks - 1)] = _find(parent, 0);
+
+    std::vector<size_t> order(edges.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (probeable[a] != probeable[b]) return !probeable[a];
+        return weights[a] > weights[b];
+    });
+    probed.assign(edges.size(), false);
+    for (auto e : order) {
+        auto u = _find(parent, edges[e].first);
+        auto v = _find(parent, edges[e].second);
+        if (u != v) {
+            parent[u] = v;
+        } else if (probeable[e]) {
+            probed[e] = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool solveEdgeCounts(size_t num_blocks,
+                     const std::vector<std::pair<size_t, size_t>> &edges,
+                     const std::vector<bool> &probed,
+                     std::vector<uint64_t> &counts) noexcept {
+    // the last one is the virtual edge from exit to entry
+    const size_t m = edges.size();
+    std::vector<std::pair<size_t, size_t>> all_edges(edges);
+    all_edges.emplace_back(num_blocks - 1, 0);
+    std::vector<int64_t> value(m + 1, 0);
+    std::vector<bool> known(m + 1, false);
+    std::vector<std::vector<size_t>> incident(num_blocks);
+    std::vector<size_t> unknown(num_blocks, 0);
+    for (size_t e = 0; e <= m; e++) {
+        if (e < m && probed[e]) {
+            known[e] = true;
+            value[e] = static_cast<int64_t>(counts[e]);
+        }
+        incident[all_edges[e].first].push_back(e);
+        if (all_edges[e].second != all_edges[e].first) incident[all_edges[e].second].push_back(e);
+        if (!known[e]) {
+            unknown[all_edges[e].first]++;
+            if (all_edges[e].second != all_edges[e].first) unknown[all_edges[e].second]++;
+        }
+    }
+
+    std::vector<size_t> worklist;
+    for (size_t v = 0; v < num_blocks; v++) {
+        if (unknown[v] == 1) worklist.push_back(v);
+    }
+    while (!worklist.empty()) {
+        auto v = worklist.back();
+        worklist.pop_back();
+        if (unknown[v] != 1) continue;
+        // inflow equals outflow
+        int64_t in = 0, out = 0;
+        size_t target = m + 1;
+        for (auto e : incident[v]) {
+            if (!known[e]) {
+                target = e;
+                continue;
+            }
+            if (all_edges[e].second == v) in += value[e];
+            if (all_edges[e].first == v) out += value[e];
+        }
+        if (target > m || all_edges[target].first == all_edges[target].second) continue;
+        value[target] = (all_edges[target].second == v) ? (out - in) : (in - out);
+        known[target] = true;
+        for (auto u : {all_edges[target].first, all_edges[target].second}) {
+            unknown[u]--;
+            if (unknown[u] == 1) worklist.push_back(u);
+        }
+    }
+
+    counts.resize(m);
+    bool solved = true;
+    for (size_t e = 0; e < m; e++) {
+        // a negative count means that flow left a block by no edge
+        if (!known[e] || value[e] < 0) solved = false;
+        counts[e] = static_cast<uint64_t>(std::max<int64_t>(0, value[e]));
+    }
+    return solved;
+}
+
+}
@@ -0,0 +1,129 @@
+#ifndef stack_cfg_h
+#define stack_cfg_h
+
+#include "instr-utils.hpp"
+#include <set>
+
+namespace wasm_instrument {
+
+enum StackEdgeKind {
+    // falls into the next block
+    edge_fallthrough = 0,
+    // br, or the end of a then-arm jumping over the else-arm
+    edge_branch,
+    // taken edge of br_if / br_on_*
+    edge_cond_branch,
+    // one of the targets of br_table
+    edge_switch_branch,
+    // if condition true
+    edge_if_then,
+    // if condition false, to the else-arm or to the end of the if
+    edge_if_else,
+    // return, return_call or falling off the end of the function
+    edge_exit,
+    // unreachable, to the exit block
+    edge_trap,
+};
+
+// control flow graph of a function built from its stack ir
+// blocks are ranges of insts, which are the non-null stack insts of the function,
+// so insts[i] is line i + 1 in the listing of wabidb-inspect
+struct StackCFG {
+    struct Block {
+        // [begin, end) of insts
+        size_t begin;
+        size_t end;
+        // number of loops that enclose the block
+        size_t loop_depth = 0;
+        // edge indices
+        std::vector<size_t> preds;
+        std::vector<size_t> succs;
+    };
+    struct Edge {
+        size_t from;
+        size_t to;
+        StackEdgeKind kind;
+        // the inst that makes the edge, e.g. the br_if or the if
+        size_t inst;
+    };
+
+    std::vector<wasm::StackInst*> insts;
+    // blocks[0] is the entry, the last block is a virtual exit block without insts
+    std::vector<Block> blocks;
+    std::vector<Edge> edges;
+
+    size_t entry() const {
+        return 0;
+    }
+    size_t exit() const {
+        return this->blocks.size() - 1;
+    }
+};
+
+// return false if the function has no stack ir or uses exception handling
+bool buildStackCFG(wasm::Function* func, StackCFG &cfg) noexcept;
+
+// where to insert code that runs exactly when an edge is taken
+struct StackEdgeProbe {
+    enum Kind {
+        // the edge cannot be probed without restructuring
+        none = 0,
+        // insert before insts[inst]
+        before,
+        // insert after insts[inst]
+        after,
+        // replace the br_if insts[inst] with: if probe br end
+        wrap_br_if,
+        // add an else-arm with the probe before the IfEnd insts[inst]
+        add_else,
+    };
+    Kind kind = Kind::none;
+    size_t inst = 0;
+};
+
+StackEdgeProbe findEdgeProbe(const StackCFG &cfg, size_t edge) noexcept;
+// insert position that runs on every entry into a block (not the exit block)
+StackEdgeProbe findBlockProbe(const StackCFG &cfg, size_t block) noexcept;
+
+// blocks with a call that may not come back, to one of /no_return/ or, if /indirect/,
+// through call_indirect or call_ref (see CallGraph::noReturn()). a frame that is still
+// at such a call when the program exits, e.g. by proc_exit, leaves its block without
+// taking an edge, so flow conservation needs an edge from each of them to the exit
+std::vector<size_t> findNoReturnBlocks(const StackCFG &cfg, const std::set<std::string> &no_return,
+                                       bool indirect) noexcept;
+
+// code to be inserted at a probe, it must leave the stack unchanged
+struct StackProbeCode {
+    StackEdgeProbe probe;
+    std::vector<wasm::StackInst*> insts;
+};
+
+// rebuild the stack ir of /func/ with the code of each probe found in /cfg/
+// code at the same probe is inserted in order
+void applyStackProbes(wasm::Module* m, wasm::Function* func, const StackCFG &cfg,
+                      const std::vector<StackProbeCode> &code) noexcept;
+
+// below: work on the plain shape of a cfg so they can be used on the host side
+// an implicit edge from exit (num_blocks - 1) to entry (0) closes the flow
+
+// select edges to be probed (chords of a maximum spanning tree), so that
+// all edge counts can be derived from theirs. edges with higher weights are kept
+// in the tree if possible. return false if edges that are not probeable form a cycle
+bool selectProbeEdges(size_t num_blocks,
+                      const std::vector<std::pair<size_t, size_t>> &edges,
+                      const std::vector<bool> &probeable,
+                      const std::vector<double> &weights,
+                      std::vector<bool> &probed) noexcept;
+
+// derive counts of all edges from counts of the probed ones by flow conservation
+// counts[e] is read for probed edges and written for the others
+// return false if some edge cannot be derived, or if the counts do not conserve flow,
+// e.g. because edges to the exit from findNoReturnBlocks() are missing
+bool solveEdgeCounts(size_t num_blocks,
+                     const std::vector<std::pair<size_t, size_t>> &edges,
+                     const std::vector<bool> &probed,
+                     std::vector<uint64_t> &counts) noexcept;
+
+}
+
+#endif
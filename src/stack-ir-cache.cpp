@@ -0,0 +1,169 @@
+#include "stack-ir-cache.hpp"
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wasm-traversal.h>
+
+namespace wasm_instrument {
+
+// "WSIR" in little endian
+const uint32_t STACK_IR_CACHE_MAGIC = 0x52495357;
+// bumped whenever the layout or the enumeration changes, the number of
+// expression ids guards against a different binaryen
+const uint32_t STACK_IR_CACHE_VERSION = (1u << 16) | wasm::Expression::Id::NumExpressionIds;
+const uint32_t STACK_IR_NOT_CACHED = ~0u;
+const size_t STACK_IR_HEADER_WORDS = 7;
+
+uint64_t hashBytes(const char* data, size_t size) noexcept {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+bool hashFile(const std::string &filename, uint64_t &hash, size_t &size) noexcept {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) return false;
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    hash = hashBytes(bytes.data(), bytes.size());
+    size = bytes.size();
+    return true;
+}
+
+namespace {
+
+// all expressions of a body in post order
+struct ExpressionList : public wasm::PostWalker<ExpressionList, wasm::UnifiedExpressionVisitor<ExpressionList>> {
+    std::vector<wasm::Expression*> list;
+    void visitExpression(wasm::Expression* curr) {
+        this->list.push_back(curr);
+    }
+};
+
+}
+
+static std::vector<uint32_t> _make_header(uint64_t hash, size_t size, wasm::Module* m, uint32_t num_funcs) {
+    return {STACK_IR_CACHE_MAGIC, STACK_IR_CACHE_VERSION,
+            static_cast<uint32_t>(hash), static_cast<uint32_t>(hash >> 32),
+            static_cast<uint32_t>(size), static_cast<uint32_t>(m->features), num_funcs};
+}
+
+static uint32_t _num_defined_functions(wasm::Module* m) {
+    uint32_t num = 0;
+    iterDefinedFunctions(m, [&num](wasm::Function*) { num++; });
+    return num;
+}
+
+std::vector<uint32_t> encodeStackIR(uint64_t hash, size_t size, wasm::Module* m) noexcept {
+    auto words = _make_header(hash, size, m, _num_defined_functions(m));
+    std::vector<uint32_t> insts;
+    iterDefinedFunctions(m, [&](wasm::Function* func) {
+        ExpressionList walker;
+        walker.walk(func->body);
+        words.push_back(static_cast<uint32_t>(walker.list.size()));
+        if (func->stackIR == nullptr) {
+            words.push_back(STACK_IR_NOT_CACHED);
+            return;
+        }
+        std::unordered_map<wasm::Expression*, uint32_t> index;
+        for (size_t i = 0; i < walker.list.size(); i++) index[walker.list[i]] = static_cast<uint32_t>(i);
+        std::vector<uint32_t> func_insts;
+        for (auto inst : *(func->stackIR)) {
+            if (inst == nullptr) continue;
+            auto iter = index.find(inst->origin);
+            if (iter == index.end()) {
+                // an origin outside of the body, generate it again when loading
+                func_insts.clear();
+                words.push_back(STACK_IR_NOT_CACHED);
+                return;
+            }
+            func_insts.push_back(inst->op);
+            func_insts.push_back(iter->second);
+        }
+        words.push_back(static_cast<uint32_t>(func_insts.size() / 2));
+        insts.insert(insts.end(), func_insts.begin(), func_insts.end());
+    });
+    words.insert(words.end(), insts.begin(), insts.end());
+    return words;
+}
+
+bool saveStackIRCache(const std::string &cache_file, uint64_t hash, size_t size, wasm::Module* m) noexcept {
+    auto words = encodeStackIR(hash, size, m);
+    // written next to the final name and renamed, so a reader never maps a partial file
+    auto temp_file = cache_file + ".tmp" + std::to_string(getpid());
+    std::ofstream out(temp_file, std::ios::binary | std::ios::trunc);
+    if (!out.is_open() ||
+        !out.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint32_t))) {
+        std::cerr << "saveStackIRCache() cannot write " << cache_file << "!" << std::endl;
+        unlink(temp_file.c_str());
+        return false;
+    }
+    out.close();
+    return rename(temp_file.c_str(), cache_file.c_str()) == 0;
+}
+
+bool loadStackIRCache(const std::string &cache_file, uint64_t hash, size_t size, wasm::Module* m) noexcept {
+    int fd = open(cache_file.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(STACK_IR_HEADER_WORDS * sizeof(uint32_t))) {
+        close(fd);
+        return false;
+    }
+    size_t bytes = static_cast<size_t>(st.st_size);
+    void* mapped = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+    bool valid = decodeStackIR(static_cast<const uint32_t*>(mapped), bytes / sizeof(uint32_t), hash, size, m);
+    munmap(mapped, bytes);
+    return valid;
+}
+
+bool decodeStackIR(const uint32_t* words, size_t num_words, uint64_t hash, size_t size, wasm::Module* m) noexcept {
+    if (num_words < STACK_IR_HEADER_WORDS) return false;
+    auto num_funcs = _num_defined_functions(m);
+    auto header = _make_header(hash, size, m, num_funcs);
+    bool valid = std::equal(header.begin(), header.end(), words);
+    size_t table = STACK_IR_HEADER_WORDS;
+    size_t pos = table + 2 * num_funcs;
+    valid = valid && pos <= num_words;
+    std::vector<wasm::Function*> loaded;
+    iterDefinedFunctions(m, [&](wasm::Function* func) {
+        if (!valid) return;
+        uint32_t num_exprs = words[table++];
+        uint32_t num_insts = words[table++];
+        if (num_insts == STACK_IR_NOT_CACHED) return;
+        ExpressionList walker;
+        walker.walk(func->body);
+        if (walker.list.size() != num_exprs || pos + 2 * size_t(num_insts) > num_words) {
+            valid = false;
+            return;
+        }
+        auto stack_ir = std::make_unique<wasm::StackIR>();
+        stack_ir->reserve(num_insts);
+        for (uint32_t i = 0; i < num_insts; i++, pos += 2) {
+            auto op = words[pos];
+            auto origin = words[pos + 1];
+            if (op > wasm::StackInst::TryTableEnd || origin >= num_exprs) {
+                valid = false;
+                return;
+            }
+            stack_ir->push_back(_make_stack_inst(static_cast<wasm::StackInst::Op>(op), walker.list[origin], m));
+        }
+        func->stackIR = std::move(stack_ir);
+        loaded.push_back(func);
+    });
+    if (!valid) {
+        for (auto func : loaded) func->stackIR.reset();
+        return false;
+    }
+    return true;
+}
+
+}
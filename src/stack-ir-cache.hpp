@@ -0,0 +1,37 @@
+#ifndef stack_ir_cache_h
+#define stack_ir_cache_h
+
+#include "instr-utils.hpp"
+
+namespace wasm_instrument {
+
+// fnv-1a hash of file contents, false if the file cannot be read
+bool hashFile(const std::string &filename, uint64_t &hash, size_t &size) noexcept;
+uint64_t hashBytes(const char* data, size_t size) noexcept;
+
+// a sidecar file with the optimized stack ir of every defined function of a module,
+// so that loading the same binary again skips stack ir generation and optimization
+//
+// binaryen has no serialized form of its ir, so the binary is still parsed; an inst is
+// stored as its op and the post-order index of its origin in the function body, which is
+// the same for the same input bytes and features. layout (u32 in native byte order):
+//   header: magic "WSIR", version, hash lo, hash hi, input size, features, number of functions
+//   per defined function: number of expressions in the body, number of insts (or ~0 if not cached)
+//   then the (op, origin index) pairs of all functions in order
+// so the file can be mapped and read in place
+bool saveStackIRCache(const std::string &cache_file, uint64_t hash, size_t size, wasm::Module* m) noexcept;
+
+// fill func->stackIR of defined functions from /cache_file/
+// return false, with no stack ir set, if the file is missing or stale
+// functions that were not cached are left without stack ir
+bool loadStackIRCache(const std::string &cache_file, uint64_t hash, size_t size, wasm::Module* m) noexcept;
+
+// the same layout in memory, e.g. for a module kept resident whose copies take its stack ir,
+// which wasm::ModuleUtils::copyModule() drops, instead of generating their own
+// /hash/ and /size/ may be 0 if the words never leave the process
+std::vector<uint32_t> encodeStackIR(uint64_t hash, size_t size, wasm::Module* m) noexcept;
+bool decodeStackIR(const uint32_t* words, size_t num_words, uint64_t hash, size_t size, wasm::Module* m) noexcept;
+
+}
+
+#endif
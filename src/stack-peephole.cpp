@@ -0,0 +1,264 @@
+#include "stack-peephole.hpp"
+#include <optional>
+#include <wasm-builder.h>
+
+namespace wasm_instrument {
+
+using Insts = std::vector<wasm::StackInst*>;
+
+static bool _int_const(const wasm::StackInst* inst, wasm::Literal &value) {
+    if (inst->op != wasm::StackInst::Basic) return false;
+    auto c = inst->origin->dynCast<wasm::Const>();
+    if (c == nullptr || !c->type.isInteger()) return false;
+    value = c->value;
+    return true;
+}
+
+static wasm::Binary* _binary(const wasm::StackInst* inst) {
+    if (inst->op != wasm::StackInst::Basic) return nullptr;
+    return inst->origin->dynCast<wasm::Binary>();
+}
+
+static std::optional<wasm::Literal> _eval(wasm::BinaryOp op, const wasm::Literal &a, const wasm::Literal &b) {
+    switch (op) {
+        case wasm::AddInt32: case wasm::AddInt64: return a.add(b);
+        case wasm::SubInt32: case wasm::SubInt64: return a.sub(b);
+        case wasm::MulInt32: case wasm::MulInt64: return a.mul(b);
+        case wasm::AndInt32: case wasm::AndInt64: return a.and_(b);
+        case wasm::OrInt32: case wasm::OrInt64: return a.or_(b);
+        case wasm::XorInt32: case wasm::XorInt64: return a.xor_(b);
+        case wasm::ShlInt32: case wasm::ShlInt64: return a.shl(b);
+        case wasm::ShrUInt32: case wasm::ShrUInt64: return a.shrU(b);
+        default: return std::nullopt;
+    }
+}
+
+// x op c == x
+static bool _is_identity(wasm::BinaryOp op, const wasm::Literal &c) {
+    int64_t value = c.getInteger();
+    int64_t shift_mask = c.type == wasm::Type::i32 ? 31 : 63;
+    switch (op) {
+        case wasm::AddInt32: case wasm::AddInt64:
+        case wasm::SubInt32: case wasm::SubInt64:
+        case wasm::OrInt32: case wasm::OrInt64:
+        case wasm::XorInt32: case wasm::XorInt64:
+            return value == 0;
+        case wasm::ShlInt32: case wasm::ShlInt64:
+        case wasm::ShrUInt32: case wasm::ShrUInt64:
+        case wasm::ShrSInt32: case wasm::ShrSInt64:
+            return (value & shift_mask) == 0;
+        case wasm::MulInt32: case wasm::MulInt64:
+            return value == 1;
+        case wasm::AndInt32: case wasm::AndInt64:
+            return value == -1;
+        default:
+            return false;
+    }
+}
+
+static bool _is_add(wasm::BinaryOp op) {
+    return op == wasm::AddInt32 || op == wasm::AddInt64;
+}
+static bool _is_sub(wasm::BinaryOp op) {
+    return op == wasm::SubInt32 || op == wasm::SubInt64;
+}
+
+// rewrite the end of /out/ once, false if nothing matches
+static bool _fold_tail(wasm::Module* m, Insts &out) {
+    wasm::Builder builder(*m);
+    auto n = out.size();
+    wasm::Literal a, b;
+    // const a; const b; binop
+    if (n >= 3 && _int_const(out[n - 3], a) && _int_const(out[n - 2], b)) {
+        auto bin = _binary(out[n - 1]);
+        std::optional<wasm::Literal> value;
+        if (bin != nullptr && a.type == b.type && bin->type == a.type) value = _eval(bin->op, a, b);
+        if (value) {
+            out.resize(n - 3);
+            out.push_back(_make_stack_inst(wasm::StackInst::Basic, builder.makeConst(*value), m));
+            return true;
+        }
+    }
+    // const a; add; const b; add
+    if (n >= 4 && _int_const(out[n - 4], a) && _int_const(out[n - 2], b) && a.type == b.type) {
+        auto first = _binary(out[n - 3]);
+        auto second = _binary(out[n - 1]);
+        if (first != nullptr && second != nullptr && first->type == a.type && second->type == a.type &&
+            (_is_add(first->op) || _is_sub(first->op)) && (_is_add(second->op) || _is_sub(second->op))) {
+            auto zero = wasm::Literal::makeZero(a.type);
+            auto sum = (_is_sub(first->op) ? zero.sub(a) : a).add(_is_sub(second->op) ? zero.sub(b) : b);
+            auto add = _is_add(first->op) ? out[n - 3] : _is_add(second->op) ? out[n - 1] : nullptr;
+            auto c = builder.makeConst(sum);
+            if (add == nullptr) {
+                auto op = a.type == wasm::Type::i32 ? wasm::AddInt32 : wasm::AddInt64;
+                add = _make_stack_inst(wasm::StackInst::Basic, builder.makeBinary(op, first->left, c), m);
+            }
+            out.resize(n - 4);
+            out.push_back(_make_stack_inst(wasm::StackInst::Basic, c, m));
+            out.push_back(add);
+            return true;
+        }
+    }
+    // const c; binop that keeps its left operand
+    if (n >= 2 && _int_const(out[n - 2], b)) {
+        auto bin = _binary(out[n - 1]);
+        if (bin != nullptr && bin->type == b.type && _is_identity(bin->op, b)) {
+            out.resize(n - 2);
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t _fold_constants(wasm::Module* m, Insts &insts) {
+    size_t folded = 0;
+    Insts out;
+    out.reserve(insts.size());
+    for (auto inst : insts) {
+        out.push_back(inst);
+        while (_fold_tail(m, out)) folded++;
+    }
+    insts.swap(out);
+    return folded;
+}
+
+static size_t _fuse_tees(wasm::Module* m, wasm::Function* func, Insts &insts) {
+    wasm::Builder builder(*m);
+    size_t fused = 0;
+    Insts out;
+    out.reserve(insts.size());
+    for (auto inst : insts) {
+        if (!out.empty() && out.back()->op == wasm::StackInst::Basic && inst->op == wasm::StackInst::Basic) {
+            auto set = out.back()->origin->dynCast<wasm::LocalSet>();
+            auto get = inst->origin->dynCast<wasm::LocalGet>();
+            if (set != nullptr && !set->isTee() && get != nullptr && get->index == set->index) {
+                auto type = func->getLocalType(set->index);
+                out.back() = _make_stack_inst(wasm::StackInst::Basic,
+                                              builder.makeLocalTee(set->index, set->value, type), m);
+                fused++;
+                continue;
+            }
+        }
+        out.push_back(inst);
+    }
+    insts.swap(out);
+    return fused;
+}
+
+// a global can only be changed by a global.set or a call, and a value teed in
+// straight-line code reaches every later inst until control flow joins
+static bool _ends_region(const wasm::StackInst* inst) {
+    if (inst->op != wasm::StackInst::Basic) return true;
+    switch (inst->origin->_id) {
+        case wasm::Expression::Id::CallId:
+        case wasm::Expression::Id::CallIndirectId:
+        case wasm::Expression::Id::CallRefId:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static wasm::Name _global_of(const wasm::StackInst* inst) {
+    if (auto get = inst->origin->dynCast<wasm::GlobalGet>()) return get->name;
+    if (auto set = inst->origin->dynCast<wasm::GlobalSet>()) return set->name;
+    return wasm::Name();
+}
+
+static size_t _forward_globals(wasm::Module* m, wasm::Function* func, Insts &insts) {
+    // index of the inst that holds the current value of a global in this region
+    std::map<wasm::Name, size_t> sources;
+    // gets to replace, by the index of their source
+    std::map<size_t, size_t> redundant;
+    std::set<size_t> used_sources;
+    for (size_t i = 0; i < insts.size(); i++) {
+        auto inst = insts[i];
+        if (_ends_region(inst)) {
+            sources.clear();
+            continue;
+        }
+        auto name = _global_of(inst);
+        if (!name.is() || !m->getGlobal(name)->type.isNumber()) continue;
+        auto source = sources.find(name);
+        if (inst->origin->is<wasm::GlobalGet>() && source != sources.end()) {
+            redundant[i] = source->second;
+            used_sources.insert(source->second);
+        } else {
+            sources[name] = i;
+        }
+    }
+    if (redundant.empty()) return 0;
+
+    wasm::Builder builder(*m);
+    // one new local per global
+    std::map<wasm::Name, wasm::Index> locals;
+    auto local_of = [&](wasm::Name name) {
+        auto iter = locals.find(name);
+        if (iter != locals.end()) return iter->second;
+        auto index = wasm::Builder::addVar(func, m->getGlobal(name)->type);
+        locals[name] = index;
+        return index;
+    };
+    Insts out;
+    out.reserve(insts.size() + used_sources.size());
+    for (size_t i = 0; i < insts.size(); i++) {
+        auto inst = insts[i];
+        auto name = _global_of(inst);
+        auto type = name.is() ? m->getGlobal(name)->type : wasm::Type::none;
+        if (redundant.count(i)) {
+            out.push_back(_make_stack_inst(wasm::StackInst::Basic, builder.makeLocalGet(local_of(name), type), m));
+        } else if (used_sources.count(i)) {
+            auto set = inst->origin->dynCast<wasm::GlobalSet>();
+            auto value = set != nullptr ? set->value : inst->origin;
+            auto tee = _make_stack_inst(wasm::StackInst::Basic, builder.makeLocalTee(local_of(name), value, type), m);
+            if (set != nullptr) out.push_back(tee);
+            out.push_back(inst);
+            if (set == nullptr) out.push_back(tee);
+        } else {
+            out.push_back(inst);
+        }
+    }
+    insts.swap(out);
+    return redundant.size();
+}
+
+bool peepholeFunction(wasm::Module* m, wasm::Function* func, PeepholeResult &result) noexcept {
+    if (func->imported() || func->stackIR == nullptr) return false;
+    Insts insts;
+    insts.reserve(func->stackIR->size());
+    for (auto inst : *(func->stackIR)) {
+        if (inst != nullptr) insts.push_back(inst);
+    }
+    auto folded = _fold_constants(m, insts);
+    auto fused = _fuse_tees(m, func, insts);
+    auto forwarded = _forward_globals(m, func, insts);
+    if (folded + fused + forwarded == 0) return false;
+    func->stackIR = std::make_unique<wasm::StackIR>(std::move(insts));
+    result.folded_constants += folded;
+    result.fused_tees += fused;
+    result.forwarded_globals += forwarded;
+    result.functions++;
+    return true;
+}
+
+bool peepholeOptimize(Instrumenter &instrumenter, const std::vector<std::string> &names,
+                      PeepholeResult &result) noexcept {
+    result = PeepholeResult();
+    auto module = instrumenter.getModule();
+    std::vector<std::string> targets = names;
+    if (targets.empty()) {
+        const auto &modified = instrumenter.stackIRModified();
+        targets.assign(modified.begin(), modified.end());
+    }
+    for (const auto &name : targets) {
+        auto func = module->getFunctionOrNull(name);
+        if (func == nullptr || func->imported() || func->stackIR == nullptr) {
+            std::cerr << "peepholeOptimize() invalid function: " << name << "!" << std::endl;
+            return false;
+        }
+        if (peepholeFunction(module, func, result)) instrumenter.stackIRChanged(name);
+    }
+    return true;
+}
+
+}
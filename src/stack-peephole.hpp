@@ -0,0 +1,38 @@
+#ifndef stack_peephole_h
+#define stack_peephole_h
+
+#include "instrumenter.hpp"
+
+namespace wasm_instrument {
+
+// numbers of rewrites done by the peephole optimizer
+struct PeepholeResult {
+    size_t functions = 0;
+    // i32/i64 arithmetic on constants folded or dropped
+    size_t folded_constants = 0;
+    // local.set x; local.get x made local.tee x
+    size_t fused_tees = 0;
+    // global.get replaced by a local.get of the value read or written before
+    size_t forwarded_globals = 0;
+};
+
+// clean up what the splicing of fragments leaves in the stack ir of /func/:
+// - const a; const b; binop => const (a binop b), for add sub mul and or xor shl shr_u
+// - const a; add; const b; add => const (a + b); add, sub included
+// - const 0; add, const 1; mul and the like are dropped
+// - local.set x; local.get x => local.tee x
+// - a global of number type read again in straight-line code, with no call or
+//   control flow in between, is read from a new local that the first read or a set tees
+// origins of the existing insts are not changed, new insts get new expressions
+// return whether the stack ir of /func/ changed
+bool peepholeFunction(wasm::Module* m, wasm::Function* func, PeepholeResult &result) noexcept;
+
+// peepholeFunction() on /names/, or on the functions whose stack ir was changed
+// (Instrumenter::stackIRModified()) if /names/ is empty. changed functions are reported
+// to the instrumenter by stackIRChanged()
+bool peepholeOptimize(Instrumenter &instrumenter, const std::vector<std::string> &names,
+                      PeepholeResult &result) noexcept;
+
+}
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef counter_region_h
+#define counter_region_h
+#include <fstream>
+#include "tool-common.hpp"
+#include "frag-builder.hpp"
+
+namespace wasm_instrument {
+
+// header of a dumped counters file, followed by /count/ u64 counters
+// "WPRF" in little endian
+const uint32_t COUNTER_MAGIC = 0x46525057;
+const uint32_t COUNTER_VERSION = 1;
+
+// an array of i64 counters in linear memory, grown by the start function
+// and dumped to /filename/ in the preopened current directory at exit
+// (when _start returns, before proc_exit, or when the host calls <prefix>_dump)
+// counter i is at <prefix>_base + 8 * i
+class CounterRegion final {
+public:
+    CounterRegion(const std::string &prefix, const std::string &filename)
+        : prefix_(prefix), filename_(filename) {}
+
+    // add imports, memory, globals, data segments, the init and dump functions
+    // and functions in /names/ and /bodies/, hook the start function and _start
+    // call it before inserting counters, which refer to the globals added here
+    bool prepare(Instrumenter &instrumenter,
+                 std::vector<std::string> names = {},
+                 std::vector<std::string> bodies = {}) noexcept {
+        add_wasi_imports(instrumenter, this->wasm_builder_);
+        auto memory = instrumenter.getMemory();
+        if (memory == nullptr) {
+            memory = instrumenter.addMemory("mem", false, 0, wasm::Memory::kMaxSize32);
+            if (memory == nullptr) return false;
+        }
+        this->memory_name_ = memory->name.toString();
+        if (memory->is64()) {
+            std::cerr << "CounterRegion: prepare() 64-bit memory is not supported!" << std::endl;
+            return false;
+        }
+        // base is set in init, others are filled in by finish()
+        if (instrumenter.addGlobal(this->name("_base").c_str(), BinaryenTypeInt32(), true, BinaryenLiteralInt32(-1)) == nullptr ||
+            instrumenter.addGlobal(this->name("_pages").c_str(), BinaryenTypeInt32(), false, BinaryenLiteralInt32(0)) == nullptr ||
+            instrumenter.addGlobal(this->name("_count").c_str(), BinaryenTypeInt32(), false, BinaryenLiteralInt32(0)) == nullptr ||
+            instrumenter.addGlobal(this->name("_scratch").c_str(), BinaryenTypeInt32(), false, BinaryenLiteralInt32(0)) == nullptr) {
+            return false;
+        }
+        std::string filename = this->filename_ + '\0';
+        if (instrumenter.addPassiveDateSegment(this->name("_rodata").c_str(), ".\00", 2) == nullptr ||
+            instrumenter.addPassiveDateSegment(this->name("_filename").c_str(), filename.c_str(), filename.size()) == nullptr) {
+            return false;
+        }
+
+        auto module = instrumenter.getModule();
+        std::string orig_start = module->start.is() ? module->start.toString() : "";
+        std::string orig_entry = "";
+        auto entry = instrumenter.getStartFunction();
+        if (entry != nullptr && entry->getParams() == wasm::Type::none && entry->getResults() == wasm::Type::none) {
+            orig_entry = entry->name.toString();
+        }
+        for (auto helper : {"__instr_memcmp", "__instr_get_cwd_fd", "__instr_fopen_rw"}) {
+            if (instrumenter.getFunction(helper) != nullptr) continue;
+            names.push_back(helper);
+            bodies.push_back(this->wasm_builder_.getWasmFunction(helper).value());
+        }
+        names.push_back(this->name("_init"));
+        bodies.push_back(this->_make_init_func());
+        names.push_back(this->name("_dump"));
+        bodies.push_back(this->_make_dump_func());
+        if (!orig_start.empty()) {
+            names.push_back(this->name("_start_init"));
+            bodies.push_back("(func $" + this->name("_start_init") + "\ncall $" + this->name("_init") +
+                             "\ncall $" + orig_start + "\n)");
+        }
+        if (!orig_entry.empty()) {
+            names.push_back(this->name("_start"));
+            bodies.push_back("(func $" + this->name("_start") + "\ncall $" + orig_entry +
+                             "\ncall $" + this->name("_dump") + "\n)");
+        }
+        if (!instrumenter.addFunctions(names, bodies)) return false;
+
+        module = instrumenter.getModule();
+        module->start = orig_start.empty() ? this->name("_init") : this->name("_start_init");
+        if (!orig_entry.empty()) {
+            instrumenter.getExport("_start")->value = this->name("_start");
+        }
+        if (instrumenter.getExport(this->name("_dump").c_str()) == nullptr) {
+            instrumenter.addExport(wasm::ModuleItemKind::Function, this->name("_dump").c_str(), this->name("_dump").c_str());
+        }
+        return true;
+    }
+
+    // counter[index] += 1 as a single load/add/store
+    std::vector<wasm::StackInst*> makeCounterInsts(wasm::Module* m, uint32_t index) const {
+        auto base = this->name("_base");
+        auto offset = index * 8;
+        std::vector<wasm::StackInst*> insts;
+        Frag(m).globalGet(base).globalGet(base)
+            .i64Load(offset, this->memory_name_)
+            .i64Const(1).i64Add()
+            .i64Store(offset, this->memory_name_)
+            .build(insts);
+        return insts;
+    }
+
+    // insert a dump before every call to proc_exit in functions in scope, or in all functions
+    void hookProcExit(Instrumenter &instrumenter, bool scope_only = true) const {
+        auto module = instrumenter.getModule();
+        wasm::Name proc_exit_name(this->wasm_builder_.getWasiName("proc_exit").value());
+        auto dump_name = this->name("_dump");
+        auto func_visitor = [&](wasm::Function* func) {
+            if (scope_only && !instrumenter.scopeContains(func->name.toString())) return;
+            assert(func->stackIR != nullptr);
+            bool found = false;
+            for (auto inst : *(func->stackIR)) {
+                if (inst != nullptr && inst->origin->_id == wasm::Expression::Id::CallId &&
+                    inst->origin->cast<wasm::Call>()->target == proc_exit_name) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) return;
+            std::list<wasm::StackInst*> stack_ir_list = _stack_ir_vec2list(*(func->stackIR.get()));
+            for (auto iter = stack_ir_list.begin(); iter != stack_ir_list.end(); iter++) {
+                auto origin = (*iter)->origin;
+                if (origin->_id != wasm::Expression::Id::CallId ||
+                    origin->cast<wasm::Call>()->target != proc_exit_name) continue;
+                auto dump = BinaryenCall(module, dump_name.c_str(), nullptr, 0, BinaryenTypeNone());
+                stack_ir_list.insert(iter, _make_stack_inst(wasm::StackInst::Basic, dump, module));
+            }
+            func->stackIR = std::make_unique<wasm::StackIR>(_stack_ir_list2vec(stack_ir_list));
+            instrumenter.stackIRChanged(func->name.toString());
+        };
+        iterDefinedFunctions(module, func_visitor);
+    }
+
+    // fill in the size of the region, raise the memory maximum and validate
+    bool finish(Instrumenter &instrumenter, uint32_t count) const noexcept {
+        auto module = instrumenter.getModule();
+        uint32_t scratch = (count * 8 + 15) / 16 * 16;
+        uint32_t pages = (scratch + SCRATCH_SIZE + PAGE_BYTES - 1) / PAGE_BYTES;
+        auto set_init = [module](const std::string &name, uint32_t value) {
+            module->getGlobal(name)->init = BinaryenConst(module, BinaryenLiteralInt32(static_cast<int32_t>(value)));
+        };
+        set_init(this->name("_count"), count);
+        set_init(this->name("_scratch"), scratch);
+        set_init(this->name("_pages"), pages);
+        auto memory = instrumenter.getMemory(this->memory_name_.c_str());
+        if (memory->imported()) {
+            std::cerr << "CounterRegion: finish() memory is imported, make sure it can grow "
+                      << pages << " more pages!" << std::endl;
+        } else if (memory->hasMax()) {
+            memory->max = std::min(static_cast<uint64_t>(memory->max + pages), static_cast<uint64_t>(wasm::Memory::kMaxSize32));
+        }
+        return instrumenter.validate();
+    }
+
+    static bool readCounters(const std::string &filename, size_t num, std::vector<uint64_t> &counters) {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in.is_open()) {
+            std::cerr << "CounterRegion: cannot open counters " << filename << "!" << std::endl;
+            return false;
+        }
+        uint32_t header[4];
+        if (!in.read(reinterpret_cast<char*>(header), sizeof(header)) ||
+            header[0] != COUNTER_MAGIC || header[1] != COUNTER_VERSION) {
+            std::cerr << "CounterRegion: bad counters file " << filename << "!" << std::endl;
+            return false;
+        }
+        if (header[2] != num) {
+            std::cerr << "CounterRegion: counters do not match the map: " << header[2] << " vs " << num << "!" << std::endl;
+            return false;
+        }
+        counters.resize(num);
+        if (!in.read(reinterpret_cast<char*>(counters.data()), num * sizeof(uint64_t))) {
+            std::cerr << "CounterRegion: truncated counters file " << filename << "!" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    std::string name(const char* suffix) const {
+        return this->prefix_ + suffix;
+    }
+    const std::string& memoryName() const {
+        return this->memory_name_;
+    }
+    const CommonWasmBuilder& wasmBuilder() const {
+        return this->wasm_builder_;
+    }
+
+private:
+    // bytes after the counters used by dump
+    static constexpr uint32_t SCRATCH_SIZE = 4096;
+    static constexpr uint32_t PAGE_BYTES = 65536;
+
+    std::string prefix_;
+    std::string filename_;
+    std::string memory_name_;
+    CommonWasmBuilder wasm_builder_;
+
+    std::string _make_init_func() const {
+        return "(func $" + this->name("_init") + " (local i32)\n"
+            "global.get $" + this->name("_base") + "\n"
+            "i32.const -1\n"
+            "i32.ne\n"
+            "if\n"
+            "return\n"
+            "end\n"
+            "global.get $" + this->name("_pages") + "\n"
+            "memory.grow\n"
+            "local.tee 0\n"
+            "i32.const -1\n"
+            "i32.eq\n"
+            "if\n"
+            "unreachable\n"
+            "end\n"
+            "local.get 0\n"
+            "i32.const 65536\n"
+            "i32.mul\n"
+            "global.set $" + this->name("_base") + "\n"
+            ")";
+    }
+
+    // write header and counters to the file, give up silently on errors as the program is exiting
+    // scratch layout (from base + scratch):
+    // 0 ".", 16 ciovecs, 48 nwritten, 64 file name, 128 header, 256 fd and prestat
+    std::string _make_dump_func() const {
+        auto base = "global.get $" + this->name("_base") + "\n";
+        return "(func $" + this->name("_dump") + " (local i32 i32)\n" +
+            base +
+            "i32.const -1\n"
+            "i32.eq\n"
+            "if\n"
+            "return\n"
+            "end\n" +
+            base +
+            "global.get $" + this->name("_scratch") + "\n"
+            "i32.add\n"
+            "local.set 0\n"
+            // strings
+            "local.get 0\n"
+            "i32.const 0\n"
+            "i32.const 2\n"
+            "memory.init $" + this->name("_rodata") + "\n"
+            "local.get 0\n"
+            "i32.const 64\n"
+            "i32.add\n"
+            "i32.const 0\n"
+            "i32.const " + std::to_string(this->filename_.size() + 1) + "\n"
+            "memory.init $" + this->name("_filename") + "\n"
+            // header
+            "local.get 0\n"
+            "i32.const " + std::to_string(COUNTER_MAGIC) + "\n"
+            "i32.store offset=128\n"
+            "local.get 0\n"
+            "i32.const " + std::to_string(COUNTER_VERSION) + "\n"
+            "i32.store offset=132\n"
+            "local.get 0\n"
+            "global.get $" + this->name("_count") + "\n"
+            "i32.store offset=136\n"
+            "local.get 0\n"
+            "i32.const 0\n"
+            "i32.store offset=140\n"
+            // ciovecs of header and counters
+            "local.get 0\n"
+            "local.get 0\n"
+            "i32.const 128\n"
+            "i32.add\n"
+            "i32.store offset=16\n"
+            "local.get 0\n"
+            "i32.const 16\n"
+            "i32.store offset=20\n"
+            "local.get 0\n" +
+            base +
+            "i32.store offset=24\n"
+            "local.get 0\n"
+            "global.get $" + this->name("_count") + "\n"
+            "i32.const 8\n"
+            "i32.mul\n"
+            "i32.store offset=28\n"
+            // open and write
+            "local.get 0\n"
+            "local.get 0\n"
+            "i32.const 256\n"
+            "i32.add\n"
+            "call $__instr_get_cwd_fd\n"
+            "if\n"
+            "return\n"
+            "end\n"
+            "local.get 0\n"
+            "i32.load offset=256\n"
+            "local.get 0\n"
+            "i32.const 64\n"
+            "i32.add\n"
+            "i32.const " + std::to_string(this->filename_.size()) + "\n"
+            "local.get 0\n"
+            "i32.const 256\n"
+            "i32.add\n"
+            "call $__instr_fopen_rw\n"
+            "if\n"
+            "return\n"
+            "end\n"
+            "local.get 0\n"
+            "i32.load offset=256\n"
+            "local.tee 1\n"
+            "local.get 0\n"
+            "i32.const 16\n"
+            "i32.add\n"
+            "i32.const 2\n"
+            "local.get 0\n"
+            "i32.const 48\n"
+            "i32.add\n"
+            "call $" + this->wasm_builder_.getWasiName("fd_write").value() + "\n"
+            "drop\n"
+            "local.get 1\n"
+            "call $" + this->wasm_builder_.getWasiName("fd_close").value() + "\n"
+            "drop\n"
+            ")";
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef tool_common_h
+#define tool_common_h
+#include <cassert>
+#include "instrumenter.hpp"
+#include "common_wasm_func.hpp"
+
+namespace wasm_instrument {
+
+struct WasiImport {
+    const char* name;
+    std::vector<BinaryenType> params;
+    BinaryenType results;
+};
+
+// reuse the import if the module already has one, and record its name in wasm_builder
+inline void _add_wasi_imports(Instrumenter &instrumenter, CommonWasmBuilder &wasm_builder,
+                              const std::vector<WasiImport> &wasi_funcs) {
+    for (const auto &wasi : wasi_funcs) {
+        std::string internal_name = std::string("__imported_wasi_snapshot_preview1_") + wasi.name;
+        auto func = instrumenter.getImport(wasm::ModuleItemKind::Function, wasi.name);
+        if (func == nullptr) {
+            auto params = BinaryenTypeCreate(const_cast<BinaryenType*>(wasi.params.data()), wasi.params.size());
+            instrumenter.addImportFunction(internal_name.c_str(), "wasi_snapshot_preview1", wasi.name,
+                                           params, wasi.results);
+            wasm_builder.updateWasiName(wasi.name, internal_name);
+        } else {
+            if (func->hasExplicitName) {
+                wasm_builder.updateWasiName(wasi.name, func->name.toString());
+            } else {
+                func->setExplicitName(internal_name);
+                wasm_builder.updateWasiName(wasi.name, internal_name);
+            }
+        }
+    }
+}
+
+// import the WASI functions used by the functions in CommonWasmBuilder
+inline void add_wasi_imports(Instrumenter &instrumenter, CommonWasmBuilder &wasm_builder) {
+    const BinaryenType i32 = BinaryenTypeInt32();
+    const BinaryenType i64 = BinaryenTypeInt64();
+    _add_wasi_imports(instrumenter, wasm_builder, {
+        {"fd_prestat_get", {i32, i32}, i32},
+        {"fd_prestat_dir_name", {i32, i32, i32}, i32},
+        {"path_open", {i32, i32, i32, i32, i32, i64, i64, i32, i32}, i32},
+        {"fd_write", {i32, i32, i32, i32}, i32},
+        {"fd_close", {i32}, i32},
+        {"proc_exit", {i32}, BinaryenTypeNone()},
+    });
+}
+
+// import environ_sizes_get and environ_get for reading options at startup
+inline void add_wasi_environ_imports(Instrumenter &instrumenter, CommonWasmBuilder &wasm_builder) {
+    const BinaryenType i32 = BinaryenTypeInt32();
+    _add_wasi_imports(instrumenter, wasm_builder, {
+        {"environ_sizes_get", {i32, i32}, i32},
+        {"environ_get", {i32, i32}, i32},
+    });
+}
+
+// preopen the current directory and replace the .wasm file in cmd by wasm_file
+inline void modify_runtime_command(std::string &cmd, const std::string &wasm_file) {
+    if ((cmd.find("--dir=.") == std::string::npos) && (cmd.find(R"("--dir=.")") == std::string::npos)) {
+        auto pos = cmd.find(" ");
+        if (pos == std::string::npos) {
+            cmd += " --dir=.";
+        } else {
+            cmd.insert(pos, " --dir=.");
+        }
+    }
+    auto pos = cmd.find(".wasm");
+    if (pos == std::string::npos) {
+        cmd += " ";
+        cmd += wasm_file;
+    } else {
+        auto start_pos = cmd.rfind(" ", pos);
+        assert(start_pos != std::string::npos);
+        while (cmd[start_pos] == ' ') start_pos++;
+        cmd.replace(start_pos, pos + 5 - start_pos, wasm_file);
+    }
+}
+
+// return the exit code of the runtime
+inline int run_runtime_command(const std::string &cmd) {
+    int return_code = system(cmd.c_str());
+    return ((return_code) & 0xff00) >> 8;
+}
+
+}
+
+#endif
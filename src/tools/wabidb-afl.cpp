@@ -0,0 +1,208 @@
+#include "instrumenter.hpp"
+#include <random>
+#include <tools/tool-options.h>
+#include <tools/tool-utils.h>
+#include "counter-region.hpp"
+#include "frag-builder.hpp"
+#include "stack-cfg.hpp"
+using namespace wasm_instrument;
+
+enum AflExitCode {
+    exit_success = 0,
+    exit_usage_error,
+    exit_load_error,
+    exit_instrument_error,
+};
+
+// afl/libfuzzer compatible 8-bit edge hit counts
+const uint32_t AFL_MAP_SIZE = 65536;
+const char* AFL_MAP_MEMORY = "__afl_map";
+const char* AFL_MAP_FILE = "__afl_map.bin";
+const char* AFL_PREV_LOC = "__afl_prev_loc";
+const char* AFL_RESET = "__afl_reset";
+
+// where the map lives
+struct AflMap {
+    // a separate memory exported as __afl_map, at address 0
+    bool separate;
+    // the memory of the map and its base, as in CounterRegion
+    std::string memory;
+    std::string base;
+};
+
+// map[prev_loc ^ cur_loc]++; prev_loc = cur_loc >> 1
+static std::vector<wasm::StackInst*> _make_afl_insts(wasm::Module* m, const AflMap &map,
+                                                     BinaryenIndex tmp, uint32_t cur_loc) {
+    Frag frag(m);
+    frag.globalGet(AFL_PREV_LOC).i32Const(static_cast<int32_t>(cur_loc)).i32Xor();
+    if (!map.separate) frag.globalGet(map.base).i32Add();
+    frag.localTee(tmp, wasm::Type::i32).localGet(tmp, wasm::Type::i32)
+        .load(1, false, 0, wasm::Type::i32, map.memory)
+        .i32Const(1).i32Add()
+        .store(1, 0, wasm::Type::i32, map.memory)
+        .i32Const(static_cast<int32_t>(cur_loc >> 1)).globalSet(AFL_PREV_LOC);
+    std::vector<wasm::StackInst*> insts;
+    frag.build(insts);
+    return insts;
+}
+
+static std::string _make_reset_func(const AflMap &map) {
+    std::string base = map.separate ? "i32.const 0\n" : "global.get $" + map.base + "\n";
+    std::string mem = map.separate ? std::string(" $") + AFL_MAP_MEMORY : "";
+    return std::string("(func $") + AFL_RESET + "\n"
+        "i32.const 0\n"
+        "global.set $" + AFL_PREV_LOC + "\n" +
+        base +
+        "i32.const 0\n"
+        "i32.const " + std::to_string(AFL_MAP_SIZE) + "\n"
+        "memory.fill" + mem + "\n"
+        ")";
+}
+
+// instrument the entry of every block of functions in scope, return the number of sites
+static size_t do_afl_instrument(Instrumenter &instrumenter, bool separate, uint32_t seed, AflMap &map) {
+    map.separate = separate;
+    CounterRegion region("__afl", AFL_MAP_FILE);
+    if (instrumenter.addGlobal(AFL_PREV_LOC, BinaryenTypeInt32(), true, BinaryenLiteralInt32(0)) == nullptr) {
+        return 0;
+    }
+    if (separate) {
+        auto pages = static_cast<int>(AFL_MAP_SIZE / 65536);
+        if (instrumenter.addMemory(AFL_MAP_MEMORY, false, pages, pages) == nullptr) return 0;
+        map.memory = AFL_MAP_MEMORY;
+        if (!instrumenter.addFunctions({AFL_RESET}, {_make_reset_func(map)})) return 0;
+    } else {
+        map.base = region.name("_base");
+        // prepare() adds the memory if there is none
+        if (!region.prepare(instrumenter, {AFL_RESET}, {_make_reset_func(map)})) return 0;
+        map.memory = region.memoryName();
+    }
+
+    auto module = instrumenter.getModule();
+    std::mt19937 rng(seed);
+    size_t sites = 0;
+    auto func_visitor = [&](wasm::Function* func) {
+        if (!instrumenter.scopeContains(func->name.toString())) return;
+        assert(func->stackIR != nullptr);
+        auto tmp = BinaryenFunctionAddVar(func, BinaryenTypeInt32());
+        auto new_site = [&]() {
+            sites++;
+            return _make_afl_insts(module, map, tmp, static_cast<uint32_t>(rng() % AFL_MAP_SIZE));
+        };
+        auto analysis = instrumenter.getAnalysis(func);
+        if (analysis == nullptr || analysis->cfg.insts.empty()) {
+            // exception handling, only the entry
+            auto insts = new_site();
+            func->stackIR->insert(func->stackIR->begin(), insts.begin(), insts.end());
+            instrumenter.stackIRChanged(func->name.toString());
+            return;
+        }
+        const auto &cfg = analysis->cfg;
+        std::vector<StackProbeCode> code;
+        for (size_t b = 0; b < cfg.exit(); b++) {
+            auto probe = findBlockProbe(cfg, b);
+            if (probe.kind == StackEdgeProbe::none) continue;
+            code.push_back(StackProbeCode{probe, new_site()});
+        }
+        applyStackProbes(module, func, cfg, code);
+        instrumenter.stackIRChanged(func->name.toString());
+    };
+    iterDefinedFunctions(module, func_visitor);
+
+    if (instrumenter.addExport(wasm::ModuleItemKind::Function, AFL_RESET, AFL_RESET) == nullptr) return 0;
+    if (separate) {
+        if (instrumenter.addExport(wasm::ModuleItemKind::Memory, AFL_MAP_MEMORY, AFL_MAP_MEMORY) == nullptr ||
+            !instrumenter.validate()) {
+            return 0;
+        }
+        return sites;
+    }
+    // the map is dumped at exit as well, like the counters of wabidb-profile
+    if (instrumenter.addExport(wasm::ModuleItemKind::Global, map.base.c_str(), map.base.c_str()) == nullptr) return 0;
+    bool memory_exported = false;
+    for (auto &e : module->exports) {
+        if (e->kind == wasm::ExternalKind::Memory && e->value == map.memory) memory_exported = true;
+    }
+    if (!memory_exported &&
+        instrumenter.addExport(wasm::ModuleItemKind::Memory, map.memory.c_str(), AFL_MAP_MEMORY) == nullptr) {
+        return 0;
+    }
+    region.hookProcExit(instrumenter);
+    return region.finish(instrumenter, AFL_MAP_SIZE / 8) ? sites : 0;
+}
+
+int main(int argc, const char* argv[]) {
+    const std::string WabidbAflOption = "wabidb-afl options";
+    wasm::ToolOptions options("wabidb-afl", "Add an afl-style edge coverage map to a wasm binary for fuzzing.");
+    bool separate = false;
+    uint32_t seed = 0;
+
+    options
+    .add("--output",
+         "-o",
+         "Output instrumented wasm filename",
+         WabidbAflOption,
+         wasm::Options::Arguments::One,
+         [](wasm::Options* o, const std::string& argument) {
+            o->extra["outfile"] = argument;
+         })
+    .add("--separate-memory",
+         "-sm",
+         "Put the map in a separate memory exported as __afl_map (needs multi-memory)",
+         WabidbAflOption,
+         wasm::Options::Arguments::Zero,
+         [&](wasm::Options* o, const std::string& argument) { separate = true; })
+    .add("--seed",
+         "-s",
+         "Seed of the random block ids",
+         WabidbAflOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { seed = static_cast<uint32_t>(std::stoul(argument)); })
+    .add_positional("INFILE",
+                    wasm::Options::Arguments::One,
+                    [](wasm::Options* o, const std::string& argument) {
+                        o->extra["infile"] = argument;
+                    });
+    options.parse(argc, argv);
+
+    auto infile = options.extra["infile"];
+    if ((infile.size() < 6) || (infile.substr(infile.size() - 5 , 5) != ".wasm")) {
+        std::cerr << "INFILE must be a .wasm file" << std::endl;
+        return AflExitCode::exit_usage_error;
+    }
+    if (options.extra.find("outfile") == options.extra.end()) {
+        options.extra["outfile"] = wasm::removeSpecificSuffix(infile, ".wasm") + "-afl.wasm";
+    }
+    auto outfile = options.extra["outfile"];
+
+    InstrumentConfig config;
+    config.filename = infile;
+    config.targetname = outfile;
+    wasm::Module* temp_module = new wasm::Module;
+    temp_module->features = config.feature;
+    options.applyFeatures(*temp_module);
+    config.feature = temp_module->features;
+    delete temp_module;
+    if (separate) config.feature.enable(wasm::FeatureSet::MultiMemory);
+
+    Instrumenter instrumenter;
+    if (instrumenter.setConfig(config) != InstrumentResult::success) {
+        std::cerr << "(wabidb-afl) Cannot load: " << infile << std::endl;
+        return AflExitCode::exit_load_error;
+    }
+    AflMap map;
+    auto sites = do_afl_instrument(instrumenter, separate, seed, map);
+    if (sites == 0 || instrumenter.writeBinary() != InstrumentResult::success) {
+        std::cerr << "(wabidb-afl) Instrumentation failed!" << std::endl;
+        return AflExitCode::exit_instrument_error;
+    }
+    std::printf("(wabidb-afl) %zu blocks instrumented, written to %s\n", sites, outfile.c_str());
+    if (separate) {
+        std::printf("(wabidb-afl) The %u-byte map is the exported memory %s\n", AFL_MAP_SIZE, AFL_MAP_MEMORY);
+    } else {
+        std::printf("(wabidb-afl) The %u-byte map is at the exported global %s in the exported memory, "
+                    "and dumped to %s at exit\n", AFL_MAP_SIZE, map.base.c_str(), AFL_MAP_FILE);
+    }
+    std::printf("(wabidb-afl) Call %s before each execution\n", AFL_RESET);
+    return AflExitCode::exit_success;
+}
@@ -0,0 +1,165 @@
+#include "batch-instrument.hpp"
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <tools/tool-options.h>
+#include <tools/tool-utils.h>
+using namespace wasm_instrument;
+
+enum BatchExitCode {
+    exit_success = 0,
+    exit_usage_error,
+    exit_plan_error,
+    // at least one module failed or crashed
+    exit_job_error,
+};
+
+// one input file per line, empty lines and lines start with '#' are skipped
+static bool read_list(const std::string &filename, std::vector<std::string> &inputs) {
+    std::ifstream in(filename);
+    if (!in.is_open()) {
+        std::cerr << "(wabidb-batch) Cannot open list: " << filename << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        inputs.push_back(line);
+    }
+    return true;
+}
+
+static std::string make_target(const std::string &input, const std::string &outdir, const std::string &suffix) {
+    auto base = wasm::removeSpecificSuffix(input, ".wasm") + suffix;
+    if (outdir.empty()) return base;
+    auto slash = base.find_last_of('/');
+    if (slash != std::string::npos) base = base.substr(slash + 1);
+    return outdir + "/" + base;
+}
+
+int main(int argc, const char* argv[]) {
+    const std::string WabidbBatchOption = "wabidb-batch options";
+    wasm::ToolOptions options("wabidb-batch", "Apply one instrumentation plan to many wasm binaries in parallel.");
+    std::string plan_name = "";
+    std::string list_name = "";
+    std::string outdir = "";
+    std::string suffix = "-instr.wasm";
+    size_t workers = 0;
+    bool threads = false;
+    bool stack_ir_cache = false;
+    bool quiet = false;
+    std::vector<std::string> inputs;
+
+    options
+    .add("--plan",
+         "-p",
+         "The instrumentation plan file",
+         WabidbBatchOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { plan_name = argument; })
+    .add("--list",
+         "-l",
+         "A file listing input wasm files, one per line",
+         WabidbBatchOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { list_name = argument; })
+    .add("--outdir",
+         "-od",
+         "Directory of instrumented files, default to the directory of each input",
+         WabidbBatchOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { outdir = argument; })
+    .add("--suffix",
+         "-sf",
+         "Suffix replacing .wasm of instrumented files, default to -instr.wasm",
+         WabidbBatchOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { suffix = argument; })
+    .add("--jobs",
+         "-j",
+         "Number of workers, default to the number of cores",
+         WabidbBatchOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { workers = std::stoul(argument); })
+    .add("--threads",
+         "-t",
+         "Run jobs on threads of one process instead of worker processes",
+         WabidbBatchOption,
+         wasm::Options::Arguments::Zero,
+         [&](wasm::Options* o, const std::string& argument) { threads = true; })
+    .add("--stack-ir-cache",
+         "-sc",
+         "Keep the stack ir of each input in <input>.sir to load it faster next time",
+         WabidbBatchOption,
+         wasm::Options::Arguments::Zero,
+         [&](wasm::Options* o, const std::string& argument) { stack_ir_cache = true; })
+    .add("--quiet",
+         "-q",
+         "Only print failed modules and the summary",
+         WabidbBatchOption,
+         wasm::Options::Arguments::Zero,
+         [&](wasm::Options* o, const std::string& argument) { quiet = true; })
+    .add_positional("INFILES",
+                    wasm::Options::Arguments::N,
+                    [&](wasm::Options* o, const std::string& argument) {
+                        inputs.push_back(argument);
+                    });
+    options.parse(argc, argv);
+
+    if (plan_name.empty()) {
+        std::cerr << "Usage: wabidb-batch --plan <PLAN> [INFILES...] [--list <LIST>]" << std::endl;
+        return BatchExitCode::exit_usage_error;
+    }
+    if (!list_name.empty() && !read_list(list_name, inputs)) {
+        return BatchExitCode::exit_usage_error;
+    }
+    if (inputs.empty()) {
+        std::cerr << "(wabidb-batch) No input file" << std::endl;
+        return BatchExitCode::exit_usage_error;
+    }
+
+    // the plan is parsed once and inherited by every worker
+    InstrumentPlan plan;
+    if (!readPlan(plan_name, plan)) {
+        std::cerr << "(wabidb-batch) Cannot load plan: " << plan_name << std::endl;
+        return BatchExitCode::exit_plan_error;
+    }
+
+    std::vector<BatchJob> jobs;
+    for (const auto &input : inputs) {
+        jobs.push_back(BatchJob{input, make_target(input, outdir, suffix)});
+    }
+
+    BatchOptions batch_options;
+    batch_options.workers = workers;
+    batch_options.threads = threads;
+    batch_options.stack_ir_cache = stack_ir_cache;
+    wasm::Module* temp_module = new wasm::Module;
+    temp_module->features = batch_options.feature;
+    options.applyFeatures(*temp_module);
+    batch_options.feature = temp_module->features;
+    delete temp_module;
+    batch_options.progress = [&](size_t job, const BatchJobResult &result, size_t finished, size_t total) {
+        if (quiet && result.status == BatchStatus::done) return;
+        std::cerr << "[" << finished << "/" << total << "] " << jobs[job].filename << ": "
+                  << BatchStatus2str(result.status);
+        if (result.status == BatchStatus::failed) {
+            std::cerr << " (" << InstrumentResult2str(result.result) << ")";
+        }
+        std::cerr << " " << std::fixed << std::setprecision(1) << result.time_us / 1000 << "ms" << std::endl;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    auto results = runBatch(plan, jobs, batch_options);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t num[4] = {0, 0, 0, 0};
+    for (const auto &r : results) num[r.status]++;
+    std::cerr << "(wabidb-batch) " << num[BatchStatus::done] << " done, "
+              << num[BatchStatus::failed] << " failed, "
+              << num[BatchStatus::crashed] << " crashed, "
+              << num[BatchStatus::not_started] << " not started in "
+              << std::fixed << std::setprecision(2) << elapsed << "s ("
+              << results.size() / std::max(elapsed, 1e-9) << " modules/s)" << std::endl;
+    return (num[BatchStatus::done] == results.size()) ? BatchExitCode::exit_success : BatchExitCode::exit_job_error;
+}
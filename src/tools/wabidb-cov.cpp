@@ -0,0 +1,431 @@
+#include "instrumenter.hpp"
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <tools/tool-options.h>
+#include <tools/tool-utils.h>
+#include <unistd.h>
+#include "counter-region.hpp"
+#include "stack-cfg.hpp"
+using namespace wasm_instrument;
+
+enum CovExitCode {
+    exit_success = 0,
+    exit_usage_error,
+    exit_load_error,
+    exit_instrument_error,
+    exit_runtime_error,
+    exit_report_error,
+};
+
+const char* COV_COUNTERS_FILE = "__cov_counters.bin";
+const char* COV_MAP_SUFFIX = ".covmap";
+const char* COV_MAP_HEADER = "wabidb-cov-map 1";
+
+// how the counts of a function are recovered
+enum CovMode {
+    // counters on chords of a spanning tree, block counts are solved on the host
+    cov_edge = 0,
+    // a counter on every block
+    cov_block,
+    // not instrumented, e.g. uses exception handling
+    cov_none,
+};
+
+struct CovFunction {
+    std::string name;
+    CovMode mode;
+    // [first, last] line numbers of wabidb-inspect and the counter of each block, -1 for none
+    std::vector<std::pair<size_t, size_t>> lines;
+    std::vector<int64_t> block_counters;
+    // edges between blocks, block lines.size() is the exit
+    std::vector<std::pair<size_t, size_t>> edges;
+    std::vector<int64_t> edge_counters;
+};
+
+struct CovMap {
+    size_t counter_num = 0;
+    std::vector<CovFunction> functions;
+
+    bool write(const std::string &filename) const {
+        std::ofstream out(filename);
+        if (!out.is_open()) return false;
+        const char* mode_str[] = {"edge", "block", "none"};
+        out << COV_MAP_HEADER << "\n" << this->counter_num << "\n";
+        for (const auto &f : this->functions) {
+            out << "func\t" << f.name << "\t" << mode_str[f.mode] << "\n";
+            for (size_t b = 0; b < f.lines.size(); b++) {
+                out << "b\t" << f.lines[b].first << "\t" << f.lines[b].second << "\t" << f.block_counters[b] << "\n";
+            }
+            for (size_t e = 0; e < f.edges.size(); e++) {
+                out << "e\t" << f.edges[e].first << "\t" << f.edges[e].second << "\t" << f.edge_counters[e] << "\n";
+            }
+        }
+        return true;
+    }
+    bool read(const std::string &filename) {
+        std::ifstream in(filename);
+        if (!in.is_open()) return false;
+        std::string line;
+        if (!std::getline(in, line) || line != COV_MAP_HEADER) return false;
+        if (!(in >> this->counter_num)) return false;
+        std::getline(in, line);
+        this->functions.clear();
+        while (std::getline(in, line)) {
+            std::istringstream ls(line);
+            std::string kind;
+            std::getline(ls, kind, '\t');
+            if (kind == "func") {
+                CovFunction f;
+                std::string mode;
+                std::getline(ls, f.name, '\t');
+                std::getline(ls, mode, '\t');
+                f.mode = (mode == "edge") ? CovMode::cov_edge : (mode == "block") ? CovMode::cov_block : CovMode::cov_none;
+                this->functions.push_back(f);
+                continue;
+            }
+            if (this->functions.empty()) return false;
+            auto &f = this->functions.back();
+            size_t a, b;
+            int64_t counter;
+            if (!(ls >> a >> b >> counter)) return false;
+            if (kind == "b") {
+                f.lines.emplace_back(a, b);
+                f.block_counters.push_back(counter);
+            } else if (kind == "e") {
+                f.edges.emplace_back(a, b);
+                f.edge_counters.push_back(counter);
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// /no_return/ and /indirect_no_return/ are from CallGraph::noReturn()
+static void _instrument_function(Instrumenter &instrumenter, wasm::Function* func, bool naive,
+                                 const std::set<std::string> &no_return, bool indirect_no_return,
+                                 const CounterRegion &region, CovMap &map) {
+    auto m = instrumenter.getModule();
+    CovFunction f;
+    f.name = func->name.toString();
+    auto analysis = instrumenter.getAnalysis(func);
+    if (analysis == nullptr || analysis->cfg.insts.empty()) {
+        f.mode = CovMode::cov_none;
+        map.functions.push_back(f);
+        return;
+    }
+    const auto &cfg = analysis->cfg;
+    const size_t num_blocks = cfg.blocks.size();
+    for (size_t b = 0; b + 1 < num_blocks; b++) {
+        f.lines.emplace_back(cfg.blocks[b].begin + 1, cfg.blocks[b].end);
+    }
+    f.block_counters.assign(num_blocks - 1, -1);
+    for (const auto &e : cfg.edges) {
+        f.edges.emplace_back(e.from, e.to);
+    }
+    f.edge_counters.assign(cfg.edges.size(), -1);
+
+    std::vector<StackEdgeProbe> edge_probes;
+    std::vector<bool> probeable;
+    std::vector<double> weights;
+    for (size_t e = 0; e < cfg.edges.size(); e++) {
+        edge_probes.push_back(findEdgeProbe(cfg, e));
+        probeable.push_back(edge_probes.back().kind != StackEdgeProbe::none);
+        // keep edges in loops unprobed if possible
+        auto depth = std::max(cfg.blocks[cfg.edges[e].from].loop_depth, cfg.blocks[cfg.edges[e].to].loop_depth);
+        weights.push_back(std::pow(10.0, static_cast<double>(depth)));
+    }
+    // frames at a call that never comes back leave their block to the exit by an edge
+    // that cannot be probed, it is only in the map and its count is solved
+    for (auto b : findNoReturnBlocks(cfg, no_return, indirect_no_return)) {
+        f.edges.emplace_back(b, num_blocks - 1);
+        f.edge_counters.push_back(-1);
+        probeable.push_back(false);
+        weights.push_back(1.0);
+    }
+    std::vector<bool> probed;
+    f.mode = CovMode::cov_edge;
+    if (naive || !selectProbeEdges(num_blocks, f.edges, probeable, weights, probed)) {
+        f.mode = CovMode::cov_block;
+    }
+
+    std::vector<StackProbeCode> code;
+    auto new_counter = [&](StackEdgeProbe probe) {
+        auto index = static_cast<uint32_t>(map.counter_num++);
+        code.push_back(StackProbeCode{probe, region.makeCounterInsts(m, index)});
+        return static_cast<int64_t>(index);
+    };
+    if (f.mode == CovMode::cov_edge) {
+        for (size_t e = 0; e < cfg.edges.size(); e++) {
+            if (probed[e]) f.edge_counters[e] = new_counter(edge_probes[e]);
+        }
+    } else {
+        for (size_t b = 0; b + 1 < num_blocks; b++) {
+            auto probe = findBlockProbe(cfg, b);
+            if (probe.kind != StackEdgeProbe::none) f.block_counters[b] = new_counter(probe);
+        }
+    }
+    applyStackProbes(m, func, cfg, code);
+    instrumenter.stackIRChanged(f.name);
+    map.functions.push_back(f);
+}
+
+static bool do_cov_instrument(Instrumenter &instrumenter, bool naive, CovMap &map) {
+    CounterRegion region("__cov", COV_COUNTERS_FILE);
+    if (!region.prepare(instrumenter)) return false;
+    auto module = instrumenter.getModule();
+    bool indirect_no_return = false;
+    auto no_return = instrumenter.callGraph().noReturn(indirect_no_return);
+    auto func_visitor = [&](wasm::Function* func) {
+        if (!instrumenter.scopeContains(func->name.toString())) return;
+        _instrument_function(instrumenter, func, naive, no_return, indirect_no_return, region, map);
+    };
+    iterDefinedFunctions(module, func_visitor);
+    region.hookProcExit(instrumenter);
+    return region.finish(instrumenter, static_cast<uint32_t>(map.counter_num));
+}
+
+// block counts of a function, false if they cannot be recovered,
+// blocks without a counter are not known
+static bool block_counts(const CovFunction &f, const std::vector<uint64_t> &counters,
+                         std::vector<uint64_t> &counts, std::vector<bool> &known) {
+    counts.assign(f.lines.size(), 0);
+    known.assign(f.lines.size(), true);
+    if (f.mode == CovMode::cov_none) return false;
+    if (f.mode == CovMode::cov_block) {
+        for (size_t b = 0; b < f.lines.size(); b++) {
+            known[b] = (f.block_counters[b] >= 0);
+            if (known[b]) counts[b] = counters[f.block_counters[b]];
+        }
+        return true;
+    }
+    std::vector<bool> probed(f.edges.size());
+    std::vector<uint64_t> edge_counts(f.edges.size(), 0);
+    for (size_t e = 0; e < f.edges.size(); e++) {
+        probed[e] = (f.edge_counters[e] >= 0);
+        if (probed[e]) edge_counts[e] = counters[f.edge_counters[e]];
+    }
+    if (!solveEdgeCounts(f.lines.size() + 1, f.edges, probed, edge_counts)) return false;
+    for (size_t e = 0; e < f.edges.size(); e++) {
+        if (f.edges[e].second < f.lines.size()) counts[f.edges[e].second] += edge_counts[e];
+        // the implicit edge from exit to entry
+        if (f.edges[e].second == f.lines.size()) counts[0] += edge_counts[e];
+    }
+    return true;
+}
+
+static std::string uncovered_lines(const CovFunction &f, const std::vector<uint64_t> &counts,
+                                   const std::vector<bool> &known) {
+    std::string ret;
+    size_t first = 0, last = 0;
+    auto flush = [&]() {
+        if (first == 0) return;
+        if (!ret.empty()) ret += ",";
+        ret += (first == last) ? std::to_string(first) : std::to_string(first) + "-" + std::to_string(last);
+        first = 0;
+    };
+    for (size_t b = 0; b < f.lines.size(); b++) {
+        if (!known[b]) {
+            flush();
+            continue;
+        }
+        if (counts[b] != 0) continue;
+        if (first != 0 && f.lines[b].first == last + 1) {
+            last = f.lines[b].second;
+        } else {
+            flush();
+            first = f.lines[b].first;
+            last = f.lines[b].second;
+        }
+    }
+    flush();
+    return ret;
+}
+
+static int report(const std::string &counters_file, const std::string &map_file, const std::string &counts_file) {
+    CovMap map;
+    if (!map.read(map_file)) {
+        std::cerr << "(wabidb-cov) Cannot read map: " << map_file << std::endl;
+        return CovExitCode::exit_report_error;
+    }
+    std::vector<uint64_t> counters;
+    if (!CounterRegion::readCounters(counters_file, map.counter_num, counters)) {
+        return CovExitCode::exit_report_error;
+    }
+    std::ofstream counts_out;
+    if (!counts_file.empty()) {
+        counts_out.open(counts_file);
+        if (!counts_out.is_open()) {
+            std::cerr << "(wabidb-cov) Cannot write: " << counts_file << std::endl;
+            return CovExitCode::exit_report_error;
+        }
+        counts_out << "# function\tfirst line\tlast line\tcount\n";
+    }
+
+    size_t total_blocks = 0, total_covered = 0, total_unknown = 0;
+    std::printf("(wabidb-cov) Block coverage, lines as listed by wabidb-inspect:\n");
+    std::printf("%12s %7s  %s\n", "blocks", "cover", "function");
+    for (const auto &f : map.functions) {
+        std::vector<uint64_t> counts;
+        std::vector<bool> known;
+        if (!block_counts(f, counters, counts, known)) {
+            std::printf("%12s %7s  %s\n", "-", "-", f.name.c_str());
+            continue;
+        }
+        // blocks that could not be probed are left out of the ratio
+        size_t covered = 0, measured = 0;
+        for (size_t b = 0; b < counts.size(); b++) {
+            if (known[b]) measured++;
+            if (counts[b] != 0) covered++;
+            if (counts_out.is_open()) {
+                counts_out << f.name << "\t" << f.lines[b].first << "\t" << f.lines[b].second << "\t";
+                if (known[b]) counts_out << counts[b] << "\n";
+                else counts_out << "-\n";
+            }
+        }
+        total_blocks += measured;
+        total_covered += covered;
+        total_unknown += counts.size() - measured;
+        auto ratio = std::to_string(covered) + "/" + std::to_string(measured);
+        std::printf("%12s %6.1f%%  %s", ratio.c_str(), 100.0 * covered / std::max<size_t>(1, measured), f.name.c_str());
+        if (covered != 0 && covered != measured) {
+            std::printf("  uncovered lines: %s", uncovered_lines(f, counts, known).c_str());
+        }
+        if (measured != counts.size()) {
+            std::printf("  unknown blocks: %zu", counts.size() - measured);
+        }
+        std::printf("\n");
+    }
+    std::printf("(wabidb-cov) Total: %zu/%zu blocks (%.1f%%) by %zu counters", total_covered, total_blocks,
+                100.0 * total_covered / std::max<size_t>(1, total_blocks), map.counter_num);
+    if (total_unknown != 0) std::printf(", %zu blocks unknown", total_unknown);
+    std::printf("\n");
+    return CovExitCode::exit_success;
+}
+
+int main(int argc, const char* argv[]) {
+    const std::string WabidbCovOption = "wabidb-cov options";
+    wasm::ToolOptions options("wabidb-cov", "Measure basic block coverage of a wasm binary.");
+    std::string command = "";
+    std::string counters_file = "";
+    std::string map_file = "";
+    std::string counts_file = "";
+    bool naive = false;
+
+    options
+    .add("--output",
+         "-o",
+         "Output instrumented wasm filename",
+         WabidbCovOption,
+         wasm::Options::Arguments::One,
+         [](wasm::Options* o, const std::string& argument) {
+            o->extra["outfile"] = argument;
+         })
+    .add("--command",
+         "-cmd",
+         "Run the instrumented file on a certain runtime and report",
+         WabidbCovOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { command = argument; })
+    .add("--report",
+         "-r",
+         "Report a counters file dumped by an instrumented run, requires --map",
+         WabidbCovOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { counters_file = argument; })
+    .add("--map",
+         "-m",
+         "The block map written along with the instrumented file",
+         WabidbCovOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { map_file = argument; })
+    .add("--counts",
+         "-c",
+         "Also write the count of every block to a file",
+         WabidbCovOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { counts_file = argument; })
+    .add("--naive",
+         "-n",
+         "Put a counter on every block instead of on spanning tree chords",
+         WabidbCovOption,
+         wasm::Options::Arguments::Zero,
+         [&](wasm::Options* o, const std::string& argument) { naive = true; })
+    .add_positional("INFILE",
+                    wasm::Options::Arguments::Optional,
+                    [](wasm::Options* o, const std::string& argument) {
+                        o->extra["infile"] = argument;
+                    });
+    options.parse(argc, argv);
+
+    // offline report
+    if (!counters_file.empty()) {
+        if (map_file.empty()) {
+            std::cerr << "--report requires --map" << std::endl;
+            return CovExitCode::exit_usage_error;
+        }
+        return report(counters_file, map_file, counts_file);
+    }
+
+    if (options.extra.find("infile") == options.extra.end()) {
+        std::cerr << "Usage: wabidb-cov <INFILE> [-cmd <COMMAND>]" << std::endl;
+        std::cerr << "       wabidb-cov --report <COUNTERS> --map <MAP>" << std::endl;
+        return CovExitCode::exit_usage_error;
+    }
+    auto infile = options.extra["infile"];
+    if ((infile.size() < 6) || (infile.substr(infile.size() - 5 , 5) != ".wasm")) {
+        std::cerr << "INFILE must be a .wasm file" << std::endl;
+        return CovExitCode::exit_usage_error;
+    }
+    if (options.extra.find("outfile") == options.extra.end()) {
+        options.extra["outfile"] = wasm::removeSpecificSuffix(infile, ".wasm") + "-cov.wasm";
+    }
+    auto outfile = options.extra["outfile"];
+    if (map_file.empty()) map_file = outfile + COV_MAP_SUFFIX;
+
+    InstrumentConfig config;
+    config.filename = infile;
+    config.targetname = outfile;
+    wasm::Module* temp_module = new wasm::Module;
+    temp_module->features = config.feature;
+    options.applyFeatures(*temp_module);
+    config.feature = temp_module->features;
+    delete temp_module;
+
+    Instrumenter instrumenter;
+    if (instrumenter.setConfig(config) != InstrumentResult::success) {
+        std::cerr << "(wabidb-cov) Cannot load: " << infile << std::endl;
+        return CovExitCode::exit_load_error;
+    }
+    CovMap map;
+    if (!do_cov_instrument(instrumenter, naive, map) ||
+        instrumenter.writeBinary() != InstrumentResult::success) {
+        std::cerr << "(wabidb-cov) Instrumentation failed!" << std::endl;
+        return CovExitCode::exit_instrument_error;
+    }
+    if (!map.write(map_file)) {
+        std::cerr << "(wabidb-cov) Cannot write: " << map_file << std::endl;
+        return CovExitCode::exit_instrument_error;
+    }
+    size_t blocks = 0;
+    for (const auto &f : map.functions) blocks += f.lines.size();
+    std::printf("(wabidb-cov) %zu counters for %zu blocks, written to %s and %s\n",
+                map.counter_num, blocks, outfile.c_str(), map_file.c_str());
+
+    if (command.empty()) {
+        std::printf("(wabidb-cov) Run it with the current directory preopened, then:\n"
+                    "  wabidb-cov --report %s --map %s\n", COV_COUNTERS_FILE, map_file.c_str());
+        return CovExitCode::exit_success;
+    }
+
+    std::remove(COV_COUNTERS_FILE);
+    modify_runtime_command(command, outfile);
+    int return_code = run_runtime_command(command);
+    if (access(COV_COUNTERS_FILE, R_OK) != 0) {
+        std::printf("(wabidb-cov) No counters dumped, runtime returned %d!\n", return_code);
+        return CovExitCode::exit_runtime_error;
+    }
+    return report(COV_COUNTERS_FILE, map_file, counts_file);
+}
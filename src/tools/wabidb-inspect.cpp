@@ -1,13 +1,18 @@
 #include "instrumenter.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 #include <fstream>
 #include <ios>
+#include <memory>
 #include <tools/tool-options.h>
 #include <tools/tool-utils.h>
 #include <unistd.h>
 #include <wasm-type.h>
-#include "common_wasm_func.hpp"
+#include "tool-common.hpp"
 #include "operation-builder.hpp"
+#include "stack-peephole.hpp"
 using namespace wasm_instrument;
 
 enum InspectState {
@@ -132,7 +137,7 @@ public:
                     std::printf(" %ld: var   name: $%s = ", i, linfo->names[i].c_str());
                 }
                 std::cout << linfo->types[i];
-                _print_typed_number(ifile, linfo->types[i]);
+                std::cout << "(" << _read_typed_number(ifile, linfo->types[i]) << ")" << std::endl;
             }
         } else if (this->type == Type::global) {
             auto ginfo = dynamic_cast<GlobalPrintInfo*>(this->info);
@@ -141,26 +146,14 @@ public:
                 if (ginfo->types[i] == wasm::Type::none) continue;
                 std::printf(" %ld: name: $%s = ", i, ginfo->names[i].c_str());
                 std::cout << ginfo->types[i];
-                _print_typed_number(ifile, ginfo->types[i]);
+                std::cout << "(" << _read_typed_number(ifile, ginfo->types[i]) << ")" << std::endl;
             }
         } else if (this->type == Type::backtrace) {
-            auto binfo = dynamic_cast<BacktracePrintInfo*>(this->info);
             std::printf("(wabidb-inspect) Backtrace:\n");
-            int32_t number_le;
             std::vector<int> backtrace_idx;
-            while(!ifile.eof()) {
-                ifile.read((char *)(&number_le), 4);
-                if (ifile.eof()) break;
-                int32_t number_be = swap_endian(number_le);
-                assert(number_be != -2);
-                if (number_be != -1) {
-                    backtrace_idx.emplace_back(number_be);
-                } else {
-                    backtrace_idx.pop_back();
-                }
-            }
+            _read_backtrace(ifile, backtrace_idx);
             for (int i = backtrace_idx.size() - 1; i >= 0; i--) {
-                std::printf(" %ld: $%s\n", backtrace_idx.size() - 1 - i, binfo->names[backtrace_idx[i]].c_str());
+                std::printf(" %ld: $%s\n", backtrace_idx.size() - 1 - i, _frame_name(backtrace_idx[i]).c_str());
             }
             std::printf(" %ld: $%s\n", backtrace_idx.size(), "_start (or what runtime directly call)");
         } else {
@@ -168,36 +161,135 @@ public:
         }
         ifile.close();
     }
+    // print the decoded cache file as json fields (without the enclosing braces)
+    // e.g. "locals":[{"index":0,"kind":"param","name":"$0","type":"i32","value":8}]
+    void print_json(const std::string &filename, std::ostream &o) const {
+        std::ifstream ifile(filename, std::ios::binary);
+        if (this->type == Type::local || this->type == Type::global) {
+            bool is_local = (this->type == Type::local);
+            size_t param_num = is_local ? dynamic_cast<LocalPrintInfo*>(this->info)->param_num : 0;
+            o << (is_local ? "\"locals\":[" : "\"globals\":[");
+            bool first = true;
+            for (size_t i = 0; i < this->info->num; i++) {
+                auto type = this->info->types[i];
+                if (type == wasm::Type::none) continue;
+                if (!first) o << ",";
+                first = false;
+                o << "{\"index\":" << i;
+                if (is_local) o << ",\"kind\":\"" << ((i < param_num) ? "param" : "var") << "\"";
+                o << ",\"name\":\"$" << json_escape(this->info->names[i]) << "\"";
+                o << ",\"type\":\"" << type.toString() << "\"";
+                auto value = _read_typed_number(ifile, type);
+                bool is_number = (type == wasm::Type::i32) || (type == wasm::Type::i64) ||
+                    (((type == wasm::Type::f32) || (type == wasm::Type::f64)) && std::isfinite(std::stod(value)));
+                if (is_number) {
+                    o << ",\"value\":" << value << "}";
+                } else {
+                    // nan and inf are not valid json numbers
+                    o << ",\"value\":\"" << value << "\"}";
+                }
+            }
+            o << "]";
+        } else if (this->type == Type::backtrace) {
+            o << "\"backtrace\":[";
+            std::vector<int> backtrace_idx;
+            _read_backtrace(ifile, backtrace_idx);
+            for (int i = backtrace_idx.size() - 1; i >= 0; i--) {
+                o << "\"$" << json_escape(_frame_name(backtrace_idx[i])) << "\"" << ((i > 0) ? "," : "");
+            }
+            o << "]";
+        }
+        ifile.close();
+    }
+    // whether the cache file holds a complete result of this inspection,
+    // print() and print_json() only print what can be read
+    bool readable(const std::string &filename) const {
+        std::ifstream ifile(filename, std::ios::binary);
+        if (!ifile) return false;
+        if (this->type == Type::backtrace) {
+            std::vector<int> backtrace_idx;
+            return _read_backtrace(ifile, backtrace_idx);
+        }
+        size_t size = 0;
+        for (size_t i = 0; i < this->info->num; i++) {
+            if (this->info->types[i] != wasm::Type::none) size += this->info->types[i].getByteSize();
+        }
+        ifile.seekg(0, std::ios::end);
+        return static_cast<size_t>(ifile.tellg()) >= size;
+    }
+    static std::string json_escape(const std::string &s) {
+        std::string ret;
+        for (const char c : s) {
+            if (c == '"' || c == '\\') {
+                ret += '\\';
+                ret += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                ret += buf;
+            } else {
+                ret += c;
+            }
+        }
+        return ret;
+    }
 private:
-    void _print_typed_number(std::ifstream &ifile, wasm::Type type) const{
+    std::string _read_typed_number(std::ifstream &ifile, wasm::Type type) const {
+        char buf[64];
         if (type == wasm::Type::i32) {
             int32_t number_le;
             ifile.read((char *)(&number_le), 4);
             int32_t number_be = swap_endian(number_le);
-            std::printf("(%d)\n", number_be);
+            std::snprintf(buf, sizeof(buf), "%d", number_be);
         } else if (type == wasm::Type::i64) {
             int64_t number_le;
             ifile.read((char *)(&number_le), 8);
             int64_t number_be = swap_endian(number_le);
-            std::printf("(%ld)\n", number_be);
+            std::snprintf(buf, sizeof(buf), "%ld", number_be);
         } else if (type == wasm::Type::f32) {
             assert(sizeof(float) == 4);
             float number_le;
             ifile.read((char *)(&number_le), 4);
             float number_be = swap_endian(number_le);
-            std::printf("(%.8f)\n", number_be);
+            std::snprintf(buf, sizeof(buf), "%.8f", number_be);
         } else if (type == wasm::Type::f64) {
             assert(sizeof(double) == 8);
             double number_le;
             ifile.read((char *)(&number_le), 8);
             double number_be = swap_endian(number_le);
-            std::printf("(%.15lf)\n", number_be);
+            std::snprintf(buf, sizeof(buf), "%.15lf", number_be);
         } else if (type == wasm::Type::v128) {
             v128_t number_le;
             ifile.read(number_le.data, 16);
             v128_t number_be = swap_endian(number_le);
-            std::cout << "(" << number_be << ")" << std::endl;
+            std::stringstream vstream;
+            vstream << number_be;
+            return vstream.str();
         } else assert(false);
+        return std::string(buf);
+    }
+    // the cache holds the index of each called function, -2 for functions without a name
+    // in info, and -1 after each return. false if it is not a sequence of those
+    bool _read_backtrace(std::ifstream &ifile, std::vector<int> &backtrace_idx) const {
+        int32_t number_le;
+        backtrace_idx.clear();
+        while(!ifile.eof()) {
+            ifile.read((char *)(&number_le), 4);
+            if (ifile.eof()) break;
+            int32_t number_be = swap_endian(number_le);
+            if (number_be == -1) {
+                if (backtrace_idx.empty()) return false;
+                backtrace_idx.pop_back();
+            } else if (number_be == -2 || (number_be >= 0 && static_cast<size_t>(number_be) < this->info->names.size())) {
+                backtrace_idx.emplace_back(number_be);
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+    std::string _frame_name(int idx) const {
+        return idx < 0 ? std::string("(unknown)") : this->info->names[idx];
     }
 };
 
@@ -289,113 +381,15 @@ static bool validate_inspect_pos(wasm::Module &m, const std::string func_name, s
     return true;
 }
 
-static void _add_imports(Instrumenter &instrumenter, CommonWasmBuilder &wasm_builder) {
-    // import WASI function fd_prestat_get()
-    auto func = instrumenter.getImport(wasm::ModuleItemKind::Function, "fd_prestat_get");
-    if (func == nullptr) {
-        BinaryenType ii[2] = {BinaryenTypeInt32(), BinaryenTypeInt32()};
-        BinaryenType fd_prestat_get_params = BinaryenTypeCreate(ii, 2);
-        instrumenter.addImportFunction("__imported_wasi_snapshot_preview1_fd_prestat_get", "wasi_snapshot_preview1", "fd_prestat_get", 
-                                        fd_prestat_get_params, BinaryenTypeInt32());
-        wasm_builder.updateWasiName("fd_prestat_get", "__imported_wasi_snapshot_preview1_fd_prestat_get");
-    } else {
-        if (func->hasExplicitName) {
-            wasm_builder.updateWasiName("fd_prestat_get", func->name.toString());
-        } else {
-            func->setExplicitName("__imported_wasi_snapshot_preview1_fd_prestat_get");
-            wasm_builder.updateWasiName("fd_prestat_get", "__imported_wasi_snapshot_preview1_fd_prestat_get");
-        }
-    }
-
-    // import WASI function fd_prestat_dir_name()
-    func = instrumenter.getImport(wasm::ModuleItemKind::Function, "fd_prestat_dir_name");
-    if (func == nullptr) {
-        BinaryenType iii[3] = {BinaryenTypeInt32(), BinaryenTypeInt32(), BinaryenTypeInt32()};
-        BinaryenType fd_prestat_dir_name_params = BinaryenTypeCreate(iii, 3);
-        instrumenter.addImportFunction("__imported_wasi_snapshot_preview1_fd_prestat_dir_name", "wasi_snapshot_preview1", "fd_prestat_dir_name", 
-                                        fd_prestat_dir_name_params, BinaryenTypeInt32());
-        wasm_builder.updateWasiName("fd_prestat_dir_name", "__imported_wasi_snapshot_preview1_fd_prestat_dir_name");
-    } else {
-        if (func->hasExplicitName) {
-            wasm_builder.updateWasiName("fd_prestat_dir_name", func->name.toString());
-        } else {
-            func->setExplicitName("__imported_wasi_snapshot_preview1_fd_prestat_dir_name");
-            wasm_builder.updateWasiName("fd_prestat_dir_name", "__imported_wasi_snapshot_preview1_fd_prestat_dir_name");
-        }
-    }
-
-    // import WASI function path_open()
-    func = instrumenter.getImport(wasm::ModuleItemKind::Function, "path_open");
-    if (func == nullptr) {
-        BinaryenType i9[9] = {BinaryenTypeInt32(), BinaryenTypeInt32(), BinaryenTypeInt32(), BinaryenTypeInt32(), 
-                            BinaryenTypeInt32(), BinaryenTypeInt64(), BinaryenTypeInt64(), BinaryenTypeInt32(), 
-                            BinaryenTypeInt32()};
-        BinaryenType path_open_params = BinaryenTypeCreate(i9, 9);
-        instrumenter.addImportFunction("__imported_wasi_snapshot_preview1_path_open", "wasi_snapshot_preview1", "path_open", 
-                                        path_open_params, BinaryenTypeInt32());
-        wasm_builder.updateWasiName("path_open", "__imported_wasi_snapshot_preview1_path_open");
-    } else {
-        if (func->hasExplicitName) {
-            wasm_builder.updateWasiName("path_open", func->name.toString());
-        } else {
-            func->setExplicitName("__imported_wasi_snapshot_preview1_path_open");
-            wasm_builder.updateWasiName("path_open", "__imported_wasi_snapshot_preview1_path_open");
-        }
-    }
-
-    // import WASI function fd_write()
-    func = instrumenter.getImport(wasm::ModuleItemKind::Function, "fd_write");
-    if (func == nullptr) {
-        BinaryenType iiii[4] = {BinaryenTypeInt32(), BinaryenTypeInt32(), BinaryenTypeInt32(), BinaryenTypeInt32()};
-        BinaryenType fd_write_params = BinaryenTypeCreate(iiii, 4);
-        instrumenter.addImportFunction("__imported_wasi_snapshot_preview1_fd_write", "wasi_snapshot_preview1", "fd_write", 
-                                        fd_write_params, BinaryenTypeInt32());
-        wasm_builder.updateWasiName("fd_write", "__imported_wasi_snapshot_preview1_fd_write");
-    } else {
-        if (func->hasExplicitName) {
-            wasm_builder.updateWasiName("fd_write", func->name.toString());
-        } else {
-            func->setExplicitName("__imported_wasi_snapshot_preview1_fd_write");
-            wasm_builder.updateWasiName("fd_write", "__imported_wasi_snapshot_preview1_fd_write");
-        }
-    }
-
-    // import WASI function fd_close()
-    func = instrumenter.getImport(wasm::ModuleItemKind::Function, "fd_close");
-    if (func == nullptr) {
-        instrumenter.addImportFunction("__imported_wasi_snapshot_preview1_fd_close", "wasi_snapshot_preview1", "fd_close", 
-                                        BinaryenTypeInt32(), BinaryenTypeInt32());
-        wasm_builder.updateWasiName("fd_close", "__imported_wasi_snapshot_preview1_fd_close");
-    } else {
-        if (func->hasExplicitName) {
-            wasm_builder.updateWasiName("fd_close", func->name.toString());
-        } else {
-            func->setExplicitName("__imported_wasi_snapshot_preview1_fd_close");
-            wasm_builder.updateWasiName("fd_close", "__imported_wasi_snapshot_preview1_fd_close");
-        }
-    }
-
-    // import WASI function proc_exit()
-    func = instrumenter.getImport(wasm::ModuleItemKind::Function, "proc_exit");
-    if (func == nullptr) {
-        instrumenter.addImportFunction("__imported_wasi_snapshot_preview1_proc_exit", "wasi_snapshot_preview1", "proc_exit", 
-                                        BinaryenTypeInt32(), BinaryenTypeNone());
-        wasm_builder.updateWasiName("proc_exit", "__imported_wasi_snapshot_preview1_proc_exit");
-    } else {
-        if (func->hasExplicitName) {
-            wasm_builder.updateWasiName("proc_exit", func->name.toString());
-        } else {
-            func->setExplicitName("__imported_wasi_snapshot_preview1_proc_exit");
-            wasm_builder.updateWasiName("proc_exit", "__imported_wasi_snapshot_preview1_proc_exit");
-        }
-    }
-}
+// the data page starts this far into its page, and the io buffer this far into the data page
+const int32_t PAGE_GUIDE = 1024;
+const int32_t IOBUF_OFFSET = 4096;
 
 static void _add_globals(Instrumenter &instrumenter) {
     // memory-associate globals:
     // auto global_ret = instrumenter.addGlobal("__instr_page_addr", BinaryenTypeInt32(), true, BinaryenLiteralInt32(-1));
     // assert(global_ret != nullptr);
-    auto global_ret = instrumenter.addGlobal("__instr_page_guide", BinaryenTypeInt32(), false, BinaryenLiteralInt32(1024));
+    auto global_ret = instrumenter.addGlobal("__instr_page_guide", BinaryenTypeInt32(), false, BinaryenLiteralInt32(PAGE_GUIDE));
     assert(global_ret != nullptr);
     global_ret = instrumenter.addGlobal("__instr_base_addr", BinaryenTypeInt32(), true, BinaryenLiteralInt32(-1));
     assert(global_ret != nullptr);
@@ -411,72 +405,193 @@ static void _add_globals(Instrumenter &instrumenter) {
     assert(global_ret != nullptr);
 }
 
-static void _add_memory(Instrumenter &instrumenter, std::string &memory_name) {
+// with --separate-memory the probe data is kept in a memory of its own, exported under the
+// same name, and the app memory is never grown nor are its limits changed. wasi only reads
+// and writes the app memory, so its page 0 is borrowed as a bounce buffer: saved, used by
+// the wasi calls, and restored. this happens for environ_get at start in all-probes mode
+// and when a probe writes its result before exiting. an app memory without pages at that
+// time cannot be borrowed: probes are not enabled from the environment, and a probe exits
+// with 12 instead of writing
+// layout: [enable table pages][saved app page][data page], the table in all-probes mode only
+const char INSTR_MEMORY[] = "__instr_mem";
+
+// /inst/ on /memory/, or on the app memory (index 0) if it is empty
+static std::string _on_memory(const std::string &inst, const std::string &memory) {
+    return memory.empty() ? inst : inst + " $" + memory;
+}
+
+// multi-memory is enabled along with --separate-memory
+static bool _add_instr_memory(Instrumenter &instrumenter, uint64_t pages) {
+    auto memory_ret = instrumenter.addMemory(INSTR_MEMORY, false, static_cast<int>(pages), static_cast<int>(pages));
+    if (memory_ret == nullptr) return false;
+    if (instrumenter.getExport(INSTR_MEMORY) == nullptr) {
+        auto export_ret = instrumenter.addExport(wasm::ModuleItemKind::Memory, INSTR_MEMORY, INSTR_MEMORY);
+        assert(export_ret != nullptr);
+    }
+    return true;
+}
+
+// the app memory of the bounce buffer, an app without memory gets one page of its own
+static void _use_app_memory(Instrumenter &instrumenter, std::string &memory_name) {
+    auto memory_ret = instrumenter.getMemory();
+    if (memory_ret == nullptr) {
+        memory_ret = instrumenter.addMemory("mem", false, 1, 1);
+        assert(memory_ret != nullptr);
+    } else {
+        memory_name = memory_ret->name.toString();
+    }
+}
+
+// make room for /pages/ more pages grown at runtime
+static void _add_memory(Instrumenter &instrumenter, std::string &memory_name, uint64_t pages = 1) {
     auto memory_ret = instrumenter.getMemory();
     if (memory_ret == nullptr) {
-        memory_ret = instrumenter.addMemory("mem", false, 0, 1);
+        memory_ret = instrumenter.addMemory("mem", false, 0, pages);
         assert(memory_ret != nullptr);
     } else {
         memory_name = memory_ret->name.toString();
-        if ((memory_ret->max - memory_ret->initial) <= 0) {
-            memory_ret->max = std::min(static_cast<uint64_t>(memory_ret->max + 1), static_cast<uint64_t>(wasm::Memory::kMaxSize32));
+        if ((memory_ret->max - memory_ret->initial) < pages) {
+            memory_ret->max = std::min(static_cast<uint64_t>(memory_ret->max + pages), static_cast<uint64_t>(wasm::Memory::kMaxSize32));
             assert((memory_ret->max - memory_ret->initial) > 0);
         }
     }
 }
 
-static void _add_data_segments(Instrumenter &instrumenter) {
+// the default name of the cache file, relative to the preopened directory
+const std::string DEFAULT_CACHE_FILE = "__instr_cache.file";
+// the cache file name goes from 1024 up to the ciovec at 2048 of the data page, with its NUL
+const size_t MAX_CACHE_FILE_LEN = 1023;
+
+static void _add_data_segments(Instrumenter &instrumenter, const std::string &cache_name) {
     auto data_ret = instrumenter.addPassiveDateSegment(".instr_rodata", ".\00", 2);
     assert(data_ret != nullptr);
-    data_ret = instrumenter.addPassiveDateSegment(".instr_filename", "__instr_cache.file\00", 19);
+    data_ret = instrumenter.addPassiveDateSegment(".instr_filename", cache_name.c_str(), cache_name.size() + 1);
     assert(data_ret != nullptr);
 }
 
-static void _add_functions(Instrumenter &instrumenter, CommonWasmBuilder &wasm_builder) {
-    bool add_func_ret = instrumenter.addFunctions(
-        {
-            "__instr_memcmp",
-            "__instr_get_cwd_fd",
-            "__instr_fopen_rw",
-            "__instr_load_data",
-        }, 
-        {
-            wasm_builder.getWasmFunction("__instr_memcmp").value(),
-            wasm_builder.getWasmFunction("__instr_get_cwd_fd").value(),
-            wasm_builder.getWasmFunction("__instr_fopen_rw").value(),
-            "(func $__instr_load_data\n"
-            "i32.const 1\n"
-            "memory.grow\n"
-            "i32.const 65536\n"
-            "i32.mul\n"
-            "global.get $__instr_page_guide\n"
-            "i32.add\n"
-            "global.set $__instr_base_addr\n"
-            
-            "global.get $__instr_base_addr\n"
-            "i32.const 3072\n"
-            "i32.add\n"
-            "global.set $__instr_wasi_ret_addr\n"
-            
-            "global.get $__instr_base_addr\n"
-            "i32.const 4096\n"
-            "i32.add\n"
-            "global.set $__instr_iobuf_addr\n"
-            
-            "global.get $__instr_base_addr\n"
-            "i32.const 0\n"
-            "i32.const 2\n"
-            "memory.init $.instr_rodata\n"
-            
-            "global.get $__instr_base_addr\n"
-            "i32.const 1024\n"
-            "i32.add\n"
-            "i32.const 0\n"
-            "i32.const 19\n"
-            "memory.init $.instr_filename\n"
-            ")",
-        }
-    );
+// the addresses of the data page that follow from __instr_base_addr
+static const std::string _set_data_addrs =
+    "global.get $__instr_base_addr\n"
+    "i32.const 3072\n"
+    "i32.add\n"
+    "global.set $__instr_wasi_ret_addr\n"
+
+    "global.get $__instr_base_addr\n"
+    "i32.const " + std::to_string(IOBUF_OFFSET) + "\n"
+    "i32.add\n"
+    "global.set $__instr_iobuf_addr\n";
+
+// grow the data page in the app memory, or use page /data_page/ of /instr_memory/
+static std::string _make_load_data(const CommonWasmBuilder &builder, const std::string &instr_memory,
+                                   uint64_t data_page, size_t name_len) {
+    std::string page = instr_memory.empty() ? "i32.const 1\n"
+                                              "memory.grow\n"
+                                              "global.set $__instr_base_addr\n"
+                                              "global.get $__instr_base_addr\n"
+                                              "i32.const -1\n"
+                                              "i32.eq\n"
+                                              "if\n"
+                                              "i32.const 12\n"
+                                              "call $" + builder.getWasiName("proc_exit").value() + "\n"
+                                              "end\n"
+                                              "global.get $__instr_base_addr\n"
+                                            : "i32.const " + std::to_string(data_page) + "\n";
+    return
+        "(func $__instr_load_data\n" +
+        page +
+        "i32.const 65536\n"
+        "i32.mul\n"
+        "global.get $__instr_page_guide\n"
+        "i32.add\n"
+        "global.set $__instr_base_addr\n" +
+        _set_data_addrs +
+
+        "global.get $__instr_base_addr\n"
+        "i32.const 0\n"
+        "i32.const 2\n" +
+        _on_memory("memory.init", instr_memory) + " $.instr_rodata\n"
+
+        "global.get $__instr_base_addr\n"
+        "i32.const 1024\n"
+        "i32.add\n"
+        "i32.const 0\n"
+        "i32.const " + std::to_string(name_len + 1) + "\n" +
+        _on_memory("memory.init", instr_memory) + " $.instr_filename\n"
+        ")";
+}
+
+// save page 0 of the app memory to page /data_page/ - 1 of the separate memory, and copy
+// the data page there, where wasi can write it out
+static std::string _make_move_data(const CommonWasmBuilder &builder, const std::string &memory_name,
+                                   uint64_t data_page) {
+    std::string saved_page = std::to_string((data_page - 1) * 65536);
+    return
+        "(func $__instr_move_data\n" +
+        _on_memory("memory.size", memory_name) + "\n"
+        "i32.eqz\n"
+        "if\n"
+        "i32.const 12\n"
+        "call $" + builder.getWasiName("proc_exit").value() + "\n"
+        "end\n"
+        "i32.const " + saved_page + "\n"
+        "i32.const 0\n"
+        "i32.const 65536\n"
+        "memory.copy $" + INSTR_MEMORY + " $" + memory_name + "\n"
+        "i32.const 0\n"
+        "global.get $__instr_base_addr\n"
+        "global.get $__instr_page_guide\n"
+        "i32.sub\n"
+        "i32.const 65536\n"
+        "memory.copy $" + memory_name + " $" + INSTR_MEMORY + "\n"
+        "global.get $__instr_page_guide\n"
+        "global.set $__instr_base_addr\n" +
+        _set_data_addrs +
+        ")";
+}
+
+// give page 0 back to the app, the data page is in the separate memory again
+static std::string _make_restore_data(const std::string &memory_name, uint64_t data_page) {
+    std::string saved_page = std::to_string((data_page - 1) * 65536);
+    return
+        "(func $__instr_restore_data\n"
+        "i32.const 0\n"
+        "i32.const " + saved_page + "\n"
+        "i32.const 65536\n"
+        "memory.copy $" + memory_name + " $" + INSTR_MEMORY + "\n"
+        "i32.const " + std::to_string(data_page * 65536) + "\n"
+        "global.get $__instr_page_guide\n"
+        "i32.add\n"
+        "global.set $__instr_base_addr\n" +
+        _set_data_addrs +
+        ")";
+}
+
+// an empty /instr_memory/ keeps the data page in the app memory /memory_name/
+static void _add_functions(Instrumenter &instrumenter,
+                           CommonWasmBuilder &wasm_builder,
+                           const std::string &memory_name,
+                           const std::string &cache_name,
+                           const std::string &instr_memory = "",
+                           uint64_t data_page = 0) {
+    std::vector<std::string> names {
+        "__instr_memcmp",
+        "__instr_get_cwd_fd",
+        "__instr_fopen_rw",
+        "__instr_load_data",
+    };
+    std::vector<std::string> funcs {
+        wasm_builder.getWasmFunction("__instr_memcmp").value(),
+        wasm_builder.getWasmFunction("__instr_get_cwd_fd").value(),
+        wasm_builder.getWasmFunction("__instr_fopen_rw").value(),
+        _make_load_data(wasm_builder, instr_memory, data_page, cache_name.size()),
+    };
+    if (!instr_memory.empty()) {
+        names.emplace_back("__instr_move_data");
+        funcs.emplace_back(_make_move_data(wasm_builder, memory_name, data_page));
+        names.emplace_back("__instr_restore_data");
+        funcs.emplace_back(_make_restore_data(memory_name, data_page));
+    }
+    bool add_func_ret = instrumenter.addFunctions(names, funcs);
     assert(add_func_ret == true);
 }
 
@@ -488,7 +603,8 @@ static void _add_exports(Instrumenter &instrumenter, std::string &memory_name) {
     }
 }
 
-static void _make_variable_op(const InspectPrintInfo::PrintInfo &info, InstrumentOperation &op, const char cmd) {
+static void _make_variable_op(const InspectPrintInfo::PrintInfo &info, InstrumentOperation &op, const char cmd,
+                             const std::string &instr_memory = "") {
     std::string item;
     if (cmd == 'l') {
         item = "local";
@@ -505,19 +621,19 @@ static void _make_variable_op(const InspectPrintInfo::PrintInfo &info, Instrumen
             item + ".get " + std::to_string(i),
         });
         if (info.types[i] == wasm::Type::i32) {
-            op.post_instructions.instructions.emplace_back("i32.store");
+            op.post_instructions.instructions.emplace_back(_on_memory("i32.store", instr_memory));
             op.post_instructions.instructions.emplace_back("i32.const 4");
         } else if (info.types[i] == wasm::Type::i64) {
-            op.post_instructions.instructions.emplace_back("i64.store");
+            op.post_instructions.instructions.emplace_back(_on_memory("i64.store", instr_memory));
             op.post_instructions.instructions.emplace_back("i32.const 8");
         } else if (info.types[i] == wasm::Type::f32) {
-            op.post_instructions.instructions.emplace_back("f32.store");
+            op.post_instructions.instructions.emplace_back(_on_memory("f32.store", instr_memory));
             op.post_instructions.instructions.emplace_back("i32.const 4");
         } else if (info.types[i] == wasm::Type::f64) {
-            op.post_instructions.instructions.emplace_back("f64.store");
+            op.post_instructions.instructions.emplace_back(_on_memory("f64.store", instr_memory));
             op.post_instructions.instructions.emplace_back("i32.const 8");
         } else if (info.types[i] == wasm::Type::v128) {
-            op.post_instructions.instructions.emplace_back("v128.store");
+            op.post_instructions.instructions.emplace_back(_on_memory("v128.store", instr_memory));
             op.post_instructions.instructions.emplace_back("i32.const 16");
         }
         op.post_instructions.instructions.insert(op.post_instructions.instructions.end(), {
@@ -528,7 +644,12 @@ static void _make_variable_op(const InspectPrintInfo::PrintInfo &info, Instrumen
     }
 }
 
-static void _make_write_op(InstrumentOperation &op, const CommonWasmBuilder &builder) {
+static void _make_write_op(InstrumentOperation &op, const CommonWasmBuilder &builder, const std::string &cache_name,
+                           bool separate = false) {
+    // the rest works on the data page in the app memory
+    if (separate) op.post_instructions.instructions.emplace_back("call $__instr_move_data");
+    auto &insts = op.post_instructions.instructions;
+    size_t begin = insts.size();
     op.post_instructions.instructions.insert(op.post_instructions.instructions.end(), 
     {
         // construct ciovec
@@ -558,7 +679,7 @@ static void _make_write_op(InstrumentOperation &op, const CommonWasmBuilder &bui
         "global.get $__instr_base_addr",
         "i32.const 1024",
         "i32.add",
-        "i32.const 18",
+        "i32.const " + std::to_string(cache_name.size()),
         "global.get $__instr_wasi_ret_addr",
         "call $__instr_fopen_rw",
         "i32.const 0",
@@ -594,19 +715,43 @@ static void _make_write_op(InstrumentOperation &op, const CommonWasmBuilder &bui
         "call $" + builder.getWasiName("proc_exit").value(),
         "end",
     });
+    if (separate) {
+        // the app gets its page back before any exit
+        for (size_t i = begin; i < insts.size(); i++) {
+            if (insts[i] == "i32.const 12") insts.insert(insts.begin() + (i++), "call $__instr_restore_data");
+        }
+        insts.emplace_back("call $__instr_restore_data");
+    }
+}
+
+// call /name/ at the beginning of _start, or make it the start function
+static void _call_at_start(Instrumenter &instrumenter, const std::string &name) {
+    auto start_func = instrumenter.getStartFunction();
+    if (start_func != nullptr) {
+        InstrumentOperation temp;
+        temp.post_instructions.instructions.emplace_back("call $" + name);
+        InstrumentResult iresult = instrumenter.instrumentFunction(temp, start_func->name.toString().c_str(), 0);
+        assert(iresult == InstrumentResult::success);
+    } else {
+        instrumenter.getModule()->addStart(name);
+    }
 }
 
+// hook_unknown = false leaves calls to functions missing in info alone,
+// e.g. the helpers called by already inserted probes
 static void _make_bt_instrument(Instrumenter &instrumenter, 
                                 const InspectPrintInfo::BacktracePrintInfo &info, 
                                 const std::string &inspect_func_name,
-                                const size_t inspect_line_num) {
+                                const size_t inspect_line_num,
+                                bool hook_unknown = true,
+                                const std::string &instr_memory = "") {
     InstrumentOperation hook_call;
     hook_call.pre_instructions.instructions = {
         "global.get $__instr_iobuf_addr",
         "global.get $__instr_iobuf_len",
         "i32.add",
         "i32.const -1", // to be modified
-        "i32.store",
+        _on_memory("i32.store", instr_memory),
         "i32.const 4",
         "global.get $__instr_iobuf_len",
         "i32.add",
@@ -619,7 +764,7 @@ static void _make_bt_instrument(Instrumenter &instrumenter,
         auto added_instructions = builder.makeOperations(instrumenter.getModule(), {hook_call});
         auto hook_insts = (*added_instructions)[0].pre_instructions;
 
-        auto inst_vistor = [&hook_insts, &info, &instrumenter, &if_in_inspect_func, &line_num, &inspect_line_num]
+        auto inst_vistor = [&hook_insts, &info, &instrumenter, &if_in_inspect_func, &line_num, &inspect_line_num, hook_unknown]
                                     (std::list<wasm::StackInst*> &l, std::list<wasm::StackInst*>::iterator &iter) {
             if (if_in_inspect_func) {
                 line_num++;
@@ -629,6 +774,7 @@ static void _make_bt_instrument(Instrumenter &instrumenter,
             if (inst->origin->_id == wasm::Expression::Id::CallId) {
                 auto call = inst->origin->dynCast<wasm::Call>();
                 auto idx_iter = info.funcname_map.find(call->target.toString());
+                if (!hook_unknown && idx_iter == info.funcname_map.end()) return;
                 wasm::StackInst* const_neg_one = hook_insts[3];
                 if (idx_iter != info.funcname_map.end()) {
                     hook_insts[3] = _make_stack_inst(wasm::StackInst::Basic, 
@@ -655,6 +801,7 @@ static void _make_bt_instrument(Instrumenter &instrumenter,
             if (!instrumenter.scopeContains(func->name.toString())) return;
             if (func->name.toString() == inspect_func_name) if_in_inspect_func = true;
             iterInstructions(func, inst_vistor);
+            instrumenter.stackIRChanged(func->name.toString());
             if_in_inspect_func = false;
         };
         
@@ -662,100 +809,660 @@ static void _make_bt_instrument(Instrumenter &instrumenter,
     } catch(...) {
         assert(false);
     }
-
-    auto start_func = instrumenter.getStartFunction();
-    if (start_func != nullptr) {
-        InstrumentOperation temp;
-        temp.post_instructions.instructions.emplace_back("call $__instr_load_data");
-        InstrumentResult iresult = instrumenter.instrumentFunction(temp, start_func->name.toString().c_str(), 0);
-        assert(iresult == InstrumentResult::success);
-    } else {
-        instrumenter.getModule()->addStart("__instr_load_data");
-    }
 }
 
-static void do_pre_instrument(Instrumenter &instrumenter,
+static bool do_pre_instrument(Instrumenter &instrumenter,
                               const std::string &inspect_func_name,
                               const size_t inspect_line_num,
                               const std::string &inspect_command,
-                              const InspectPrintInfo &print_info)
+                              const InspectPrintInfo &print_info,
+                              const std::string &cache_name,
+                              bool separate = false)
 {
     // auto start_func = instrumenter.getStartFunction();
     // assert(start_func != nullptr);
     CommonWasmBuilder wasm_builder;
-    _add_imports(instrumenter, wasm_builder);
+    add_wasi_imports(instrumenter, wasm_builder);
     _add_globals(instrumenter);
     std::string memory_name = "mem";
-    _add_memory(instrumenter, memory_name);
-    _add_data_segments(instrumenter);
-    _add_functions(instrumenter, wasm_builder);
+    std::string instr_memory = separate ? INSTR_MEMORY : "";
+    if (separate) {
+        _use_app_memory(instrumenter, memory_name);
+        if (!_add_instr_memory(instrumenter, 2)) return false;
+    } else {
+        _add_memory(instrumenter, memory_name);
+    }
+    _add_data_segments(instrumenter, cache_name);
+    // with a separate memory, the data page follows the saved app page
+    _add_functions(instrumenter, wasm_builder, memory_name, cache_name, instr_memory, 1);
     _add_exports(instrumenter, memory_name);
 
     InstrumentOperation op;
     if (inspect_command == "l" || inspect_command == "g") {
         op.post_instructions.instructions.emplace_back("call $__instr_load_data");
-        _make_variable_op(*(print_info.info), op, inspect_command[0]);
+        _make_variable_op(*(print_info.info), op, inspect_command[0], instr_memory);
     }
-    _make_write_op(op, wasm_builder);
+    _make_write_op(op, wasm_builder, cache_name, separate);
     op.post_instructions.instructions.emplace_back("i32.const 10");
     op.post_instructions.instructions.emplace_back("call $" + wasm_builder.getWasiName("proc_exit").value());
     InstrumentResult iresult = instrumenter.instrumentFunction(op, inspect_func_name.c_str(), inspect_line_num);
-    assert(iresult == InstrumentResult::success);
+    if (iresult != InstrumentResult::success) return false;
     
     if (inspect_command == "bt") {
         _make_bt_instrument(instrumenter,
                             *dynamic_cast<InspectPrintInfo::BacktracePrintInfo*>(print_info.info),
-                            inspect_func_name, inspect_line_num);
+                            inspect_func_name, inspect_line_num, true, instr_memory);
+        _call_at_start(instrumenter, "__instr_load_data");
     }
-    assert(BinaryenModuleValidate(instrumenter.getModule()));
+    return instrumenter.validate();
 }
 
-static void modify_runtime_command(std::string &cmd, const std::string &wasm_file) {
-    if ((cmd.find("--dir=.") == std::string::npos) && (cmd.find(R"("--dir=.")") == std::string::npos)) {
-        auto pos = cmd.find(" ");
-        if (pos == std::string::npos) {
-            cmd += " --dir=.";
-        } else {
-            cmd.insert(pos, " --dir=.");
+// normalize user input to the short form of a command
+// return empty string on an invalid command
+static std::string normalize_command(const std::string &command) {
+    if (command == "locals" || command == "l") return "l";
+    if (command == "globals" || command == "g") return "g";
+    if (command == "backtrace" || command == "bt") return "bt";
+    return "";
+}
+
+static std::string command_long_name(const std::string &command) {
+    if (command == "l") return "locals";
+    if (command == "g") return "globals";
+    if (command == "bt") return "backtrace";
+    return "";
+}
+
+// make print info based on a normalized command
+static InspectPrintInfo* make_print_info(Instrumenter &instrumenter,
+                                         const std::string &inspect_func_name,
+                                         const std::string &inspect_command) {
+    InspectPrintInfo* inspect_print_info = nullptr;
+    if (inspect_command == "l") {
+        inspect_print_info = new InspectPrintInfo(InspectPrintInfo::Type::local);
+        auto target_func = instrumenter.getFunction(inspect_func_name.c_str());
+        auto linfo = dynamic_cast<InspectPrintInfo::LocalPrintInfo*>(inspect_print_info->info);
+        linfo->num = target_func->getNumLocals();
+        linfo->param_num = target_func->getNumParams();
+        for (size_t i = 0; i < linfo->num; i++) {
+            auto type = target_func->getLocalType(i);
+            linfo->types.emplace_back(type);
+            linfo->names.emplace_back(target_func->getLocalNameOrGeneric(i).toString());
+        }
+    } else if (inspect_command == "g") {
+        inspect_print_info = new InspectPrintInfo(InspectPrintInfo::Type::global);
+        auto target_module = instrumenter.getModule();
+        auto ginfo = dynamic_cast<InspectPrintInfo::GlobalPrintInfo*>(inspect_print_info->info);
+        ginfo->num = target_module->globals.size();
+        for (size_t i = 0; i < ginfo->num; i++) {
+            auto type = target_module->globals[i]->type;
+            if (!type.isNumber()) type = wasm::Type::none;
+            ginfo->types.emplace_back(type);
+            ginfo->names.emplace_back(target_module->globals[i]->name.toString());
+        }
+    } else if (inspect_command == "bt") {
+        inspect_print_info = new InspectPrintInfo(InspectPrintInfo::Type::backtrace);
+        auto binfo = dynamic_cast<InspectPrintInfo::BacktracePrintInfo*>(inspect_print_info->info);
+        binfo->num = instrumenter.getModule()->functions.size();
+        binfo->names.resize(binfo->num);
+        size_t i = 0;
+        for (const auto &f : instrumenter.getModule()->functions) {
+            if (f->imported()) {
+                binfo->names[i] = f->base.toString();
+            } else {
+                binfo->names[i] = f->name.toString();
+            }
+            binfo->funcname_map.emplace(binfo->names[i], i);
+            i++;
         }
     }
-    auto pos = cmd.find(".wasm");
-    if (pos == std::string::npos) {
-        cmd += " ";
-        cmd += wasm_file;
-    } else {
-        auto start_pos = cmd.rfind(" ", pos);
-        assert(start_pos != std::string::npos);
-        while (cmd[start_pos] == ' ') start_pos++;
-        cmd.replace(start_pos, pos + 5 - start_pos, wasm_file);
-    }
+    return inspect_print_info;
 }
 
-static bool run_runtime_command(const std::string &cmd) {
-    int return_code = system(cmd.c_str());
-    return_code = ((return_code) & 0xff00) >> 8;
-    if (return_code == 10) {
-        return true;
-    } else if (return_code == 12) {
+// runtime exit code:
+// 10 denotes the inspection point is reached and the cache file is written
+// 12 denotes the instrumented part failed
+static void print_runtime_error(int return_code) {
+    if (return_code == 12) {
         std::printf("(wabidb-inspect) Instrumented part failed!\n");
     } else {
         std::printf("(wabidb-inspect) Unexpected return code: %d!\n", return_code);
     }
-    return false;
 }
 
 static void print_cache_file(const InspectPrintInfo &info, const std::string &filename) {
-    if (access(filename.c_str(), R_OK) == 0) {
+    if (access(filename.c_str(), R_OK) != 0) {
+        std::printf("(wabidb-inspect) Cache file cannot access!\n");
+    } else if (!info.readable(filename)) {
+        std::printf("(wabidb-inspect) Cache file is incomplete!\n");
+    } else {
         info.print(filename);
+    }
+}
+
+// exit status of the tool, also used as the status of a single probe in script mode
+enum InspectExitCode {
+    exit_success = 0,
+    // bad command line options or unreadable script file
+    exit_usage_error,
+    // cannot read the input module
+    exit_load_error,
+    // invalid probe position or command in the script
+    exit_probe_error,
+    // instrumentation or writing of the instrumented module failed
+    exit_instrument_error,
+    // the runtime did not reach the inspection point
+    exit_runtime_error,
+    // the inspection point is reached while the cache file cannot be read
+    exit_cache_error,
+};
+
+static const char* exit_code2str(InspectExitCode code) {
+    const char* code_map[] = {
+        "ok",
+        "usage_error",
+        "load_error",
+        "probe_error",
+        "instrument_error",
+        "runtime_error",
+        "cache_error",
+    };
+    return code_map[int(code)];
+}
+
+// a single inspection of script mode
+struct InspectProbe {
+    std::string func_name;
+    size_t line_num;
+    std::string command;
+    // line number in the script file for error reporting
+    size_t script_line;
+};
+
+// line number of a probe that stands for every line of its function, all-probes mode only
+const size_t ALL_LINES = SIZE_MAX;
+
+static bool parse_line_num(const std::string &s, size_t &line_num) {
+    if (s == "*") {
+        line_num = ALL_LINES;
+        return true;
+    }
+    if (s.empty() || (s.size() > 18) || (s.find_first_not_of("0123456789") != std::string::npos)) return false;
+    line_num = std::stoul(s);
+    return true;
+}
+
+// script file has one probe per line: <func> <line> <command>
+// empty lines and lines start with '#' are ignored
+static bool read_script(const std::string &filename, std::vector<InspectProbe> &probes) {
+    std::ifstream ifile(filename);
+    if (!ifile.is_open()) {
+        std::cerr << "(wabidb-inspect) Cannot open script file: " << filename << std::endl;
+        return false;
+    }
+    std::string line;
+    size_t script_line = 0;
+    while (std::getline(ifile, line)) {
+        script_line++;
+        std::istringstream lstream(line);
+        InspectProbe probe;
+        probe.script_line = script_line;
+        if (!(lstream >> probe.func_name) || probe.func_name[0] == '#') continue;
+        std::string line_str;
+        std::string extra;
+        if (!(lstream >> line_str >> probe.command) || (lstream >> extra) ||
+            !parse_line_num(line_str, probe.line_num)) {
+            std::cerr << "(wabidb-inspect) Script line " << script_line
+                      << ": expect <func> <line> <command>" << std::endl;
+            return false;
+        }
+        probes.emplace_back(probe);
+    }
+    return true;
+}
+
+// run one probe non-interactively, messages go to stderr so that stdout keeps the records only
+static InspectExitCode run_probe(Instrumenter &instrumenter,
+                                 const InstrumentConfig &config,
+                                 const InspectProbe &probe,
+                                 const std::string &runtime_command,
+                                 const std::string &cache_name,
+                                 bool json,
+                                 size_t probe_idx,
+                                 bool separate) {
+    InspectExitCode code = InspectExitCode::exit_success;
+    InspectPrintInfo* print_info = nullptr;
+    std::string command = normalize_command(probe.command);
+    std::string cmd = runtime_command;
+
+    if (command.empty() || !validate_inspect_pos(*instrumenter.getModule(), probe.func_name, probe.line_num)) {
+        std::cerr << "(wabidb-inspect) Script line " << probe.script_line << ": invalid probe "
+                  << probe.func_name << " " << probe.line_num << " " << probe.command << std::endl;
+        code = InspectExitCode::exit_probe_error;
     } else {
-        std::printf("(wabidb-inspect) Cache file cannot access!\n");
+        print_info = make_print_info(instrumenter, probe.func_name, command);
+        std::remove(cache_name.c_str());
+        if (!do_pre_instrument(instrumenter, probe.func_name, probe.line_num, command, *print_info, cache_name, separate) ||
+            (instrumenter.writeBinary() != InstrumentResult::success)) {
+            code = InspectExitCode::exit_instrument_error;
+        } else if (cmd.empty()) {
+            std::cerr << "(wabidb-inspect) No runtime command, write instrumented file to: "
+                      << config.targetname << std::endl;
+        } else {
+            modify_runtime_command(cmd, config.targetname);
+            // keep stdout clean for json records
+            if (json) cmd += " 1>&2";
+            int return_code = run_runtime_command(cmd);
+            if (return_code != 10) {
+                std::cerr << "(wabidb-inspect) Probe " << probe_idx << " runtime return code: " << return_code << std::endl;
+                code = InspectExitCode::exit_runtime_error;
+            } else if (access(cache_name.c_str(), R_OK) != 0 || !print_info->readable(cache_name)) {
+                code = InspectExitCode::exit_cache_error;
+            }
+        }
     }
+
+    if (json) {
+        std::cout << "{\"probe\":" << probe_idx
+                  << ",\"func\":\"" << InspectPrintInfo::json_escape(probe.func_name) << "\""
+                  << ",\"line\":" << probe.line_num
+                  << ",\"command\":\"" << InspectPrintInfo::json_escape(
+                        command.empty() ? probe.command : command_long_name(command)) << "\""
+                  << ",\"status\":\"" << exit_code2str(code) << "\"";
+        if (code == InspectExitCode::exit_success && !cmd.empty()) {
+            std::cout << ",";
+            print_info->print_json(cache_name, std::cout);
+        }
+        std::cout << "}" << std::endl;
+    } else {
+        std::printf("(wabidb-inspect) Probe %ld: %s %ld %s -> %s\n", probe_idx, probe.func_name.c_str(),
+                    probe.line_num, probe.command.c_str(), exit_code2str(code));
+        if (code == InspectExitCode::exit_success && !cmd.empty()) {
+            print_info->print(cache_name);
+        }
+    }
+    delete print_info;
+    return code;
+}
+
+// all-probes mode: every probe of a script is inserted once, each guarded by its byte of an
+// enable table that __instr_probe_init fills at startup from the WABIDB_PROBES environment
+// variable, a comma separated list of probe ids or '*' for all of them
+// a disabled probe costs a global.get, a load and a branch
+const char PROBES_ENV[] = "WABIDB_PROBES=";
+const size_t PROBES_ENV_LEN = sizeof(PROBES_ENV) - 1;
+
+// lines of a function that are not removed by the stack ir optimizer
+static size_t func_line_num(const wasm::Function* func) {
+    return func->stackIR->size() - std::count(func->stackIR->begin(), func->stackIR->end(), nullptr);
+}
+
+// replace '*' of functions and lines by every defined function and every line of the function
+// probes of unknown functions are kept for the caller to report
+static std::vector<InspectProbe> expand_probes(wasm::Module &m, const std::vector<InspectProbe> &probes) {
+    std::vector<InspectProbe> ret;
+    for (const auto &probe : probes) {
+        std::vector<wasm::Function*> funcs;
+        if (probe.func_name == "*") {
+            iterDefinedFunctions(&m, [&funcs](wasm::Function* func) {
+                if (func->stackIR != nullptr) funcs.push_back(func);
+            });
+        } else {
+            auto func = m.getFunctionOrNull(probe.func_name);
+            if ((func == nullptr) || (func->stackIR == nullptr) || (probe.line_num != ALL_LINES)) {
+                ret.push_back(probe);
+                continue;
+            }
+            funcs.push_back(func);
+        }
+        for (auto func : funcs) {
+            InspectProbe expanded = probe;
+            expanded.func_name = func->name.toString();
+            if (probe.line_num != ALL_LINES) {
+                ret.push_back(expanded);
+                continue;
+            }
+            for (size_t line = 1; line <= func_line_num(func); line++) {
+                expanded.line_num = line;
+                ret.push_back(expanded);
+            }
+        }
+    }
+    return ret;
+}
+
+// grow the enable table and the data page, then enable the probes listed in WABIDB_PROBES
+// the environment is read into the io buffer, which is free at startup
+// with /instr_memory/ the table is at its address 0, and wasi needs the environment in the
+// app memory, so it is read into the first app page, which is saved in /instr_memory/ meanwhile
+static std::string make_probe_init(const CommonWasmBuilder &builder, size_t num_probes, uint64_t table_pages,
+                                   const std::string &memory_name = "", const std::string &instr_memory = "") {
+    bool separate = !instr_memory.empty();
+    std::string saved_page = std::to_string(table_pages * 65536);
+    std::string restore_copy =
+        separate ? "i32.const 0\n"
+                   "i32.const " + saved_page + "\n"
+                   "i32.const 65536\n"
+                   "memory.copy $" + memory_name + " $" + instr_memory + "\n"
+                 : "";
+    // the app gets its page back before any exit
+    std::string proc_exit = "call $" + builder.getWasiName("proc_exit").value() + "\n";
+    std::string fail = restore_copy + "i32.const 12\n" + proc_exit;
+    std::string check_errno = "i32.const 0\ni32.ne\nif\n" + fail + "end\n";
+    std::string env_len = std::to_string(PROBES_ENV_LEN);
+    std::string num = std::to_string(num_probes);
+    std::string table = "i32.const 0\n";
+    if (!separate) {
+        table =
+            // the table is below the data page, so an overflowed io buffer traps instead of enabling probes
+            "i32.const " + std::to_string(table_pages) + "\n"
+            "memory.grow\n"
+            "local.tee $p\n"
+            "i32.const -1\n"
+            "i32.eq\n"
+            "if\n" +
+            fail +
+            "end\n"
+            "local.get $p\n"
+            "i32.const 65536\n"
+            "i32.mul\n";
+    }
+    // the environment goes to the io buffer up to the end of the data page, or with
+    // /instr_memory/ from address 0 up to the prefix at env_addr
+    std::string env_cap = std::to_string(separate ? 64512 : 65536 - PAGE_GUIDE - IOBUF_OFFSET);
+    std::string save_app_page =
+        // an app memory without pages cannot lend one, the probes stay off
+        separate ? "(block $no_env\n" +
+                   _on_memory("memory.size", memory_name) + "\n"
+                   "i32.eqz\n"
+                   "br_if $no_env\n"
+                   "i32.const " + saved_page + "\n"
+                   "i32.const 0\n"
+                   "i32.const 65536\n"
+                   "memory.copy $" + instr_memory + " $" + memory_name + "\n"
+                 : "";
+    std::string restore_app_page = separate ? restore_copy + ")\n" : "";
+    // where the prefix to look for, the sizes and the environment go in the app memory
+    std::string env_addr = separate ? "i32.const 64512\n" : "global.get $__instr_base_addr\ni32.const 1536\ni32.add\n";
+    std::string ret_addr = separate ? "i32.const 0\n" : "global.get $__instr_wasi_ret_addr\n";
+    std::string buf_addr = separate ? "i32.const 0\n" : "global.get $__instr_iobuf_addr\n";
+    return
+        "(func $__instr_probe_init\n"
+        "(local $count i32)\n"
+        "(local $i i32)\n"
+        "(local $p i32)\n"
+        "(local $c i32)\n"
+        "(local $id i32)\n"
+        "(local $seen i32)\n" +
+        table +
+        "global.set $__instr_probes\n"
+        "call $__instr_load_data\n" +
+        save_app_page +
+
+        env_addr +
+        "i32.const 0\n"
+        "i32.const " + env_len + "\n"
+        "memory.init $.instr_probe_env\n" +
+
+        ret_addr +
+        ret_addr +
+        "i32.const 4\n"
+        "i32.add\n"
+        "call $" + builder.getWasiName("environ_sizes_get").value() + "\n" +
+        check_errno +
+        ret_addr +
+        "i32.load\n"
+        "local.tee $count\n"
+        "i32.const 4\n"
+        "i32.mul\n" +
+        ret_addr +
+        "i32.load offset=4\n"
+        "i32.add\n"
+        "i32.const " + env_cap + "\n"
+        "i32.gt_u\n"
+        "if\n" +
+        fail +
+        "end\n" +
+        buf_addr +
+        buf_addr +
+        "local.get $count\n"
+        "i32.const 4\n"
+        "i32.mul\n"
+        "i32.add\n"
+        "call $" + builder.getWasiName("environ_get").value() + "\n" +
+        check_errno +
+
+        "(block $done\n"
+        "(loop $next_env\n"
+        "local.get $i\n"
+        "local.get $count\n"
+        "i32.ge_u\n"
+        "br_if $done\n" +
+        buf_addr +
+        "local.get $i\n"
+        "i32.const 4\n"
+        "i32.mul\n"
+        "i32.add\n"
+        "i32.load\n"
+        "local.set $p\n"
+        "local.get $i\n"
+        "i32.const 1\n"
+        "i32.add\n"
+        "local.set $i\n"
+        "local.get $p\n" +
+        env_addr +
+        "i32.const " + env_len + "\n"
+        "call $__instr_memcmp\n"
+        "br_if $next_env\n"
+
+        "local.get $p\n"
+        "i32.const " + env_len + "\n"
+        "i32.add\n"
+        "local.tee $p\n"
+        "i32.load8_u\n"
+        "i32.const 42\n" // '*'
+        "i32.eq\n"
+        "if\n"
+        "global.get $__instr_probes\n"
+        "i32.const 1\n"
+        "i32.const " + num + "\n" +
+        _on_memory("memory.fill", instr_memory) + "\n"
+        "br $done\n"
+        "end\n"
+
+        "(loop $next_char\n"
+        "local.get $p\n"
+        "i32.load8_u\n"
+        "local.tee $c\n"
+        "i32.const 48\n" // '0'
+        "i32.sub\n"
+        "i32.const 10\n"
+        "i32.lt_u\n"
+        "if\n"
+        "local.get $id\n"
+        "i32.const 10\n"
+        "i32.mul\n"
+        "local.get $c\n"
+        "i32.const 48\n"
+        "i32.sub\n"
+        "i32.add\n"
+        "local.set $id\n"
+        "i32.const 1\n"
+        "local.set $seen\n"
+        "else\n"
+        // a separator or the end of the value
+        "local.get $seen\n"
+        "local.get $id\n"
+        "i32.const " + num + "\n"
+        "i32.lt_u\n"
+        "i32.and\n"
+        "if\n"
+        "global.get $__instr_probes\n"
+        "local.get $id\n"
+        "i32.add\n"
+        "i32.const 1\n" +
+        _on_memory("i32.store8", instr_memory) + "\n"
+        "end\n"
+        "i32.const 0\n"
+        "local.set $id\n"
+        "i32.const 0\n"
+        "local.set $seen\n"
+        "local.get $c\n"
+        "i32.eqz\n"
+        "br_if $done\n"
+        "end\n"
+        "local.get $p\n"
+        "i32.const 1\n"
+        "i32.add\n"
+        "local.set $p\n"
+        "br $next_char\n"
+        ")\n"
+        ")\n"
+        ")\n" +
+        restore_app_page +
+        ")";
+}
+
+// probes must be valid with normalized commands
+static bool do_all_probes_instrument(Instrumenter &instrumenter, const std::vector<InspectProbe> &probes,
+                                     const std::string &cache_name, bool separate = false) {
+    // print infos are made on the module before the helpers are added, as in do_pre_instrument()
+    std::map<std::pair<std::string, std::string>, std::unique_ptr<InspectPrintInfo>> print_infos;
+    for (const auto &probe : probes) {
+        auto key = std::make_pair(probe.command == "l" ? probe.func_name : "", probe.command);
+        if (print_infos.find(key) != print_infos.end()) continue;
+        print_infos[key].reset(make_print_info(instrumenter, probe.func_name, probe.command));
+    }
+
+    uint64_t table_pages = std::max<uint64_t>(1, (probes.size() + 65535) / 65536);
+    CommonWasmBuilder wasm_builder;
+    add_wasi_imports(instrumenter, wasm_builder);
+    add_wasi_environ_imports(instrumenter, wasm_builder);
+    _add_globals(instrumenter);
+    auto global_ret = instrumenter.addGlobal("__instr_probes", BinaryenTypeInt32(), true, BinaryenLiteralInt32(-1));
+    assert(global_ret != nullptr);
+    std::string memory_name = "mem";
+    std::string instr_memory = separate ? INSTR_MEMORY : "";
+    if (separate) {
+        _use_app_memory(instrumenter, memory_name);
+        if (!_add_instr_memory(instrumenter, table_pages + 2)) return false;
+    } else {
+        _add_memory(instrumenter, memory_name, table_pages + 1);
+    }
+    _add_data_segments(instrumenter, cache_name);
+    auto data_ret = instrumenter.addPassiveDateSegment(".instr_probe_env", PROBES_ENV, PROBES_ENV_LEN);
+    assert(data_ret != nullptr);
+    _add_functions(instrumenter, wasm_builder, memory_name, cache_name, instr_memory, table_pages + 1);
+    if (!instrumenter.addFunctions({"__instr_probe_init"},
+                                   {make_probe_init(wasm_builder, probes.size(), table_pages,
+                                                    memory_name, instr_memory)})) return false;
+    _add_exports(instrumenter, memory_name);
+    // the address of the table, for hosts that flip probes themselves
+    // in the exported memory, or at 0 in the separate memory
+    if (instrumenter.getExport("__instr_probes") == nullptr) {
+        auto export_ret = instrumenter.addExport(wasm::ModuleItemKind::Global, "__instr_probes", "__instr_probes");
+        assert(export_ret != nullptr);
+    }
+
+    std::vector<InstrumentOperation> ops(probes.size());
+    std::vector<std::string> names;
+    std::vector<size_t> positions;
+    for (size_t i = 0; i < probes.size(); i++) {
+        const auto &probe = probes[i];
+        auto &insts = ops[i].post_instructions.instructions;
+        insts = {
+            "global.get $__instr_probes",
+            _on_memory("i32.load8_u", instr_memory) + " offset=" + std::to_string(i),
+            "if",
+        };
+        if (probe.command != "bt") {
+            // drop the calls recorded for backtrace probes
+            insts.emplace_back("i32.const 0");
+            insts.emplace_back("global.set $__instr_iobuf_len");
+            auto key = std::make_pair(probe.command == "l" ? probe.func_name : "", probe.command);
+            _make_variable_op(*(print_infos[key]->info), ops[i], probe.command[0], instr_memory);
+        }
+        _make_write_op(ops[i], wasm_builder, cache_name, separate);
+        insts.emplace_back("i32.const 10");
+        insts.emplace_back("call $" + wasm_builder.getWasiName("proc_exit").value());
+        insts.emplace_back("end");
+        names.emplace_back(probe.func_name);
+        positions.emplace_back(probe.line_num);
+    }
+    if (instrumenter.instrumentFunctions(ops, names, positions) != InstrumentResult::success) return false;
+
+    auto bt_info = print_infos.find(std::make_pair(std::string(), std::string("bt")));
+    if (bt_info != print_infos.end()) {
+        // every call is recorded, the calls of the probes themselves are not
+        _make_bt_instrument(instrumenter,
+                            *dynamic_cast<InspectPrintInfo::BacktracePrintInfo*>(bt_info->second->info),
+                            "", 0, false, instr_memory);
+    }
+    _call_at_start(instrumenter, "__instr_probe_init");
+    return instrumenter.validate();
+}
+
+// probe ids of an all-probes binary, in the order of WABIDB_PROBES
+static void print_probe_list(const std::vector<InspectProbe> &probes, bool json) {
+    for (size_t i = 0; i < probes.size(); i++) {
+        const auto &probe = probes[i];
+        if (json) {
+            std::cout << "{\"probe\":" << i
+                      << ",\"func\":\"" << InspectPrintInfo::json_escape(probe.func_name) << "\""
+                      << ",\"line\":" << probe.line_num
+                      << ",\"command\":\"" << command_long_name(probe.command) << "\"}" << std::endl;
+        } else {
+            std::printf("(wabidb-inspect) Probe %ld: %s %ld %s\n", i, probe.func_name.c_str(),
+                        probe.line_num, probe.command.c_str());
+        }
+    }
+}
+
+// print the cache file written by probe /id/ of an all-probes binary
+static InspectExitCode read_probe(Instrumenter &instrumenter,
+                                  const std::vector<InspectProbe> &probes,
+                                  size_t id,
+                                  const std::string &cache_name,
+                                  bool json) {
+    if (id >= probes.size()) {
+        std::cerr << "(wabidb-inspect) No probe " << id << ", the script has " << probes.size() << std::endl;
+        return InspectExitCode::exit_usage_error;
+    }
+    if (access(cache_name.c_str(), R_OK) != 0) {
+        std::cerr << "(wabidb-inspect) Cache file cannot access!" << std::endl;
+        return InspectExitCode::exit_cache_error;
+    }
+    const auto &probe = probes[id];
+    std::unique_ptr<InspectPrintInfo> print_info(make_print_info(instrumenter, probe.func_name, probe.command));
+    if (!print_info->readable(cache_name)) {
+        std::cerr << "(wabidb-inspect) Cache file is incomplete!" << std::endl;
+        return InspectExitCode::exit_cache_error;
+    }
+    if (json) {
+        std::cout << "{\"probe\":" << id
+                  << ",\"func\":\"" << InspectPrintInfo::json_escape(probe.func_name) << "\""
+                  << ",\"line\":" << probe.line_num
+                  << ",\"command\":\"" << command_long_name(probe.command) << "\""
+                  << ",\"status\":\"ok\",";
+        print_info->print_json(cache_name, std::cout);
+        std::cout << "}" << std::endl;
+    } else {
+        print_info->print(cache_name);
+    }
+    return InspectExitCode::exit_success;
 }
 
 int main(int argc, const char* argv[]) {
     const std::string WabidbInspectOption = "wabidb-inspect options";
     wasm::ToolOptions options("wabidb-inspect", "Make one point inspection into a wasm binary.");
     std::string command = "";
+    std::string script_name = "";
+    std::string all_probes_name = "";
+    std::string read_probe_id = "";
+    bool json = false;
+    bool peephole = false;
+    bool separate = false;
+    std::string cache_name = "";
 
     options
     .add("--output",
@@ -772,6 +1479,49 @@ int main(int argc, const char* argv[]) {
          WabidbInspectOption,
          wasm::Options::Arguments::One,
          [&](wasm::Options* o, const std::string& argument) { command = argument; })
+    .add("--script",
+         "-s",
+         "Run probes listed in a file non-interactively, one '<func> <line> <command>' per line",
+         WabidbInspectOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { script_name = argument; })
+    .add("--all-probes",
+         "-ap",
+         "Insert all probes of a script file at once, enabled at runtime by WABIDB_PROBES=<id>,... or '*'",
+         WabidbInspectOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { all_probes_name = argument; })
+    .add("--read-probe",
+         "-rp",
+         "Print the result of the probe with this id of an all-probes binary",
+         WabidbInspectOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { read_probe_id = argument; })
+    .add("--json",
+         "-j",
+         "Print one json record per probe in script or all-probes mode",
+         WabidbInspectOption,
+         wasm::Options::Arguments::Zero,
+         [&](wasm::Options* o, const std::string& argument) { json = true; })
+    .add("--peephole",
+         "-ph",
+         "Run the stack ir peephole optimizer on the probed functions in all-probes mode",
+         WabidbInspectOption,
+         wasm::Options::Arguments::Zero,
+         [&](wasm::Options* o, const std::string& argument) { peephole = true; })
+    .add("--separate-memory",
+         "-sm",
+         "Keep the probe data in a separate memory exported as __instr_mem (needs multi-memory)",
+         WabidbInspectOption,
+         wasm::Options::Arguments::Zero,
+         [&](wasm::Options* o, const std::string& argument) { separate = true; })
+    .add("--cache-file",
+         "-cf",
+         "Name of the cache file the probes write, relative to the preopened directory "
+         "(default: __instr_cache.file, or one per process with --script)",
+         WabidbInspectOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { cache_name = argument; })
     .add_positional("INFILE",
                     wasm::Options::Arguments::One,
                     [](wasm::Options* o, const std::string& argument) {
@@ -780,12 +1530,37 @@ int main(int argc, const char* argv[]) {
     options.parse(argc, argv);
     if (options.extra.find("infile") == options.extra.end()) {
         std::cerr << "Usage: wabidb-inspect <INFILE>" << std::endl;
-        return 1;
+        return InspectExitCode::exit_usage_error;
     }
     auto infile = options.extra["infile"];
     if ((infile.size() < 6) || (infile.substr(infile.size() - 5 , 5) != ".wasm")) {
         std::cerr << "INFILE must be a .wasm file" << std::endl;
-        return 1;
+        return InspectExitCode::exit_usage_error;
+    }
+    if (json && script_name.empty() && all_probes_name.empty()) {
+        std::cerr << "--json can only be used with --script or --all-probes" << std::endl;
+        return InspectExitCode::exit_usage_error;
+    }
+    if (peephole && all_probes_name.empty()) {
+        std::cerr << "--peephole can only be used with --all-probes" << std::endl;
+        return InspectExitCode::exit_usage_error;
+    }
+    if (cache_name.size() > MAX_CACHE_FILE_LEN) {
+        std::cerr << "--cache-file name is longer than " << MAX_CACHE_FILE_LEN << std::endl;
+        return InspectExitCode::exit_usage_error;
+    }
+    // parallel script runs in one directory do not share a cache file
+    bool own_cache = cache_name.empty() && !script_name.empty();
+    if (own_cache) {
+        cache_name = "__instr_cache." + std::to_string(getpid()) + ".file";
+    } else if (cache_name.empty()) {
+        cache_name = DEFAULT_CACHE_FILE;
+    }
+    size_t read_probe_idx = 0;
+    if (!read_probe_id.empty() &&
+        (all_probes_name.empty() || !parse_line_num(read_probe_id, read_probe_idx) || (read_probe_idx == ALL_LINES))) {
+        std::cerr << "--read-probe needs a probe id and --all-probes" << std::endl;
+        return InspectExitCode::exit_usage_error;
     }
     if (options.extra.find("outfile") == options.extra.end()) {
         options.extra["outfile"] = wasm::removeSpecificSuffix(infile, ".wasm") + "-inspect.wasm";
@@ -800,10 +1575,69 @@ int main(int argc, const char* argv[]) {
     options.applyFeatures(*temp_module);
     config.feature = temp_module->features;
     delete temp_module;
+    if (separate) config.feature.enable(wasm::FeatureSet::MultiMemory);
 
     Instrumenter instrumenter;
     InstrumentResult iresult = instrumenter.setConfig(config);
-    assert(iresult == InstrumentResult::success);
+    if (iresult != InstrumentResult::success) {
+        std::cerr << "(wabidb-inspect) Cannot load: " << infile << std::endl;
+        return InspectExitCode::exit_load_error;
+    }
+
+    // non-interactive mode: run every probe of the script and
+    // exit with the status of the first failed probe
+    if (!script_name.empty()) {
+        std::vector<InspectProbe> probes;
+        if (!read_script(script_name, probes)) return InspectExitCode::exit_usage_error;
+        InspectExitCode ret = InspectExitCode::exit_success;
+        for (size_t i = 0; i < probes.size(); i++) {
+            if (i != 0) {
+                instrumenter.clear();
+                if (instrumenter.setConfig(config) != InstrumentResult::success) {
+                    return InspectExitCode::exit_load_error;
+                }
+            }
+            auto code = run_probe(instrumenter, config, probes[i], command, cache_name, json, i, separate);
+            if (ret == InspectExitCode::exit_success) ret = code;
+        }
+        if (own_cache) std::remove(cache_name.c_str());
+        return ret;
+    }
+
+    // all-probes mode: instrument every probe of the script once, or read the result of one
+    if (!all_probes_name.empty()) {
+        std::vector<InspectProbe> probes;
+        if (!read_script(all_probes_name, probes)) return InspectExitCode::exit_usage_error;
+        probes = expand_probes(*instrumenter.getModule(), probes);
+        for (auto &probe : probes) {
+            auto normalized = normalize_command(probe.command);
+            auto func = instrumenter.getModule()->getFunctionOrNull(probe.func_name);
+            if (normalized.empty() || (func == nullptr) || (func->stackIR == nullptr) ||
+                (probe.line_num > func_line_num(func))) {
+                std::cerr << "(wabidb-inspect) Script line " << probe.script_line << ": invalid probe "
+                          << probe.func_name << " " << probe.line_num << " " << probe.command << std::endl;
+                return InspectExitCode::exit_probe_error;
+            }
+            probe.command = normalized;
+        }
+        if (!read_probe_id.empty()) return read_probe(instrumenter, probes, read_probe_idx, cache_name, json);
+        PeepholeResult peephole_result;
+        if (!do_all_probes_instrument(instrumenter, probes, cache_name, separate) ||
+            (peephole && !peepholeOptimize(instrumenter, {}, peephole_result)) ||
+            (instrumenter.writeBinary() != InstrumentResult::success)) {
+            return InspectExitCode::exit_instrument_error;
+        }
+        print_probe_list(probes, json);
+        if (peephole) {
+            std::cerr << "(wabidb-inspect) Peephole: " << peephole_result.functions << " functions, "
+                      << peephole_result.folded_constants << " constants folded, "
+                      << peephole_result.fused_tees << " tees fused, "
+                      << peephole_result.forwarded_globals << " globals forwarded" << std::endl;
+        }
+        std::cerr << "(wabidb-inspect) Write instrumented file with " << probes.size()
+                  << " probes to: " << config.targetname << std::endl;
+        return InspectExitCode::exit_success;
+    }
 
     std::stringstream mstream;
     auto is_color = Colors::isEnabled();
@@ -865,62 +1699,27 @@ int main(int argc, const char* argv[]) {
                 std::printf("(wabidb-inspect) Enter inspect command\n");
                 std::printf(" > locals(l) | globals(g) | backtrace(bt)\n > ");
                 std::cin >> inspect_command;
-                if (inspect_command == "locals" || inspect_command == "l") {
-                    inspect_command = "l";
-                    // make print info based on command l
-                    inspect_print_info = new InspectPrintInfo(InspectPrintInfo::Type::local);
-                    auto target_func = instrumenter.getFunction(inspect_func_name.c_str());
-                    auto linfo = dynamic_cast<InspectPrintInfo::LocalPrintInfo*>(inspect_print_info->info);
-                    linfo->num = target_func->getNumLocals();
-                    linfo->param_num = target_func->getNumParams();
-                    for (size_t i = 0; i < linfo->num; i++) {
-                        auto type = target_func->getLocalType(i);
-                        linfo->types.emplace_back(type);
-                        linfo->names.emplace_back(target_func->getLocalNameOrGeneric(i).toString());
-                    }
-                } else if (inspect_command == "globals" || inspect_command == "g") {
-                    inspect_command = "g";
-                    // make print info based on command g
-                    inspect_print_info = new InspectPrintInfo(InspectPrintInfo::Type::global);
-                    auto target_module = instrumenter.getModule();
-                    auto ginfo = dynamic_cast<InspectPrintInfo::GlobalPrintInfo*>(inspect_print_info->info);
-                    ginfo->num = target_module->globals.size();
-                    for (size_t i = 0; i < ginfo->num; i++) {
-                        auto type = target_module->globals[i]->type;
-                        if (!type.isNumber()) type = wasm::Type::none;
-                        ginfo->types.emplace_back(type);
-                        ginfo->names.emplace_back(target_module->globals[i]->name.toString());
-                    }
-                } else if (inspect_command == "backtrace" || inspect_command == "bt") {
-                    inspect_command = "bt";
-                    inspect_print_info = new InspectPrintInfo(InspectPrintInfo::Type::backtrace);
-                    auto binfo = dynamic_cast<InspectPrintInfo::BacktracePrintInfo*>(inspect_print_info->info);
-                    binfo->num = instrumenter.getModule()->functions.size();
-                    binfo->names.resize(binfo->num);
-                    size_t i = 0;
-                    for (const auto &f : instrumenter.getModule()->functions) {
-                        if (f->imported()) {
-                            binfo->names[i] = f->base.toString();
-                        } else {
-                            binfo->names[i] = f->name.toString();
-                        }
-                        binfo->funcname_map.emplace(binfo->names[i], i);
-                        i++;
-                    }
-                } else {
+                inspect_command = normalize_command(inspect_command);
+                if (inspect_command.empty()) {
                     std::printf(" Error: please enter valid command\n");
                     state = InspectState::commanding;
                     break;
                 }
+                inspect_print_info = make_print_info(instrumenter, inspect_func_name, inspect_command);
                 state = InspectState::instrumenting;
                 break;
             }
             case InspectState::instrumenting:
             {
                 std::printf("(wabidb-inspect) Instrumenting ...\n");
-                do_pre_instrument(instrumenter, inspect_func_name, inspect_line_num, inspect_command, *inspect_print_info);
+                bool instrumented = do_pre_instrument(instrumenter, inspect_func_name, inspect_line_num, inspect_command,
+                                                      *inspect_print_info, cache_name, separate);
+                if (!instrumented || (instrumenter.writeBinary() != InstrumentResult::success)) {
+                    std::printf("(wabidb-inspect) Instrumentation failed!\n");
+                    delete inspect_print_info;
+                    return InspectExitCode::exit_instrument_error;
+                }
                 std::printf("(wabidb-inspect) Write instrumented file to: %s\n", options.extra["outfile"].c_str());
-                instrumenter.writeBinary();
                 state = InspectState::executing;
                 break;
             }
@@ -929,10 +1728,14 @@ int main(int argc, const char* argv[]) {
                 if (command.size() == 0) {
                     std::printf("(wabidb-inspect) No runtime command, you should deal with the instrumented wasm file yourself!\n");
                 } else {
-                    modify_runtime_command(command, options.extra["outfile"]);
-                    std::printf("(wabidb-inspect) Executing with: \"%s\" ...\n", command.c_str());
-                    if (run_runtime_command(command)) {
-                        print_cache_file(*inspect_print_info, "__instr_cache.file");
+                    std::string cmd = command;
+                    modify_runtime_command(cmd, options.extra["outfile"]);
+                    std::printf("(wabidb-inspect) Executing with: \"%s\" ...\n", cmd.c_str());
+                    int return_code = run_runtime_command(cmd);
+                    if (return_code == 10) {
+                        print_cache_file(*inspect_print_info, cache_name);
+                    } else {
+                        print_runtime_error(return_code);
                     }
                 }
                 state = InspectState::end;
@@ -948,7 +1751,10 @@ int main(int argc, const char* argv[]) {
                         delete inspect_print_info;
                         instrumenter.clear();
                         iresult = instrumenter.setConfig(config);
-                        assert(iresult == InstrumentResult::success);
+                        if (iresult != InstrumentResult::success) {
+                            std::printf("(wabidb-inspect) Cannot load: %s\n", infile.c_str());
+                            return InspectExitCode::exit_load_error;
+                        }
                         state = InspectState::positioning;
                     } else if (next_cmd[0] == 'q') {
                         delete inspect_print_info;
@@ -965,5 +1771,5 @@ int main(int argc, const char* argv[]) {
         }
     }
 
-    return 0;
-}
\ No newline at end of file
+    return InspectExitCode::exit_success;
+}
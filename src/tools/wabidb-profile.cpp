@@ -0,0 +1,694 @@
+#include "instrumenter.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <tools/tool-options.h>
+#include <tools/tool-utils.h>
+#include <unistd.h>
+#include "counter-region.hpp"
+#include "frag-builder.hpp"
+#include "path-numbering.hpp"
+#include "stack-cfg.hpp"
+using namespace wasm_instrument;
+
+enum ProfileExitCode {
+    exit_success = 0,
+    exit_usage_error,
+    exit_load_error,
+    exit_instrument_error,
+    exit_runtime_error,
+    exit_report_error,
+};
+
+// the counters are dumped by the instrumented module to this file
+// in the preopened current directory
+const char* PROF_COUNTERS_FILE = "__prof_counters.bin";
+const char* PROF_MAP_SUFFIX = ".profmap";
+const char* PROF_MAP_HEADER = "wabidb-profile-map 1";
+
+// what a counter counts, counter i is at __prof_base + 8 * i
+struct ProfileSite {
+    enum Kind {
+        // entries of the function /caller/
+        entry = 0,
+        // executions of a call site in /caller/ to /callee/
+        call,
+    };
+    Kind kind;
+    std::string caller;
+    std::string callee;
+};
+
+struct ProfileMap {
+    std::vector<ProfileSite> sites;
+
+    bool write(const std::string &filename) const {
+        std::ofstream out(filename);
+        if (!out.is_open()) return false;
+        out << PROF_MAP_HEADER << "\n" << this->sites.size() << "\n";
+        for (const auto &site : this->sites) {
+            if (site.kind == ProfileSite::entry) {
+                out << "f\t" << site.caller << "\n";
+            } else {
+                out << "c\t" << site.caller << "\t" << site.callee << "\n";
+            }
+        }
+        return true;
+    }
+    bool read(const std::string &filename) {
+        std::ifstream in(filename);
+        if (!in.is_open()) return false;
+        std::string line;
+        size_t num = 0;
+        if (!std::getline(in, line) || line != PROF_MAP_HEADER) return false;
+        if (!std::getline(in, line)) return false;
+        try {
+            num = std::stoul(line);
+        } catch (...) {
+            return false;
+        }
+        this->sites.clear();
+        while (std::getline(in, line)) {
+            std::vector<std::string> fields;
+            size_t start = 0, tab = 0;
+            while ((tab = line.find('\t', start)) != std::string::npos) {
+                fields.push_back(line.substr(start, tab - start));
+                start = tab + 1;
+            }
+            fields.push_back(line.substr(start));
+            if (fields[0] == "f" && fields.size() == 2) {
+                this->sites.push_back(ProfileSite{ProfileSite::entry, fields[1], ""});
+            } else if (fields[0] == "c" && fields.size() == 3) {
+                this->sites.push_back(ProfileSite{ProfileSite::call, fields[1], fields[2]});
+            } else {
+                return false;
+            }
+        }
+        return this->sites.size() == num;
+    }
+};
+
+// add a counter to function entries and call sites of functions in scope
+static void _insert_counters(Instrumenter &instrumenter, const CounterRegion &region, ProfileMap &map) {
+    auto module = instrumenter.getModule();
+    auto new_counter = [&](ProfileSite site) {
+        auto index = static_cast<uint32_t>(map.sites.size());
+        map.sites.push_back(site);
+        return _stack_ir_vec2list(region.makeCounterInsts(module, index));
+    };
+    auto func_visitor = [&](wasm::Function* func) {
+        if (!instrumenter.scopeContains(func->name.toString())) return;
+        assert(func->stackIR != nullptr);
+        auto caller = func->name.toString();
+        std::list<wasm::StackInst*> stack_ir_list = _stack_ir_vec2list(*(func->stackIR.get()));
+        stack_ir_list.splice(stack_ir_list.begin(), new_counter(ProfileSite{ProfileSite::entry, caller, ""}));
+        for (auto iter = stack_ir_list.begin(); iter != stack_ir_list.end(); iter++) {
+            auto origin = (*iter)->origin;
+            std::string callee;
+            if (origin->_id == wasm::Expression::Id::CallId) {
+                auto target = module->getFunction(origin->cast<wasm::Call>()->target);
+                callee = target->imported() ? target->base.toString() : target->name.toString();
+            } else if (origin->_id == wasm::Expression::Id::CallIndirectId) {
+                callee = "(indirect)";
+            } else if (origin->_id == wasm::Expression::Id::CallRefId) {
+                callee = "(ref)";
+            } else {
+                continue;
+            }
+            stack_ir_list.splice(iter, new_counter(ProfileSite{ProfileSite::call, caller, callee}));
+        }
+        func->stackIR = std::make_unique<wasm::StackIR>(_stack_ir_list2vec(stack_ir_list));
+        instrumenter.stackIRChanged(caller);
+    };
+    iterDefinedFunctions(module, func_visitor);
+}
+
+static bool do_profile_instrument(Instrumenter &instrumenter, ProfileMap &map) {
+    CounterRegion region("__prof", PROF_COUNTERS_FILE);
+    if (!region.prepare(instrumenter)) return false;
+    _insert_counters(instrumenter, region, map);
+    // counted call edges to proc_exit are dumped as well
+    region.hookProcExit(instrumenter);
+    return region.finish(instrumenter, static_cast<uint32_t>(map.sites.size()));
+}
+
+template <typename K>
+static std::vector<std::pair<K, uint64_t>> sort_by_count(const std::map<K, uint64_t> &m) {
+    std::vector<std::pair<K, uint64_t>> v(m.begin(), m.end());
+    std::stable_sort(v.begin(), v.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+    return v;
+}
+
+static void print_report(const ProfileMap &map, const std::vector<uint64_t> &counters, size_t top) {
+    std::map<std::string, uint64_t> func_counts;
+    std::map<std::pair<std::string, std::string>, uint64_t> edge_counts;
+    for (size_t i = 0; i < map.sites.size(); i++) {
+        const auto &site = map.sites[i];
+        if (site.kind == ProfileSite::entry) {
+            func_counts[site.caller] += counters[i];
+        } else if (counters[i] != 0) {
+            edge_counts[{site.caller, site.callee}] += counters[i];
+        }
+    }
+    auto funcs = sort_by_count(func_counts);
+    auto edges = sort_by_count(edge_counts);
+    if (top == 0) top = std::max(funcs.size(), edges.size());
+
+    std::printf("(wabidb-profile) Function calls:\n");
+    std::printf("%20s  %s\n", "count", "function");
+    for (size_t i = 0; i < std::min(top, funcs.size()); i++) {
+        if (funcs[i].second == 0) break;
+        std::printf("%20llu  %s\n", (unsigned long long)funcs[i].second, funcs[i].first.c_str());
+    }
+    std::printf("(wabidb-profile) Call graph:\n");
+    std::printf("%20s  %s\n", "count", "caller -> callee");
+    for (size_t i = 0; i < std::min(top, edges.size()); i++) {
+        std::printf("%20llu  %s -> %s\n", (unsigned long long)edges[i].second,
+                    edges[i].first.first.c_str(), edges[i].first.second.c_str());
+    }
+}
+
+static bool write_dot(const std::string &filename, const ProfileMap &map, const std::vector<uint64_t> &counters) {
+    std::ofstream out(filename);
+    if (!out.is_open()) return false;
+    std::map<std::pair<std::string, std::string>, uint64_t> edge_counts;
+    std::map<std::string, uint64_t> func_counts;
+    for (size_t i = 0; i < map.sites.size(); i++) {
+        const auto &site = map.sites[i];
+        if (site.kind == ProfileSite::entry) {
+            func_counts[site.caller] += counters[i];
+        } else if (counters[i] != 0) {
+            edge_counts[{site.caller, site.callee}] += counters[i];
+        }
+    }
+    out << "digraph callgraph {\n";
+    for (const auto &[name, count] : func_counts) {
+        if (count == 0) continue;
+        out << "  \"" << name << "\" [label=\"" << name << "\\n" << count << "\"];\n";
+    }
+    for (const auto &[edge, count] : edge_counts) {
+        out << "  \"" << edge.first << "\" -> \"" << edge.second << "\" [label=\"" << count << "\"];\n";
+    }
+    out << "}\n";
+    return true;
+}
+
+static int report(const std::string &counters_file, const std::string &map_file,
+                  const std::string &dot_file, size_t top) {
+    ProfileMap map;
+    if (!map.read(map_file)) {
+        std::cerr << "(wabidb-profile) Cannot read map: " << map_file << std::endl;
+        return ProfileExitCode::exit_report_error;
+    }
+    std::vector<uint64_t> counters;
+    if (!CounterRegion::readCounters(counters_file, map.sites.size(), counters)) {
+        return ProfileExitCode::exit_report_error;
+    }
+    print_report(map, counters, top);
+    if (!dot_file.empty() && !write_dot(dot_file, map, counters)) {
+        std::cerr << "(wabidb-profile) Cannot write: " << dot_file << std::endl;
+        return ProfileExitCode::exit_report_error;
+    }
+    return ProfileExitCode::exit_success;
+}
+
+// ---- acyclic path profiling (--paths) ----
+
+const char* PATH_COUNTERS_FILE = "__path_counters.bin";
+const char* PATH_MAP_SUFFIX = ".pathmap";
+const char* PATH_MAP_HEADER = "wabidb-path-map 1";
+const char* PATH_HASH_FUNC = "__path_hash_inc";
+// path ids are kept in an i32 local
+const uint64_t PATH_MAX_PATHS = 0x7fffffff;
+// functions with more paths count them in a hash table
+const uint64_t PATH_ARRAY_LIMIT = 4096;
+const uint32_t PATH_HASH_BITS = 10;
+const uint32_t PATH_HASH_SLOTS = 1u << PATH_HASH_BITS;
+
+// counters of a function: an array indexed by path id, or a hash table of
+// a lost counter (paths not counted as the table is full) and (id + 1, count) slots
+struct PathFunction {
+    std::string name;
+    bool hashed;
+    size_t counter_base;
+    // [first, last] line numbers of wabidb-inspect of each block, and edges of the cfg
+    std::vector<std::pair<size_t, size_t>> lines;
+    std::vector<std::pair<size_t, size_t>> edges;
+
+    size_t counterNum(uint64_t num_paths) const {
+        return this->hashed ? 1 + 2 * PATH_HASH_SLOTS : num_paths;
+    }
+};
+
+struct PathMap {
+    size_t counter_num = 0;
+    std::vector<PathFunction> functions;
+
+    bool write(const std::string &filename) const {
+        std::ofstream out(filename);
+        if (!out.is_open()) return false;
+        out << PATH_MAP_HEADER << "\n" << this->counter_num << "\n";
+        for (const auto &f : this->functions) {
+            out << "func\t" << f.name << "\t" << (f.hashed ? "hash" : "array") << "\t" << f.counter_base << "\n";
+            for (const auto &l : f.lines) out << "b\t" << l.first << "\t" << l.second << "\n";
+            for (const auto &e : f.edges) out << "e\t" << e.first << "\t" << e.second << "\n";
+        }
+        return true;
+    }
+    bool read(const std::string &filename) {
+        std::ifstream in(filename);
+        if (!in.is_open()) return false;
+        std::string line;
+        if (!std::getline(in, line) || line != PATH_MAP_HEADER) return false;
+        if (!(in >> this->counter_num)) return false;
+        std::getline(in, line);
+        this->functions.clear();
+        while (std::getline(in, line)) {
+            std::istringstream ls(line);
+            std::string kind;
+            std::getline(ls, kind, '\t');
+            if (kind == "func") {
+                PathFunction f;
+                std::string storage;
+                std::getline(ls, f.name, '\t');
+                std::getline(ls, storage, '\t');
+                f.hashed = (storage == "hash");
+                if (!(ls >> f.counter_base)) return false;
+                this->functions.push_back(f);
+                continue;
+            }
+            size_t a, b;
+            if (this->functions.empty() || !(ls >> a >> b)) return false;
+            if (kind == "b") {
+                this->functions.back().lines.emplace_back(a, b);
+            } else if (kind == "e") {
+                this->functions.back().edges.emplace_back(a, b);
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// counts (key - 1) in the table, linear probing, the first counter is for lost paths
+static std::string _make_path_hash_func() {
+    auto mask = std::to_string(PATH_HASH_SLOTS - 1);
+    // 0 key, 1 table, 2 slot, 3 slot address, 4 tries
+    return std::string("(func $") + PATH_HASH_FUNC + " (param i32 i32) (local i32 i32 i32)\n"
+        "local.get 0\n"
+        "i32.const 1\n"
+        "i32.add\n"
+        "local.tee 0\n"
+        "i32.const -1640531535\n"
+        "i32.mul\n"
+        "i32.const " + std::to_string(32 - PATH_HASH_BITS) + "\n"
+        "i32.shr_u\n"
+        "local.set 2\n"
+        "loop\n"
+        "local.get 1\n"
+        "local.get 2\n"
+        "i32.const 16\n"
+        "i32.mul\n"
+        "i32.add\n"
+        "local.tee 3\n"
+        "i64.load offset=8\n"
+        "local.get 0\n"
+        "i64.extend_i32_u\n"
+        "i64.eq\n"
+        "if\n"
+        "local.get 3\n"
+        "local.get 3\n"
+        "i64.load offset=16\n"
+        "i64.const 1\n"
+        "i64.add\n"
+        "i64.store offset=16\n"
+        "return\n"
+        "end\n"
+        "local.get 3\n"
+        "i64.load offset=8\n"
+        "i64.eqz\n"
+        "if\n"
+        "local.get 3\n"
+        "local.get 0\n"
+        "i64.extend_i32_u\n"
+        "i64.store offset=8\n"
+        "local.get 3\n"
+        "i64.const 1\n"
+        "i64.store offset=16\n"
+        "return\n"
+        "end\n"
+        "local.get 2\n"
+        "i32.const 1\n"
+        "i32.add\n"
+        "i32.const " + mask + "\n"
+        "i32.and\n"
+        "local.set 2\n"
+        "local.get 4\n"
+        "i32.const 1\n"
+        "i32.add\n"
+        "local.tee 4\n"
+        "i32.const " + std::to_string(PATH_HASH_SLOTS) + "\n"
+        "i32.lt_u\n"
+        "br_if 0\n"
+        "end\n"
+        "local.get 1\n"
+        "local.get 1\n"
+        "i64.load\n"
+        "i64.const 1\n"
+        "i64.add\n"
+        "i64.store\n"
+        ")";
+}
+
+// number the paths of /func/ and insert the increments of the path register and the counting,
+// return false if the function is left unchanged
+static bool _insert_path_counters(Instrumenter &instrumenter, wasm::Function* func,
+                                  const CounterRegion &region, PathMap &map) {
+    auto m = instrumenter.getModule();
+    PathFunction f;
+    f.name = func->name.toString();
+    auto analysis = instrumenter.getAnalysis(func);
+    if (analysis == nullptr || analysis->cfg.insts.empty()) {
+        std::cerr << "(wabidb-profile) Skip " << f.name << ": no stack ir or exception handling" << std::endl;
+        return false;
+    }
+    const auto &cfg = analysis->cfg;
+    std::vector<StackEdgeProbe> probes;
+    std::vector<bool> probeable;
+    std::vector<double> weights;
+    for (size_t e = 0; e < cfg.edges.size(); e++) {
+        probes.push_back(findEdgeProbe(cfg, e));
+        probeable.push_back(probes.back().kind != StackEdgeProbe::none);
+        auto depth = std::max(cfg.blocks[cfg.edges[e].from].loop_depth, cfg.blocks[cfg.edges[e].to].loop_depth);
+        weights.push_back(std::pow(10.0, static_cast<double>(depth)));
+        f.edges.emplace_back(cfg.edges[e].from, cfg.edges[e].to);
+        // paths are counted on back edges and edges to the exit
+        if (!probeable.back() && (cfg.edges[e].to <= cfg.edges[e].from || cfg.edges[e].to == cfg.exit())) {
+            std::cerr << "(wabidb-profile) Skip " << f.name << ": cannot probe line " << cfg.edges[e].inst + 1 << std::endl;
+            return false;
+        }
+    }
+    PathNumbering numbering;
+    if (!numberPaths(cfg.blocks.size(), f.edges, probeable, weights, PATH_MAX_PATHS, numbering)) {
+        std::cerr << "(wabidb-profile) Skip " << f.name << ": too many paths" << std::endl;
+        return false;
+    }
+    for (size_t b = 0; b < cfg.exit(); b++) {
+        f.lines.emplace_back(cfg.blocks[b].begin + 1, cfg.blocks[b].end);
+    }
+    f.hashed = numbering.numPaths() > PATH_ARRAY_LIMIT;
+    f.counter_base = map.counter_num;
+    map.counter_num += f.counterNum(numbering.numPaths());
+
+    auto path_reg = BinaryenFunctionAddVar(func, BinaryenTypeInt32());
+    auto addr_reg = f.hashed ? 0 : BinaryenFunctionAddVar(func, BinaryenTypeInt32());
+    auto base = region.name("_base");
+    auto mem = region.memoryName();
+    auto offset = static_cast<uint32_t>(f.counter_base * 8);
+    // path register + inc
+    auto emit_path = [&](Frag &frag, int64_t inc) {
+        frag.localGet(path_reg, wasm::Type::i32);
+        if (inc != 0) frag.i32Const(static_cast<int32_t>(inc)).i32Add();
+    };
+    auto emit_count = [&](Frag &frag, int64_t inc) {
+        emit_path(frag, inc);
+        if (f.hashed) {
+            frag.globalGet(base).i32Const(static_cast<int32_t>(offset)).i32Add().call(PATH_HASH_FUNC);
+            return;
+        }
+        frag.i32Const(3).i32Shl().globalGet(base).i32Add()
+            .localTee(addr_reg, wasm::Type::i32).localGet(addr_reg, wasm::Type::i32)
+            .i64Load(offset, mem).i64Const(1).i64Add().i64Store(offset, mem);
+    };
+
+    // code on the edges of the cfg, a back edge counts its path and starts a new one
+    std::map<size_t, Frag> edge_code;
+    auto edge_frag = [&](size_t e) -> Frag& {
+        return edge_code.try_emplace(e, m).first->second;
+    };
+    Frag entry_frag(m);
+    for (const auto &edge : numbering.edges) {
+        switch (edge.kind) {
+            case PathNumbering::entry:
+                if (edge.inc != 0) entry_frag.i32Const(static_cast<int32_t>(edge.inc)).localSet(path_reg);
+                break;
+            case PathNumbering::forward:
+                if (edge.to == numbering.exitNode()) {
+                    emit_count(edge_frag(edge.edge), edge.inc);
+                } else if (edge.inc != 0) {
+                    emit_path(edge_frag(edge.edge), edge.inc);
+                    edge_frag(edge.edge).localSet(path_reg);
+                }
+                break;
+            case PathNumbering::back_exit:
+                emit_count(edge_frag(edge.edge), edge.inc);
+                break;
+            case PathNumbering::back_entry:
+                edge_frag(edge.edge).i32Const(static_cast<int32_t>(edge.inc)).localSet(path_reg);
+                break;
+        }
+    }
+    std::vector<StackProbeCode> code;
+    for (auto &[e, frag] : edge_code) {
+        code.push_back(StackProbeCode{probes[e], {}});
+        if (!frag.build(code.back().insts)) return false;
+    }
+    std::vector<wasm::StackInst*> entry_code;
+    if (!entry_frag.build(entry_code)) return false;
+    applyStackProbes(m, func, cfg, code);
+    func->stackIR->insert(func->stackIR->begin(), entry_code.begin(), entry_code.end());
+    instrumenter.stackIRChanged(f.name);
+    map.functions.push_back(f);
+    return true;
+}
+
+static bool do_path_instrument(Instrumenter &instrumenter, PathMap &map) {
+    CounterRegion region("__path", PATH_COUNTERS_FILE);
+    if (!region.prepare(instrumenter, {PATH_HASH_FUNC}, {_make_path_hash_func()})) return false;
+    auto module = instrumenter.getModule();
+    auto func_visitor = [&](wasm::Function* func) {
+        if (!instrumenter.scopeContains(func->name.toString())) return;
+        _insert_path_counters(instrumenter, func, region, map);
+    };
+    iterDefinedFunctions(module, func_visitor);
+    // the program may exit in any function
+    region.hookProcExit(instrumenter, false);
+    return region.finish(instrumenter, static_cast<uint32_t>(map.counter_num));
+}
+
+static std::string path2str(const PathFunction &f, const std::vector<size_t> &blocks, bool from_loop, bool to_loop) {
+    std::string ret = from_loop ? "(loop) " : "";
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (i != 0) ret += " > ";
+        const auto &l = f.lines[blocks[i]];
+        ret += (l.first == l.second) ? std::to_string(l.first) : std::to_string(l.first) + "-" + std::to_string(l.second);
+    }
+    return to_loop ? ret + " (back)" : ret;
+}
+
+static int report_paths(const std::string &counters_file, const std::string &map_file, size_t top) {
+    PathMap map;
+    if (!map.read(map_file)) {
+        std::cerr << "(wabidb-profile) Cannot read map: " << map_file << std::endl;
+        return ProfileExitCode::exit_report_error;
+    }
+    std::vector<uint64_t> counters;
+    if (!CounterRegion::readCounters(counters_file, map.counter_num, counters)) {
+        return ProfileExitCode::exit_report_error;
+    }
+    for (const auto &f : map.functions) {
+        PathNumbering numbering;
+        std::vector<bool> probeable(f.edges.size(), true);
+        std::vector<double> weights(f.edges.size(), 1.0);
+        if (!numberPaths(f.lines.size() + 1, f.edges, probeable, weights, PATH_MAX_PATHS, numbering) ||
+            f.counter_base + f.counterNum(numbering.numPaths()) > counters.size()) {
+            std::cerr << "(wabidb-profile) Bad map of " << f.name << std::endl;
+            return ProfileExitCode::exit_report_error;
+        }
+        std::map<uint64_t, uint64_t> path_counts;
+        uint64_t lost = 0;
+        if (f.hashed) {
+            lost = counters[f.counter_base];
+            for (size_t i = 0; i < PATH_HASH_SLOTS; i++) {
+                auto key = counters[f.counter_base + 1 + 2 * i];
+                if (key != 0) path_counts[key - 1] += counters[f.counter_base + 2 + 2 * i];
+            }
+        } else {
+            for (uint64_t id = 0; id < numbering.numPaths(); id++) {
+                if (counters[f.counter_base + id] != 0) path_counts[id] = counters[f.counter_base + id];
+            }
+        }
+        auto paths = sort_by_count(path_counts);
+        std::printf("(wabidb-profile) Paths of %s: %llu executed of %llu", f.name.c_str(),
+                    (unsigned long long)paths.size(), (unsigned long long)numbering.numPaths());
+        if (lost != 0) std::printf(", %llu not counted as the table is full", (unsigned long long)lost);
+        std::printf("\n%20s  %s\n", "count", "blocks (lines as listed by wabidb-inspect)");
+        size_t limit = (top == 0) ? paths.size() : std::min(top, paths.size());
+        for (size_t i = 0; i < limit; i++) {
+            std::vector<size_t> blocks;
+            bool from_loop, to_loop;
+            if (!decodePath(numbering, paths[i].first, blocks, from_loop, to_loop)) continue;
+            std::printf("%20llu  %s\n", (unsigned long long)paths[i].second,
+                        path2str(f, blocks, from_loop, to_loop).c_str());
+        }
+    }
+    return ProfileExitCode::exit_success;
+}
+
+int main(int argc, const char* argv[]) {
+    const std::string WabidbProfileOption = "wabidb-profile options";
+    wasm::ToolOptions options("wabidb-profile", "Count function calls and call edges of a wasm binary.");
+    std::string command = "";
+    std::string counters_file = "";
+    std::string map_file = "";
+    std::string dot_file = "";
+    std::string path_funcs = "";
+    size_t top = 0;
+
+    options
+    .add("--output",
+         "-o",
+         "Output instrumented wasm filename",
+         WabidbProfileOption,
+         wasm::Options::Arguments::One,
+         [](wasm::Options* o, const std::string& argument) {
+            o->extra["outfile"] = argument;
+         })
+    .add("--command",
+         "-cmd",
+         "Run the instrumented file on a certain runtime and report",
+         WabidbProfileOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { command = argument; })
+    .add("--report",
+         "-r",
+         "Report a counters file dumped by an instrumented run, requires --map",
+         WabidbProfileOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { counters_file = argument; })
+    .add("--map",
+         "-m",
+         "The counter map written along with the instrumented file",
+         WabidbProfileOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { map_file = argument; })
+    .add("--dot",
+         "-d",
+         "Also write the weighted call graph in graphviz format",
+         WabidbProfileOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { dot_file = argument; })
+    .add("--top",
+         "-t",
+         "Only print the top N functions and call edges",
+         WabidbProfileOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { top = std::stoul(argument); })
+    .add("--paths",
+         "-p",
+         "Profile acyclic paths of the comma separated functions instead of calls",
+         WabidbProfileOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { path_funcs = argument; })
+    .add_positional("INFILE",
+                    wasm::Options::Arguments::Optional,
+                    [](wasm::Options* o, const std::string& argument) {
+                        o->extra["infile"] = argument;
+                    });
+    options.parse(argc, argv);
+
+    // offline report
+    if (!counters_file.empty()) {
+        if (map_file.empty()) {
+            std::cerr << "--report requires --map" << std::endl;
+            return ProfileExitCode::exit_usage_error;
+        }
+        std::ifstream map_in(map_file);
+        std::string header;
+        std::getline(map_in, header);
+        if (header == PATH_MAP_HEADER) return report_paths(counters_file, map_file, top);
+        return report(counters_file, map_file, dot_file, top);
+    }
+
+    if (options.extra.find("infile") == options.extra.end()) {
+        std::cerr << "Usage: wabidb-profile <INFILE> [-cmd <COMMAND>]" << std::endl;
+        std::cerr << "       wabidb-profile --report <COUNTERS> --map <MAP>" << std::endl;
+        return ProfileExitCode::exit_usage_error;
+    }
+    auto infile = options.extra["infile"];
+    if ((infile.size() < 6) || (infile.substr(infile.size() - 5 , 5) != ".wasm")) {
+        std::cerr << "INFILE must be a .wasm file" << std::endl;
+        return ProfileExitCode::exit_usage_error;
+    }
+    if (options.extra.find("outfile") == options.extra.end()) {
+        options.extra["outfile"] = wasm::removeSpecificSuffix(infile, ".wasm") + "-profile.wasm";
+    }
+    auto outfile = options.extra["outfile"];
+    bool paths = !path_funcs.empty();
+    if (map_file.empty()) map_file = outfile + (paths ? PATH_MAP_SUFFIX : PROF_MAP_SUFFIX);
+    const char* dumped_file = paths ? PATH_COUNTERS_FILE : PROF_COUNTERS_FILE;
+
+    InstrumentConfig config;
+    config.filename = infile;
+    config.targetname = outfile;
+    wasm::Module* temp_module = new wasm::Module;
+    temp_module->features = config.feature;
+    options.applyFeatures(*temp_module);
+    config.feature = temp_module->features;
+    delete temp_module;
+
+    Instrumenter instrumenter;
+    if (instrumenter.setConfig(config) != InstrumentResult::success) {
+        std::cerr << "(wabidb-profile) Cannot load: " << infile << std::endl;
+        return ProfileExitCode::exit_load_error;
+    }
+    ProfileMap map;
+    PathMap path_map;
+    bool instrumented = false;
+    if (paths) {
+        // only the given functions, to keep the overhead bounded
+        instrumenter.scopeClear();
+        std::istringstream names(path_funcs);
+        std::string name;
+        while (std::getline(names, name, ',')) {
+            if (instrumenter.getFunction(name.c_str()) == nullptr) {
+                std::cerr << "(wabidb-profile) No function: " << name << std::endl;
+                return ProfileExitCode::exit_usage_error;
+            }
+            instrumenter.scopeAdd(name);
+        }
+        instrumented = do_path_instrument(instrumenter, path_map);
+    } else {
+        instrumented = do_profile_instrument(instrumenter, map);
+    }
+    if (!instrumented || instrumenter.writeBinary() != InstrumentResult::success) {
+        std::cerr << "(wabidb-profile) Instrumentation failed!" << std::endl;
+        return ProfileExitCode::exit_instrument_error;
+    }
+    if (!(paths ? path_map.write(map_file) : map.write(map_file))) {
+        std::cerr << "(wabidb-profile) Cannot write: " << map_file << std::endl;
+        return ProfileExitCode::exit_instrument_error;
+    }
+    std::printf("(wabidb-profile) %zu counters, written to %s and %s\n",
+                paths ? path_map.counter_num : map.sites.size(), outfile.c_str(), map_file.c_str());
+
+    if (command.empty()) {
+        std::printf("(wabidb-profile) Run it with the current directory preopened, then:\n"
+                    "  wabidb-profile --report %s --map %s\n", dumped_file, map_file.c_str());
+        return ProfileExitCode::exit_success;
+    }
+
+    std::remove(dumped_file);
+    modify_runtime_command(command, outfile);
+    int return_code = run_runtime_command(command);
+    if (access(dumped_file, R_OK) != 0) {
+        std::printf("(wabidb-profile) No counters dumped, runtime returned %d!\n", return_code);
+        return ProfileExitCode::exit_runtime_error;
+    }
+    if (paths) return report_paths(dumped_file, map_file, top);
+    return report(dumped_file, map_file, dot_file, top);
+}
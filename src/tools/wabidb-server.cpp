@@ -0,0 +1,151 @@
+#include "instrument-server.hpp"
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <tools/tool-options.h>
+#include <tools/tool-utils.h>
+using namespace wasm_instrument;
+
+enum ServerExitCode {
+    exit_success = 0,
+    exit_usage_error,
+    exit_socket_error,
+    exit_plan_error,
+    exit_job_error,
+};
+
+// send one job and write the instrumented binary
+static int do_request(const std::string &socket_path, const std::string &plan_name,
+                      const std::string &infile, std::string outfile) {
+    std::ifstream plan_in(plan_name);
+    if (!plan_in.is_open()) {
+        std::cerr << "(wabidb-server) Cannot open plan: " << plan_name << std::endl;
+        return ServerExitCode::exit_plan_error;
+    }
+    std::stringstream plan_text;
+    plan_text << plan_in.rdbuf();
+    // the server may run in another directory
+    char abs_path[PATH_MAX];
+    if (realpath(infile.c_str(), abs_path) == nullptr) {
+        std::cerr << "(wabidb-server) Cannot find: " << infile << std::endl;
+        return ServerExitCode::exit_usage_error;
+    }
+    if (outfile.empty()) outfile = wasm::removeSpecificSuffix(infile, ".wasm") + "-instr.wasm";
+
+    std::vector<char> output;
+    auto result = requestInstrument(socket_path, abs_path, plan_text.str(), output);
+    if (result != InstrumentResult::success) {
+        std::cerr << "(wabidb-server) " << infile << ": " << InstrumentResult2str(result) << " "
+                  << std::string(output.begin(), output.end()) << std::endl;
+        return ServerExitCode::exit_job_error;
+    }
+    std::ofstream out(outfile, std::ios::binary);
+    if (!out.write(output.data(), output.size())) {
+        std::cerr << "(wabidb-server) Cannot write: " << outfile << std::endl;
+        return ServerExitCode::exit_job_error;
+    }
+    return ServerExitCode::exit_success;
+}
+
+int main(int argc, const char* argv[]) {
+    const std::string WabidbServerOption = "wabidb-server options";
+    wasm::ToolOptions options("wabidb-server",
+                              "Serve instrumentation plans on a unix socket, keeping parsed modules in memory. "
+                              "With --plan, send one job to a running server instead.");
+    std::string socket_path = "wabidb.sock";
+    std::string plan_name = "";
+    std::string outfile = "";
+    std::string infile = "";
+    size_t workers = 0;
+    size_t max_modules = 8;
+    std::string root = ".";
+    bool stop = false;
+    bool quiet = false;
+
+    options
+    .add("--socket",
+         "-s",
+         "Path of the unix socket, default to wabidb.sock",
+         WabidbServerOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { socket_path = argument; })
+    .add("--jobs",
+         "-j",
+         "Number of worker threads, default to the number of cores",
+         WabidbServerOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { workers = std::stoul(argument); })
+    .add("--modules",
+         "-m",
+         "Number of parsed modules kept in memory, default to 8",
+         WabidbServerOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { max_modules = std::stoul(argument); })
+    .add("--root",
+         "-r",
+         "Only open modules below this directory, default to the current directory, empty for any path",
+         WabidbServerOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { root = argument; })
+    .add("--quiet",
+         "-q",
+         "Only print failed jobs",
+         WabidbServerOption,
+         wasm::Options::Arguments::Zero,
+         [&](wasm::Options* o, const std::string& argument) { quiet = true; })
+    .add("--plan",
+         "-p",
+         "Client: send INFILE with this plan to the server",
+         WabidbServerOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { plan_name = argument; })
+    .add("--output",
+         "-o",
+         "Client: output instrumented wasm filename",
+         WabidbServerOption,
+         wasm::Options::Arguments::One,
+         [&](wasm::Options* o, const std::string& argument) { outfile = argument; })
+    .add("--stop",
+         "-st",
+         "Client: stop the server after its pending jobs",
+         WabidbServerOption,
+         wasm::Options::Arguments::Zero,
+         [&](wasm::Options* o, const std::string& argument) { stop = true; })
+    .add_positional("INFILE",
+                    wasm::Options::Arguments::Optional,
+                    [&](wasm::Options* o, const std::string& argument) { infile = argument; });
+    options.parse(argc, argv);
+
+    if (stop) {
+        return requestStop(socket_path) ? ServerExitCode::exit_success : ServerExitCode::exit_socket_error;
+    }
+    if (!plan_name.empty()) {
+        if (infile.empty()) {
+            std::cerr << "Usage: wabidb-server --socket <SOCKET> --plan <PLAN> <INFILE> [-o <OUTFILE>]" << std::endl;
+            return ServerExitCode::exit_usage_error;
+        }
+        return do_request(socket_path, plan_name, infile, outfile);
+    }
+
+    ServerOptions server_options;
+    server_options.workers = workers;
+    server_options.max_modules = max_modules;
+    server_options.root = root;
+    wasm::Module* temp_module = new wasm::Module;
+    temp_module->features = server_options.feature;
+    options.applyFeatures(*temp_module);
+    server_options.feature = temp_module->features;
+    delete temp_module;
+    server_options.log = [quiet](const std::string &filename, const ServerJobResult &result) {
+        if (quiet && result.result == InstrumentResult::success) return;
+        std::cerr << filename << ": " << InstrumentResult2str(result.result)
+                  << (result.warm ? " warm " : " cold ")
+                  << std::fixed << std::setprecision(1) << result.time_us / 1000 << "ms" << std::endl;
+    };
+    std::cerr << "(wabidb-server) Listening on " << socket_path << std::endl;
+    if (!runServer(socket_path, server_options)) return ServerExitCode::exit_socket_error;
+    std::cerr << "(wabidb-server) Stopped" << std::endl;
+    return ServerExitCode::exit_success;
+}
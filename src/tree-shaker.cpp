@@ -0,0 +1,153 @@
+#include "tree-shaker.hpp"
+#include <ir/find_all.h>
+
+namespace wasm_instrument {
+
+namespace {
+
+// marks what is reachable from the roots, following the stack ir of live functions,
+// which is written out, and their bodies, which are validated
+struct Marker {
+    wasm::Module* module;
+    const CallGraph &graph;
+    std::set<wasm::Name> functions;
+    std::set<wasm::Name> globals;
+    std::set<wasm::Name> data_segments;
+    bool tables = false;
+    std::vector<wasm::Name> function_worklist;
+    std::vector<wasm::Name> global_worklist;
+
+    Marker(wasm::Module* m, const CallGraph &g) : module(m), graph(g) {}
+
+    void useTables() {
+        if (this->tables) return;
+        this->tables = true;
+        for (const auto &target : this->graph.indirect_targets) {
+            this->function_worklist.push_back(target);
+        }
+        for (auto &segment : this->module->elementSegments) {
+            this->noteConstant(segment->offset);
+            for (auto* e : segment->data) this->noteConstant(e);
+        }
+    }
+    // initializers and offsets
+    void noteConstant(wasm::Expression* e) {
+        if (e == nullptr) return;
+        for (auto* get : wasm::FindAll<wasm::GlobalGet>(e).list) this->global_worklist.push_back(get->name);
+        for (auto* ref : wasm::FindAll<wasm::RefFunc>(e).list) this->function_worklist.push_back(ref->func);
+    }
+    void noteExpression(wasm::Expression* e) {
+        switch (e->_id) {
+            case wasm::Expression::Id::CallId:
+                this->function_worklist.push_back(e->cast<wasm::Call>()->target);
+                break;
+            case wasm::Expression::Id::RefFuncId:
+                this->function_worklist.push_back(e->cast<wasm::RefFunc>()->func);
+                break;
+            case wasm::Expression::Id::GlobalGetId:
+                this->global_worklist.push_back(e->cast<wasm::GlobalGet>()->name);
+                break;
+            case wasm::Expression::Id::GlobalSetId:
+                this->global_worklist.push_back(e->cast<wasm::GlobalSet>()->name);
+                break;
+            case wasm::Expression::Id::MemoryInitId:
+                this->data_segments.insert(e->cast<wasm::MemoryInit>()->segment);
+                break;
+            case wasm::Expression::Id::DataDropId:
+                this->data_segments.insert(e->cast<wasm::DataDrop>()->segment);
+                break;
+            case wasm::Expression::Id::CallIndirectId:
+            case wasm::Expression::Id::TableGetId:
+            case wasm::Expression::Id::TableSetId:
+            case wasm::Expression::Id::TableSizeId:
+            case wasm::Expression::Id::TableGrowId:
+            case wasm::Expression::Id::TableFillId:
+            case wasm::Expression::Id::TableCopyId:
+            case wasm::Expression::Id::TableInitId:
+            case wasm::Expression::Id::ElemDropId:
+                this->useTables();
+                break;
+            default:
+                break;
+        }
+    }
+
+    bool run() {
+        for (const auto &root : this->graph.roots) this->function_worklist.push_back(root);
+        if (this->graph.tables_escape) this->useTables();
+        for (auto &e : this->module->exports) {
+            if (e->kind == wasm::ExternalKind::Global) this->global_worklist.push_back(e->value);
+        }
+        // active data segments are kept
+        for (auto &segment : this->module->dataSegments) this->noteConstant(segment->offset);
+
+        while (!this->function_worklist.empty() || !this->global_worklist.empty()) {
+            if (!this->global_worklist.empty()) {
+                auto name = this->global_worklist.back();
+                this->global_worklist.pop_back();
+                if (!this->globals.insert(name).second) continue;
+                auto global = this->module->getGlobalOrNull(name);
+                if (global != nullptr && !global->imported()) this->noteConstant(global->init);
+                continue;
+            }
+            auto name = this->function_worklist.back();
+            this->function_worklist.pop_back();
+            if (!this->functions.insert(name).second) continue;
+            auto func = this->module->getFunctionOrNull(name);
+            if (func == nullptr || func->imported()) continue;
+            if (func->stackIR == nullptr) {
+                std::cerr << "shakeModule() no stack ir in " << name << "!" << std::endl;
+                return false;
+            }
+            iterInstructionsConst(func, [this](const wasm::StackInst* inst) { this->noteExpression(inst->origin); });
+            if (func->body != nullptr) {
+                for (auto* e : wasm::FindAll<wasm::Expression>(func->body).list) this->noteExpression(e);
+            }
+        }
+        return true;
+    }
+};
+
+}
+
+bool shakeModule(Instrumenter &instrumenter, ShakeResult &result) noexcept {
+    result = ShakeResult();
+    auto module = instrumenter.getModule();
+    Marker marker(module, instrumenter.callGraph());
+    if (!marker.run()) return false;
+
+    // element segments only matter if tables are used
+    if (!marker.tables) {
+        result.element_segments = module->elementSegments.size();
+        result.tables = module->tables.size();
+        module->removeElementSegments([](wasm::ElementSegment*) { return true; });
+        module->removeTables([](wasm::Table*) { return true; });
+    }
+    // gc instructions may refer to data segments as well
+    bool gc = module->features.hasGC();
+    module->removeDataSegments([&](wasm::DataSegment* segment) {
+        if (!segment->isPassive || gc || marker.data_segments.count(segment->name)) return false;
+        result.data_segments++;
+        return true;
+    });
+    module->removeGlobals([&](wasm::Global* global) {
+        if (marker.globals.count(global->name)) return false;
+        result.globals++;
+        return true;
+    });
+    module->removeFunctions([&](wasm::Function* func) {
+        if (marker.functions.count(func->name)) return false;
+        if (func->imported()) {
+            result.imported_functions++;
+        } else {
+            result.functions++;
+        }
+        return true;
+    });
+
+    instrumenter.invalidateAnalysis();
+    instrumenter.invalidateCallGraph();
+    return instrumenter.validate();
+}
+
+}
@@ -0,0 +1,26 @@
+#ifndef tree_shaker_h
+#define tree_shaker_h
+
+#include "instrumenter.hpp"
+
+namespace wasm_instrument {
+
+// numbers of removed module elements
+struct ShakeResult {
+    size_t functions = 0;
+    size_t imported_functions = 0;
+    size_t globals = 0;
+    size_t data_segments = 0;
+    size_t element_segments = 0;
+    size_t tables = 0;
+};
+
+// remove functions, globals, segments and tables that cannot be reached from
+// exports, the start function and escaping tables, following the stack ir and the bodies of the module
+// types and indices are renumbered when the module is written
+// the caches of the instrumenter are dropped
+bool shakeModule(Instrumenter &instrumenter, ShakeResult &result) noexcept;
+
+}
+
+#endif
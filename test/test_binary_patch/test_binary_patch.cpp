@@ -0,0 +1,64 @@
+#include "binary-patcher.hpp"
+#include "instrumenter.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+using namespace wasm_instrument;
+
+/*
+* test_binary_patch doc:
+* 1. find fib by its export name and count the instructions of every body
+* 2. insert `i32.const 1 drop` before every instruction of every body of fib.wasm
+* 3. check that the instruction counts grow by the inserted ones and that the
+*    result is read and validated by binaryen
+* 4. check that patches out of a body are rejected
+*/
+int main() {
+    std::string relative_path = "../test/test_fib/";
+    std::ifstream in(relative_path + "fib.wasm", std::ios::binary);
+    std::vector<char> input((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    assert(!input.empty());
+
+    uint32_t fib = 0;
+    assert(findFunctionIndex(input, "fib", fib));
+    std::vector<BinaryPatch> patches;
+    std::vector<std::pair<uint32_t, size_t>> counts;
+    for (uint32_t f = fib; ; f++) {
+        size_t count = 0;
+        if (!countInstructions(input, f, count)) break;
+        counts.emplace_back(f, count);
+        for (size_t pos = 0; pos <= count; pos++) {
+            std::vector<uint8_t> bytes = {0x41};
+            appendSLEB128(bytes, -1);
+            bytes.push_back(0x1a);
+            patches.push_back({f, pos, bytes});
+        }
+    }
+    assert(!counts.empty());
+
+    std::vector<char> output;
+    assert(patchBinary(input, patches, output));
+    assert(output.size() > input.size());
+    for (const auto &[f, count] : counts) {
+        size_t new_count = 0;
+        assert(countInstructions(output, f, new_count));
+        assert(new_count == count + 2 * (count + 1));
+    }
+    // in the build directory, removed below
+    std::string patched_name = "fib_patched.wasm";
+    std::ofstream out(patched_name, std::ios::binary);
+    out.write(output.data(), output.size());
+    out.close();
+    InstrumentConfig config;
+    config.filename = patched_name;
+    Instrumenter instrumenter;
+    assert(instrumenter.setConfig(config) == InstrumentResult::success);
+    assert(BinaryenModuleValidate(instrumenter.getModule()));
+    std::remove(patched_name.c_str());
+
+    // after the final end
+    assert(!patchBinary(input, {{counts[0].first, counts[0].second + 1, {0x01}}}, output));
+    assert(!patchBinary(input, {{counts.back().first + 1, 0, {0x01}}}, output));
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include "counter-promotion.hpp"
+#include <shell-interface.h>
+#include <wasm-binary.h>
+#include <wasm-interpreter.h>
+
+using namespace wasm_instrument;
+
+// counter k of the table is at 4 * k of $mem, or at 8 * k for i64 counters
+static std::vector<std::string> helpers(bool wide) {
+    std::string t = wide ? "i64" : "i32";
+    std::string address = "local.get 0\ni32.const " + std::string(wide ? "8" : "4") + "\ni32.mul\n";
+    return {
+        "(func $__incInstr (param i32)\n" + address + address + t + ".load\n" + t + ".const 1\n" + t + ".add\n" +
+            t + ".store\n)",
+        "(func $__addInstr (param i32 " + t + ")\n" + address + address + t + ".load\nlocal.get 1\n" + t + ".add\n" +
+            t + ".store\n)",
+        "(func $__count (param i32) (result " + t + ")\n" + address + t + ".load\n)",
+    };
+}
+
+// sum fib(1), fib(2) ... fib(n - 1), and return as soon as the sum is over 100
+static std::string loop_exit(const std::string &fib) {
+    return "(func $loop_exit (param i32) (result i32) (local i32 i32)\n"
+           "i32.const 1\nlocal.set 1\n"
+           "loop\n"
+           "local.get 1\ncall $" + fib + "\nlocal.get 2\ni32.add\nlocal.tee 2\n"
+           "i32.const 100\ni32.gt_u\n"
+           "if\nlocal.get 2\nreturn\nend\n"
+           "local.get 1\ni32.const 1\ni32.add\nlocal.tee 1\n"
+           "local.get 0\ni32.lt_u\nbr_if 0\n"
+           "end\n"
+           "local.get 2\n)";
+}
+
+// count i up from 1 without calls, return i + 1000 once i is n, leave the block once
+// i is m, and leave the loop by its br_if back edge not taken once i is 30
+static const std::string kMultiExit =
+    "(func $multi_exit (param i32 i32) (result i32) (local i32)\n"
+    "block\nloop\n"
+    "local.get 2\ni32.const 1\ni32.add\nlocal.tee 2\nlocal.get 1\ni32.eq\nbr_if 1\n"
+    "local.get 2\nlocal.get 0\ni32.eq\n"
+    "if\nlocal.get 2\ni32.const 1000\ni32.add\nreturn\nend\n"
+    "local.get 2\ni32.const 30\ni32.lt_u\nbr_if 0\n"
+    "end\nend\n"
+    "local.get 2\n)";
+
+// fib.wasm, loop_exit and multi_exit with a counting site before every instruction of
+// the kind k, for k up to unreachable, then hoisted and promoted counters as asked
+static std::vector<char> build(bool hoist, bool promote, bool wide, HoistResult &hoisted, PromotionResult &promoted) {
+    InstrumentConfig config;
+    config.filename = "../test/test_fib/fib.wasm";
+    config.targetname = "fib_promoted.wasm";
+    Instrumenter instrumenter;
+    assert(instrumenter.setConfig(config) == InstrumentResult::success);
+    auto fib = instrumenter.getExport("fib")->value.toString();
+    assert(instrumenter.addMemory("mem", false, 1, 1) != nullptr);
+    auto funcs = helpers(wide);
+    funcs.push_back(loop_exit(fib));
+    funcs.push_back(kMultiExit);
+    assert(instrumenter.addFunctions({"__incInstr", "__addInstr", "__count", "loop_exit", "multi_exit"}, funcs));
+    assert(instrumenter.scopeAdd("loop_exit") && instrumenter.scopeAdd("multi_exit"));
+    for (auto name : {"loop_exit", "multi_exit", "__count"}) {
+        assert(instrumenter.addExport(wasm::ModuleItemKind::Function, name, name) != nullptr);
+    }
+
+    std::vector<InstrumentOperation> ops(wasm::Expression::Id::UnreachableId);
+    for (int i = 1; i <= wasm::Expression::Id::UnreachableId; i++) {
+        ops[i-1].targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id(i), std::nullopt, std::nullopt});
+        ops[i-1].pre_instructions.instructions = {"i32.const " + std::to_string(i), "call $__incInstr"};
+    }
+    assert(instrumenter.instrument(ops) == InstrumentResult::success);
+    if (hoist) assert(hoistLoopCounters(instrumenter, {"__incInstr", "__addInstr"}, hoisted));
+    if (promote) assert(promoteCounters(instrumenter, {"__incInstr", "__addInstr"}, promoted));
+    assert(instrumenter.validate());
+    std::vector<char> binary;
+    assert(instrumenter.writeBinary(binary) == InstrumentResult::success);
+    return binary;
+}
+
+using Call = std::pair<std::string, wasm::Literals>;
+
+// results of /calls/ in order, then the counters
+static std::vector<int64_t> run(const std::vector<char> &binary, const std::vector<Call> &calls) {
+    wasm::Module m;
+    m.features = FEATURE_SPEC;
+    wasm::WasmBinaryReader reader(m, m.features, binary);
+    reader.read();
+    wasm::ShellExternalInterface interface;
+    wasm::ModuleRunner instance(m, &interface);
+    std::vector<int64_t> ret;
+    for (const auto &[name, args] : calls) {
+        ret.push_back(instance.callExport(name.c_str(), args)[0].geti32());
+    }
+    for (int32_t k = 1; k <= wasm::Expression::Id::UnreachableId; k++) {
+        ret.push_back(instance.callExport("__count", {wasm::Literal(k)})[0].getInteger());
+    }
+    return ret;
+}
+
+/*
+* test_counter_promotion doc:
+* 1. count every kind of instruction of fib, of loop_exit, whose loop calls fib and
+*    returns early once the sum is over 100, and of multi_exit, whose loop has no calls,
+*    a br_if back edge and exits through a return, a br_if out of the loop and the end
+* 2. promote the counters, hoist them, or do both as examples/my_analysis.cpp does,
+*    with a table of i32 and of i64 counters, the module validates
+* 3. run the functions on arguments that take every exit of the loops, and check that
+*    results and counters match those of the module without either
+*/
+int main() {
+    std::vector<Call> calls;
+    for (int32_t n : {5, 20}) {
+        calls.push_back({"fib", {wasm::Literal(n)}});
+        calls.push_back({"loop_exit", {wasm::Literal(n)}});
+    }
+    // return, br_if out, end
+    std::vector<std::pair<int32_t, int32_t>> exits = {{3, 10}, {20, 7}, {40, 40}};
+    for (auto [n, m] : exits) {
+        calls.push_back({"multi_exit", {wasm::Literal(n), wasm::Literal(m)}});
+    }
+
+    for (bool wide : {false, true}) {
+        HoistResult unused_hoisted, hoisted, both_hoisted;
+        PromotionResult unused_promoted, promoted, both_promoted;
+        auto plain = build(false, false, wide, unused_hoisted, unused_promoted);
+        auto promoted_binary = build(false, true, wide, unused_hoisted, promoted);
+        auto hoisted_binary = build(true, false, wide, hoisted, unused_promoted);
+        auto both = build(true, true, wide, both_hoisted, both_promoted);
+        assert(promoted.functions == 3);
+        assert(promoted.sites > 0 && promoted.counters > 0);
+        // before the calls of fib and loop_exit, the returns and the ends
+        assert(promoted.flushes >= 7);
+        // the loops of fib and loop_exit call fib
+        assert(hoisted.functions == 1 && hoisted.loops == 1 && hoisted.sites > 0);
+        assert(both_hoisted.sites == hoisted.sites);
+        assert(both_promoted.sites < promoted.sites);
+
+        auto expected = run(plain, calls);
+        // 1 1 2 3 5: loop_exit(5) ends after fib(4), loop_exit(20) returns 143 after fib(10)
+        assert(expected[0] == 5 && expected[1] == 7);
+        assert(expected[2] == 6765 && expected[3] == 143);
+        assert(expected[4] == 1003 && expected[5] == 7 && expected[6] == 30);
+        // calls and returns are counted
+        assert(expected[calls.size() + wasm::Expression::Id::CallId - 1] > 0);
+        assert(expected[calls.size() + wasm::Expression::Id::ReturnId - 1] > 0);
+        assert(run(promoted_binary, calls) == expected);
+        assert(run(hoisted_binary, calls) == expected);
+        assert(run(both, calls) == expected);
+    }
+    return 0;
+}
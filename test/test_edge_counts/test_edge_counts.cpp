@@ -0,0 +1,186 @@
+#include "frag-builder.hpp"
+#include "instrumenter.hpp"
+#include "stack-cfg.hpp"
+#include <shell-interface.h>
+#include <wasm-binary.h>
+#include <wasm-interpreter.h>
+#include <map>
+
+using namespace wasm_instrument;
+
+// step counts i up to 4, but calls proc_exit once i is 2 in step(3)
+static const std::string kStep =
+    "(func $step (param i32) (local i32)\n"
+    "loop\n"
+    "local.get 1\ni32.const 1\ni32.add\nlocal.tee 1\ni32.const 2\ni32.eq\n"
+    "local.get 0\ni32.const 3\ni32.eq\ni32.and\n"
+    "if\ni32.const 7\ncall $proc_exit\nend\n"
+    "local.get 1\ni32.const 4\ni32.lt_u\nbr_if 0\n"
+    "end\n)";
+
+// run calls step(0), step(1) ... step(n - 1)
+static const std::string kRun =
+    "(func $run (param i32) (local i32)\n"
+    "loop\n"
+    "local.get 1\ncall $step\n"
+    "local.get 1\ni32.const 1\ni32.add\nlocal.tee 1\nlocal.get 0\ni32.lt_u\nbr_if 0\n"
+    "end\n)";
+
+// what the host needs to recover the block counts of a function
+struct Counted {
+    size_t num_blocks = 0;
+    std::vector<std::pair<size_t, size_t>> edges;
+    // counter of an edge or block, -1 for none
+    std::vector<int64_t> counters;
+};
+
+struct Exit {
+    int32_t code;
+};
+
+class ExitInterface : public wasm::ShellExternalInterface {
+public:
+    wasm::Literals callImport(wasm::Function* import, const wasm::Literals &arguments) override {
+        if (import->base == "proc_exit") throw Exit{arguments[0].geti32()};
+        return wasm::ShellExternalInterface::callImport(import, arguments);
+    }
+};
+
+// fib.wasm with run and step, and an i64 counter of $mem on every block of them, or on
+// the probed edges with the edges to the exit of findNoReturnBlocks()
+static std::vector<char> build(bool blocks, std::map<std::string, Counted> &counted) {
+    InstrumentConfig config;
+    config.filename = "../test/test_fib/fib.wasm";
+    config.targetname = "fib_edge_counts.wasm";
+    Instrumenter instrumenter;
+    assert(instrumenter.setConfig(config) == InstrumentResult::success);
+    auto m = instrumenter.getModule();
+    assert(instrumenter.addMemory("mem", false, 1, 1) != nullptr);
+    assert(instrumenter.addImportFunction("proc_exit", "wasi_snapshot_preview1", "proc_exit",
+                                          BinaryenTypeInt32(), BinaryenTypeNone()));
+    assert(instrumenter.addFunctions({"step", "run"}, {kStep, kRun}));
+    assert(instrumenter.scopeAdd("step") && instrumenter.scopeAdd("run"));
+    assert(instrumenter.addExport(wasm::ModuleItemKind::Function, "run", "run") != nullptr);
+
+    bool indirect = false;
+    auto no_return = instrumenter.callGraph().noReturn(indirect);
+    assert(no_return.count("proc_exit") && no_return.count("step") && no_return.count("run"));
+
+    uint32_t counter_num = 0;
+    auto counter = [&]() {
+        std::vector<wasm::StackInst*> insts;
+        auto k = 8 * counter_num++;
+        assert(Frag(m).i32Const(0).i32Const(0).i64Load(k, "mem").i64Const(1).i64Add().i64Store(k, "mem").build(insts));
+        return insts;
+    };
+    for (auto name : {"step", "run"}) {
+        auto func = instrumenter.getFunction(name);
+        StackCFG cfg;
+        assert(buildStackCFG(func, cfg));
+        auto &c = counted[name];
+        c.num_blocks = cfg.blocks.size();
+        std::vector<StackProbeCode> code;
+        if (blocks) {
+            for (size_t b = 0; b < cfg.exit(); b++) {
+                auto probe = findBlockProbe(cfg, b);
+                assert(probe.kind != StackEdgeProbe::none);
+                c.counters.push_back(counter_num);
+                code.push_back(StackProbeCode{probe, counter()});
+            }
+        } else {
+            std::vector<bool> probeable;
+            for (size_t e = 0; e < cfg.edges.size(); e++) {
+                c.edges.emplace_back(cfg.edges[e].from, cfg.edges[e].to);
+                probeable.push_back(findEdgeProbe(cfg, e).kind != StackEdgeProbe::none);
+            }
+            auto stuck = findNoReturnBlocks(cfg, no_return, indirect);
+            // the if arm of step that calls proc_exit, the loop of run that calls step
+            assert(stuck.size() == 1);
+            c.edges.emplace_back(stuck[0], cfg.exit());
+            probeable.push_back(false);
+            std::vector<bool> probed;
+            assert(selectProbeEdges(c.num_blocks, c.edges, probeable, std::vector<double>(c.edges.size(), 1.0), probed));
+            assert(!probed.back());
+            for (size_t e = 0; e < c.edges.size(); e++) {
+                c.counters.push_back(probed[e] ? counter_num : -1);
+                if (probed[e]) code.push_back(StackProbeCode{findEdgeProbe(cfg, e), counter()});
+            }
+        }
+        applyStackProbes(m, func, cfg, code);
+        instrumenter.stackIRChanged(name);
+    }
+    assert(instrumenter.validate());
+    std::vector<char> binary;
+    assert(instrumenter.writeBinary(binary) == InstrumentResult::success);
+    return binary;
+}
+
+// run(n) until proc_exit, and read the counters
+static std::vector<uint64_t> run(const std::vector<char> &binary, int32_t n, size_t counter_num) {
+    wasm::Module m;
+    m.features = FEATURE_SPEC;
+    wasm::WasmBinaryReader reader(m, m.features, binary);
+    reader.read();
+    ExitInterface interface;
+    wasm::ModuleRunner instance(m, &interface);
+    bool exited = false;
+    try {
+        instance.callExport("run", {wasm::Literal(n)});
+    } catch (const Exit &e) {
+        exited = (e.code == 7);
+    }
+    assert(exited);
+    std::vector<uint64_t> ret;
+    for (size_t k = 0; k < counter_num; k++) {
+        ret.push_back(interface.load64u(8 * k, "mem"));
+    }
+    return ret;
+}
+
+static size_t counters_of(const std::map<std::string, Counted> &counted) {
+    size_t ret = 0;
+    for (const auto &[name, c] : counted) {
+        for (auto k : c.counters) ret += (k >= 0);
+    }
+    return ret;
+}
+
+/*
+* test_edge_counts doc:
+* 1. step calls proc_exit from inside its loop, run calls step from inside its loop,
+*    so both are left by frames that never come back
+* 2. probe the edges selected with an edge to the exit from each block that calls a
+*    function that may not return, and count every block in another build
+* 3. run both until proc_exit, solve the edge counts by flow conservation and check
+*    that the block counts, as wabidb-cov recovers them, are exact
+*/
+int main() {
+    std::map<std::string, Counted> by_edges, by_blocks;
+    auto edge_counters = run(build(false, by_edges), 10, counters_of(by_edges));
+    auto block_counters = run(build(true, by_blocks), 10, counters_of(by_blocks));
+
+    for (auto name : {"step", "run"}) {
+        const auto &e = by_edges[name];
+        const auto &b = by_blocks[name];
+        assert(e.num_blocks == b.num_blocks);
+        std::vector<bool> probed(e.edges.size());
+        std::vector<uint64_t> edge_counts(e.edges.size(), 0);
+        for (size_t i = 0; i < e.edges.size(); i++) {
+            probed[i] = (e.counters[i] >= 0);
+            if (probed[i]) edge_counts[i] = edge_counters[e.counters[i]];
+        }
+        assert(solveEdgeCounts(e.num_blocks, e.edges, probed, edge_counts));
+        std::vector<uint64_t> counts(e.num_blocks - 1, 0);
+        for (size_t i = 0; i < e.edges.size(); i++) {
+            if (e.edges[i].second < counts.size()) counts[e.edges[i].second] += edge_counts[i];
+            // the implicit edge from exit to entry
+            if (e.edges[i].second == counts.size()) counts[0] += edge_counts[i];
+        }
+        for (size_t i = 0; i < counts.size(); i++) {
+            assert(counts[i] == block_counters[b.counters[i]]);
+        }
+        // a frame of each is left at proc_exit
+        assert(edge_counts.back() == 1);
+    }
+    return 0;
+}
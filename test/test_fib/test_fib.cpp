@@ -11,6 +11,8 @@ using namespace wasm_instrument;
 * 5. add function as _start for running the test in standalone runtimes
 *    the _start function calls fib(x) then print its result(or maybe the number of calls)
 * 6. add function to transfer int(i32) to char*(i32) which is compiled from cpp
+* 7. add an import after instrumenting, then a function and a fragment that call add_call
+*    by its index in the binary, and check that both calls resolve to add_call
 */
 int main() {
     std::string relative_path = "../test/test_fib/";
@@ -153,6 +155,32 @@ int main() {
     op1.post_instructions = {};
     result = instrumenter.instrument({op1,});
     assert(result == InstrumentResult::success);
+
+    // imports are numbered before the defined functions, also those added later
+    assert(instrumenter.addImportFunction("proc_exit", "wasi_snapshot_preview1", "proc_exit",
+                                          BinaryenTypeInt32(), BinaryenTypeNone()));
+    auto m = instrumenter.getModule();
+    uint32_t add_call_index = 0;
+    for (auto &func : m->functions) add_call_index += func->imported();
+    for (auto &func : m->functions) {
+        if (func->imported()) continue;
+        if (func->name.toString() == "add_call") break;
+        add_call_index++;
+    }
+    std::string call_by_index = "call " + std::to_string(add_call_index);
+    assert(instrumenter.addFunctions({"by_index"}, {"(func $by_index\n" + call_by_index + "\n)"}));
+    InstrumentOperation op2;
+    op2.post_instructions.instructions = {call_by_index};
+    result = instrumenter.instrumentFunction(op2, "by_index", 0);
+    assert(result == InstrumentResult::success);
+    size_t calls = 0;
+    iterInstructionsConst(instrumenter.getFunction("by_index"), [&calls](const wasm::StackInst* inst) {
+        if (auto* call = inst->origin->dynCast<wasm::Call>()) {
+            assert(call->target.toString() == "add_call");
+            calls++;
+        }
+    });
+    assert(calls == 2);
     
     // write back the instrumented module
     result = instrumenter.writeBinary();
@@ -0,0 +1,94 @@
+#include "frag-builder.hpp"
+#include "instrumenter.hpp"
+
+using namespace wasm_instrument;
+
+/*
+* test_frag_builder doc:
+* 1. build a counter fragment and a fragment on a stack context, insert them into
+*    the stack ir of fib and check that the written module validates
+* 2. check type mismatches: operands, globals, call params and the stack context
+* 3. check stack underflow of operators, drop, stores and calls
+* 4. check that fragments which do not leave the stack as the context are rejected
+* 5. check that unknown globals, functions and memories are rejected, and that
+*    calls after the first error do nothing
+*/
+int main() {
+    std::string relative_path = "../test/test_fib/";
+
+    InstrumentConfig config;
+    config.filename = relative_path + "fib.wasm";
+    config.targetname = relative_path + "fib_instr.wasm";
+    Instrumenter instrumenter;
+    assert(instrumenter.setConfig(config) == InstrumentResult::success);
+    auto m = instrumenter.getModule();
+    assert(instrumenter.addGlobal("cnt", BinaryenTypeInt32(), true, BinaryenLiteralInt32(0)) != nullptr);
+    assert(instrumenter.addGlobal("fixed", BinaryenTypeInt32(), false, BinaryenLiteralInt32(0)) != nullptr);
+    auto fib_name = m->getExport("fib")->value.toString();
+    auto fib = m->getFunction(fib_name);
+
+    // happy path
+    std::vector<wasm::StackInst*> counter;
+    auto frag = Frag(m).globalGet("cnt").i32Const(1).i32Add().globalSet("cnt");
+    assert(frag.ok());
+    assert(frag.build(counter));
+    assert(counter.size() == 4);
+    assert(counter[0]->origin->_id == wasm::Expression::Id::GlobalGetId);
+    assert(counter[2]->origin->_id == wasm::Expression::Id::BinaryId);
+    assert(counter[3]->origin->_id == wasm::Expression::Id::GlobalSetId);
+
+    // the context stands for the i32.const 1 at the start of fib
+    std::vector<wasm::StackInst*> on_context;
+    assert(Frag(m, {wasm::Type::i32}).localTee(1, wasm::Type::i32).i32Const(0).i32Add().build(on_context));
+    assert(on_context.size() == 3);
+    std::vector<wasm::StackInst*> with_call;
+    assert(Frag(m).i32Const(5).call(fib_name).drop().build(with_call));
+
+    auto &stack_ir = *(fib->stackIR);
+    size_t first = 0;
+    while (stack_ir[first] == nullptr) first++;
+    assert(stack_ir[first]->origin->_id == wasm::Expression::Id::ConstId);
+    stack_ir.insert(stack_ir.begin() + first + 1, on_context.begin(), on_context.end());
+    stack_ir.insert(stack_ir.begin(), with_call.begin(), with_call.end());
+    stack_ir.insert(stack_ir.begin(), counter.begin(), counter.end());
+    instrumenter.stackIRChanged(fib_name);
+    assert(instrumenter.validate());
+
+    std::vector<wasm::StackInst*> insts;
+    // type mismatch
+    assert(!Frag(m).i64Const(1).i32Const(2).i32Add().ok());
+    assert(!Frag(m).i64Const(1).globalSet("cnt").ok());
+    assert(!Frag(m).i64Const(1).call(fib_name).ok());
+    assert(!Frag(m).f32Const(1).i32Eqz().ok());
+    assert(!Frag(m, {wasm::Type::i64}).localTee(0, wasm::Type::i32).ok());
+    assert(!Frag(m, {wasm::Type::none}).ok());
+    assert(!Frag(m, {wasm::Type::i32}).drop().i64Const(0).build(insts));
+    // stack underflow
+    assert(!Frag(m).i32Add().ok());
+    assert(!Frag(m).i32Const(1).i32Add().ok());
+    assert(!Frag(m).drop().ok());
+    assert(!Frag(m).call(fib_name).ok());
+    assert(!Frag(m).localSet(0).ok());
+    // unbalanced
+    auto left = Frag(m).i32Const(1);
+    assert(left.ok() && !left.build(insts));
+    assert(!Frag(m, {wasm::Type::i32}).drop().build(insts));
+    assert(!Frag(m, {wasm::Type::i32}).i32Const(1).build(insts));
+    // unknown or immutable
+    assert(!Frag(m).globalGet("no_such_global").ok());
+    assert(!Frag(m).i32Const(1).globalSet("fixed").ok());
+    assert(!Frag(m).call("no_such_function").ok());
+    assert(!Frag(m).i32Const(0).i32Load().ok());
+    // the first error sticks
+    auto failed = Frag(m).drop().i32Const(1).drop();
+    assert(!failed.ok() && !failed.build(insts));
+
+    // memory access once there is a memory
+    assert(instrumenter.addMemory("mem", false, 1, 1) != nullptr);
+    assert(Frag(m).i32Const(0).i32Const(0).i32Load().i32Store(8).build(insts));
+    assert(insts.size() == 4);
+    assert(!Frag(m).i32Const(0).i64Const(0).i32Store().ok());
+    assert(!Frag(m).i32Const(0).i32Store().ok());
+    assert(!Frag(m).i32Const(0).i32Load(0, "no_such_memory").ok());
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include "instrumenter.hpp"
+#include <ir/find_all.h>
+#include <shell-interface.h>
+#include <wasm-binary.h>
+#include <wasm-interpreter.h>
+#include <algorithm>
+#include <map>
+
+using namespace wasm_instrument;
+
+static const std::vector<std::string> kHelpers = {
+    "(func $__instr_arg (param i32) (result i32)\n"
+    "global.get $args\nlocal.get 0\ni32.add\nglobal.set $args\nlocal.get 0\n)",
+    "(func $__instr_mark\nglobal.get $marks\ni32.const 1\ni32.add\nglobal.set $marks\n)",
+    "(func $__instr_add\nglobal.get $adds\ni32.const 1\ni32.add\nglobal.set $adds\n)",
+    "(func $__counts (param i32) (result i64)\n"
+    "local.get 0\ni32.eqz\nif (result i64)\nglobal.get $calls\nelse\n"
+    "local.get 0\ni32.const 1\ni32.eq\nif (result i64)\nglobal.get $args\ni64.extend_i32_u\nelse\n"
+    "local.get 0\ni32.const 2\ni32.eq\nif (result i64)\nglobal.get $marks\ni64.extend_i32_u\nelse\n"
+    "global.get $adds\ni64.extend_i32_u\nend\nend\nend\n)",
+};
+
+// calls, sum of call arguments, marks and executed i32.add of fib as fib.wat computes it
+struct Counts {
+    int64_t calls = 0;
+    uint32_t args = 0;
+    uint32_t adds = 0;
+};
+
+static uint32_t fib(uint32_t n, Counts &c) {
+    uint32_t t = n - 1;
+    if (t < 2) return 1;
+    uint32_t s = 0;
+    do {
+        c.calls++;
+        c.args += t;
+        s = fib(t, c) + s;
+        c.adds++;
+        t = n - 3;
+        n = n - 2;
+    } while (t > 1);
+    c.adds++;
+    return s + 1;
+}
+
+// fib.wasm with the calls and adds of fib counted through instrumentIR(), optimized if
+// /level/ is not 0. the post fragment of calls leaves the call result under instructions
+// of type none, so the parser gives it scratch locals that must become locals of fib
+static std::vector<char> build(int level) {
+    InstrumentConfig config;
+    config.filename = "../test/test_fib/fib.wasm";
+    config.targetname = "fib_ir_instrument.wasm";
+    Instrumenter instrumenter;
+    assert(instrumenter.setConfig(config) == InstrumentResult::success);
+    auto fib_name = instrumenter.getExport("fib")->value.toString();
+    auto func = instrumenter.getFunction(fib_name.c_str());
+    assert(instrumenter.addGlobal("calls", BinaryenTypeInt64(), true, BinaryenLiteralInt64(0)) != nullptr);
+    for (auto name : {"args", "marks", "adds"}) {
+        assert(instrumenter.addGlobal(name, BinaryenTypeInt32(), true, BinaryenLiteralInt32(0)) != nullptr);
+    }
+    assert(instrumenter.addFunctions({"__instr_arg", "__instr_mark", "__instr_add", "__counts"}, kHelpers));
+    assert(instrumenter.addExport(wasm::ModuleItemKind::Function, "__counts", "__counts") != nullptr);
+
+    size_t adds = 0;
+    for (auto binary : wasm::FindAll<wasm::Binary>(func->body).list) adds += (binary->op == wasm::AddInt32);
+    size_t calls = wasm::FindAll<wasm::Call>(func->body).list.size();
+    auto vars = func->vars;
+    assert(adds == 2 && calls == 1);
+    assert(std::find(vars.begin(), vars.end(), wasm::Type::i64) == vars.end());
+
+    InstrumentOperation op_call;
+    op_call.targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id::CallId, std::nullopt, std::nullopt});
+    op_call.pre_instructions.instructions = {"call $__instr_arg"};
+    op_call.pre_instructions.stack_context = {wasm::Type::i32};
+    op_call.post_instructions.instructions = {"global.get $calls", "i64.const 1", "i64.add",
+                                              "call $__instr_mark", "global.set $calls"};
+    op_call.post_instructions.stack_context = {wasm::Type::i32};
+    InstrumentOperation::ExpName add {wasm::Expression::Id::BinaryId, std::nullopt, std::nullopt};
+    InstrumentOperation::ExpName::ExpOp exp_op;
+    exp_op.bop = wasm::AddInt32;
+    add.exp_op = exp_op;
+    InstrumentOperation op_add;
+    op_add.targets.push_back(add);
+    op_add.pre_instructions.instructions = {"call $__instr_add"};
+    assert(instrumenter.instrumentIR({op_call, op_add}) == InstrumentResult::success);
+
+    // the inserted expressions, helpers called once per site
+    func = instrumenter.getFunction(fib_name.c_str());
+    std::map<std::string, size_t> targets;
+    for (auto call : wasm::FindAll<wasm::Call>(func->body).list) targets[call->target.toString()]++;
+    assert(targets["__instr_arg"] == calls && targets["__instr_mark"] == calls);
+    assert(targets["__instr_add"] == adds && targets[fib_name] == calls);
+    // the scratch i64 of the post fragment is a new local of fib
+    assert(func->vars.size() > vars.size());
+    assert(std::find(func->vars.begin(), func->vars.end(), wasm::Type::i64) != func->vars.end());
+    assert(instrumenter.stackIRModified().empty());
+    assert(instrumenter.validate());
+
+    if (level > 0) assert(instrumenter.optimize(level) == InstrumentResult::success);
+    assert(instrumenter.validate());
+    std::vector<char> binary;
+    assert(instrumenter.writeBinary(binary) == InstrumentResult::success);
+    return binary;
+}
+
+/*
+* test_ir_instrument doc:
+* 1. count the calls of fib with a pre fragment on the call argument and a post fragment
+*    on its result, and the i32.add of fib with a pre fragment, through instrumentIR()
+* 2. check the inserted helper calls, and that the scratch locals of the fragments are
+*    new locals of fib; the module validates before and after optimize()
+* 3. run fib with and without optimization and check results and counts against fib.wat
+*/
+int main() {
+    for (int level : {0, 2}) {
+        auto binary = build(level);
+        wasm::Module m;
+        m.features = FEATURE_SPEC;
+        wasm::WasmBinaryReader reader(m, m.features, binary);
+        reader.read();
+        wasm::ShellExternalInterface interface;
+        wasm::ModuleRunner instance(m, &interface);
+        Counts expected;
+        for (int32_t n : {2, 5, 10}) {
+            auto ret = fib(n, expected);
+            assert(instance.callExport("fib", {wasm::Literal(n)})[0].geti32() == int32_t(ret));
+        }
+        assert(expected.calls > 0);
+        auto count = [&](int32_t k) { return instance.callExport("__counts", {wasm::Literal(k)})[0].geti64(); };
+        assert(count(0) == expected.calls);
+        assert(count(1) == expected.args);
+        assert(count(2) == expected.calls);
+        assert(count(3) == expected.adds);
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "instrumenter.hpp"
+#include "offset-map.hpp"
+#include <cstdio>
+#include <map>
+
+using namespace wasm_instrument;
+
+// bytes of each original line of /func/ in /binary/
+static std::map<uint32_t, std::vector<char>> line_bytes(const OffsetMap &map, const std::vector<char> &binary,
+                                                        uint32_t func) {
+    std::map<uint32_t, std::vector<char>> ret;
+    for (size_t i = 0; i + 1 < map.entries.size(); i++) {
+        const auto &e = map.entries[i];
+        if (e.func != func || e.kind != OffsetKind::offset_original) continue;
+        auto end = map.entries[i + 1].offset;
+        assert(e.offset < end && end <= binary.size());
+        assert(ret.count(e.line) == 0);
+        ret[e.line].assign(binary.begin() + e.offset, binary.begin() + end);
+    }
+    return ret;
+}
+
+/*
+* test_offset_map doc:
+* 1. write fib.wasm with an offset map and no instrumentation, every line of fib is original
+* 2. insert a nop before every binary expression of fib and write it with an offset map
+* 3. check that the map loads, is sorted and that lookup() finds the entry of every offset
+* 4. check that every line of fib maps to the same bytes as in the uninstrumented binary
+* 5. check that each nop is one inserted entry which records the line it follows
+*/
+int main() {
+    std::string relative_path = "../test/test_fib/";
+    // in the build directory, removed below
+    std::string plain_map_file = "fib_plain.map";
+    std::string instr_map_file = "fib_instr.map";
+
+    InstrumentConfig config;
+    config.filename = relative_path + "fib.wasm";
+    config.targetname = "fib_instr.wasm";
+    config.offset_map = plain_map_file;
+    Instrumenter plain;
+    assert(plain.setConfig(config) == InstrumentResult::success);
+    auto fib_name = plain.getModule()->getExport("fib")->value;
+    size_t fib_lines = 0;
+    iterInstructionsConst(plain.getModule()->getFunction(fib_name), [&](const wasm::StackInst*) { fib_lines++; });
+    std::vector<char> plain_binary;
+    assert(plain.writeBinary(plain_binary) == InstrumentResult::success);
+    OffsetMap plain_map;
+    assert(plain_map.load(plain_map_file));
+
+    config.offset_map = instr_map_file;
+    Instrumenter instrumenter;
+    assert(instrumenter.setConfig(config) == InstrumentResult::success);
+    InstrumentOperation op;
+    op.targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id::BinaryId, std::nullopt, std::nullopt});
+    op.pre_instructions.instructions = {"nop"};
+    assert(instrumenter.instrument({op}) == InstrumentResult::success);
+    size_t nops = instrumenter.getStats().operation_matches[0][0];
+    assert(nops > 0);
+    std::vector<char> binary;
+    assert(instrumenter.writeBinary(binary) == InstrumentResult::success);
+    OffsetMap map;
+    assert(map.load(instr_map_file));
+
+    // fib has the index 1 in fib.wasm, after __wasm_call_ctors
+    const uint32_t fib = 1;
+    for (const auto *m : {&plain_map, &map}) {
+        assert(!m->entries.empty());
+        for (size_t i = 0; i + 1 < m->entries.size(); i++) {
+            const auto &e = m->entries[i];
+            assert(e.offset < m->entries[i + 1].offset);
+            assert(m->lookup(e.offset) == &e);
+            assert(m->lookup(m->entries[i + 1].offset - 1) == &e);
+        }
+        assert(m->lookup(0) == nullptr);
+        assert(m->lookup(m->entries.back().offset) == nullptr);
+    }
+    for (const auto &e : plain_map.entries) assert(e.kind != OffsetKind::offset_inserted);
+
+    auto plain_lines = line_bytes(plain_map, plain_binary, fib);
+    auto lines = line_bytes(map, binary, fib);
+    assert(plain_lines.size() == fib_lines);
+    assert(plain_lines.begin()->first == 1 && plain_lines.rbegin()->first == fib_lines);
+    assert(lines == plain_lines);
+
+    size_t inserted = 0;
+    uint32_t last_line = 0;
+    for (size_t i = 0; i + 1 < map.entries.size(); i++) {
+        const auto &e = map.entries[i];
+        if (e.func != fib) continue;
+        if (e.kind == OffsetKind::offset_original) last_line = e.line;
+        if (e.kind != OffsetKind::offset_inserted) continue;
+        inserted++;
+        assert(e.line == last_line);
+        // a nop, followed by the binary expression of the next line
+        const auto &next = map.entries[i + 1];
+        assert(next.offset == e.offset + 1 && static_cast<uint8_t>(binary[e.offset]) == 0x01);
+        assert(next.kind == OffsetKind::offset_original && next.line == e.line + 1);
+    }
+    assert(inserted == nops);
+
+    std::remove(plain_map_file.c_str());
+    std::remove(instr_map_file.c_str());
+    return 0;
+}
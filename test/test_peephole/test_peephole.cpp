@@ -0,0 +1,117 @@
+#include "frag-builder.hpp"
+#include "stack-peephole.hpp"
+#include <wasm-builder.h>
+
+using namespace wasm_instrument;
+using Id = wasm::Expression::Id;
+
+// a function of no params and results whose stack ir is /frag/, it has two i32 locals
+static wasm::Function* add_function(wasm::Module* m, const std::string &name, const Frag &frag) {
+    std::vector<wasm::StackInst*> insts;
+    assert(frag.build(insts));
+    wasm::Builder builder(*m);
+    auto func = wasm::Builder::makeFunction(name, wasm::Signature(wasm::Type::none, wasm::Type::none),
+                                            {wasm::Type::i32, wasm::Type::i32}, builder.makeNop());
+    func->stackIR = std::make_unique<wasm::StackIR>(insts);
+    return m->addFunction(std::move(func));
+}
+
+static std::vector<Id> ids(const wasm::Function* func) {
+    std::vector<Id> ret;
+    iterInstructionsConst(func, [&](const wasm::StackInst* inst) { ret.push_back(inst->origin->_id); });
+    return ret;
+}
+
+static int64_t const_at(const wasm::Function* func, size_t i) {
+    std::vector<const wasm::StackInst*> insts;
+    iterInstructionsConst(func, [&](const wasm::StackInst* inst) { insts.push_back(inst); });
+    return insts[i]->origin->cast<wasm::Const>()->value.getInteger();
+}
+
+/*
+* test_peephole doc:
+* 1. fold constants: const const binop, add chains and identities, but not division,
+*    operations on a non-constant left operand, or shifts by a nonzero amount
+* 2. fuse local.set x; local.get x into local.tee x, but not for different locals
+* 3. forward a global read again, or read after a set, in straight-line code through
+*    a new local, but not across a call
+* 4. with no names, only the functions in stackIRModified() are optimized, even after
+*    resetStats(); the result validates
+*/
+int main() {
+    std::string relative_path = "../test/test_fib/";
+
+    InstrumentConfig config;
+    config.filename = relative_path + "fib.wasm";
+    config.targetname = relative_path + "fib_instr.wasm";
+    Instrumenter instrumenter;
+    assert(instrumenter.setConfig(config) == InstrumentResult::success);
+    auto m = instrumenter.getModule();
+    assert(instrumenter.addGlobal("g", BinaryenTypeInt32(), true, BinaryenLiteralInt32(0)) != nullptr);
+    auto fib = m->getExport("fib")->value.toString();
+
+    auto fold = add_function(m, "fold", Frag(m).i32Const(2).i32Const(3).i32Add().globalSet("g"));
+    auto chain = add_function(m, "chain",
+        Frag(m).globalGet("g").i32Const(1).i32Add().i32Const(2).i32Sub().globalSet("g"));
+    auto identity = add_function(m, "identity",
+        Frag(m).globalGet("g").i32Const(0).i32Add().i32Const(1).i32Mul().i32Const(0).i32Shl().globalSet("g"));
+    auto no_fold = add_function(m, "no_fold",
+        Frag(m).i32Const(1).i32Const(0).binary(wasm::DivUInt32, wasm::Type::i32).drop()
+               .i32Const(0).localGet(0, wasm::Type::i32).i32Sub().drop()
+               .localGet(0, wasm::Type::i32).i32Const(1).i32Shl().localSet(0));
+    auto tee = add_function(m, "tee", Frag(m).i32Const(7).localSet(0).localGet(0, wasm::Type::i32).globalSet("g"));
+    auto no_tee = add_function(m, "no_tee", Frag(m).i32Const(7).localSet(0).localGet(1, wasm::Type::i32).globalSet("g"));
+    auto forward = add_function(m, "forward",
+        Frag(m).globalGet("g").drop().globalGet("g").drop().i32Const(1).globalSet("g").globalGet("g").drop());
+    auto no_forward = add_function(m, "no_forward",
+        Frag(m).globalGet("g").drop().i32Const(1).call(fib).drop().globalGet("g").drop());
+    auto untouched = add_function(m, "untouched", Frag(m).i32Const(2).i32Const(3).i32Add().globalSet("g"));
+    for (auto func : {fold, chain, identity, no_fold, tee, no_tee, forward, no_forward}) {
+        instrumenter.stackIRChanged(func->name.toString());
+    }
+    auto no_fold_ids = ids(no_fold);
+    auto no_tee_ids = ids(no_tee);
+    auto no_forward_ids = ids(no_forward);
+    auto untouched_ids = ids(untouched);
+    auto forward_vars = forward->getNumVars();
+
+    // the statistics do not decide the targets
+    instrumenter.resetStats();
+    PeepholeResult result;
+    assert(peepholeOptimize(instrumenter, {}, result));
+    assert(result.functions == 5);
+
+    assert((ids(fold) == std::vector<Id>{Id::ConstId, Id::GlobalSetId}));
+    assert(const_at(fold, 0) == 5);
+    assert((ids(chain) == std::vector<Id>{Id::GlobalGetId, Id::ConstId, Id::BinaryId, Id::GlobalSetId}));
+    assert(const_at(chain, 1) == -1);
+    assert((ids(identity) == std::vector<Id>{Id::GlobalGetId, Id::GlobalSetId}));
+    assert(result.folded_constants == 5);
+    assert(ids(no_fold) == no_fold_ids);
+
+    assert((ids(tee) == std::vector<Id>{Id::ConstId, Id::LocalSetId, Id::GlobalSetId}));
+    std::vector<const wasm::StackInst*> tee_insts;
+    iterInstructionsConst(tee, [&](const wasm::StackInst* inst) { tee_insts.push_back(inst); });
+    assert(tee_insts[1]->origin->cast<wasm::LocalSet>()->isTee());
+    assert(ids(no_tee) == no_tee_ids);
+    assert(result.fused_tees == 1);
+
+    // both later reads come from the new local
+    assert((ids(forward) == std::vector<Id>{Id::GlobalGetId, Id::LocalSetId, Id::DropId,
+                                             Id::LocalGetId, Id::DropId,
+                                             Id::ConstId, Id::LocalSetId, Id::GlobalSetId,
+                                             Id::LocalGetId, Id::DropId}));
+    assert(forward->getNumVars() == forward_vars + 1);
+    assert(ids(no_forward) == no_forward_ids);
+    assert(result.forwarded_globals == 2);
+
+    assert(ids(untouched) == untouched_ids);
+    PeepholeResult named;
+    assert(peepholeOptimize(instrumenter, {"untouched"}, named));
+    assert(named.functions == 1 && named.folded_constants == 1);
+    assert(instrumenter.stackIRModified().count("untouched"));
+    assert(!peepholeOptimize(instrumenter, {"no_such_function"}, named));
+
+    assert(instrumenter.validate());
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "batch-instrument.hpp"
+#include <cstdio>
+#include <sstream>
+#include <support/threads.h>
+
+using namespace wasm_instrument;
+
+/*
+* test_plan doc:
+* 1. parse a plan which counts calls into a new global
+* 2. write the plan back to text and check that it parses to the same plan
+* 3. apply the plan to fib.wasm through runBatch() and check the worker result, the
+*    output goes to the build directory; the pool of binaryen is made with one core
+*    before the workers are forked
+* 4. check that a missing input only fails its own job
+*/
+int main() {
+    std::string relative_path = "../test/test_fib/";
+    std::string plan_str =
+        "# count calls\n"
+        "global call_num i32 mut 0\n"
+        "func add_call\n"
+        "(func $add_call\n"
+        "  global.get $call_num\n"
+        "  i32.const 1\n"
+        "  i32.add\n"
+        "  global.set $call_num\n"
+        ")\n"
+        "end\n"
+        "op\n"
+        "  target Call\n"
+        "  target Binary op=0 type=i32\n"
+        "  post call $add_call\n"
+        "end\n";
+
+    std::istringstream in(plan_str);
+    InstrumentPlan plan;
+    assert(parsePlan(in, plan));
+    assert(plan.globals.size() == 1);
+    assert(plan.function_names.size() == 1 && plan.function_names[0] == "add_call");
+    assert(plan.operations.size() == 1);
+    assert(plan.operations[0].targets.size() == 2);
+    assert(plan.operations[0].targets[1].exp_op->bop == wasm::BinaryOp::AddInt32);
+    assert(plan.operations[0].post_instructions.instructions[0] == "call $add_call");
+
+    std::ostringstream out;
+    writePlan(out, plan);
+    std::istringstream in2(out.str());
+    InstrumentPlan plan2;
+    assert(parsePlan(in2, plan2));
+    std::ostringstream out2;
+    writePlan(out2, plan2);
+    assert(out.str() == out2.str());
+
+    std::istringstream bad("op\n  target NoSuchExpression\nend\n");
+    InstrumentPlan plan3;
+    assert(!parsePlan(bad, plan3));
+
+    std::vector<BatchJob> jobs = {
+        {relative_path + "fib.wasm", "fib_plan.wasm"},
+        {relative_path + "no_such_file.wasm", "no_such_file_plan.wasm"},
+    };
+    BatchOptions options;
+    options.workers = 2;
+    size_t progress_num = 0;
+    options.progress = [&](size_t, const BatchJobResult&, size_t, size_t) { progress_num++; };
+    auto results = runBatch(plan, jobs, options);
+    assert(results.size() == 2);
+    assert(progress_num == 2);
+    assert(results[0].status == BatchStatus::done);
+    assert(results[1].status == BatchStatus::failed);
+    assert(results[1].result == InstrumentResult::open_module_error);
+    assert(wasm::ThreadPool::get()->size() == 1);
+
+    InstrumentConfig config;
+    config.filename = "fib_plan.wasm";
+    config.targetname = "fib_plan.wasm";
+    Instrumenter instrumenter;
+    assert(instrumenter.setConfig(config) == InstrumentResult::success);
+    assert(instrumenter.getGlobal("call_num") != nullptr);
+    assert(instrumenter.getFunction("add_call") != nullptr);
+    std::remove("fib_plan.wasm");
+    return 0;
+}
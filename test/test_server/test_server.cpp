@@ -0,0 +1,154 @@
+#include "instrument-server.hpp"
+#include "stack-ir-cache.hpp"
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <wasm-binary.h>
+
+using namespace wasm_instrument;
+
+static std::string absolute(const std::string &path) {
+    char buf[PATH_MAX];
+    assert(realpath(path.c_str(), buf) != nullptr);
+    return buf;
+}
+
+static void copy_file(const std::string &from, const std::string &to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary | std::ios::trunc);
+    assert(in.is_open() && out.is_open());
+    out << in.rdbuf();
+}
+
+// a connection that never sends a request
+static int connect_idle(const std::string &socket_path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, socket_path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assert(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    return fd;
+}
+
+/*
+* test_server doc:
+* 1. ModuleCache hits on the same file, parses it again once it changes in place, and
+*    drops the least recently used module
+* 2. a copy of a resident module takes its stack ir, which matches the generated one
+* 3. serve on a unix socket and instrument fib.wasm twice through the frame protocol,
+*    the second job hits the cache and gives the same binary
+* 4. the instrumented binary reads back with the global of the plan added
+* 5. a missing module and one outside of the root are reported through the protocol
+* 6. with one worker held by an idle connection, a stop request still stops the server
+*/
+int main() {
+    std::string relative_path = "../test/test_fib/";
+    std::string fib = absolute(relative_path + "fib.wasm");
+    std::string fib_instr = absolute(relative_path + "fib_instr.wasm");
+
+    ModuleCache cache(1, FEATURE_SPEC);
+    bool hit = true;
+    auto m1 = cache.get(fib, hit);
+    assert(m1 != nullptr && !hit);
+    auto m2 = cache.get(fib, hit);
+    assert(m2 == m1 && hit);
+    assert(cache.get(fib_instr, hit) != nullptr && !hit);
+    assert(cache.size() == 1);
+    assert(cache.get(fib, hit) != nullptr && !hit);
+    assert(cache.get(relative_path + "no_such_file.wasm", hit) == nullptr);
+    assert(cache.get(absolute(relative_path), hit) == nullptr);
+
+    // the size of the file changes
+    std::string changing = "test_server_module.wasm";
+    copy_file(fib, changing);
+    ModuleCache changing_cache(2, FEATURE_SPEC);
+    auto before = changing_cache.get(changing, hit);
+    assert(before != nullptr && !hit);
+    assert(changing_cache.get(changing, hit) == before && hit);
+    copy_file(fib_instr, changing);
+    auto after = changing_cache.get(changing, hit);
+    assert(after != nullptr && after != before && !hit);
+    assert(after->module.functions.size() != before->module.functions.size() ||
+           after->module.globals.size() != before->module.globals.size());
+    assert(changing_cache.size() == 1);
+    std::remove(changing.c_str());
+
+    assert(!m1->stack_ir.empty());
+    wasm::Module copy;
+    wasm::ModuleUtils::copyModule(m1->module, copy);
+    copy.features = m1->module.features;
+    assert(decodeStackIR(m1->stack_ir.data(), m1->stack_ir.size(), 0, 0, &copy));
+    InstrumentConfig config;
+    config.filename = fib;
+    config.targetname = "test_server_copy.wasm";
+    Instrumenter generated, copied;
+    assert(generated.setConfig(config) == InstrumentResult::success);
+    assert(copied.setConfig(config, m1->module, &(m1->stack_ir)) == InstrumentResult::success);
+    for (const auto &func : generated.getModule()->functions) {
+        if (func->imported()) continue;
+        auto copy = copied.getFunction(func->name.toString().c_str());
+        assert(copy != nullptr && copy->stackIR != nullptr && func->stackIR != nullptr);
+        assert(copy->stackIR->size() == func->stackIR->size());
+        for (size_t i = 0; i < func->stackIR->size(); i++) {
+            assert((*copy->stackIR)[i]->op == (*func->stackIR)[i]->op);
+            assert((*copy->stackIR)[i]->origin->_id == (*func->stackIR)[i]->origin->_id);
+        }
+    }
+
+    std::string plan_text =
+        "global call_num i32 mut 0\n"
+        "op\n"
+        "  target Call\n"
+        "  pre global.get $call_num\n"
+        "  pre i32.const 1\n"
+        "  pre i32.add\n"
+        "  pre global.set $call_num\n"
+        "end\n";
+    std::string socket_path = "/tmp/test_server_" + std::to_string(getpid()) + ".sock";
+    ServerOptions options;
+    options.workers = 1;
+    options.root = relative_path;
+    std::vector<ServerJobResult> jobs;
+    options.log = [&](const std::string&, const ServerJobResult &job) { jobs.push_back(job); };
+    bool served = false;
+    std::thread server([&]() { served = runServer(socket_path, options); });
+    // wait for the socket
+    for (int i = 0; i < 100 && access(socket_path.c_str(), F_OK) != 0; i++) usleep(10000);
+
+    std::vector<char> first, second;
+    assert(requestInstrument(socket_path, fib, plan_text, first) == InstrumentResult::success);
+    assert(requestInstrument(socket_path, fib, plan_text, second) == InstrumentResult::success);
+    assert(jobs.size() == 2);
+    assert(!jobs[0].warm && jobs[1].warm);
+    assert(first.size() > 4 && std::memcmp(first.data(), "\0asm", 4) == 0);
+    assert(first == second);
+
+    wasm::Module instrumented;
+    instrumented.features = FEATURE_SPEC;
+    wasm::WasmBinaryReader reader(instrumented, instrumented.features, first);
+    reader.read();
+    assert(instrumented.globals.size() == m1->module.globals.size() + 1);
+
+    std::vector<char> error;
+    assert(requestInstrument(socket_path, relative_path + "no_such_file.wasm", plan_text, error) ==
+           InstrumentResult::open_module_error);
+    assert(!error.empty());
+    assert(requestInstrument(socket_path, absolute("../test/test_path_open/fib.wasm"), plan_text, error) ==
+           InstrumentResult::config_error);
+    assert(requestInstrument(socket_path, relative_path + "../test_path_open/fib.wasm", plan_text, error) ==
+           InstrumentResult::config_error);
+
+    int idle = connect_idle(socket_path);
+    assert(requestStop(socket_path));
+    server.join();
+    assert(served);
+    close(idle);
+    assert(access(socket_path.c_str(), F_OK) != 0);
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "instrumenter.hpp"
+#include "stack-cfg.hpp"
+
+using namespace wasm_instrument;
+
+/*
+* test_stack_cfg doc:
+* 1. build the cfg of every function of fib.wasm and check its shape
+* 2. check that every edge of the cfg can be probed somewhere
+* 3. select probe edges of a diamond inside a loop and check that the
+*    edges of the loop stay in the spanning tree
+* 4. derive all edge counts from the probed ones
+* 5. check dominators and loops of the cached analysis, and that it is rebuilt
+*    after the function is rewritten, while those of other functions are kept
+* 6. check the call graph: fib is recursive and all functions are exported
+*/
+int main() {
+    std::string relative_path = "../test/test_fib/";
+
+    InstrumentConfig config;
+    config.filename = relative_path + "fib.wasm";
+    config.targetname = relative_path + "fib_instr.wasm";
+    Instrumenter instrumenter;
+    assert(instrumenter.setConfig(config) == InstrumentResult::success);
+
+    size_t func_num = 0;
+    iterDefinedFunctions(instrumenter.getModule(), [&](wasm::Function* func) {
+        StackCFG cfg;
+        assert(buildStackCFG(func, cfg));
+        func_num++;
+        assert(cfg.blocks.size() >= 2);
+        assert(cfg.blocks[cfg.exit()].begin == cfg.blocks[cfg.exit()].end);
+        // blocks cover all insts in order
+        size_t pos = 0;
+        for (size_t b = 0; b < cfg.exit(); b++) {
+            assert(cfg.blocks[b].begin == pos && cfg.blocks[b].end > pos);
+            pos = cfg.blocks[b].end;
+        }
+        assert(pos == cfg.insts.size());
+        assert(!cfg.blocks[cfg.exit()].preds.empty());
+        for (size_t e = 0; e < cfg.edges.size(); e++) {
+            assert(cfg.edges[e].from != cfg.exit());
+            auto probe = findEdgeProbe(cfg, e);
+            // only br_table targets and br_if with values may need restructuring
+            assert(probe.kind != StackEdgeProbe::none ||
+                   cfg.edges[e].kind == StackEdgeKind::edge_switch_branch ||
+                   cfg.edges[e].kind == StackEdgeKind::edge_cond_branch);
+        }
+    });
+    assert(func_num > 0);
+
+    iterDefinedFunctions(instrumenter.getModule(), [&](wasm::Function* func) {
+        auto analysis = instrumenter.getAnalysis(func);
+        assert(analysis != nullptr && analysis == instrumenter.getAnalysis(func));
+        const auto &cfg = analysis->cfg;
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            if (!analysis->reachable(b)) continue;
+            assert(analysis->dominates(cfg.entry(), b));
+            assert(analysis->dominates(analysis->idom[b], b));
+            assert(b == cfg.entry() || !analysis->dominates(b, analysis->idom[b]));
+        }
+        for (const auto &loop : analysis->loops) {
+            assert(cfg.insts[cfg.blocks[loop.header].begin]->op == wasm::StackInst::LoopBegin);
+            for (auto b : loop.blocks) assert(analysis->dominates(loop.header, b));
+            assert(loop.depth <= cfg.blocks[loop.header].loop_depth);
+        }
+        for (size_t line = 1; line <= cfg.insts.size(); line++) {
+            auto b = analysis->blockOfLine(line);
+            assert(cfg.blocks[b].begin < line && line <= cfg.blocks[b].end);
+        }
+    });
+    // fib has a loop, its analysis follows the rewrite
+    auto fib_name = instrumenter.getExport("fib")->value.toString();
+    const auto &graph = instrumenter.callGraph();
+    assert(&graph == &instrumenter.callGraph());
+    assert(graph.callees.at(fib_name).count(fib_name) == 1);
+    assert(graph.roots.count(fib_name) == 1);
+    assert(graph.reachable().size() == func_num);
+    auto fib = instrumenter.getFunction(fib_name.c_str());
+    auto size = instrumenter.getAnalysis(fib)->cfg.insts.size();
+    assert(instrumenter.getAnalysis(fib)->loops.size() == 1);
+    std::vector<std::pair<wasm::Function*, const StackAnalysis*>> others;
+    iterDefinedFunctions(instrumenter.getModule(), [&](wasm::Function* func) {
+        if (func != fib) others.emplace_back(func, instrumenter.getAnalysis(func));
+    });
+    InstrumentOperation nop;
+    nop.post_instructions.instructions = {"nop"};
+    assert(instrumenter.instrumentFunction(nop, fib_name.c_str(), 0) == InstrumentResult::success);
+    fib = instrumenter.getFunction(fib_name.c_str());
+    assert(instrumenter.getAnalysis(fib)->cfg.insts.size() == size + 1);
+    for (auto [func, analysis] : others) assert(instrumenter.getAnalysis(func) == analysis);
+
+    // 0 -> 1, loop head 1 -> 2 / 3 -> 4 -> 1, 4 -> 5 (exit)
+    std::vector<std::pair<size_t, size_t>> edges = {
+        {0, 1}, {1, 2}, {1, 3}, {2, 4}, {3, 4}, {4, 1}, {4, 5},
+    };
+    std::vector<bool> probeable(edges.size(), true);
+    std::vector<double> weights = {1, 10, 10, 10, 10, 10, 1};
+    std::vector<bool> probed;
+    assert(selectProbeEdges(6, edges, probeable, weights, probed));
+    // chords = edges - (blocks - 1), the exit -> entry edge is always in the tree
+    size_t probed_num = 0;
+    for (auto p : probed) probed_num += p;
+    assert(probed_num == edges.size() - 4);
+    // the heavy loop edges hold 3 of the 4 tree edges
+    assert(probed[1] + probed[2] + probed[3] + probed[4] + probed[5] == 2);
+
+    // 3 calls, 10 iterations each, 4 of them through 2
+    std::vector<uint64_t> expected = {3, 4, 26, 4, 26, 27, 3};
+    std::vector<uint64_t> counts(edges.size(), 0);
+    for (size_t e = 0; e < edges.size(); e++) {
+        if (probed[e]) counts[e] = expected[e];
+    }
+    assert(solveEdgeCounts(6, edges, probed, counts));
+    assert(counts == expected);
+
+    // unprobeable edges that form a cycle
+    std::vector<bool> none_probeable(edges.size(), false);
+    assert(!selectProbeEdges(6, edges, none_probeable, weights, probed));
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "instrumenter.hpp"
+#include "stack-ir-cache.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <wasm-io.h>
+
+using namespace wasm_instrument;
+
+// ops and origin ids of the stack ir of every defined function
+static std::vector<std::pair<int, int>> stack_ir_shape(wasm::Module* m) {
+    std::vector<std::pair<int, int>> shape;
+    iterDefinedFunctions(m, [&](wasm::Function* func) {
+        assert(func->stackIR != nullptr);
+        iterInstructionsConst(func, [&](const wasm::StackInst* inst) {
+            shape.emplace_back(inst->op, inst->origin->_id);
+        });
+        shape.emplace_back(-1, -1);
+    });
+    return shape;
+}
+
+static bool has_stack_ir(wasm::Module* m) {
+    bool ret = false;
+    iterDefinedFunctions(m, [&](wasm::Function* func) { ret = ret || func->stackIR != nullptr; });
+    return ret;
+}
+
+static void read_module(const std::string &filename, wasm::Module &m) {
+    m.features.enable(FEATURE_SPEC);
+    wasm::ModuleReader reader;
+    reader.read(filename, m, "");
+}
+
+/*
+* test_stack_ir_cache doc:
+* 1. setConfig() with a cache file writes it, and a second setConfig() maps it back
+*    to the same stack ir, which is instrumented and validated
+* 2. the cache round-trips through saveStackIRCache() and loadStackIRCache()
+* 3. a cache is rejected, with no stack ir set, if the hash, the size, the features
+*    or the version differ, or if it is truncated
+*/
+int main() {
+    std::string relative_path = "../test/test_fib/";
+    std::string input = relative_path + "fib.wasm";
+    // in the build directory, removed below
+    std::string cache_file = "fib.sir";
+    std::remove(cache_file.c_str());
+
+    InstrumentConfig config;
+    config.filename = input;
+    config.targetname = "fib_cached.wasm";
+    config.stack_ir_cache = cache_file;
+    Instrumenter first;
+    assert(first.setConfig(config) == InstrumentResult::success);
+    std::ifstream written(cache_file, std::ios::binary);
+    assert(written.is_open());
+    written.close();
+    Instrumenter second;
+    assert(second.setConfig(config) == InstrumentResult::success);
+    auto shape = stack_ir_shape(first.getModule());
+    assert(!shape.empty());
+    assert(stack_ir_shape(second.getModule()) == shape);
+    InstrumentOperation op;
+    op.targets.push_back(InstrumentOperation::ExpName{wasm::Expression::Id::CallId, std::nullopt, std::nullopt});
+    op.pre_instructions.instructions = {"nop"};
+    assert(second.instrument({op}) == InstrumentResult::success);
+
+    uint64_t hash = 0;
+    size_t size = 0;
+    assert(hashFile(input, hash, size));
+    assert(saveStackIRCache(cache_file, hash, size, first.getModule()));
+    wasm::Module loaded;
+    read_module(input, loaded);
+    assert(!has_stack_ir(&loaded));
+    assert(loadStackIRCache(cache_file, hash, size, &loaded));
+    assert(stack_ir_shape(&loaded) == shape);
+
+    // stale
+    wasm::Module stale;
+    read_module(input, stale);
+    assert(!loadStackIRCache(cache_file, hash + 1, size, &stale));
+    assert(!loadStackIRCache(cache_file, hash, size + 1, &stale));
+    assert(!loadStackIRCache("no_such_file.sir", hash, size, &stale));
+    stale.features.enable(wasm::FeatureSet::MultiMemory);
+    assert(!loadStackIRCache(cache_file, hash, size, &stale));
+    stale.features.disable(wasm::FeatureSet::MultiMemory);
+    assert(!has_stack_ir(&stale));
+
+    std::ifstream in(cache_file, std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    auto rewrite = [&](const std::vector<char> &contents) {
+        std::ofstream out(cache_file, std::ios::binary | std::ios::trunc);
+        out.write(contents.data(), contents.size());
+    };
+    // the version is the second word
+    auto other_version = bytes;
+    other_version[4] ^= 1;
+    rewrite(other_version);
+    assert(!loadStackIRCache(cache_file, hash, size, &stale));
+    // the per function table is cut off
+    rewrite(std::vector<char>(bytes.begin(), bytes.begin() + 7 * sizeof(uint32_t)));
+    assert(!loadStackIRCache(cache_file, hash, size, &stale));
+    // the insts are cut off, nothing that was loaded before is kept
+    rewrite(std::vector<char>(bytes.begin(), bytes.end() - sizeof(uint32_t)));
+    assert(!loadStackIRCache(cache_file, hash, size, &stale));
+    assert(!has_stack_ir(&stale));
+    rewrite(bytes);
+    assert(loadStackIRCache(cache_file, hash, size, &stale));
+    assert(stack_ir_shape(&stale) == shape);
+
+    std::remove(cache_file.c_str());
+    return 0;
+}